@@ -0,0 +1,55 @@
+#include "AsyncLoader.h"
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+namespace labhelper {
+    static std::mutex upload_mutex;
+    static std::vector<UploadJob> upload_jobs;
+
+    void queueUpload(UploadJob job) {
+        std::lock_guard<std::mutex> lock(upload_mutex);
+        upload_jobs.push_back(std::move(job));
+    }
+
+    int finishUploads(float budget_ms) {
+        auto start = std::chrono::steady_clock::now();
+        auto out_of_time = [start, budget_ms]() {
+            std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count() >= budget_ms;
+        };
+
+        // Jobs may queue new jobs, so the lock is not held while they run
+        std::vector<UploadJob> jobs;
+        {
+            std::lock_guard<std::mutex> lock(upload_mutex);
+            jobs.swap(upload_jobs);
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Go round the jobs for as long as some of them make progress
+        ///////////////////////////////////////////////////////////////////////
+        bool progress = true;
+        bool stop = false;
+        while (progress && !stop && !jobs.empty()) {
+            progress = false;
+            for (size_t i = 0; i < jobs.size() && !stop;) {
+                UploadStatus status = jobs[i]();
+                if (status != UPLOAD_WAITING) {
+                    progress = true;
+                    stop = out_of_time();
+                }
+                if (status == UPLOAD_DONE) {
+                    jobs.erase(jobs.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(upload_mutex);
+        upload_jobs.insert(upload_jobs.begin(), std::make_move_iterator(jobs.begin()),
+                           std::make_move_iterator(jobs.end()));
+        return int(upload_jobs.size());
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <future>
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Helpers for futures of assets that are loaded in the background
+//////////////////////////////////////////////////////////////////////////////
+template<typename Future>
+bool isReady(const Future& future)
+{
+	return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+// Moves the result of `future` into `result` if it is ready, and resets
+// the future. Returns true if it did.
+template<typename Future, typename T>
+bool takeIfReady(Future& future, T& result)
+{
+	if(!isReady(future))
+	{
+		return false;
+	}
+	result = future.get();
+	future = Future();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// GL work of assets that are loaded in the background. The parsing and
+// decoding runs on the ThreadPool, the GL calls are queued as upload jobs
+// and run on the GL thread by finishUploads(), a few at a time, so that
+// loading does not stall the frame.
+//
+// An upload job is called repeatedly until it returns UPLOAD_DONE. Each
+// call should do a small step of the work (e.g. upload one texture), or
+// return UPLOAD_WAITING if it has nothing to do yet.
+//////////////////////////////////////////////////////////////////////////////
+enum UploadStatus
+{
+	UPLOAD_WAITING,
+	UPLOAD_PROGRESS,
+	UPLOAD_DONE
+};
+typedef std::function<UploadStatus()> UploadJob;
+
+void queueUpload(UploadJob job);
+
+//////////////////////////////////////////////////////////////////////////////
+// Call once per frame on the GL thread. Runs upload jobs until `budget_ms`
+// milliseconds have passed or all jobs are waiting. At least one step is
+// taken if any job can make progress. Returns the number of jobs left.
+//////////////////////////////////////////////////////////////////////////////
+int finishUploads(float budget_ms);
+} // namespace labhelper
@@ -0,0 +1,113 @@
+#include "Culling.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LABHELPER_CULLING_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace labhelper {
+    Frustum frustumFromMatrix(const glm::mat4 &m) {
+        // The rows of the matrix, glm is column major
+        glm::vec4 row[4];
+        for (int i = 0; i < 4; i++) {
+            row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+        }
+        Frustum frustum;
+        frustum.planes[0] = row[3] + row[0]; // left
+        frustum.planes[1] = row[3] - row[0]; // right
+        frustum.planes[2] = row[3] + row[1]; // bottom
+        frustum.planes[3] = row[3] - row[1]; // top
+        frustum.planes[4] = row[3] + row[2]; // near
+        frustum.planes[5] = row[3] - row[2]; // far
+        return frustum;
+    }
+
+    bool intersects(const Frustum &frustum, const glm::vec3 &center, const glm::vec3 &extent) {
+        for (const glm::vec4 &plane : frustum.planes) {
+            float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+            float radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+            if (distance + radius < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void buildMeshBounds(Model *model) {
+        const size_t number_of_meshes = model->m_meshes.size();
+        model->m_mesh_bounds.resize((number_of_meshes + 3) / 4);
+        // Unused lanes get empty boxes at the origin, they are never read
+        memset(model->m_mesh_bounds.data(), 0, model->m_mesh_bounds.size() * sizeof(MeshBoundsBatch));
+        for (size_t i = 0; i < number_of_meshes; i++) {
+            const Mesh &mesh = model->m_meshes[i];
+            MeshBoundsBatch &batch = model->m_mesh_bounds[i / 4];
+            for (int k = 0; k < 3; k++) {
+                batch.extent[k][i % 4] = 0.5f * mesh.m_position_scale[k];
+                batch.center[k][i % 4] = mesh.m_position_offset[k] + batch.extent[k][i % 4];
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// A box is outside a plane if the corner that is furthest along the normal
+// is: dot(n, center) + w + dot(|n|, extent) < 0.
+///////////////////////////////////////////////////////////////////////////
+    uint32_t cullMeshes(const Model *model, const glm::mat4 &modelViewProjectionMatrix,
+                        std::vector<uint8_t> &visible) {
+        const size_t number_of_meshes = model->m_meshes.size();
+        if (model->m_mesh_bounds.size() != (number_of_meshes + 3) / 4) {
+            // The bounds were never built, draw everything
+            visible.assign(number_of_meshes, 1);
+            return uint32_t(number_of_meshes);
+        }
+        visible.resize(number_of_meshes);
+        Frustum frustum = frustumFromMatrix(modelViewProjectionMatrix);
+        uint32_t number_visible = 0;
+        for (size_t b = 0; b < model->m_mesh_bounds.size(); b++) {
+            const MeshBoundsBatch &batch = model->m_mesh_bounds[b];
+            int outside = 0;
+#ifdef LABHELPER_CULLING_SSE
+            __m128 center_x = _mm_loadu_ps(batch.center[0]);
+            __m128 center_y = _mm_loadu_ps(batch.center[1]);
+            __m128 center_z = _mm_loadu_ps(batch.center[2]);
+            __m128 extent_x = _mm_loadu_ps(batch.extent[0]);
+            __m128 extent_y = _mm_loadu_ps(batch.extent[1]);
+            __m128 extent_z = _mm_loadu_ps(batch.extent[2]);
+            __m128 outside_mask = _mm_setzero_ps();
+            for (const glm::vec4 &plane : frustum.planes) {
+                __m128 distance = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(center_x, _mm_set1_ps(plane.x)), _mm_mul_ps(center_y, _mm_set1_ps(plane.y))),
+                        _mm_add_ps(_mm_mul_ps(center_z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+                __m128 radius = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(extent_x, _mm_set1_ps(std::fabs(plane.x))),
+                                   _mm_mul_ps(extent_y, _mm_set1_ps(std::fabs(plane.y)))),
+                        _mm_mul_ps(extent_z, _mm_set1_ps(std::fabs(plane.z))));
+                outside_mask = _mm_or_ps(outside_mask, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+            }
+            outside = _mm_movemask_ps(outside_mask);
+#else
+            for (int lane = 0; lane < 4; lane++) {
+                for (const glm::vec4 &plane : frustum.planes) {
+                    float distance = batch.center[0][lane] * plane.x + batch.center[1][lane] * plane.y
+                                     + batch.center[2][lane] * plane.z + plane.w;
+                    float radius = batch.extent[0][lane] * std::fabs(plane.x)
+                                   + batch.extent[1][lane] * std::fabs(plane.y)
+                                   + batch.extent[2][lane] * std::fabs(plane.z);
+                    if (distance + radius < 0.0f) {
+                        outside |= 1 << lane;
+                        break;
+                    }
+                }
+            }
+#endif
+            for (size_t lane = 0; lane < 4 && b * 4 + lane < number_of_meshes; lane++) {
+                visible[b * 4 + lane] = (outside >> lane) & 1 ? 0 : 1;
+                number_visible += visible[b * 4 + lane];
+            }
+        }
+        return number_visible;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "Model.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// The six planes of the frustum of a (model) view projection matrix, in the
+// space the matrix transforms from (Gribb & Hartmann 2001, "Fast
+// Extraction of Viewing Frustum Planes from the World-View-Projection
+// Matrix"). A point p is inside a plane if dot(plane, vec4(p, 1)) >= 0.
+// The planes are not normalized.
+//////////////////////////////////////////////////////////////////////////////
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+Frustum frustumFromMatrix(const glm::mat4& modelViewProjectionMatrix);
+
+// Whether the box from center - extent to center + extent is at least partly
+// inside the frustum (outside no single plane)
+bool intersects(const Frustum& frustum, const glm::vec3& center, const glm::vec3& extent);
+
+// Fills in Model::m_mesh_bounds from the bounds of the meshes
+void buildMeshBounds(Model* model);
+
+//////////////////////////////////////////////////////////////////////////////
+// Sets visible[i] to 1 for the meshes whose boxes are at least partly
+// inside the frustum of modelViewProjectionMatrix, and to 0 for the others.
+// Four meshes are tested at a time with SSE. Boxes that are outside no
+// single plane are kept, so a few meshes near the corners of the frustum
+// are drawn needlessly. Returns the number of visible meshes.
+//////////////////////////////////////////////////////////////////////////////
+uint32_t cullMeshes(const Model* model, const glm::mat4& modelViewProjectionMatrix, std::vector<uint8_t>& visible);
+} // namespace labhelper
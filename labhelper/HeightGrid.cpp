@@ -0,0 +1,257 @@
+#include "HeightGrid.h"
+#include <algorithm>
+#include <cmath>
+
+namespace labhelper {
+    HeightGrid::HeightGrid(const float *heights, int width, int height, const glm::vec3 &origin,
+                           const glm::vec3 &extent)
+            : m_width(width), m_height(height), m_heights(heights, heights + size_t(width) * height),
+              m_origin(origin), m_extent(extent),
+              m_to_texels(float(width) / extent.x, float(height) / extent.z) {
+        buildPyramid();
+    }
+
+    float HeightGrid::texel(int i, int j) const {
+        i = std::min(std::max(i, 0), m_width - 1);
+        j = std::min(std::max(j, 0), m_height - 1);
+        return m_heights[size_t(j) * m_width + i];
+    }
+
+    float HeightGrid::heightAt(float x, float z) const {
+        if (empty()) {
+            return m_origin.y;
+        }
+        glm::vec2 t = toTexels(x, z);
+        float fi = std::floor(t.x), fj = std::floor(t.y);
+        float s = t.x - fi, u = t.y - fj;
+        int i = int(fi), j = int(fj);
+        float h = (texel(i, j) * (1.0f - s) + texel(i + 1, j) * s) * (1.0f - u)
+                  + (texel(i, j + 1) * (1.0f - s) + texel(i + 1, j + 1) * s) * u;
+        return m_origin.y + m_extent.y * h;
+    }
+
+    glm::vec3 HeightGrid::normalAt(float x, float z) const {
+        // Central differences one texel apart
+        const float dx = 1.0f / m_to_texels.x, dz = 1.0f / m_to_texels.y;
+        float slope_x = (heightAt(x + dx, z) - heightAt(x - dx, z)) / (2.0f * dx);
+        float slope_z = (heightAt(x, z + dz) - heightAt(x, z - dz)) / (2.0f * dz);
+        return glm::normalize(glm::vec3(-slope_x, 1.0f, -slope_z));
+    }
+
+    void HeightGrid::buildPyramid() {
+        m_levels.clear();
+        if (empty()) {
+            return;
+        }
+        Level level;
+        level.width = std::max(m_width - 1, 1);
+        level.height = std::max(m_height - 1, 1);
+        level.low.resize(size_t(level.width) * level.height);
+        level.high.resize(level.low.size());
+        for (int j = 0; j < level.height; j++) {
+            for (int i = 0; i < level.width; i++) {
+                float a = texel(i, j), b = texel(i + 1, j), c = texel(i, j + 1), d = texel(i + 1, j + 1);
+                level.low[size_t(j) * level.width + i] = std::min(std::min(a, b), std::min(c, d));
+                level.high[size_t(j) * level.width + i] = std::max(std::max(a, b), std::max(c, d));
+            }
+        }
+        m_levels.push_back(std::move(level));
+        while (m_levels.back().width > 1 || m_levels.back().height > 1) {
+            const Level &below = m_levels.back();
+            Level next;
+            next.width = (below.width + 1) / 2;
+            next.height = (below.height + 1) / 2;
+            next.low.resize(size_t(next.width) * next.height);
+            next.high.resize(next.low.size());
+            for (int j = 0; j < next.height; j++) {
+                for (int i = 0; i < next.width; i++) {
+                    float low = INFINITY, high = -INFINITY;
+                    for (int k = 0; k < 4; k++) {
+                        int bi = std::min(2 * i + (k & 1), below.width - 1);
+                        int bj = std::min(2 * j + (k >> 1), below.height - 1);
+                        low = std::min(low, below.low[size_t(bj) * below.width + bi]);
+                        high = std::max(high, below.high[size_t(bj) * below.width + bi]);
+                    }
+                    next.low[size_t(j) * next.width + i] = low;
+                    next.high[size_t(j) * next.width + i] = high;
+                }
+            }
+            m_levels.push_back(std::move(next));
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// The rectangle is widened to the cells it touches, and the level is the
+// lowest one where those cells fall in at most 2x2 nodes.
+///////////////////////////////////////////////////////////////////////////
+    void HeightGrid::heightRange(float x0, float z0, float x1, float z1, float &low, float &high) const {
+        if (empty()) {
+            low = high = m_origin.y;
+            return;
+        }
+        const Level &cells = m_levels[0];
+        glm::vec2 t0 = toTexels(std::min(x0, x1), std::min(z0, z1));
+        glm::vec2 t1 = toTexels(std::max(x0, x1), std::max(z0, z1));
+        int i0 = std::min(std::max(int(std::floor(t0.x)), 0), cells.width - 1);
+        int j0 = std::min(std::max(int(std::floor(t0.y)), 0), cells.height - 1);
+        int i1 = std::min(std::max(int(std::floor(t1.x)), 0), cells.width - 1);
+        int j1 = std::min(std::max(int(std::floor(t1.y)), 0), cells.height - 1);
+        size_t l = 0;
+        while (l + 1 < m_levels.size() && ((i1 >> l) - (i0 >> l) > 1 || (j1 >> l) - (j0 >> l) > 1)) {
+            l++;
+        }
+        const Level &level = m_levels[l];
+        float lowest = INFINITY, highest = -INFINITY;
+        for (int j = j0 >> l; j <= (j1 >> l); j++) {
+            for (int i = i0 >> l; i <= (i1 >> l); i++) {
+                lowest = std::min(lowest, level.low[size_t(j) * level.width + i]);
+                highest = std::max(highest, level.high[size_t(j) * level.width + i]);
+            }
+        }
+        low = m_origin.y + m_extent.y * lowest;
+        high = m_origin.y + m_extent.y * highest;
+        if (m_extent.y < 0.0f) {
+            std::swap(low, high);
+        }
+    }
+
+    void HeightGrid::nodeBounds(int level, int i, int j, glm::vec3 &low, glm::vec3 &high) const {
+        if (empty()) {
+            low = high = m_origin;
+            return;
+        }
+        const Level &cells = m_levels[0];
+        const Level &node = m_levels[level];
+        float x0 = float(i << level), x1 = float(std::min((i + 1) << level, cells.width));
+        float z0 = float(j << level), z1 = float(std::min((j + 1) << level, cells.height));
+        size_t k = size_t(j) * node.width + i;
+        low = glm::vec3(m_origin.x + (x0 + 0.5f) / m_to_texels.x, m_origin.y + m_extent.y * node.low[k],
+                        m_origin.z + (z0 + 0.5f) / m_to_texels.y);
+        high = glm::vec3(m_origin.x + (x1 + 0.5f) / m_to_texels.x, m_origin.y + m_extent.y * node.high[k],
+                         m_origin.z + (z1 + 0.5f) / m_to_texels.y);
+        if (m_extent.y < 0.0f) {
+            std::swap(low.y, high.y);
+        }
+    }
+
+    bool HeightGrid::intersect(const glm::vec3 &origin, const glm::vec3 &direction, float tnear, float &tfar,
+                               glm::vec3 &normal) const {
+        return !empty() && intersect(origin, direction, tnear, tfar, normal, int(m_levels.size()) - 1, 0, 0);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// The children of a node are visited nearest first, given the signs of the
+// direction, which is front to back along the ray: it can not pass through
+// both of the two children that are not nearest or farthest. So the first
+// cell that is hit holds the closest hit.
+///////////////////////////////////////////////////////////////////////////
+    bool HeightGrid::intersect(const glm::vec3 &origin, const glm::vec3 &direction, float tnear, float &tfar,
+                               glm::vec3 &normal, int level, int i, int j) const {
+        if (empty()) {
+            return false;
+        }
+        // To texel space, where t stays the same. Zero components are nudged
+        // so the slab tests below never compute 0 * infinity.
+        const glm::vec2 o = toTexels(origin.x, origin.z);
+        const glm::vec3 ray_origin(o.x, (origin.y - m_origin.y) / m_extent.y, o.y);
+        glm::vec3 ray_direction(direction.x * m_to_texels.x, direction.y / m_extent.y, direction.z * m_to_texels.y);
+        for (int k = 0; k < 3; k++) {
+            if (ray_direction[k] == 0.0f) {
+                ray_direction[k] = 1e-30f;
+            }
+        }
+        const glm::vec3 inverse_direction = 1.0f / ray_direction;
+        const int near_i = ray_direction.x < 0.0f ? 1 : 0, near_j = ray_direction.z < 0.0f ? 1 : 0;
+        const int cells_x = m_levels[0].width, cells_z = m_levels[0].height;
+
+        // Each level pushes at most three nodes more than it pops
+        struct Node
+        {
+            int level, i, j;
+        };
+        Node stack[3 * 32 + 1];
+        int size = 0;
+        stack[size++] = {level, i, j};
+        while (size > 0) {
+            const Node node = stack[--size];
+            const Level &nodes = m_levels[node.level];
+            const size_t k = size_t(node.j) * nodes.width + node.i;
+            glm::vec3 low(float(node.i << node.level), nodes.low[k], float(node.j << node.level));
+            glm::vec3 high(float(std::min((node.i + 1) << node.level, cells_x)), nodes.high[k],
+                           float(std::min((node.j + 1) << node.level, cells_z)));
+            glm::vec3 t0 = (low - ray_origin) * inverse_direction, t1 = (high - ray_origin) * inverse_direction;
+            glm::vec3 t_min = glm::min(t0, t1), t_max = glm::max(t0, t1);
+            float enter = std::max(std::max(t_min.x, t_min.y), std::max(t_min.z, tnear));
+            float leave = std::min(std::min(t_max.x, t_max.y), std::min(t_max.z, tfar));
+            if (enter > leave) {
+                continue;
+            }
+            if (node.level == 0) {
+                if (intersectCell(node.i, node.j, ray_origin, ray_direction, enter, leave, tfar, normal)) {
+                    return true;
+                }
+                continue;
+            }
+            const Level &children = m_levels[node.level - 1];
+            for (int c = 3; c >= 0; c--) {
+                int ci = 2 * node.i + ((c & 1) ^ near_i), cj = 2 * node.j + ((c >> 1) ^ near_j);
+                if (ci < children.width && cj < children.height) {
+                    stack[size++] = {node.level - 1, ci, cj};
+                }
+            }
+        }
+        return false;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Along the ray, the height above the bilinear surface
+// a + (b - a) s + (c - a) u + e s u of the cell is a quadratic in t. It is
+// solved in double, and the roots may be a little outside the cell so that
+// rays through edges and corners do not slip between cells.
+///////////////////////////////////////////////////////////////////////////
+    bool HeightGrid::intersectCell(int i, int j, const glm::vec3 &origin, const glm::vec3 &direction, float enter,
+                                   float leave, float &tfar, glm::vec3 &normal) const {
+        const double a = texel(i, j), b = texel(i + 1, j), c = texel(i, j + 1);
+        const double e = a - b - c + texel(i + 1, j + 1);
+        const double s0 = double(origin.x) - i, u0 = double(origin.z) - j;
+        const double dx = direction.x, dy = direction.y, dz = direction.z;
+        const double qa = -e * dx * dz;
+        const double qb = dy - ((b - a) * dx + (c - a) * dz + e * (s0 * dz + u0 * dx));
+        const double qc = origin.y - (a + (b - a) * s0 + (c - a) * u0 + e * s0 * u0);
+
+        double roots[2];
+        int count = 0;
+        if (std::abs(qa) <= 1e-9 * std::abs(qb)) {
+            if (qb != 0.0) {
+                roots[count++] = -qc / qb;
+            }
+        } else {
+            double discriminant = qb * qb - 4.0 * qa * qc;
+            if (discriminant < 0.0) {
+                return false;
+            }
+            double q = -0.5 * (qb + std::copysign(std::sqrt(discriminant), qb));
+            roots[count++] = q / qa;
+            if (q != 0.0) {
+                roots[count++] = qc / q;
+            }
+            if (count == 2 && roots[1] < roots[0]) {
+                std::swap(roots[0], roots[1]);
+            }
+        }
+        const double slack = 1e-4 * (double(leave) - double(enter)) + 1e-7 * std::abs(double(leave));
+        for (int k = 0; k < count; k++) {
+            double t = roots[k];
+            if (t < double(enter) - slack || t > double(leave) + slack) {
+                continue;
+            }
+            double s = s0 + t * dx, u = u0 + t * dz;
+            float slope_x = m_extent.y * float((b - a) + e * u) * m_to_texels.x;
+            float slope_z = m_extent.y * float((c - a) + e * s) * m_to_texels.y;
+            normal = glm::normalize(glm::vec3(-slope_x, 1.0f, -slope_z));
+            tfar = float(std::min(std::max(t, double(enter)), double(leave)));
+            return true;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// A height field kept on the CPU, for collisions and culling against
+// terrain that is drawn from a height texture.
+//
+// The grid is sampled like a GL_LINEAR, GL_CLAMP_TO_EDGE texture of
+// width x height texels: texel (i, j) sits at texture coordinate
+// ((i + 0.5) / width, (j + 0.5) / height). Texture coordinates map to the
+// world box from `origin` to `origin + extent`, and a height h to
+// origin.y + extent.y * h.
+//
+// The min-max pyramid bounds the surface over any region: level 0 holds the
+// lowest and highest of the four texels around each cell between texel
+// centers, which bound the bilinear surface of the cell, and each further
+// level bounds 2x2 nodes of the level below. Node (i, j) of level l covers
+// the cells from (i * 2^l, j * 2^l) up to (but not including)
+// ((i + 1) * 2^l, (j + 1) * 2^l).
+//
+// Rays are intersected by walking down the pyramid front to back, through
+// the nodes whose boxes the ray passes, to the cells where the bilinear
+// surface is solved for exactly. No triangles are stored.
+//////////////////////////////////////////////////////////////////////////////
+class HeightGrid
+{
+public:
+	struct Level
+	{
+		int width = 0, height = 0;
+		std::vector<float> low, high;
+	};
+
+	HeightGrid() = default;
+	// Copies the heights, `heights` holds `width` texels per row
+	HeightGrid(const float* heights, int width, int height, const glm::vec3& origin, const glm::vec3& extent);
+
+	int width() const
+	{
+		return m_width;
+	}
+	int height() const
+	{
+		return m_height;
+	}
+	bool empty() const
+	{
+		return m_heights.empty();
+	}
+	const glm::vec3& origin() const
+	{
+		return m_origin;
+	}
+	const glm::vec3& extent() const
+	{
+		return m_extent;
+	}
+	const std::vector<Level>& levels() const
+	{
+		return m_levels;
+	}
+	// The unscaled height of a texel, clamped to the grid
+	float texel(int i, int j) const;
+
+	// World space height and normal of the surface under (x, z)
+	float heightAt(float x, float z) const;
+	glm::vec3 normalAt(float x, float z) const;
+
+	// The lowest and highest world height of the surface over the world
+	// space rectangle from (x0, z0) to (x1, z1), from at most 2x2 nodes of
+	// the pyramid. The range may be larger than the exact one, never smaller.
+	void heightRange(float x0, float z0, float x1, float z1, float& low, float& high) const;
+
+	// The world space box of node (i, j) of a level of the pyramid
+	void nodeBounds(int level, int i, int j, glm::vec3& low, glm::vec3& high) const;
+
+	// The first hit of the ray origin + t * direction with the surface, for
+	// t from tnear to tfar, over the whole grid or under one node of the
+	// pyramid. On a hit, tfar is moved to it and normal is the normal of the
+	// bilinear surface there.
+	bool intersect(const glm::vec3& origin, const glm::vec3& direction, float tnear, float& tfar,
+	               glm::vec3& normal) const;
+	bool intersect(const glm::vec3& origin, const glm::vec3& direction, float tnear, float& tfar,
+	               glm::vec3& normal, int level, int i, int j) const;
+
+	// World x, z to continuous texel coordinates, where texel centers are
+	// at whole numbers
+	glm::vec2 toTexels(float x, float z) const
+	{
+		return glm::vec2((x - m_origin.x) * m_to_texels.x - 0.5f, (z - m_origin.z) * m_to_texels.y - 0.5f);
+	}
+	const float* data() const
+	{
+		return m_heights.data();
+	}
+
+private:
+	int m_width = 0, m_height = 0;
+	std::vector<float> m_heights;
+	glm::vec3 m_origin = glm::vec3(0.0f);
+	glm::vec3 m_extent = glm::vec3(1.0f);
+	glm::vec2 m_to_texels = glm::vec2(1.0f);
+	std::vector<Level> m_levels;
+
+	void buildPyramid();
+	// The ray is in texel space here: cells are unit squares and heights are
+	// unscaled
+	bool intersectCell(int i, int j, const glm::vec3& origin, const glm::vec3& direction, float enter,
+	                   float exit, float& tfar, glm::vec3& normal) const;
+};
+} // namespace labhelper
@@ -0,0 +1,345 @@
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+
+namespace labhelper {
+///////////////////////////////////////////////////////////////////////////
+// A FIFO vertex cache. A vertex is in the cache if fewer than
+// VERTEX_CACHE_SIZE vertices have been added since it was.
+///////////////////////////////////////////////////////////////////////////
+    struct VertexCache {
+        std::vector<uint32_t> timestamps;
+        uint32_t time;
+
+        explicit VertexCache(size_t number_of_vertices)
+                : timestamps(number_of_vertices, 0), time(VERTEX_CACHE_SIZE + 1) {
+        }
+
+        bool contains(uint32_t vertex) const {
+            return time - timestamps[vertex] <= VERTEX_CACHE_SIZE;
+        }
+
+        // Returns the number of misses
+        int add(const uint32_t *triangle) {
+            int misses = 0;
+            for (int j = 0; j < 3; j++) {
+                if (!contains(triangle[j])) {
+                    timestamps[triangle[j]] = time++;
+                    misses++;
+                }
+            }
+            return misses;
+        }
+
+        void flush() {
+            time += VERTEX_CACHE_SIZE + 1;
+        }
+    };
+
+    static uint64_t cacheMisses(const uint32_t *indices, uint32_t number_of_triangles, uint32_t number_of_vertices) {
+        VertexCache cache(number_of_vertices);
+        uint64_t misses = 0;
+        for (uint32_t t = 0; t < number_of_triangles; t++) {
+            misses += cache.add(indices + t * 3);
+        }
+        return misses;
+    }
+
+    VertexCacheStatistics vertexCacheStatistics(const Model *model) {
+        uint64_t misses = 0, triangles = 0, vertices = 0;
+        for (const auto &mesh : model->m_meshes) {
+            const uint32_t *indices = model->m_indices.data() + mesh.m_first_index;
+            VertexCache cache(mesh.m_number_of_vertices);
+            std::vector<bool> used(mesh.m_number_of_vertices, false);
+            for (uint32_t i = 0; i + 3 <= mesh.m_number_of_indices; i += 3) {
+                misses += cache.add(indices + i);
+                triangles += 1;
+                for (int j = 0; j < 3; j++) {
+                    if (!used[indices[i + j]]) {
+                        used[indices[i + j]] = true;
+                        vertices += 1;
+                    }
+                }
+            }
+        }
+        VertexCacheStatistics statistics;
+        if (triangles > 0) {
+            statistics.acmr = float(misses) / float(triangles);
+            statistics.atvr = float(misses) / float(vertices);
+        }
+        return statistics;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Tipsify. Fans around one vertex at a time, and moves on to the vertex
+// of the last fan that will stay in the cache and has been in it the
+// longest. Returns the triangles in the new order, and in `restarts` the
+// positions in it where there was no such vertex and it had to start over
+// somewhere else.
+///////////////////////////////////////////////////////////////////////////
+    static std::vector<uint32_t> tipsify(const uint32_t *indices, uint32_t number_of_triangles,
+                                         uint32_t number_of_vertices, std::vector<uint32_t> &restarts) {
+        // The triangles around each vertex, and how many are not emitted yet
+        std::vector<uint32_t> live(number_of_vertices, 0);
+        for (uint32_t i = 0; i < number_of_triangles * 3; i++) {
+            live[indices[i]]++;
+        }
+        std::vector<uint32_t> first_adjacent(number_of_vertices + 1, 0);
+        for (uint32_t v = 0; v < number_of_vertices; v++) {
+            first_adjacent[v + 1] = first_adjacent[v] + live[v];
+        }
+        std::vector<uint32_t> adjacent(number_of_triangles * 3);
+        std::vector<uint32_t> fill(first_adjacent.begin(), first_adjacent.end() - 1);
+        for (uint32_t t = 0; t < number_of_triangles; t++) {
+            for (int j = 0; j < 3; j++) {
+                adjacent[fill[indices[t * 3 + j]]++] = t;
+            }
+        }
+
+        VertexCache cache(number_of_vertices);
+        std::vector<bool> emitted(number_of_triangles, false);
+        std::vector<uint32_t> dead_ends;
+        std::vector<uint32_t> candidates;
+        std::vector<uint32_t> order;
+        order.reserve(number_of_triangles);
+        uint32_t cursor = 0;
+
+        // Recently used vertices first, then the rest in input order
+        auto skipDeadEnd = [&]() -> int64_t {
+            while (!dead_ends.empty()) {
+                uint32_t vertex = dead_ends.back();
+                dead_ends.pop_back();
+                if (live[vertex] > 0) {
+                    return vertex;
+                }
+            }
+            for (; cursor < number_of_vertices; cursor++) {
+                if (live[cursor] > 0) {
+                    return cursor;
+                }
+            }
+            return -1;
+        };
+
+        int64_t fanning = skipDeadEnd();
+        if (fanning >= 0) {
+            restarts.push_back(0);
+        }
+        while (fanning >= 0) {
+            candidates.clear();
+            for (uint32_t a = first_adjacent[fanning]; a < first_adjacent[fanning + 1]; a++) {
+                uint32_t t = adjacent[a];
+                if (emitted[t]) {
+                    continue;
+                }
+                emitted[t] = true;
+                order.push_back(t);
+                cache.add(indices + t * 3);
+                for (int j = 0; j < 3; j++) {
+                    uint32_t vertex = indices[t * 3 + j];
+                    live[vertex]--;
+                    dead_ends.push_back(vertex);
+                    candidates.push_back(vertex);
+                }
+            }
+
+            int64_t next = -1;
+            uint32_t best_priority = 0;
+            for (uint32_t vertex : candidates) {
+                if (live[vertex] == 0) {
+                    continue;
+                }
+                // Fanning around it adds at most two vertices per triangle
+                uint32_t age = cache.time - cache.timestamps[vertex];
+                uint32_t priority = age + 2 * live[vertex] <= VERTEX_CACHE_SIZE ? age : 0;
+                if (next < 0 || priority > best_priority) {
+                    next = vertex;
+                    best_priority = priority;
+                }
+            }
+            if (next < 0) {
+                next = skipDeadEnd();
+                if (next >= 0) {
+                    restarts.push_back(uint32_t(order.size()));
+                }
+            }
+            fanning = next;
+        }
+        return order;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Overdraw: cut the Tipsify order into clusters, and draw the clusters
+// that face away from the center of the mesh first. Every restart starts
+// a cluster, and a cluster is cut early once its ACMR so far (starting
+// with a cold cache) is within OVERDRAW_THRESHOLD of the ACMR of the
+// whole run. Larger thresholds give more clusters, so less overdraw but
+// more cache misses.
+///////////////////////////////////////////////////////////////////////////
+    const float OVERDRAW_THRESHOLD = 1.05f;
+
+    static std::vector<uint32_t> sortClusters(const uint32_t *indices, const std::vector<uint32_t> &order,
+                                              const std::vector<uint32_t> &restarts, const glm::vec3 *positions,
+                                              uint32_t number_of_vertices) {
+        std::vector<uint32_t> boundaries;
+        VertexCache cache(number_of_vertices);
+        for (size_t r = 0; r < restarts.size(); r++) {
+            uint32_t begin = restarts[r];
+            uint32_t end = r + 1 < restarts.size() ? restarts[r + 1] : uint32_t(order.size());
+            cache.flush();
+            uint32_t misses = 0;
+            for (uint32_t i = begin; i < end; i++) {
+                misses += cache.add(indices + order[i] * 3);
+            }
+            float threshold = OVERDRAW_THRESHOLD * float(misses) / float(end - begin);
+
+            boundaries.push_back(begin);
+            cache.flush();
+            uint32_t running_misses = 0, running_triangles = 0;
+            for (uint32_t i = begin; i + 1 < end; i++) {
+                running_misses += cache.add(indices + order[i] * 3);
+                running_triangles += 1;
+                if (float(running_misses) <= threshold * float(running_triangles)) {
+                    boundaries.push_back(i + 1);
+                    cache.flush();
+                    running_misses = 0;
+                    running_triangles = 0;
+                }
+            }
+        }
+        boundaries.push_back(uint32_t(order.size()));
+
+        ///////////////////////////////////////////////////////////////////////
+        // Sort by how much the (area weighted) average normal of a cluster
+        // points away from the center of the mesh
+        ///////////////////////////////////////////////////////////////////////
+        glm::vec3 mesh_center(0.0f);
+        for (uint32_t t : order) {
+            for (int j = 0; j < 3; j++) {
+                mesh_center += positions[indices[t * 3 + j]];
+            }
+        }
+        mesh_center /= float(order.size() * 3);
+
+        struct Cluster {
+            uint32_t begin, end;
+            float facing;
+        };
+        std::vector<Cluster> clusters;
+        for (size_t c = 0; c + 1 < boundaries.size(); c++) {
+            Cluster cluster = {boundaries[c], boundaries[c + 1], 0.0f};
+            glm::vec3 center(0.0f), normal(0.0f);
+            float area = 0.0f;
+            for (uint32_t i = cluster.begin; i < cluster.end; i++) {
+                const uint32_t *triangle = indices + order[i] * 3;
+                glm::vec3 p0 = positions[triangle[0]], p1 = positions[triangle[1]], p2 = positions[triangle[2]];
+                glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+                float triangle_area = glm::length(n);
+                center += triangle_area * (p0 + p1 + p2) / 3.0f;
+                normal += n;
+                area += triangle_area;
+            }
+            if (area > 0.0f && glm::length(normal) > 0.0f) {
+                cluster.facing = glm::dot(center / area - mesh_center, glm::normalize(normal));
+            }
+            clusters.push_back(cluster);
+        }
+        std::stable_sort(clusters.begin(), clusters.end(),
+                         [](const Cluster &a, const Cluster &b) { return a.facing > b.facing; });
+
+        std::vector<uint32_t> sorted;
+        sorted.reserve(order.size());
+        for (const auto &cluster : clusters) {
+            sorted.insert(sorted.end(), order.begin() + cluster.begin, order.begin() + cluster.end);
+        }
+        return sorted;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Vertex fetch: move the vertices of a mesh into the order they are
+// first used in, unused vertices last
+///////////////////////////////////////////////////////////////////////////
+    template<typename T>
+    static void permute(T *data, const std::vector<uint32_t> &new_index) {
+        std::vector<T> old(data, data + new_index.size());
+        for (size_t v = 0; v < new_index.size(); v++) {
+            data[new_index[v]] = old[v];
+        }
+    }
+
+    static void reorderVertices(Model *model, const Mesh &mesh) {
+        const uint32_t UNUSED = UINT32_MAX;
+        uint32_t *indices = model->m_indices_storage.data() + mesh.m_first_index;
+        std::vector<uint32_t> new_index(mesh.m_number_of_vertices, UNUSED);
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < mesh.m_number_of_indices; i++) {
+            if (new_index[indices[i]] == UNUSED) {
+                new_index[indices[i]] = next++;
+            }
+        }
+        for (auto &index : new_index) {
+            if (index == UNUSED) {
+                index = next++;
+            }
+        }
+        for (uint32_t i = 0; i < mesh.m_number_of_indices; i++) {
+            indices[i] = new_index[indices[i]];
+        }
+        // The LODs use the same vertices
+        for (const auto &lod : mesh.m_lods) {
+            uint32_t *lod_indices = model->m_indices_storage.data() + lod.m_first_index;
+            for (uint32_t i = 0; i < lod.m_number_of_indices; i++) {
+                lod_indices[i] = new_index[lod_indices[i]];
+            }
+        }
+        permute(model->m_positions_storage.data() + mesh.m_start_index, new_index);
+        permute(model->m_normals_storage.data() + mesh.m_start_index, new_index);
+        permute(model->m_texture_coordinates_storage.data() + mesh.m_start_index, new_index);
+    }
+
+    // Tipsify and cluster the triangles of a mesh or LOD, if that helps
+    static void reorderTriangles(uint32_t *indices, uint32_t number_of_indices, const glm::vec3 *positions,
+                                 uint32_t number_of_vertices) {
+        uint32_t number_of_triangles = number_of_indices / 3;
+        if (number_of_triangles == 0) {
+            return;
+        }
+        std::vector<uint32_t> restarts;
+        std::vector<uint32_t> order = tipsify(indices, number_of_triangles, number_of_vertices, restarts);
+        order = sortClusters(indices, order, restarts, positions, number_of_vertices);
+
+        std::vector<uint32_t> reordered(number_of_triangles * 3);
+        for (uint32_t t = 0; t < number_of_triangles; t++) {
+            std::copy(indices + order[t] * 3, indices + order[t] * 3 + 3, &reordered[t * 3]);
+        }
+        // Meshes that were already in a good order can get a little worse
+        // from the clustering, keep their order then
+        if (cacheMisses(reordered.data(), number_of_triangles, number_of_vertices)
+            < cacheMisses(indices, number_of_triangles, number_of_vertices)) {
+            std::copy(reordered.begin(), reordered.end(), indices);
+        }
+    }
+
+    bool optimizeModel(Model *model) {
+        if (model->m_positions.data() != model->m_positions_storage.data()
+            || model->m_indices.data() != model->m_indices_storage.data()
+            || model->m_indices.size() != model->m_indices_storage.size()) {
+            std::cout << "ERROR: optimizeModel(): " << model->m_filename << " does not own its arrays.\n";
+            return false;
+        }
+
+        for (const auto &mesh : model->m_meshes) {
+            uint32_t *indices = model->m_indices_storage.data();
+            const glm::vec3 *positions = model->m_positions_storage.data() + mesh.m_start_index;
+            reorderTriangles(indices + mesh.m_first_index, mesh.m_number_of_indices, positions,
+                             mesh.m_number_of_vertices);
+            for (const auto &lod : mesh.m_lods) {
+                reorderTriangles(indices + lod.m_first_index, lod.m_number_of_indices, positions,
+                                 mesh.m_number_of_vertices);
+            }
+            reorderVertices(model, mesh);
+        }
+        return true;
+    }
+}
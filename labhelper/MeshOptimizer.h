@@ -0,0 +1,42 @@
+#pragma once
+#include "Model.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Statistics of the post-transform vertex cache, simulated as a FIFO with
+// VERTEX_CACHE_SIZE entries that is flushed between meshes.
+// ACMR: vertices transformed per triangle (3 is the worst, ~0.5 the best
+//       for large regular meshes).
+// ATVR: vertices transformed per unique vertex (1 is the best).
+//////////////////////////////////////////////////////////////////////////////
+const int VERTEX_CACHE_SIZE = 16;
+
+struct VertexCacheStatistics
+{
+	float acmr = 0.0f;
+	float atvr = 0.0f;
+};
+VertexCacheStatistics vertexCacheStatistics(const Model* model);
+
+//////////////////////////////////////////////////////////////////////////////
+// Reorders the triangles and vertices of each mesh, without changing what
+// is drawn:
+// 1. Triangles are ordered for the vertex cache with Tipsify (Sander et al.
+//    2007, "Fast Triangle Reordering for Vertex Locality and Reduced
+//    Overdraw").
+// 2. The result is cut into clusters that each keep a good ACMR, and the
+//    clusters are sorted so that those that face away from the center of
+//    the mesh are drawn first, which helps early-z.
+// 3. Vertices are renumbered in the order they are first used, so that
+//    vertex fetches (and the pathtracer's BVH leaves) touch memory in order.
+//
+// The LODs of the meshes (see generateLods()) are reordered the same way.
+//
+// The model must own its arrays (m_positions etc. view the storage vectors,
+// as for models parsed from OBJ files) and must not be uploaded yet.
+// loadModelFromOBJ() does this when setModelOptimization(true) was called.
+// Returns false if the model can not be optimized.
+//////////////////////////////////////////////////////////////////////////////
+bool optimizeModel(Model* model);
+} // namespace labhelper
@@ -1,4 +1,10 @@
 #include "Model.h"
+#include "Culling.h"
+#include "labhelper.h"
+#include "MeshOptimizer.h"
+#include "ObjLoader.h"
+#include "Simplifier.h"
+#include "ThreadPool.h"
 #include <iostream>
 
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
@@ -10,43 +16,33 @@
 #include <iomanip>
 #include <GL/glew.h>
 #include <stb_image.h>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+#include <unordered_map>
+#include <fstream>
+#include <sys/stat.h>
 
 namespace labhelper {
     bool Texture::load(const std::string &_directory, const std::string &_filename, int _components) {
         filename = _filename;
         directory = _directory;
-        valid = true;
-        int discard;
-        data = stbi_load((directory + filename).c_str(), &width, &height, &discard, _components);
-        if (data == nullptr) {
+        image = TextureCache::instance().get(directory + filename, _components);
+        if (!image) {
             std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << _directory
                       << "\n";
             exit(1);
         }
-        glGenTextures(1, &gl_id);
-        glBindTexture(GL_TEXTURE_2D, gl_id);
-        GLenum format, internal_format;
-        if (_components == 1) {
-            format = GL_RED;
-            internal_format = GL_R8;
-        } else if (_components == 3) {
-            format = GL_RGB;
-            internal_format = GL_RGB;
-        } else if (_components == 4) {
-            format = GL_RGBA;
-            internal_format = GL_RGBA;
-        } else {
-            std::cout << "Texture loading not implemented for this number of compenents.\n";
-            exit(1);
-        }
+        valid = true;
+        gl_id = image->gl_id;
+        width = image->width;
+        height = image->height;
+        data = image->data;
         components = _components;
-        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
         return true;
     }
 
@@ -150,28 +146,940 @@ namespace labhelper {
 // Destructor
 ///////////////////////////////////////////////////////////////////////////
     Model::~Model() {
-        for (auto &material : m_materials) {
-            if (material.m_color_texture.valid)
-                glDeleteTextures(1, &material.m_color_texture.gl_id);
-            if (material.m_reflectivity_texture.valid)
-                glDeleteTextures(1, &material.m_reflectivity_texture.gl_id);
-            if (material.m_roughness_texture.valid)
-                glDeleteTextures(1, &material.m_roughness_texture.gl_id);
-            if (material.m_metalness_texture.valid)
-                glDeleteTextures(1, &material.m_metalness_texture.gl_id);
-            if (material.m_fresnel_texture.valid)
-                glDeleteTextures(1, &material.m_fresnel_texture.gl_id);
-            if (material.m_emission_texture.valid)
-                glDeleteTextures(1, &material.m_emission_texture.gl_id);
-            if (material.m_normal_texture.valid)
-                glDeleteTextures(1, &material.m_normal_texture.gl_id);
-        }
+        // The textures are deleted by the TextureCache when no longer used
         glDeleteBuffers(1, &m_positions_bo);
         glDeleteBuffers(1, &m_normals_bo);
         glDeleteBuffers(1, &m_texture_coordinates_bo);
+        glDeleteBuffers(1, &m_indices_bo);
+        glDeleteBuffers(1, &m_materials_bo);
     }
 
-    Model *loadModelFromOBJ(std::string path) {
+///////////////////////////////////////////////////////////////////////////
+// Vertices with the same position, normal and texture coordinates (bit
+// for bit) are welded into one when loading
+///////////////////////////////////////////////////////////////////////////
+    struct VertexKey {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec2 texture_coordinates;
+
+        bool operator==(const VertexKey &other) const {
+            return memcmp(this, &other, sizeof(VertexKey)) == 0;
+        }
+    };
+
+    struct VertexKeyHash {
+        size_t operator()(const VertexKey &key) const {
+            // FNV-1a over the 32 bit words of the key
+            uint32_t words[sizeof(VertexKey) / 4];
+            memcpy(words, &key, sizeof(VertexKey));
+            uint64_t hash = 14695981039346656037ull;
+            for (uint32_t word : words) {
+                hash = (hash ^ word) * 1099511628211ull;
+            }
+            return size_t(hash ^ (hash >> 32));
+        }
+    };
+
+///////////////////////////////////////////////////////////////////////////
+// Pack the indices of each mesh (and its LODs) as 16 bit if it is small
+// enough, and set the GPU index size and offsets of the meshes
+///////////////////////////////////////////////////////////////////////////
+    static std::vector<uint8_t> packGPUIndices(Model *model) {
+        std::vector<uint8_t> gpu_indices;
+        auto pack = [&](uint32_t index_size, uint32_t first_index, uint32_t number_of_indices) {
+            size_t offset = (gpu_indices.size() + 3) & ~size_t(3);
+            gpu_indices.resize(offset + size_t(number_of_indices) * index_size);
+            for (uint32_t i = 0; i < number_of_indices; i++) {
+                uint32_t index = model->m_indices[first_index + i];
+                if (index_size == 2) {
+                    uint16_t short_index = uint16_t(index);
+                    memcpy(&gpu_indices[offset + i * 2], &short_index, 2);
+                } else {
+                    memcpy(&gpu_indices[offset + i * 4], &index, 4);
+                }
+            }
+            return uint32_t(offset);
+        };
+        for (auto &mesh : model->m_meshes) {
+            mesh.m_gpu_index_size = mesh.m_number_of_vertices <= 65536 ? 2 : 4;
+            mesh.m_gpu_index_offset = pack(mesh.m_gpu_index_size, mesh.m_first_index, mesh.m_number_of_indices);
+            for (auto &lod : mesh.m_lods) {
+                lod.m_gpu_index_offset = pack(mesh.m_gpu_index_size, lod.m_first_index, lod.m_number_of_indices);
+            }
+        }
+        return gpu_indices;
+    }
+
+    // The triangles of the full meshes, without LODs
+    static size_t numberOfTriangles(const Model *model) {
+        size_t number_of_triangles = 0;
+        for (const auto &mesh : model->m_meshes) {
+            number_of_triangles += mesh.m_number_of_indices / 3;
+        }
+        return number_of_triangles;
+    }
+
+    // The size of the vertex and index buffers on the GPU
+    static size_t gpuBytes(const Model *model, size_t gpu_indices_size) {
+        if (!model->m_compressed_vertices.empty()) {
+            return model->m_compressed_vertices.size() * sizeof(CompressedVertex) + gpu_indices_size;
+        }
+        return model->m_positions.size() * (2 * sizeof(glm::vec3) + sizeof(glm::vec2)) + gpu_indices_size;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// The std140 layout of MaterialBlock, see render()
+///////////////////////////////////////////////////////////////////////////
+    struct MaterialBlock {
+        float color[3];
+        float reflectivity;
+        float metalness;
+        float fresnel;
+        float shininess;
+        float emission;
+        int32_t has_color_texture;
+        int32_t has_reflectivity_texture;
+        int32_t has_metalness_texture;
+        int32_t has_fresnel_texture;
+        int32_t has_shininess_texture;
+        int32_t has_emission_texture;
+        int32_t padding[2];
+    };
+    static_assert(sizeof(MaterialBlock) == 64, "MaterialBlock does not match the std140 layout");
+
+    void updateMaterials(Model *model) {
+        if (model->m_material_block_stride == 0) {
+            // Each material starts at a multiple of the offset alignment
+            GLint alignment = 256;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            model->m_material_block_stride =
+                    uint32_t((sizeof(MaterialBlock) + alignment - 1) / alignment * alignment);
+        }
+        std::vector<uint8_t> blocks(std::max<size_t>(model->m_materials.size(), 1) * model->m_material_block_stride);
+        for (size_t i = 0; i < model->m_materials.size(); i++) {
+            const Material &material = model->m_materials[i];
+            MaterialBlock block = {};
+            memcpy(block.color, &material.m_color.x, sizeof(block.color));
+            block.reflectivity = material.m_reflectivity;
+            block.metalness = material.m_metalness;
+            block.fresnel = material.m_fresnel;
+            block.shininess = material.m_roughness;
+            block.emission = material.m_emission;
+            block.has_color_texture = material.m_color_texture.valid;
+            block.has_reflectivity_texture = material.m_reflectivity_texture.valid;
+            block.has_metalness_texture = material.m_metalness_texture.valid;
+            block.has_fresnel_texture = material.m_fresnel_texture.valid;
+            block.has_shininess_texture = material.m_roughness_texture.valid;
+            block.has_emission_texture = material.m_emission_texture.valid;
+            memcpy(&blocks[i * model->m_material_block_stride], &block, sizeof(block));
+        }
+        if (model->m_materials_bo == 0) {
+            glGenBuffers(1, &model->m_materials_bo);
+            glBindBuffer(GL_UNIFORM_BUFFER, model->m_materials_bo);
+            glBufferData(GL_UNIFORM_BUFFER, blocks.size(), blocks.data(), GL_STATIC_DRAW);
+        } else {
+            glBindBuffer(GL_UNIFORM_BUFFER, model->m_materials_bo);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, blocks.size(), blocks.data());
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Upload the vertices and the packed indices of a model to the GPU
+///////////////////////////////////////////////////////////////////////////
+    static void uploadModel(Model *model, const uint8_t *gpu_indices, size_t gpu_indices_size) {
+        glGenVertexArrays(1, &model->m_vaob);
+        glBindVertexArray(model->m_vaob);
+        if (!model->m_compressed_vertices.empty()) {
+            // One interleaved buffer, see CompressedVertex
+            const GLsizei stride = sizeof(CompressedVertex);
+            glGenBuffers(1, &model->m_positions_bo);
+            glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+            glBufferData(GL_ARRAY_BUFFER, model->m_compressed_vertices.size() * sizeof(CompressedVertex),
+                         model->m_compressed_vertices.data(), GL_STATIC_DRAW);
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, true, stride,
+                                  (void *) offsetof(CompressedVertex, position));
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(1, 2, GL_SHORT, true, stride, (void *) offsetof(CompressedVertex, normal));
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(2, 2, GL_HALF_FLOAT, false, stride,
+                                  (void *) offsetof(CompressedVertex, texture_coordinates));
+            glEnableVertexAttribArray(2);
+            model->m_normals_bo = 0;
+            model->m_texture_coordinates_bo = 0;
+        } else {
+            glGenBuffers(1, &model->m_positions_bo);
+            glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+            glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), model->m_positions.data(),
+                         GL_STATIC_DRAW);
+            glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+            glEnableVertexAttribArray(0);
+            glGenBuffers(1, &model->m_normals_bo);
+            glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+            glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), model->m_normals.data(),
+                         GL_STATIC_DRAW);
+            glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+            glEnableVertexAttribArray(1);
+            glGenBuffers(1, &model->m_texture_coordinates_bo);
+            glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+            glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
+                         model->m_texture_coordinates.data(), GL_STATIC_DRAW);
+            glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+            glEnableVertexAttribArray(2);
+        }
+        // The element array binding is part of the vertex array object
+        glGenBuffers(1, &model->m_indices_bo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, gpu_indices_size, gpu_indices, GL_STATIC_DRAW);
+        glBindVertexArray(0);
+        // The textures are loaded by now, so has_*_texture are known
+        updateMaterials(model);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Point the views of a model at its own storage. The positions get one
+// zero vertex (12 bytes) of padding, see Model::m_positions.
+///////////////////////////////////////////////////////////////////////////
+    static void viewStorage(Model *model) {
+        size_t number_of_vertices = model->m_positions_storage.size();
+        model->m_positions_storage.push_back(glm::vec3(0.0f));
+        model->m_positions_storage.shrink_to_fit();
+        model->m_normals_storage.shrink_to_fit();
+        model->m_texture_coordinates_storage.shrink_to_fit();
+        model->m_indices_storage.shrink_to_fit();
+        model->m_positions = ArrayView<glm::vec3>(model->m_positions_storage.data(), number_of_vertices);
+        model->m_normals = ArrayView<glm::vec3>(model->m_normals_storage.data(), number_of_vertices);
+        model->m_texture_coordinates = ArrayView<glm::vec2>(model->m_texture_coordinates_storage.data(),
+                                                            number_of_vertices);
+        model->m_indices = ArrayView<uint32_t>(model->m_indices_storage.data(), model->m_indices_storage.size());
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Models parsed from OBJ files are optimized if this is set, see
+// MeshOptimizer.h
+///////////////////////////////////////////////////////////////////////////
+    static std::atomic<bool> model_optimization(false);
+
+    void setModelOptimization(bool enabled) {
+        model_optimization = enabled;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// LODs are generated for models parsed from OBJ files if this is set, see
+// Simplifier.h
+///////////////////////////////////////////////////////////////////////////
+    static std::atomic<bool> lod_generation(false);
+
+    void setLodGeneration(bool enabled) {
+        lod_generation = enabled;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Compressed vertices, see CompressedVertex
+///////////////////////////////////////////////////////////////////////////
+    static std::atomic<bool> vertex_compression(false);
+    const float MAX_COMPRESSED_TEXTURE_COORDINATE = 2.0f;
+
+    void setVertexCompression(bool enabled) {
+        vertex_compression = enabled;
+    }
+
+    static std::atomic<bool> keep_vertex_arrays(false);
+
+    void setKeepVertexArrays(bool enabled) {
+        keep_vertex_arrays = enabled;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Free the float vertex arrays of a compressed model, unless they are to
+// be kept. Mapped models just stop pointing at them, so those pages of the
+// file are never read.
+///////////////////////////////////////////////////////////////////////////
+    static void dropVertexArrays(Model *model) {
+        if (model->m_compressed_vertices.empty() || keep_vertex_arrays) {
+            return;
+        }
+        model->m_positions = ArrayView<glm::vec3>();
+        model->m_normals = ArrayView<glm::vec3>();
+        model->m_texture_coordinates = ArrayView<glm::vec2>();
+        model->m_positions_storage = std::vector<glm::vec3>();
+        model->m_normals_storage = std::vector<glm::vec3>();
+        model->m_texture_coordinates_storage = std::vector<glm::vec2>();
+    }
+
+    static bool hasVertexArrays(const Model *model) {
+        return model->m_compressed_vertices.empty() || !model->m_positions.empty();
+    }
+
+    // Octahedral encoding: project onto the octahedron |x| + |y| + |z| = 1
+    // and fold the lower half over the upper
+    static glm::vec2 octahedralEncode(glm::vec3 n) {
+        float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (sum == 0.0f) {
+            return glm::vec2(0.0f);
+        }
+        n /= sum;
+        if (n.z < 0.0f) {
+            return glm::vec2((1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                             (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+        }
+        return glm::vec2(n.x, n.y);
+    }
+
+    glm::vec3 decodePosition(const CompressedVertex &vertex, const Mesh &mesh) {
+        glm::vec3 quantized(vertex.position[0], vertex.position[1], vertex.position[2]);
+        return mesh.m_position_offset + mesh.m_position_scale * (quantized * (1.0f / 65535.0f));
+    }
+
+    glm::vec3 decodeNormal(const CompressedVertex &vertex) {
+        uint32_t packed;
+        memcpy(&packed, vertex.normal, sizeof(packed));
+        glm::vec2 e = glm::unpackSnorm2x16(packed);
+        glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+        if (n.z < 0.0f) {
+            n.x = (1.0f - std::abs(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f);
+            n.y = (1.0f - std::abs(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        return glm::normalize(n);
+    }
+
+    glm::vec2 decodeTextureCoordinates(const CompressedVertex &vertex) {
+        uint32_t packed;
+        memcpy(&packed, vertex.texture_coordinates, sizeof(packed));
+        return glm::unpackHalf2x16(packed);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Set the bounds of the meshes: the box, a sphere around its center that
+// is usually a lot tighter than the one through its corners, and the
+// batches for culling
+///////////////////////////////////////////////////////////////////////////
+    static void computeBounds(Model *model) {
+        for (auto &mesh : model->m_meshes) {
+            glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+            for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++) {
+                lo = glm::min(lo, model->m_positions[i]);
+                hi = glm::max(hi, model->m_positions[i]);
+            }
+            if (mesh.m_number_of_vertices == 0) {
+                lo = hi = glm::vec3(0.0f);
+            }
+            mesh.m_position_offset = lo;
+            mesh.m_position_scale = hi - lo;
+            mesh.m_bounds_center = 0.5f * (lo + hi);
+            float radius2 = 0.0f;
+            for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++) {
+                glm::vec3 d = model->m_positions[i] - mesh.m_bounds_center;
+                radius2 = std::max(radius2, glm::dot(d, d));
+            }
+            mesh.m_bounds_radius = std::sqrt(radius2);
+        }
+        buildMeshBounds(model);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Compress the vertices of a model, unless the texture coordinates do not
+// fit (see setVertexCompression()). Positions are quantized within the
+// bounds of their mesh, so computeBounds() goes first.
+///////////////////////////////////////////////////////////////////////////
+    static bool compressVertices(const Model *model, std::vector<CompressedVertex> &compressed) {
+        for (const auto &uv : model->m_texture_coordinates) {
+            if (std::abs(uv.x) > MAX_COMPRESSED_TEXTURE_COORDINATE
+                || std::abs(uv.y) > MAX_COMPRESSED_TEXTURE_COORDINATE) {
+                return false;
+            }
+        }
+        compressed.resize(model->m_positions.size());
+        for (auto &mesh : model->m_meshes) {
+            glm::vec3 lo = mesh.m_position_offset;
+            // Flat meshes have no extent along some axis
+            glm::vec3 inverse_scale;
+            for (int k = 0; k < 3; k++) {
+                inverse_scale[k] = mesh.m_position_scale[k] > 0.0f ? 1.0f / mesh.m_position_scale[k] : 0.0f;
+            }
+            for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++) {
+                CompressedVertex &vertex = compressed[i];
+                glm::vec3 p = glm::clamp((model->m_positions[i] - lo) * inverse_scale, 0.0f, 1.0f);
+                for (int k = 0; k < 3; k++) {
+                    vertex.position[k] = uint16_t(std::round(p[k] * 65535.0f));
+                }
+                vertex.position[3] = 0;
+                uint32_t normal = glm::packSnorm2x16(octahedralEncode(model->m_normals[i]));
+                memcpy(vertex.normal, &normal, sizeof(normal));
+                uint32_t texture_coordinates = glm::packHalf2x16(model->m_texture_coordinates[i]);
+                memcpy(vertex.texture_coordinates, &texture_coordinates, sizeof(texture_coordinates));
+            }
+        }
+        return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// The binary model format (.lhm). All offsets are in bytes from the start
+// of the file. Every array starts at a multiple of 16 bytes and is
+// followed by at least 16 bytes of zero padding. Strings are kept in one
+// table and referred to by offset and size. Everything that takes a pass
+// over the vertices (the bounds, the compressed vertices) and the checks
+// of the indices are done when the file is written, so that loading it
+// only reads the header and the tables.
+///////////////////////////////////////////////////////////////////////////
+    const char BINARY_MAGIC[4] = {'L', 'H', 'M', 'B'};
+    const uint32_t BINARY_VERSION = 5;
+    const size_t BINARY_ALIGNMENT = 16;
+    const uint32_t BINARY_OPTIMIZED = 1;
+    const uint32_t BINARY_LODS = 2;
+    const int NUMBER_OF_TEXTURES = 7;
+
+    // The textures of a material in the order they are stored, and the
+    // number of components they are loaded with
+    Texture Material::*const MATERIAL_TEXTURES[NUMBER_OF_TEXTURES] = {
+            &Material::m_color_texture, &Material::m_reflectivity_texture, &Material::m_roughness_texture,
+            &Material::m_metalness_texture, &Material::m_fresnel_texture, &Material::m_emission_texture,
+            &Material::m_normal_texture};
+    const int MATERIAL_TEXTURE_COMPONENTS[NUMBER_OF_TEXTURES] = {4, 1, 1, 1, 1, 4, 3};
+
+    // Start decoding the textures of OBJ materials on the thread pool
+    static void prefetchTextures(const std::string &directory, const std::vector<tinyobj::material_t> &materials) {
+        TextureCache &cache = TextureCache::instance();
+        for (const auto &m : materials) {
+            const std::pair<const std::string *, int> textures[] = {
+                    {&m.diffuse_texname,   4}, {&m.specular_texname,  1}, {&m.metallic_texname, 1},
+                    {&m.sheen_texname,     1}, {&m.roughness_texname, 1}, {&m.emissive_texname, 4},
+                    {&m.normal_texname,    3}};
+            for (const auto &texture : textures) {
+                if (*texture.first != "") {
+                    cache.prefetch(directory + *texture.first, texture.second);
+                }
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Models are loaded in two stages. Everything that does not need GL
+// (parsing, welding, mapping a binary model) is done first, on any
+// thread. What is left is the GL work, which is done by uploadStep() on
+// the GL thread, one texture at a time so that it can be spread over
+// several frames (see AsyncLoader.h).
+///////////////////////////////////////////////////////////////////////////
+    struct PendingModel {
+        Model *model = nullptr;
+        // The packed indices to upload, in the mapped file of a binary
+        // model or else in the storage
+        std::vector<uint8_t> gpu_indices_storage;
+        const uint8_t *gpu_indices = nullptr;
+        size_t gpu_indices_size = 0;
+        // The next texture to load, counting NUMBER_OF_TEXTURES per material
+        size_t next_texture = 0;
+    };
+
+    // Name a texture of a material and start decoding it. It is loaded by
+    // uploadStep().
+    static void deferTexture(Texture &texture, const std::string &directory, const std::string &filename,
+                             int components) {
+        texture.directory = directory;
+        texture.filename = filename;
+        texture.components = components;
+        TextureCache::instance().prefetch(directory + filename, components);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Do the next piece of the GL work of a pending model: load a texture, or
+// upload the buffers once all textures are loaded. Unless `wait` is set,
+// a texture that is still being decoded is not waited for.
+///////////////////////////////////////////////////////////////////////////
+    static UploadStatus uploadStep(PendingModel &pending, bool wait) {
+        Model *model = pending.model;
+        size_t number_of_textures = model->m_materials.size() * NUMBER_OF_TEXTURES;
+        for (; pending.next_texture < number_of_textures; pending.next_texture++) {
+            Material &material = model->m_materials[pending.next_texture / NUMBER_OF_TEXTURES];
+            Texture &texture = material.*MATERIAL_TEXTURES[pending.next_texture % NUMBER_OF_TEXTURES];
+            if (texture.filename == "" || texture.valid) {
+                continue;
+            }
+            if (!wait && !TextureCache::instance().isReady(texture.directory + texture.filename, texture.components)) {
+                return UPLOAD_WAITING;
+            }
+            texture.load(texture.directory, texture.filename, texture.components);
+            pending.next_texture++;
+            return UPLOAD_PROGRESS;
+        }
+        uploadModel(model, pending.gpu_indices, pending.gpu_indices_size);
+        pending.gpu_indices_storage = std::vector<uint8_t>();
+        return UPLOAD_DONE;
+    }
+
+    static Model *finishModel(PendingModel &pending) {
+        while (uploadStep(pending, true) != UPLOAD_DONE) {
+        }
+        return pending.model;
+    }
+
+    struct BinaryString {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    struct BinaryHeader {
+        char magic[4];
+        uint32_t version;
+        // BINARY_OPTIMIZED if the model went through optimizeModel(),
+        // BINARY_LODS if it went through generateLods()
+        uint32_t flags;
+        // Size and modification time of the OBJ file the model was made
+        // from, to tell whether a cached model is up to date
+        uint64_t source_size;
+        int64_t source_time;
+        // The material libraries the OBJ file named, with their stamps,
+        // since the materials are baked into the model too
+        uint32_t number_of_material_files;
+        uint64_t material_files_offset;
+        uint32_t number_of_materials;
+        uint32_t number_of_meshes;
+        uint32_t number_of_vertices;
+        // 0 if there is no index buffer. The vertices of each mesh are then
+        // a list of triangles.
+        uint32_t number_of_indices;
+        uint32_t number_of_lods;
+        uint64_t strings_offset, strings_size;
+        uint64_t materials_offset;
+        uint64_t meshes_offset;
+        uint64_t lods_offset;
+        uint64_t positions_offset;
+        uint64_t normals_offset;
+        uint64_t texture_coordinates_offset;
+        uint64_t indices_offset;
+        // The indices as uploaded to the GPU, see packGPUIndices()
+        uint64_t gpu_indices_offset, gpu_indices_size;
+        // The vertices in the compressed layout, or 0 if the model does not
+        // fit it, see compressVertices()
+        uint64_t compressed_vertices_offset;
+    };
+
+    struct BinaryMaterial {
+        BinaryString name;
+        float color[3];
+        float reflectivity, roughness, metalness, fresnel, emission, transparency;
+        BinaryString textures[NUMBER_OF_TEXTURES];
+    };
+
+    struct BinaryMesh {
+        BinaryString name;
+        uint32_t material_idx;
+        uint32_t start_index, number_of_vertices;
+        uint32_t first_index, number_of_indices;
+        uint32_t gpu_index_size, gpu_index_offset;
+        // The LODs of the mesh in the LOD table
+        uint32_t first_lod, number_of_lods;
+        // The bounds, see computeBounds()
+        float position_offset[3], position_scale[3];
+        float bounds_center[3], bounds_radius;
+    };
+
+    struct BinaryLod {
+        uint32_t first_index, number_of_indices;
+        uint32_t gpu_index_offset;
+        float error;
+    };
+
+    struct SourceStamp {
+        uint64_t size = 0;
+        int64_t time = 0;
+    };
+
+    // Relative to the directory of the model
+    struct BinaryMaterialFile {
+        BinaryString filename;
+        uint64_t size;
+        int64_t time;
+    };
+
+    static SourceStamp sourceStamp(const std::string &path) {
+        SourceStamp stamp;
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            stamp.size = uint64_t(info.st_size);
+            stamp.time = int64_t(info.st_mtime);
+        }
+        return stamp;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Check that the indices of each mesh and LOD are inside the vertices of
+// the mesh, as both the GPU and Embree take them as they are
+///////////////////////////////////////////////////////////////////////////
+    static bool indicesInside(const Model *model) {
+        auto inside = [model](const Mesh &mesh, uint32_t first_index, uint32_t number_of_indices) {
+            if (uint64_t(first_index) + number_of_indices > model->m_indices.size()) {
+                return false;
+            }
+            for (uint32_t i = first_index; i < first_index + number_of_indices; i++) {
+                if (model->m_indices[i] >= mesh.m_number_of_vertices) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        for (const auto &mesh : model->m_meshes) {
+            if (!inside(mesh, mesh.m_first_index, mesh.m_number_of_indices)) {
+                return false;
+            }
+            for (const auto &lod : mesh.m_lods) {
+                if (!inside(mesh, lod.m_first_index, lod.m_number_of_indices)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Write a model as a binary model. The file is built in memory and
+// written in one go. `material_files` are stamped as they are now.
+///////////////////////////////////////////////////////////////////////////
+    static bool writeBinary(Model *model, const std::string &path, const SourceStamp &source,
+                            const std::vector<std::string> &material_files, uint32_t flags) {
+        if (!indicesInside(model)) {
+            std::cout << "ERROR: " << model->m_filename << " has indices outside its meshes.\n";
+            return false;
+        }
+        if (!hasVertexArrays(model)) {
+            std::cout << "ERROR: " << model->m_filename << " has no vertex arrays, see setKeepVertexArrays().\n";
+            return false;
+        }
+        std::vector<uint8_t> gpu_indices = packGPUIndices(model);
+        // Compressed whether or not this model uses it, so that loading the
+        // file with compression on is as cheap as without
+        std::vector<CompressedVertex> compressed_storage;
+        ArrayView<CompressedVertex> compressed = model->m_compressed_vertices;
+        if (compressed.empty() && compressVertices(model, compressed_storage)) {
+            compressed = ArrayView<CompressedVertex>(compressed_storage.data(), compressed_storage.size());
+        }
+        size_t separator = path.find_last_of("\\/");
+        std::string directory = separator != std::string::npos ? path.substr(0, separator + 1) : "./";
+
+        std::string strings;
+        auto addString = [&strings](const std::string &s) {
+            BinaryString result = {uint32_t(strings.size()), uint32_t(s.size())};
+            strings += s;
+            return result;
+        };
+        std::vector<BinaryMaterial> materials(model->m_materials.size());
+        for (size_t i = 0; i < materials.size(); i++) {
+            const Material &m = model->m_materials[i];
+            BinaryMaterial &b = materials[i];
+            b.name = addString(m.m_name);
+            b.color[0] = m.m_color.x;
+            b.color[1] = m.m_color.y;
+            b.color[2] = m.m_color.z;
+            b.reflectivity = m.m_reflectivity;
+            b.roughness = m.m_roughness;
+            b.metalness = m.m_metalness;
+            b.fresnel = m.m_fresnel;
+            b.emission = m.m_emission;
+            b.transparency = m.m_transparency;
+            for (int t = 0; t < NUMBER_OF_TEXTURES; t++) {
+                const Texture &texture = m.*MATERIAL_TEXTURES[t];
+                b.textures[t] = addString(texture.filename);
+            }
+        }
+        std::vector<BinaryMaterialFile> stamps(material_files.size());
+        for (size_t i = 0; i < stamps.size(); i++) {
+            SourceStamp stamp = sourceStamp(directory + material_files[i]);
+            stamps[i] = {addString(material_files[i]), stamp.size, stamp.time};
+        }
+        std::vector<BinaryMesh> meshes(model->m_meshes.size());
+        std::vector<BinaryLod> lods;
+        for (size_t i = 0; i < meshes.size(); i++) {
+            const Mesh &mesh = model->m_meshes[i];
+            BinaryMesh &b = meshes[i];
+            b.name = addString(mesh.m_name);
+            b.material_idx = mesh.m_material_idx;
+            b.start_index = mesh.m_start_index;
+            b.number_of_vertices = mesh.m_number_of_vertices;
+            b.first_index = mesh.m_first_index;
+            b.number_of_indices = mesh.m_number_of_indices;
+            b.gpu_index_size = mesh.m_gpu_index_size;
+            b.gpu_index_offset = mesh.m_gpu_index_offset;
+            b.first_lod = uint32_t(lods.size());
+            b.number_of_lods = uint32_t(mesh.m_lods.size());
+            for (int k = 0; k < 3; k++) {
+                b.position_offset[k] = mesh.m_position_offset[k];
+                b.position_scale[k] = mesh.m_position_scale[k];
+                b.bounds_center[k] = mesh.m_bounds_center[k];
+            }
+            b.bounds_radius = mesh.m_bounds_radius;
+            for (const auto &lod : mesh.m_lods) {
+                lods.push_back({lod.m_first_index, lod.m_number_of_indices, lod.m_gpu_index_offset, lod.m_error});
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Lay out the file
+        ///////////////////////////////////////////////////////////////////////
+        BinaryHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        header.version = BINARY_VERSION;
+        header.flags = flags;
+        header.source_size = source.size;
+        header.source_time = source.time;
+        header.number_of_material_files = uint32_t(stamps.size());
+        header.number_of_materials = uint32_t(materials.size());
+        header.number_of_meshes = uint32_t(meshes.size());
+        header.number_of_vertices = uint32_t(model->m_positions.size());
+        header.number_of_indices = uint32_t(model->m_indices.size());
+        header.number_of_lods = uint32_t(lods.size());
+        size_t size = sizeof(BinaryHeader);
+        auto place = [&size](size_t bytes) {
+            size_t offset = (size + BINARY_ALIGNMENT - 1) & ~(BINARY_ALIGNMENT - 1);
+            size = offset + bytes + BINARY_ALIGNMENT;
+            return uint64_t(offset);
+        };
+        header.strings_size = strings.size();
+        header.strings_offset = place(strings.size());
+        header.material_files_offset = place(stamps.size() * sizeof(BinaryMaterialFile));
+        header.materials_offset = place(materials.size() * sizeof(BinaryMaterial));
+        header.meshes_offset = place(meshes.size() * sizeof(BinaryMesh));
+        header.lods_offset = place(lods.size() * sizeof(BinaryLod));
+        header.positions_offset = place(model->m_positions.size() * sizeof(glm::vec3));
+        header.normals_offset = place(model->m_normals.size() * sizeof(glm::vec3));
+        header.texture_coordinates_offset = place(model->m_texture_coordinates.size() * sizeof(glm::vec2));
+        header.indices_offset = place(model->m_indices.size() * sizeof(uint32_t));
+        header.gpu_indices_size = gpu_indices.size();
+        header.gpu_indices_offset = place(gpu_indices.size());
+        if (!compressed.empty()) {
+            header.compressed_vertices_offset = place(compressed.size() * sizeof(CompressedVertex));
+        }
+
+        std::vector<char> file(size, 0);
+        auto copy = [&file](uint64_t offset, const void *data, size_t bytes) {
+            if (bytes > 0) memcpy(&file[offset], data, bytes);
+        };
+        copy(0, &header, sizeof(header));
+        copy(header.strings_offset, strings.data(), strings.size());
+        copy(header.material_files_offset, stamps.data(), stamps.size() * sizeof(BinaryMaterialFile));
+        copy(header.materials_offset, materials.data(), materials.size() * sizeof(BinaryMaterial));
+        copy(header.meshes_offset, meshes.data(), meshes.size() * sizeof(BinaryMesh));
+        copy(header.lods_offset, lods.data(), lods.size() * sizeof(BinaryLod));
+        copy(header.positions_offset, model->m_positions.data(), model->m_positions.size() * sizeof(glm::vec3));
+        copy(header.normals_offset, model->m_normals.data(), model->m_normals.size() * sizeof(glm::vec3));
+        copy(header.texture_coordinates_offset, model->m_texture_coordinates.data(),
+             model->m_texture_coordinates.size() * sizeof(glm::vec2));
+        copy(header.indices_offset, model->m_indices.data(), model->m_indices.size() * sizeof(uint32_t));
+        copy(header.gpu_indices_offset, gpu_indices.data(), gpu_indices.size());
+        if (!compressed.empty()) {
+            copy(header.compressed_vertices_offset, compressed.data(), compressed.size() * sizeof(CompressedVertex));
+        }
+
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) {
+            return false;
+        }
+        out.write(file.data(), file.size());
+        return bool(out);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Map a binary model and point a new Model at it. Returns nullptr if the
+// file can not be used, or if `source` is given and does not match the
+// stamp in the file, or a material library has changed (a stale cache).
+// A cache that was not optimized, or has no LODs, is stale too if models
+// should be optimized or have LODs.
+///////////////////////////////////////////////////////////////////////////
+    static bool loadBinary(const std::string &path, const SourceStamp *source, PendingModel &pending) {
+        auto load_start = std::chrono::steady_clock::now();
+        std::unique_ptr<MappedFile> file(new MappedFile);
+        if (!file->open(path) || file->size() < sizeof(BinaryHeader)) {
+            return false;
+        }
+        const char *data = file->data();
+        BinaryHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0 || header.version != BINARY_VERSION) {
+            std::cout << "ERROR: " << path << " is not a binary model of version " << BINARY_VERSION << ".\n";
+            return false;
+        }
+        uint32_t wanted_flags = (model_optimization ? BINARY_OPTIMIZED : 0) | (lod_generation ? BINARY_LODS : 0);
+        if (source != nullptr && (header.source_size != source->size || header.source_time != source->time
+                                  || (header.flags & wanted_flags) != wanted_flags)) {
+            return false;
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Check that everything is inside the file
+        ///////////////////////////////////////////////////////////////////////
+        uint64_t file_size = file->size();
+        auto inside = [file_size](uint64_t offset, uint64_t bytes) {
+            return offset <= file_size && bytes <= file_size - offset;
+        };
+        bool indexed = header.number_of_indices > 0;
+        if (!inside(header.strings_offset, header.strings_size)
+            || !inside(header.material_files_offset,
+                       uint64_t(header.number_of_material_files) * sizeof(BinaryMaterialFile))
+            || !inside(header.materials_offset, uint64_t(header.number_of_materials) * sizeof(BinaryMaterial))
+            || !inside(header.meshes_offset, uint64_t(header.number_of_meshes) * sizeof(BinaryMesh))
+            || !inside(header.lods_offset, uint64_t(header.number_of_lods) * sizeof(BinaryLod))
+            || !inside(header.positions_offset, uint64_t(header.number_of_vertices + 1) * sizeof(glm::vec3))
+            || !inside(header.normals_offset, uint64_t(header.number_of_vertices) * sizeof(glm::vec3))
+            || !inside(header.texture_coordinates_offset, uint64_t(header.number_of_vertices) * sizeof(glm::vec2))
+            || (indexed && !inside(header.indices_offset, uint64_t(header.number_of_indices) * sizeof(uint32_t)))
+            || (indexed && !inside(header.gpu_indices_offset, header.gpu_indices_size))
+            || (header.compressed_vertices_offset != 0
+                && !inside(header.compressed_vertices_offset,
+                           uint64_t(header.number_of_vertices) * sizeof(CompressedVertex)))) {
+            std::cout << "ERROR: " << path << " is truncated.\n";
+            return false;
+        }
+        const char *strings = data + header.strings_offset;
+        auto getString = [&](const BinaryString &s) {
+            if (uint64_t(s.offset) + s.size > header.strings_size) return std::string();
+            return std::string(strings + s.offset, s.size);
+        };
+        size_t separator = path.find_last_of("\\/");
+        std::string directory = separator != std::string::npos ? path.substr(0, separator + 1) : "./";
+        std::string filename = path.substr(separator + 1);
+        if (source != nullptr) {
+            const BinaryMaterialFile *material_files = (const BinaryMaterialFile *) (data + header.material_files_offset);
+            for (uint32_t i = 0; i < header.number_of_material_files; i++) {
+                SourceStamp stamp = sourceStamp(directory + getString(material_files[i].filename));
+                if (stamp.size != material_files[i].size || stamp.time != material_files[i].time) {
+                    return false;
+                }
+            }
+        }
+        const BinaryMaterial *materials = (const BinaryMaterial *) (data + header.materials_offset);
+        const BinaryMesh *meshes = (const BinaryMesh *) (data + header.meshes_offset);
+        const BinaryLod *lods = (const BinaryLod *) (data + header.lods_offset);
+        ///////////////////////////////////////////////////////////////////////
+        // Check that the ranges of each mesh and LOD are inside the arrays.
+        // The indices themselves were checked by writeBinary().
+        ///////////////////////////////////////////////////////////////////////
+        auto rangeInside = [&](const BinaryMesh &mesh, uint32_t first_index, uint32_t number_of_indices,
+                               uint32_t gpu_index_offset) {
+            return uint64_t(first_index) + number_of_indices <= header.number_of_indices
+                   && uint64_t(gpu_index_offset) + uint64_t(number_of_indices) * mesh.gpu_index_size
+                              <= header.gpu_indices_size;
+        };
+        for (uint32_t i = 0; i < header.number_of_meshes; i++) {
+            const BinaryMesh &b = meshes[i];
+            bool broken = b.material_idx >= header.number_of_materials
+                          || uint64_t(b.start_index) + b.number_of_vertices > header.number_of_vertices
+                          || uint64_t(b.first_lod) + b.number_of_lods > header.number_of_lods
+                          || (!indexed && b.number_of_lods > 0);
+            if (indexed && !broken) {
+                broken = (b.gpu_index_size != 2 && b.gpu_index_size != 4)
+                         || (b.gpu_index_size == 2 && b.number_of_vertices > 65536)
+                         || !rangeInside(b, b.first_index, b.number_of_indices, b.gpu_index_offset);
+            }
+            for (uint32_t l = 0; l < b.number_of_lods && !broken; l++) {
+                const BinaryLod &lod = lods[b.first_lod + l];
+                broken = !rangeInside(b, lod.first_index, lod.number_of_indices, lod.gpu_index_offset);
+            }
+            if (broken) {
+                std::cout << "ERROR: " << path << " has a broken mesh table.\n";
+                return false;
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Materials and meshes are the only things that are copied
+        ///////////////////////////////////////////////////////////////////////
+        Model *model = new Model;
+        model->m_name = filename.substr(0, filename.find_last_of('.'));
+        model->m_filename = path;
+        for (uint32_t i = 0; i < header.number_of_materials; i++) {
+            const BinaryMaterial &b = materials[i];
+            Material material;
+            material.m_name = getString(b.name);
+            material.m_color = glm::vec3(b.color[0], b.color[1], b.color[2]);
+            material.m_reflectivity = b.reflectivity;
+            material.m_roughness = b.roughness;
+            material.m_metalness = b.metalness;
+            material.m_fresnel = b.fresnel;
+            material.m_emission = b.emission;
+            material.m_transparency = b.transparency;
+            for (int t = 0; t < NUMBER_OF_TEXTURES; t++) {
+                std::string texture = getString(b.textures[t]);
+                if (texture != "") {
+                    deferTexture(material.*MATERIAL_TEXTURES[t], directory, texture, MATERIAL_TEXTURE_COMPONENTS[t]);
+                }
+            }
+            model->m_materials.push_back(material);
+        }
+        for (uint32_t i = 0; i < header.number_of_meshes; i++) {
+            const BinaryMesh &b = meshes[i];
+            Mesh mesh;
+            mesh.m_name = getString(b.name);
+            mesh.m_material_idx = b.material_idx;
+            mesh.m_start_index = b.start_index;
+            mesh.m_number_of_vertices = b.number_of_vertices;
+            mesh.m_first_index = b.first_index;
+            mesh.m_number_of_indices = b.number_of_indices;
+            mesh.m_gpu_index_size = b.gpu_index_size;
+            mesh.m_gpu_index_offset = b.gpu_index_offset;
+            mesh.m_position_offset = glm::vec3(b.position_offset[0], b.position_offset[1], b.position_offset[2]);
+            mesh.m_position_scale = glm::vec3(b.position_scale[0], b.position_scale[1], b.position_scale[2]);
+            mesh.m_bounds_center = glm::vec3(b.bounds_center[0], b.bounds_center[1], b.bounds_center[2]);
+            mesh.m_bounds_radius = b.bounds_radius;
+            for (uint32_t l = 0; l < b.number_of_lods; l++) {
+                const BinaryLod &lod = lods[b.first_lod + l];
+                mesh.m_lods.push_back({lod.first_index, lod.number_of_indices, lod.gpu_index_offset, lod.error});
+            }
+            model->m_meshes.push_back(mesh);
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Point the vertex arrays into the file
+        ///////////////////////////////////////////////////////////////////////
+        model->m_positions = ArrayView<glm::vec3>((const glm::vec3 *) (data + header.positions_offset),
+                                                  header.number_of_vertices);
+        model->m_normals = ArrayView<glm::vec3>((const glm::vec3 *) (data + header.normals_offset),
+                                                header.number_of_vertices);
+        model->m_texture_coordinates = ArrayView<glm::vec2>(
+                (const glm::vec2 *) (data + header.texture_coordinates_offset), header.number_of_vertices);
+        if (indexed) {
+            model->m_indices = ArrayView<uint32_t>((const uint32_t *) (data + header.indices_offset),
+                                                   header.number_of_indices);
+            pending.gpu_indices = (const uint8_t *) (data + header.gpu_indices_offset);
+            pending.gpu_indices_size = header.gpu_indices_size;
+        } else {
+            // Without an index buffer, make one that lists the vertices in order
+            for (auto &mesh : model->m_meshes) {
+                mesh.m_first_index = uint32_t(model->m_indices_storage.size());
+                mesh.m_number_of_indices = mesh.m_number_of_vertices - mesh.m_number_of_vertices % 3;
+                for (uint32_t i = 0; i < mesh.m_number_of_indices; i++) {
+                    model->m_indices_storage.push_back(i);
+                }
+            }
+            model->m_indices = ArrayView<uint32_t>(model->m_indices_storage.data(), model->m_indices_storage.size());
+            pending.gpu_indices_storage = packGPUIndices(model);
+            pending.gpu_indices = pending.gpu_indices_storage.data();
+            pending.gpu_indices_size = pending.gpu_indices_storage.size();
+        }
+        if (vertex_compression && header.compressed_vertices_offset != 0) {
+            model->m_compressed_vertices = ArrayView<CompressedVertex>(
+                    (const CompressedVertex *) (data + header.compressed_vertices_offset), header.number_of_vertices);
+        }
+        model->m_file = std::move(file);
+        pending.model = model;
+        buildMeshBounds(model);
+
+        // Printed in one go, models may be loaded on several threads
+        std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+        std::ostringstream report;
+        report << "Loaded " << path << " (" << int(load_time.count() * 1e3) << " ms, mapped).\n"
+               << "    " << numberOfTriangles(model) << " triangles, " << header.number_of_vertices
+               << " vertices. " << file_size / 1024 << " KB mapped, "
+               << gpuBytes(model, pending.gpu_indices_size) / 1024 << " KB on GPU.\n";
+        std::cout << report.str();
+        dropVertexArrays(model);
+        return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Load an OBJ file, or its binary cache, up to the GL work
+///////////////////////////////////////////////////////////////////////////
+    static void loadOBJModel(const std::string &path, PendingModel &pending) {
         ///////////////////////////////////////////////////////////////////////
         // Separate filename into directory, base filename and extension
         // NOTE: This can be made a LOT simpler as soon as compilers properly
@@ -195,16 +1103,30 @@ namespace labhelper {
         filename = filename.substr(0, separator);
 
         ///////////////////////////////////////////////////////////////////////
-        // Parse the OBJ file using tinyobj
+        // Use the binary cache of the OBJ file if it is up to date
+        ///////////////////////////////////////////////////////////////////////
+        std::string cache_path = directory + filename + ".lhm";
+        SourceStamp source = sourceStamp(directory + filename + extension);
+        if (loadBinary(cache_path, &source, pending)) {
+            pending.model->m_name = filename;
+            pending.model->m_filename = path;
+            return;
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Parse the OBJ file (in parallel, see ObjLoader.h)
         ///////////////////////////////////////////////////////////////////////
-        std::cout << "Loading " << path << "..." << std::flush;
+        auto load_start = std::chrono::steady_clock::now();
         tinyobj::attrib_t attrib;
         std::vector<tinyobj::shape_t> shapes;
         std::vector<tinyobj::material_t> materials;
         std::string err;
-        // Expect '.mtl' file in the same directory and triangulate meshes
-        bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-                (directory + filename + extension).c_str(), directory.c_str(), true);
+        // Expect '.mtl' file in the same directory and triangulate meshes. The
+        // textures are decoded while the rest of the file is parsed.
+        std::vector<std::string> material_files;
+        bool ret = loadOBJ(&attrib, &shapes, &materials, &err, directory + filename + extension, directory,
+                           [&directory](const std::vector<tinyobj::material_t> &m) { prefetchTextures(directory, m); },
+                           0, &material_files);
         if (!err.empty()) { // `err` may contain warning message.
             std::cerr << err << std::endl;
         }
@@ -223,30 +1145,30 @@ namespace labhelper {
             material.m_name = m.name;
             material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
             if (m.diffuse_texname != "") {
-                material.m_color_texture.load(directory, m.diffuse_texname, 4);
+                deferTexture(material.m_color_texture, directory, m.diffuse_texname, 4);
             }
             material.m_reflectivity = m.specular[0];
             if (m.specular_texname != "") {
-                material.m_reflectivity_texture.load(directory, m.specular_texname, 1);
+                deferTexture(material.m_reflectivity_texture, directory, m.specular_texname, 1);
             }
             material.m_metalness = m.metallic;
             if (m.metallic_texname != "") {
-                material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+                deferTexture(material.m_metalness_texture, directory, m.metallic_texname, 1);
             }
             material.m_fresnel = m.sheen;
             if (m.sheen_texname != "") {
-                material.m_fresnel_texture.load(directory, m.sheen_texname, 1);
+                deferTexture(material.m_fresnel_texture, directory, m.sheen_texname, 1);
             }
             material.m_roughness = m.roughness;
             if (m.roughness_texname != "") {
-                material.m_roughness_texture.load(directory, m.roughness_texname, 1);
+                deferTexture(material.m_roughness_texture, directory, m.roughness_texname, 1);
             }
             material.m_emission = m.emission[0];
             if (m.emissive_texname != "") {
-                material.m_emission_texture.load(directory, m.emissive_texname, 4);
+                deferTexture(material.m_emission_texture, directory, m.emissive_texname, 4);
             }
             if (m.normal_texname != "") {
-                material.m_normal_texture.load(directory, m.normal_texname, 3);
+                deferTexture(material.m_normal_texture, directory, m.normal_texname, 3);
             }
             material.m_transparency = m.transmittance[0];
             model->m_materials.push_back(material);
@@ -254,16 +1176,15 @@ namespace labhelper {
 
         ///////////////////////////////////////////////////////////////////////
         // A vertex in the OBJ file may have different indices for position,
-        // normal and texture coordinate. We will not even attempt to use
-        // indexed lookups, but will store a simple vertex stream per mesh.
+        // normal and texture coordinate, so we can not use the OBJ indices
+        // directly. Instead every corner of every face is turned into a
+        // vertex, and identical vertices within a mesh are welded together.
         ///////////////////////////////////////////////////////////////////////
-        uint64_t number_of_vertices = 0;
+        uint64_t number_of_corners = 0;
         for (const auto &shape : shapes) {
-            number_of_vertices += shape.mesh.indices.size();
+            number_of_corners += shape.mesh.indices.size();
         }
-        model->m_positions.resize(number_of_vertices);
-        model->m_normals.resize(number_of_vertices);
-        model->m_texture_coordinates.resize(number_of_vertices);
+        model->m_indices_storage.reserve(number_of_corners);
 
         ///////////////////////////////////////////////////////////////////////
         // For each vertex _position_ auto generate a normal that will be used
@@ -299,7 +1220,7 @@ namespace labhelper {
         // Now we will turn all shapes into Meshes. A shape that has several
         // materials will be split into several meshes with unique names
         ///////////////////////////////////////////////////////////////////////
-        int vertices_so_far = 0;
+        std::unordered_map<VertexKey, uint32_t, VertexKeyHash> welded_vertices;
         for (const auto &shape : shapes) {
             ///////////////////////////////////////////////////////////////////
             // The shapes in an OBJ file may several different materials.
@@ -318,8 +1239,10 @@ namespace labhelper {
                 Mesh mesh;
                 mesh.m_name = shape.name + "_" + materials[current_material_index].name;
                 mesh.m_material_idx = current_material_index;
-                mesh.m_start_index = vertices_so_far;
+                mesh.m_start_index = uint32_t(model->m_positions_storage.size());
+                mesh.m_first_index = uint32_t(model->m_indices_storage.size());
                 number_of_materials_in_shape += 1;
+                welded_vertices.clear();
 
                 uint64_t number_of_faces = shape.mesh.indices.size() / 3;
                 for (int i = current_material_starting_face; i < number_of_faces; i++) {
@@ -337,37 +1260,43 @@ namespace labhelper {
                         // Now we generate the vertices
                         ///////////////////////////////////////////////////////
                         for (int j = 0; j < 3; j++) {
-                            int v = shape.mesh.indices[i * 3 + j].vertex_index;
-                            model->m_positions[vertices_so_far + j] =
-                                    glm::vec3(attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
-                                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
-                                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
-                            if (shape.mesh.indices[i * 3 + j].normal_index == -1) {
+                            const tinyobj::index_t &index = shape.mesh.indices[i * 3 + j];
+                            VertexKey vertex;
+                            vertex.position = glm::vec3(attrib.vertices[index.vertex_index * 3 + 0],
+                                    attrib.vertices[index.vertex_index * 3 + 1],
+                                    attrib.vertices[index.vertex_index * 3 + 2]);
+                            if (index.normal_index == -1) {
                                 // No normal, use the autogenerated
-                                model->m_normals[vertices_so_far + j] = glm::vec3(
-                                        auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
+                                vertex.normal = glm::vec3(auto_normals[index.vertex_index]);
                             } else {
-                                model->m_normals[vertices_so_far + j] =
-                                        glm::vec3(attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
-                                                attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
-                                                attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
+                                vertex.normal = glm::vec3(attrib.normals[index.normal_index * 3 + 0],
+                                        attrib.normals[index.normal_index * 3 + 1],
+                                        attrib.normals[index.normal_index * 3 + 2]);
                             }
-                            if (shape.mesh.indices[i * 3 + j].texcoord_index == -1) {
+                            if (index.texcoord_index == -1) {
                                 // No UV coordinates. Use null.
-                                model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(0.0f);
+                                vertex.texture_coordinates = glm::vec2(0.0f);
                             } else {
-                                model->m_texture_coordinates[vertices_so_far + j] = glm::vec2(
-                                        attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
-                                        attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
+                                vertex.texture_coordinates = glm::vec2(
+                                        attrib.texcoords[index.texcoord_index * 2 + 0],
+                                        attrib.texcoords[index.texcoord_index * 2 + 1]);
+                            }
+                            uint32_t next_vertex = uint32_t(model->m_positions_storage.size()) - mesh.m_start_index;
+                            auto welded = welded_vertices.insert(std::make_pair(vertex, next_vertex));
+                            if (welded.second) {
+                                model->m_positions_storage.push_back(vertex.position);
+                                model->m_normals_storage.push_back(vertex.normal);
+                                model->m_texture_coordinates_storage.push_back(vertex.texture_coordinates);
                             }
+                            model->m_indices_storage.push_back(welded.first->second);
                         }
-                        vertices_so_far += 3;
                     }
                 }
                 ///////////////////////////////////////////////////////////////
                 // Finalize and push this mesh to the list
                 ///////////////////////////////////////////////////////////////
-                mesh.m_number_of_vertices = vertices_so_far - mesh.m_start_index;
+                mesh.m_number_of_vertices = uint32_t(model->m_positions_storage.size()) - mesh.m_start_index;
+                mesh.m_number_of_indices = uint32_t(model->m_indices_storage.size()) - mesh.m_first_index;
                 model->m_meshes.push_back(mesh);
                 finished_materials[current_material_index] = true;
             }
@@ -376,35 +1305,118 @@ namespace labhelper {
             }
         }
 
+        viewStorage(model);
+
         ///////////////////////////////////////////////////////////////////////
-        // Upload to GPU
+        // Make LODs, see Simplifier.h
         ///////////////////////////////////////////////////////////////////////
-        glGenVertexArrays(1, &model->m_vaob);
-        glBindVertexArray(model->m_vaob);
-        glGenBuffers(1, &model->m_positions_bo);
-        glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-        glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), &model->m_positions[0].x,
-                GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
-        glEnableVertexAttribArray(0);
-        glGenBuffers(1, &model->m_normals_bo);
-        glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-        glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
-                GL_STATIC_DRAW);
-        glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
-        glEnableVertexAttribArray(1);
-        glGenBuffers(1, &model->m_texture_coordinates_bo);
-        glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-        glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-                &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
-        glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
-        glEnableVertexAttribArray(2);
-
-        std::cout << "done.\n";
-        return model;
+        bool has_lods = false;
+        std::chrono::duration<double> lod_time(0.0);
+        if (lod_generation) {
+            auto lod_start = std::chrono::steady_clock::now();
+            has_lods = generateLods(model);
+            lod_time = std::chrono::steady_clock::now() - lod_start;
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Reorder for the vertex cache and overdraw, see MeshOptimizer.h
+        ///////////////////////////////////////////////////////////////////////
+        bool optimized = false;
+        VertexCacheStatistics unoptimized_statistics, optimized_statistics;
+        std::chrono::duration<double> optimize_time(0.0);
+        if (model_optimization) {
+            auto optimize_start = std::chrono::steady_clock::now();
+            unoptimized_statistics = vertexCacheStatistics(model);
+            optimized = optimizeModel(model);
+            optimized_statistics = vertexCacheStatistics(model);
+            optimize_time = std::chrono::steady_clock::now() - optimize_start;
+        }
+
+        pending.model = model;
+        pending.gpu_indices_storage = packGPUIndices(model);
+        pending.gpu_indices = pending.gpu_indices_storage.data();
+        pending.gpu_indices_size = pending.gpu_indices_storage.size();
+        computeBounds(model);
+        if (vertex_compression && compressVertices(model, model->m_compressed_vertices_storage)) {
+            model->m_compressed_vertices = ArrayView<CompressedVertex>(model->m_compressed_vertices_storage.data(),
+                                                                       model->m_compressed_vertices_storage.size());
+        }
+
+        uint32_t flags = (optimized ? BINARY_OPTIMIZED : 0) | (has_lods ? BINARY_LODS : 0);
+        bool cached = writeBinary(model, cache_path, source, material_files, flags);
+        size_t number_of_vertices = model->m_positions.size();
+        dropVertexArrays(model);
+
+        ///////////////////////////////////////////////////////////////////////
+        // Report what the indexing saved, compared to one vertex per corner
+        ///////////////////////////////////////////////////////////////////////
+        std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+        size_t vertex_size = 2 * sizeof(glm::vec3) + sizeof(glm::vec2);
+        size_t cpu_bytes = model->m_positions.size() * vertex_size
+                           + model->m_compressed_vertices.size() * sizeof(CompressedVertex)
+                           + model->m_indices.size() * sizeof(uint32_t);
+
+        size_t unindexed_bytes = number_of_corners * vertex_size;
+        std::ostringstream report;
+        report << "Loaded " << path << " (" << int(load_time.count() * 1e3) << " ms).\n"
+               << "    " << numberOfTriangles(model) << " triangles, " << number_of_vertices
+               << " vertices instead of " << number_of_corners << ". " << cpu_bytes / 1024 << " KB on CPU, "
+               << gpuBytes(model, pending.gpu_indices_size) / 1024 << " KB on GPU (unindexed: "
+               << unindexed_bytes / 1024 << " KB).\n";
+        if (has_lods) {
+            // The triangles of the model when every mesh uses its LOD `level`, or its last
+            report << "    LODs in " << int(lod_time.count() * 1e3) << " ms:";
+            for (int level = 1; level <= MAX_LODS; level++) {
+                size_t lod_triangles = 0;
+                for (const auto &mesh : model->m_meshes) {
+                    int last = std::min(level, int(mesh.m_lods.size()));
+                    lod_triangles += (last == 0 ? mesh.m_number_of_indices : mesh.m_lods[last - 1].m_number_of_indices) / 3;
+                }
+                report << (level > 1 ? ", " : " ") << lod_triangles;
+            }
+            report << " triangles.\n";
+        }
+        if (optimized) {
+            report << std::fixed << std::setprecision(2) << "    Optimized in " << int(optimize_time.count() * 1e3)
+                   << " ms: ACMR " << unoptimized_statistics.acmr << " -> " << optimized_statistics.acmr << ", ATVR "
+                   << unoptimized_statistics.atvr << " -> " << optimized_statistics.atvr << ".\n";
+        }
+        if (!cached) {
+            report << "    Could not write the binary cache " << cache_path << ".\n";
+        }
+        std::cout << report.str();
+    }
+
+    Model *loadModelFromOBJ(std::string path) {
+        PendingModel pending;
+        loadOBJModel(path, pending);
+        return finishModel(pending);
+    }
+
+    std::shared_future<Model *> loadModelFromOBJAsync(std::string path) {
+        auto pending = std::make_shared<PendingModel>();
+        std::shared_future<void> loaded = ThreadPool::shared().submit([path, pending]() {
+            loadOBJModel(path, *pending);
+        }).share();
+        auto result = std::make_shared<std::promise<Model *>>();
+        queueUpload([pending, loaded, result]() -> UploadStatus {
+            if (!isReady(loaded)) {
+                return UPLOAD_WAITING;
+            }
+            UploadStatus status = uploadStep(*pending, false);
+            if (status == UPLOAD_DONE) {
+                result->set_value(pending->model);
+            }
+            return status;
+        });
+        return result->get_future().share();
     }
 
     void saveModelToOBJ(Model *model, std::string path) {
+        if (!hasVertexArrays(model)) {
+            std::cout << "Could not save " << model->m_name << ", it has no vertex arrays, see setKeepVertexArrays().\n";
+            return;
+        }
         ///////////////////////////////////////////////////////////////////////
         // Separate filename into directory, base filename and extension
         // NOTE: This can be made a LOT simpler as soon as compilers properly
@@ -491,14 +1503,33 @@ namespace labhelper {
                 obj_file << "vt " << model->m_texture_coordinates[i].x << " " << model->m_texture_coordinates[i].y
                          << "\n";
             }
-            int number_of_faces = mesh.m_number_of_vertices / 3;
+            int number_of_faces = mesh.m_number_of_indices / 3;
             for (int i = 0; i < number_of_faces; i++) {
-                obj_file << "f " << vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-                         << vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-                         << vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-                vertex_counter += 3;
+                obj_file << "f";
+                for (int j = 0; j < 3; j++) {
+                    int v = vertex_counter + int(model->m_indices[mesh.m_first_index + i * 3 + j]);
+                    obj_file << " " << v << "/" << v << "/" << v;
+                }
+                obj_file << "\n";
             }
+            vertex_counter += mesh.m_number_of_vertices;
+        }
+    }
+
+    Model *loadModelFromBinary(std::string path) {
+        PendingModel pending;
+        if (!loadBinary(path, nullptr, pending)) {
+            return nullptr;
+        }
+        return finishModel(pending);
+    }
+
+    bool saveModelToBinary(Model *model, std::string path) {
+        if (!writeBinary(model, path, SourceStamp(), std::vector<std::string>(), 0)) {
+            std::cout << "Could not write " << path << ".\n";
+            return false;
         }
+        return true;
     }
 
 ///////////////////////////////////////////////////////////////////////
@@ -512,60 +1543,147 @@ namespace labhelper {
 ///////////////////////////////////////////////////////////////////////
 // Loop through all Meshes in the Model and render them
 ///////////////////////////////////////////////////////////////////////
+    LodSelection lodSelection(const glm::mat4 &modelViewMatrix, const glm::mat4 &projectionMatrix,
+                              int viewport_height, float max_error_pixels) {
+        LodSelection selection;
+        selection.model_view_matrix = modelViewMatrix;
+        // projectionMatrix[1][1] is 1 / tan(fovy / 2) for perspective projections
+        selection.pixels_per_unit = 0.5f * float(viewport_height) * projectionMatrix[1][1];
+        selection.max_error_pixels = max_error_pixels;
+        return selection;
+    }
+
+    int selectLod(const Mesh &mesh, const LodSelection &selection) {
+        if (selection.pixels_per_unit <= 0.0f || mesh.m_lods.empty()) {
+            return 0;
+        }
+        glm::mat3 linear(selection.model_view_matrix);
+        float scale = glm::max(glm::length(linear[0]), glm::max(glm::length(linear[1]), glm::length(linear[2])));
+        float radius = mesh.m_bounds_radius * scale;
+        float distance =
+                glm::length(glm::vec3(selection.model_view_matrix * glm::vec4(mesh.m_bounds_center, 1.0f))) - radius;
+        if (distance <= 0.0f) {
+            // The camera is inside the bounds
+            return 0;
+        }
+        float pixels_per_error = selection.pixels_per_unit * scale / distance;
+        int level = 0;
+        while (level < int(mesh.m_lods.size())
+               && mesh.m_lods[level].m_error * pixels_per_error <= selection.max_error_pixels) {
+            level++;
+        }
+        return level;
+    }
+
     void render(const Model *model, const bool submitMaterials) {
+        render(model, submitMaterials, LodSelection());
+    }
+
+    static void renderMeshes(const Model *model, const bool submitMaterials, const LodSelection &lod,
+                             const uint8_t *visible);
+
+    void render(const Model *model, const bool submitMaterials, const LodSelection &lod) {
+        renderMeshes(model, submitMaterials, lod, nullptr);
+    }
+
+    void render(const Model *model, const bool submitMaterials, const LodSelection &lod,
+                const glm::mat4 &modelViewProjectionMatrix, RenderStatistics *statistics) {
+        // Only drawn from the GL thread
+        static std::vector<uint8_t> visible;
+        uint32_t number_visible = cullMeshes(model, modelViewProjectionMatrix, visible);
+        if (statistics != nullptr) {
+            statistics->drawn_meshes += number_visible;
+            statistics->culled_meshes += uint32_t(model->m_meshes.size()) - number_visible;
+        }
+        if (number_visible > 0) {
+            renderMeshes(model, submitMaterials, lod, visible.data());
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////
+// Set the material uniforms one by one, for programs without MaterialBlock
+///////////////////////////////////////////////////////////////////////
+    static void setMaterialUniforms(GLuint program, const Material &material) {
+        bool has_color_texture = material.m_color_texture.valid;
+        glUniform1i(getUniformLocation(program, "has_color_texture"), has_color_texture);
+        glUniform1i(getUniformLocation(program, "has_reflectivity_texture"), material.m_reflectivity_texture.valid);
+        glUniform1i(getUniformLocation(program, "has_metalness_texture"), material.m_metalness_texture.valid);
+        glUniform1i(getUniformLocation(program, "has_fresnel_texture"), material.m_fresnel_texture.valid);
+        glUniform1i(getUniformLocation(program, "has_shininess_texture"), material.m_roughness_texture.valid);
+        glUniform1i(getUniformLocation(program, "has_emission_texture"), material.m_emission_texture.valid);
+        glUniform3fv(getUniformLocation(program, "material_color"), 1, &material.m_color.x);
+        glUniform1fv(getUniformLocation(program, "material_reflectivity"), 1, &material.m_reflectivity);
+        glUniform1fv(getUniformLocation(program, "material_metalness"), 1, &material.m_metalness);
+        glUniform1fv(getUniformLocation(program, "material_fresnel"), 1, &material.m_fresnel);
+        glUniform1fv(getUniformLocation(program, "material_shininess"), 1, &material.m_roughness);
+        glUniform1fv(getUniformLocation(program, "material_emission"), 1, &material.m_emission);
+        //FIXME: Compatibility with old shading model of lab3.
+        glUniform3fv(getUniformLocation(program, "material_diffuse_color"), 1, &material.m_color.x);
+        glUniform3fv(getUniformLocation(program, "material_emissive_color"), 1, &material.m_color.x);
+        glUniform1i(getUniformLocation(program, "has_diffuse_texture"), has_color_texture);
+    }
+
+///////////////////////////////////////////////////////////////////////
+// Draw the meshes, or if visible is given those with visible[i] != 0.
+// Consecutive meshes with the same material only bind it once.
+///////////////////////////////////////////////////////////////////////
+    static void renderMeshes(const Model *model, const bool submitMaterials, const LodSelection &lod,
+                             const uint8_t *visible) {
         glBindVertexArray(model->m_vaob);
-        for (auto &mesh : model->m_meshes) {
-            if (submitMaterials) {
+        GLint current_program = 0;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+        GLuint program = GLuint(current_program);
+        // Shaders that draw models decode compressed vertices with these
+        bool compressed = !model->m_compressed_vertices.empty();
+        glUniform1i(getUniformLocation(program, "compressedVertices"), compressed);
+        GLint position_offset_location = getUniformLocation(program, "positionOffset");
+        GLint position_scale_location = getUniformLocation(program, "positionScale");
+        bool material_block = model->m_materials_bo != 0
+                              && getUniformBlockIndex(program, "MaterialBlock") != GL_INVALID_INDEX;
+        uint32_t bound_material = UINT32_MAX;
+        for (size_t i = 0; i < model->m_meshes.size(); i++) {
+            const Mesh &mesh = model->m_meshes[i];
+            if (visible != nullptr && !visible[i]) {
+                continue;
+            }
+            if (compressed) {
+                glUniform3fv(position_offset_location, 1, &mesh.m_position_offset.x);
+                glUniform3fv(position_scale_location, 1, &mesh.m_position_scale.x);
+            }
+            if (submitMaterials && mesh.m_material_idx != bound_material) {
+                bound_material = mesh.m_material_idx;
                 const Material &material = model->m_materials[mesh.m_material_idx];
-
-                bool has_color_texture = material.m_color_texture.valid;
-                bool has_reflectivity_texture = material.m_reflectivity_texture.valid;
-                bool has_metalness_texture = material.m_metalness_texture.valid;
-                bool has_fresnel_texture = material.m_fresnel_texture.valid;
-                bool has_shininess_texture = material.m_roughness_texture.valid;
-                bool has_emission_texture = material.m_emission_texture.valid;
-                if (has_color_texture)
+                if (material.m_color_texture.valid)
                     glBindTextures(0, 1, &material.m_color_texture.gl_id);
-                if (has_reflectivity_texture)
+                if (material.m_reflectivity_texture.valid)
                     glBindTextures(1, 1, &material.m_reflectivity_texture.gl_id);
-                if (has_metalness_texture)
+                if (material.m_metalness_texture.valid)
                     glBindTextures(2, 1, &material.m_metalness_texture.gl_id);
-                if (has_fresnel_texture)
+                if (material.m_fresnel_texture.valid)
                     glBindTextures(3, 1, &material.m_fresnel_texture.gl_id);
-                if (has_shininess_texture)
+                if (material.m_roughness_texture.valid)
                     glBindTextures(4, 1, &material.m_roughness_texture.gl_id);
-                if (has_emission_texture)
+                if (material.m_emission_texture.valid)
                     glBindTextures(5, 1, &material.m_emission_texture.gl_id);
 
-                GLint current_program = 0;
-                glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
-                glUniform1i(glGetUniformLocation(current_program, "has_color_texture"), has_color_texture);
-                glUniform1i(glGetUniformLocation(current_program, "has_diffuse_texture"),
-                        has_color_texture ? 1 : 0); // FIXME
-                glUniform1i(glGetUniformLocation(current_program, "has_reflectivity_texture"),
-                        has_reflectivity_texture);
-                glUniform1i(glGetUniformLocation(current_program, "has_metalness_texture"), has_metalness_texture);
-                glUniform1i(glGetUniformLocation(current_program, "has_fresnel_texture"), has_fresnel_texture);
-                glUniform1i(glGetUniformLocation(current_program, "has_shininess_texture"), has_shininess_texture);
-                glUniform1i(glGetUniformLocation(current_program, "has_emission_texture"),
-                        has_emission_texture ? 1 : 0);
-                glUniform3fv(glGetUniformLocation(current_program, "material_color"), 1, &material.m_color.x);
-                glUniform3fv(glGetUniformLocation(current_program, "material_diffuse_color"), 1,
-                        &material.m_color.x); //FIXME: Compatibility with old shading model of lab3.
-                glUniform3fv(glGetUniformLocation(current_program, "material_emissive_color"), 1,
-                        &material.m_color.x); //FIXME: Compatibility with old shading model of lab3.
-                glUniform1i(glGetUniformLocation(current_program, "has_diffuse_texture"),
-                        has_color_texture); //FIXME: Compatibility with old shading model of lab3.
-                glUniform1fv(glGetUniformLocation(current_program, "material_reflectivity"), 1,
-                        &material.m_reflectivity);
-                glUniform1fv(glGetUniformLocation(current_program, "material_metalness"), 1,
-                        &material.m_metalness);
-                glUniform1fv(glGetUniformLocation(current_program, "material_fresnel"), 1, &material.m_fresnel);
-                glUniform1fv(glGetUniformLocation(current_program, "material_shininess"), 1,
-                        &material.m_roughness);
-                glUniform1fv(glGetUniformLocation(current_program, "material_emission"), 1, &material.m_emission);
-            }
-            glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei) mesh.m_number_of_vertices);
+                if (material_block) {
+                    glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, model->m_materials_bo,
+                                      GLintptr(mesh.m_material_idx) * model->m_material_block_stride,
+                                      sizeof(MaterialBlock));
+                } else {
+                    setMaterialUniforms(program, material);
+                }
+            }
+            uint32_t number_of_indices = mesh.m_number_of_indices;
+            uint32_t gpu_index_offset = mesh.m_gpu_index_offset;
+            int level = selectLod(mesh, lod);
+            if (level > 0) {
+                number_of_indices = mesh.m_lods[level - 1].m_number_of_indices;
+                gpu_index_offset = mesh.m_lods[level - 1].m_gpu_index_offset;
+            }
+            glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei) number_of_indices,
+                    mesh.m_gpu_index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+                    (void *) size_t(gpu_index_offset), GLint(mesh.m_start_index));
         }
     }
 } // namespace labhelper
@@ -2,6 +2,11 @@
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
+#include <future>
+#include <memory>
+#include "AsyncLoader.h"
+#include "MappedFile.h"
+#include "TextureCache.h"
 
 namespace labhelper
 {
@@ -14,6 +19,8 @@ struct Texture
 	int width, height;
 	uint8_t* data = nullptr;
 	int components;
+	// The shared image behind gl_id and data, see TextureCache
+	std::shared_ptr<TextureImage> image;
 	bool load(const std::string& directory, const std::string& filename, int nof_components);
 	/** From top-left-most */
 	uint8_t color(int pixel_x, int pixel_y, int component) const;
@@ -53,13 +60,110 @@ struct Material
 	Texture m_normal_texture;
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// A read-only view of an array that is owned by someone else
+//////////////////////////////////////////////////////////////////////////////
+template<typename T>
+class ArrayView
+{
+public:
+	ArrayView() = default;
+	ArrayView(const T* data, size_t size) : m_data(data), m_size(size)
+	{
+	}
+	const T& operator[](size_t i) const
+	{
+		return m_data[i];
+	}
+	const T* data() const
+	{
+		return m_data;
+	}
+	size_t size() const
+	{
+		return m_size;
+	}
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+	const T* begin() const
+	{
+		return m_data;
+	}
+	const T* end() const
+	{
+		return m_data + m_size;
+	}
+
+private:
+	const T* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The compressed vertex layout, 16 bytes instead of 32. Positions are
+// quantized to 16 bits within the bounds of their mesh, normals are
+// octahedral encoded in two 16 bit snorms and texture coordinates are half
+// floats. Vertex shaders decode the positions and normals with
+// compressed_vertex.glsl, see render().
+//////////////////////////////////////////////////////////////////////////////
+struct CompressedVertex
+{
+	// The fourth is padding
+	uint16_t position[4];
+	int16_t normal[2];
+	uint16_t texture_coordinates[2];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// A simplified version of a Mesh, see generateLods(). Its triangles use the
+// vertices of the mesh, and its indices are stored like those of the mesh.
+//////////////////////////////////////////////////////////////////////////////
+struct MeshLod
+{
+	uint32_t m_first_index;
+	uint32_t m_number_of_indices;
+	uint32_t m_gpu_index_offset;
+	// How far (in model space) the LOD may be off from the mesh
+	float m_error;
+};
+
 struct Mesh
 {
 	std::string m_name;
 	uint32_t m_material_idx;
-	// Where this Mesh's vertices start
+	// Where this Mesh's vertices start, and how many unique vertices it has
 	uint32_t m_start_index;
 	uint32_t m_number_of_vertices;
+	// Where this Mesh's triangles start in m_indices, and how many indices
+	// (three per triangle) it has. Indices are relative to m_start_index.
+	uint32_t m_first_index;
+	uint32_t m_number_of_indices;
+	// Size (2 or 4 bytes) and byte offset of the indices in the GPU index
+	// buffer. Meshes with fewer than 65536 vertices use 16 bit indices.
+	uint32_t m_gpu_index_size;
+	uint32_t m_gpu_index_offset;
+	// The bounds of the vertices of the mesh, as offset (minimum) and scale
+	// (size). Compressed positions are quantized within them.
+	glm::vec3 m_position_offset;
+	glm::vec3 m_position_scale;
+	// A bounding sphere of the vertices, centered in the bounds above
+	glm::vec3 m_bounds_center;
+	float m_bounds_radius;
+	// Simplified versions of the mesh, from fine to coarse
+	std::vector<MeshLod> m_lods;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The bounds of four consecutive meshes of a model, as the center and half
+// size of their boxes, laid out so that they are tested against a plane
+// with one SSE instruction per term. See cullMeshes() in Culling.h.
+//////////////////////////////////////////////////////////////////////////////
+struct MeshBoundsBatch
+{
+	float center[3][4];
+	float extent[3][4];
 };
 
 class Model
@@ -74,20 +178,148 @@ public:
 	std::vector<Material> m_materials;
 	// A model will contain one or more "Meshes"
 	std::vector<Mesh> m_meshes;
-	// Buffers on CPU
-	std::vector<glm::vec3> m_positions;
-	std::vector<glm::vec3> m_normals;
-	std::vector<glm::vec2> m_texture_coordinates;
+	// Buffers on CPU. For models parsed from OBJ files these are views of
+	// the storage below, for binary models they point straight into the
+	// mapped file. The position array is followed by at least one more
+	// readable vertex (12 bytes), so Embree can share it: it reads the last
+	// vertex with a 16 byte load.
+	ArrayView<glm::vec3> m_positions;
+	ArrayView<glm::vec3> m_normals;
+	ArrayView<glm::vec2> m_texture_coordinates;
+	ArrayView<uint32_t> m_indices;
+	std::vector<glm::vec3> m_positions_storage;
+	std::vector<glm::vec3> m_normals_storage;
+	std::vector<glm::vec2> m_texture_coordinates_storage;
+	std::vector<uint32_t> m_indices_storage;
+	std::unique_ptr<MappedFile> m_file;
+	// The vertices in the compressed layout, if it is used. Like the arrays
+	// above, a view of the storage below or of the mapped file. The arrays
+	// above are then empty, see setKeepVertexArrays().
+	ArrayView<CompressedVertex> m_compressed_vertices;
+	std::vector<CompressedVertex> m_compressed_vertices_storage;
+	// The bounds of the meshes, four per batch
+	std::vector<MeshBoundsBatch> m_mesh_bounds;
 	// Buffers on GPU
 	uint32_t m_positions_bo;
 	uint32_t m_normals_bo;
 	uint32_t m_texture_coordinates_bo;
+	uint32_t m_indices_bo;
+	// The materials as std140 uniform blocks, see render()
+	uint32_t m_materials_bo = 0;
+	uint32_t m_material_block_stride = 0;
 	// Vertex Array Object
 	uint32_t m_vaob;
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// Loads an OBJ file. The parsed model is cached in a binary model next to
+// the OBJ file (same name, with extension .lhm), which is used instead of
+// the OBJ file for as long as the OBJ file is not modified.
+//////////////////////////////////////////////////////////////////////////////
 Model* loadModelFromOBJ(std::string filename);
+//////////////////////////////////////////////////////////////////////////////
+// Loads an OBJ file like loadModelFromOBJ(), but parses it and decodes its
+// textures on the ThreadPool. The GL work is done by finishUploads(), and
+// the future is ready once it is all done.
+//////////////////////////////////////////////////////////////////////////////
+std::shared_future<Model*> loadModelFromOBJAsync(std::string filename);
 void saveModelToOBJ(Model* model, std::string filename);
+//////////////////////////////////////////////////////////////////////////////
+// Binary models (.lhm) are memory mapped and used in place: the vertex and
+// index arrays of the Model point into the file, and are uploaded to the
+// GPU from there. Texture filenames are relative to the directory of the
+// file. loadModelFromBinary() returns nullptr if the file can not be used.
+//////////////////////////////////////////////////////////////////////////////
+Model* loadModelFromBinary(std::string filename);
+bool saveModelToBinary(Model* model, std::string filename);
+//////////////////////////////////////////////////////////////////////////////
+// OBJ files parsed after setModelOptimization(true) are reordered for the
+// vertex cache and overdraw by optimizeModel(), see MeshOptimizer.h. The
+// binary cache keeps the optimized order, and an unoptimized cache is
+// parsed again.
+//////////////////////////////////////////////////////////////////////////////
+void setModelOptimization(bool enabled);
+//////////////////////////////////////////////////////////////////////////////
+// OBJ files parsed after setLodGeneration(true) get a chain of LODs per
+// mesh, see generateLods() in Simplifier.h. Like optimization, the LODs are
+// kept in the binary cache.
+//////////////////////////////////////////////////////////////////////////////
+void setLodGeneration(bool enabled);
+//////////////////////////////////////////////////////////////////////////////
+// Models loaded after setVertexCompression(true) use the compressed vertex
+// layout, on the GPU and in m_compressed_vertices. Models with texture
+// coordinates outside [-2, 2] are not compressed, since half floats are too
+// coarse there.
+//////////////////////////////////////////////////////////////////////////////
+void setVertexCompression(bool enabled);
+//////////////////////////////////////////////////////////////////////////////
+// The GPU only reads m_compressed_vertices, so compressed models free their
+// float arrays (m_positions, m_normals, m_texture_coordinates) once they
+// are loaded. Code that reads them calls setKeepVertexArrays(true) before
+// loading: the pathtracer, as Embree builds its BVH from m_positions, and
+// anyone who saves the model with saveModelToOBJ() or saveModelToBinary().
+//////////////////////////////////////////////////////////////////////////////
+void setKeepVertexArrays(bool enabled);
+glm::vec3 decodePosition(const CompressedVertex& vertex, const Mesh& mesh);
+glm::vec3 decodeNormal(const CompressedVertex& vertex);
+glm::vec2 decodeTextureCoordinates(const CompressedVertex& vertex);
 void freeModel(Model* model);
+//////////////////////////////////////////////////////////////////////////////
+// Draws the meshes of a model with the current program. With
+// submitMaterials, programs that declare this uniform block get the
+// materials from Model::m_materials_bo, one buffer range per material:
+//
+//   layout(std140, binding = 0) uniform MaterialBlock
+//   {
+//   	vec3 material_color;
+//   	float material_reflectivity;
+//   	float material_metalness;
+//   	float material_fresnel;
+//   	float material_shininess;
+//   	float material_emission;
+//   	int has_color_texture;
+//   	int has_reflectivity_texture;
+//   	int has_metalness_texture;
+//   	int has_fresnel_texture;
+//   	int has_shininess_texture;
+//   	int has_emission_texture;
+//   };
+//
+// Other programs get each of these as a plain uniform instead. The
+// textures are bound to units 0 to 5 in both cases.
+//////////////////////////////////////////////////////////////////////////////
+const uint32_t MATERIAL_BLOCK_BINDING = 0;
 void render(const Model* model, const bool submitMaterials = true);
+// Uploads m_materials again after they have been changed
+void updateMaterials(Model* model);
+//////////////////////////////////////////////////////////////////////////////
+// LOD selection. The error of each LOD of a mesh is projected to the screen
+// at the distance of the mesh's bounds, and the coarsest LOD that is off by
+// at most max_error_pixels is drawn. With pixels_per_unit = 0 the full
+// meshes are drawn.
+//////////////////////////////////////////////////////////////////////////////
+struct LodSelection
+{
+	glm::mat4 model_view_matrix = glm::mat4(1.0f);
+	// The size in pixels of one unit at distance one in front of the camera
+	float pixels_per_unit = 0.0f;
+	float max_error_pixels = 1.0f;
+};
+LodSelection lodSelection(const glm::mat4& modelViewMatrix, const glm::mat4& projectionMatrix,
+                          int viewport_height, float max_error_pixels);
+// Returns 0 for the mesh itself, or 1 + the index in Mesh::m_lods
+int selectLod(const Mesh& mesh, const LodSelection& selection);
+void render(const Model* model, const bool submitMaterials, const LodSelection& lod);
+//////////////////////////////////////////////////////////////////////////////
+// Like render(), but skips the meshes whose bounds are outside the frustum
+// of modelViewProjectionMatrix. If statistics is given, the drawn and
+// culled meshes are added to it.
+//////////////////////////////////////////////////////////////////////////////
+struct RenderStatistics
+{
+	uint32_t drawn_meshes = 0;
+	uint32_t culled_meshes = 0;
+};
+void render(const Model* model, const bool submitMaterials, const LodSelection& lod,
+            const glm::mat4& modelViewProjectionMatrix, RenderStatistics* statistics = nullptr);
 } // namespace labhelper
\ No newline at end of file
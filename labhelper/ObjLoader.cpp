@@ -0,0 +1,581 @@
+#include "ObjLoader.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <thread>
+
+namespace labhelper {
+    namespace {
+        // Files smaller than this per thread are not worth splitting
+        const size_t MIN_CHUNK_SIZE = 1 << 20;
+        // Marks a texture coordinate or normal index that is not given
+        const int MISSING = INT_MIN;
+
+        inline bool isSpace(char c) {
+            return c == ' ' || c == '\t';
+        }
+
+        inline bool isDigit(char c) {
+            return static_cast<unsigned int>(c - '0') < 10u;
+        }
+
+        // Whitespace as sscanf("%s") sees it (there are no newlines in a line)
+        inline bool isBlank(char c) {
+            return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Parse a float in [s, s_end). This does exactly the arithmetic of
+        // tryParseDouble() in tinyobj, in the same order, so the results are
+        // identical to the last bit. What makes it fast is that it reads
+        // straight out of the mapped file, with no copies of the line.
+        ///////////////////////////////////////////////////////////////////////
+        bool parseDouble(const char *s, const char *s_end, double *result) {
+            static const double pow_lut[] = {1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001};
+            const int lut_entries = sizeof pow_lut / sizeof pow_lut[0];
+
+            if (s >= s_end) {
+                return false;
+            }
+            const char *curr = s;
+            double mantissa = 0.0;
+            int exponent = 0;
+            bool negative = false;
+            if (*curr == '+' || *curr == '-') {
+                negative = *curr == '-';
+                curr++;
+            } else if (!isDigit(*curr)) {
+                return false;
+            }
+
+            // Integer part
+            int read = 0;
+            while (curr != s_end && isDigit(*curr)) {
+                mantissa *= 10;
+                mantissa += static_cast<int>(*curr - '0');
+                curr++;
+                read++;
+            }
+            if (read == 0) {
+                return false;
+            }
+
+            // Fractional part
+            if (curr != s_end && *curr == '.') {
+                curr++;
+                read = 1;
+                while (curr != s_end && isDigit(*curr)) {
+                    mantissa += static_cast<int>(*curr - '0')
+                                * (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+                    read++;
+                    curr++;
+                }
+            }
+
+            // Exponent
+            if (curr != s_end && (*curr == 'e' || *curr == 'E')) {
+                curr++;
+                bool negative_exponent = false;
+                if (curr != s_end && (*curr == '+' || *curr == '-')) {
+                    negative_exponent = *curr == '-';
+                    curr++;
+                } else if (curr == s_end || !isDigit(*curr)) {
+                    return false;
+                }
+                read = 0;
+                while (curr != s_end && isDigit(*curr)) {
+                    exponent *= 10;
+                    exponent += static_cast<int>(*curr - '0');
+                    curr++;
+                    read++;
+                }
+                if (read == 0) {
+                    return false;
+                }
+                exponent = negative_exponent ? -exponent : exponent;
+            }
+
+            *result = (negative ? -1 : 1)
+                      * (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+            return true;
+        }
+
+        inline float parseFloat(const char *&token, const char *end) {
+            while (token < end && isSpace(*token)) token++;
+            const char *number_end = token;
+            while (number_end < end && !isSpace(*number_end)) number_end++;
+            double value = 0.0;
+            parseDouble(token, number_end, &value);
+            token = number_end;
+            return static_cast<float>(value);
+        }
+
+        // Same as atoi(), but stops at `end`
+        inline int parseInt(const char *token, const char *end) {
+            while (token < end && isBlank(*token)) token++;
+            bool negative = false;
+            if (token < end && (*token == '+' || *token == '-')) {
+                negative = *token == '-';
+                token++;
+            }
+            int value = 0;
+            while (token < end && isDigit(*token)) {
+                value = value * 10 + (*token - '0');
+                token++;
+            }
+            return negative ? -value : value;
+        }
+
+        inline const char *skipIndex(const char *token, const char *end) {
+            while (token < end && *token != '/' && !isSpace(*token)) token++;
+            return token;
+        }
+
+        // The first word, as read by sscanf(token, "%s")
+        inline std::string firstWord(const char *token, const char *end) {
+            while (token < end && isBlank(*token)) token++;
+            const char *word_end = token;
+            while (word_end < end && !isBlank(*word_end)) word_end++;
+            return std::string(token, word_end);
+        }
+
+        inline bool startsWith(const char *token, const char *end, const char *keyword, size_t length) {
+            return size_t(end - token) > length && strncmp(token, keyword, length) == 0 && isSpace(token[length]);
+        }
+
+        // Make index zero based, and resolve relative indices
+        inline int fixIndex(int idx, int n) {
+            if (idx == MISSING) return -1;
+            if (idx > 0) return idx - 1;
+            if (idx == 0) return 0;
+            return n + idx;
+        }
+
+        struct RawIndex {
+            int v, vt, vn;
+        };
+
+        struct Face {
+            size_t first_index;
+            int number_of_indices;
+            // The number of positions, texture coordinates and normals read
+            // so far in this chunk, to resolve relative indices
+            int v, vt, vn;
+        };
+
+        // Everything but faces and vertex data, in the order it is read
+        struct Command {
+            enum Type {
+                USEMTL, MTLLIB, GROUP, OBJECT
+            } type;
+            std::string argument;
+            // The number of faces read before this command in this chunk, and
+            // the number of triangle indices they give
+            size_t face;
+            size_t triangle_index;
+        };
+
+        struct Chunk {
+            const char *begin, *end;
+            std::vector<float> v, vn, vt;
+            std::vector<RawIndex> indices;
+            std::vector<Face> faces;
+            std::vector<Command> commands;
+            std::vector<tinyobj::index_t> triangles;
+            // Number of positions, normals and texture coordinates in the
+            // chunks before this one
+            int v_offset = 0, vn_offset = 0, vt_offset = 0;
+        };
+
+        ///////////////////////////////////////////////////////////////////////
+        // Parse one line, without the line ending. Follows the line parsing
+        // of tinyobj::LoadObj().
+        ///////////////////////////////////////////////////////////////////////
+        void parseLine(Chunk &chunk, const char *token, const char *end) {
+            while (token < end && isSpace(*token)) token++;
+            if (token == end || *token == '#') {
+                return;
+            }
+            char c0 = token[0];
+            char c1 = end - token > 1 ? token[1] : '\0';
+            char c2 = end - token > 2 ? token[2] : '\0';
+
+            if (c0 == 'v' && isSpace(c1)) {
+                token += 2;
+                float x = parseFloat(token, end);
+                float y = parseFloat(token, end);
+                float z = parseFloat(token, end);
+                chunk.v.push_back(x);
+                chunk.v.push_back(y);
+                chunk.v.push_back(z);
+            } else if (c0 == 'v' && c1 == 'n' && isSpace(c2)) {
+                token += 3;
+                float x = parseFloat(token, end);
+                float y = parseFloat(token, end);
+                float z = parseFloat(token, end);
+                chunk.vn.push_back(x);
+                chunk.vn.push_back(y);
+                chunk.vn.push_back(z);
+            } else if (c0 == 'v' && c1 == 't' && isSpace(c2)) {
+                token += 3;
+                float x = parseFloat(token, end);
+                float y = parseFloat(token, end);
+                chunk.vt.push_back(x);
+                chunk.vt.push_back(y);
+            } else if (c0 == 'f' && isSpace(c1)) {
+                token += 2;
+                while (token < end && isSpace(*token)) token++;
+                Face face;
+                face.first_index = chunk.indices.size();
+                face.v = int(chunk.v.size() / 3);
+                face.vn = int(chunk.vn.size() / 3);
+                face.vt = int(chunk.vt.size() / 2);
+                // i, i/j, i//k or i/j/k
+                while (token < end) {
+                    RawIndex index = {parseInt(token, end), MISSING, MISSING};
+                    token = skipIndex(token, end);
+                    if (token < end && *token == '/') {
+                        token++;
+                        if (token < end && *token == '/') {
+                            token++;
+                            index.vn = parseInt(token, end);
+                            token = skipIndex(token, end);
+                        } else {
+                            index.vt = parseInt(token, end);
+                            token = skipIndex(token, end);
+                            if (token < end && *token == '/') {
+                                token++;
+                                index.vn = parseInt(token, end);
+                                token = skipIndex(token, end);
+                            }
+                        }
+                    }
+                    chunk.indices.push_back(index);
+                    while (token < end && isSpace(*token)) token++;
+                }
+                face.number_of_indices = int(chunk.indices.size() - face.first_index);
+                chunk.faces.push_back(face);
+            } else if (startsWith(token, end, "usemtl", 6)) {
+                chunk.commands.push_back({Command::USEMTL, firstWord(token + 7, end), chunk.faces.size(), 0});
+            } else if (startsWith(token, end, "mtllib", 6)) {
+                chunk.commands.push_back({Command::MTLLIB, std::string(token + 7, end), chunk.faces.size(), 0});
+            } else if (c0 == 'g' && isSpace(c1)) {
+                // The name is the first word after 'g', other names are ignored
+                token += 1;
+                while (token < end && isSpace(*token)) token++;
+                const char *name_end = token;
+                while (name_end < end && !isSpace(*name_end)) name_end++;
+                chunk.commands.push_back({Command::GROUP, std::string(token, name_end), chunk.faces.size(), 0});
+            } else if (c0 == 'o' && isSpace(c1)) {
+                chunk.commands.push_back({Command::OBJECT, firstWord(token + 2, end), chunk.faces.size(), 0});
+            }
+            // Tags and unknown commands are ignored
+        }
+
+        void parseChunk(Chunk &chunk) {
+            const char *p = chunk.begin;
+            while (p < chunk.end) {
+                // "\r\n" gives an extra empty line, which is skipped anyway
+                const char *line_end = p;
+                while (line_end < chunk.end && *line_end != '\n' && *line_end != '\r') line_end++;
+                parseLine(chunk, p, line_end);
+                p = line_end + 1;
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Once the offsets of the chunk are known: resolve the indices and
+        // turn every polygon into a fan of triangles
+        ///////////////////////////////////////////////////////////////////////
+        void triangulateChunk(Chunk &chunk) {
+            size_t command = 0;
+            for (size_t f = 0; f <= chunk.faces.size(); f++) {
+                while (command < chunk.commands.size() && chunk.commands[command].face == f) {
+                    chunk.commands[command++].triangle_index = chunk.triangles.size();
+                }
+                if (f == chunk.faces.size()) {
+                    break;
+                }
+                const Face &face = chunk.faces[f];
+                int v_size = chunk.v_offset + face.v;
+                int vn_size = chunk.vn_offset + face.vn;
+                int vt_size = chunk.vt_offset + face.vt;
+                auto resolve = [&](const RawIndex &raw) {
+                    tinyobj::index_t index;
+                    index.vertex_index = fixIndex(raw.v, v_size);
+                    index.normal_index = fixIndex(raw.vn, vn_size);
+                    index.texcoord_index = fixIndex(raw.vt, vt_size);
+                    return index;
+                };
+                const RawIndex *polygon = &chunk.indices[face.first_index];
+                for (int k = 2; k < face.number_of_indices; k++) {
+                    chunk.triangles.push_back(resolve(polygon[0]));
+                    chunk.triangles.push_back(resolve(polygon[k - 1]));
+                    chunk.triangles.push_back(resolve(polygon[k]));
+                }
+            }
+            std::vector<RawIndex>().swap(chunk.indices);
+        }
+
+        template<typename F>
+        void parallelFor(size_t count, const F &f) {
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < count; i++) {
+                threads.emplace_back([&f, i]() { f(i); });
+            }
+            if (count > 0) {
+                f(0);
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+        }
+
+        // The filenames of an mtllib command, split as tinyobj splits them
+        std::vector<std::string> splitFilenames(const std::string &argument) {
+            std::vector<std::string> filenames;
+            std::stringstream ss(argument);
+            std::string filename;
+            while (std::getline(ss, filename, ' ')) {
+                filenames.push_back(filename);
+            }
+            return filenames;
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Read the material libraries named before the first vertex or face
+        // and hand their materials to `callback`. Errors are left for the
+        // real parse to report.
+        ///////////////////////////////////////////////////////////////////////
+        void readEarlyMaterials(const char *p, const char *end, const std::string &mtl_directory,
+                                const MaterialCallback &callback) {
+            tinyobj::MaterialFileReader reader(mtl_directory);
+            while (p < end) {
+                const char *line_end = p;
+                while (line_end < end && *line_end != '\n' && *line_end != '\r') line_end++;
+                const char *token = p;
+                while (token < line_end && isSpace(*token)) token++;
+                if (token < line_end && (*token == 'v' || *token == 'f')) {
+                    return;
+                }
+                if (startsWith(token, line_end, "mtllib", 6)) {
+                    std::vector<tinyobj::material_t> materials;
+                    std::map<std::string, int> material_map;
+                    for (const auto &f : splitFilenames(std::string(token + 7, line_end))) {
+                        std::string err;
+                        if (reader(f, &materials, &material_map, &err)) {
+                            break;
+                        }
+                    }
+                    if (!materials.empty()) {
+                        callback(materials);
+                    }
+                }
+                p = line_end + 1;
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Builds the shapes from the parsed chunks. This is the state machine
+        // of tinyobj::LoadObj(), with runs of faces instead of single faces.
+        ///////////////////////////////////////////////////////////////////////
+        class ShapeBuilder {
+        public:
+            ShapeBuilder(std::vector<tinyobj::shape_t> *shapes, std::vector<tinyobj::material_t> *materials,
+                         std::string *err, const std::string &mtl_directory, std::vector<std::string> *material_files)
+                    : shapes(shapes), materials(materials), err(err), material_reader(mtl_directory),
+                      material_files(material_files) {
+            }
+
+            // Faces [first_face, last_face) of a chunk, which give the triangle
+            // indices [first_index, last_index)
+            void addFaces(const Chunk &chunk, size_t first_face, size_t last_face, size_t first_index,
+                          size_t last_index) {
+                if (first_face == last_face) return;
+                pending_faces += last_face - first_face;
+                pending.push_back({&chunk, first_index, last_index});
+            }
+
+            void command(const Command &c) {
+                switch (c.type) {
+                    case Command::USEMTL: {
+                        auto it = material_map.find(c.argument);
+                        int new_material = it != material_map.end() ? it->second : -1;
+                        if (new_material != material) {
+                            flush();
+                            material = new_material;
+                        }
+                        break;
+                    }
+                    case Command::MTLLIB:
+                        loadMaterials(c.argument);
+                        break;
+                    case Command::GROUP:
+                    case Command::OBJECT:
+                        if (flush()) {
+                            shapes->push_back(std::move(shape));
+                        }
+                        shape = tinyobj::shape_t();
+                        name = c.argument;
+                        break;
+                }
+            }
+
+            void finish() {
+                if (flush() || !shape.mesh.indices.empty()) {
+                    shapes->push_back(std::move(shape));
+                }
+                shape = tinyobj::shape_t();
+            }
+
+        private:
+            struct Run {
+                const Chunk *chunk;
+                size_t first_index, last_index;
+            };
+
+            std::vector<tinyobj::shape_t> *shapes;
+            std::vector<tinyobj::material_t> *materials;
+            std::string *err;
+            tinyobj::MaterialFileReader material_reader;
+            std::vector<std::string> *material_files;
+            std::map<std::string, int> material_map;
+            int material = -1;
+            std::string name;
+            tinyobj::shape_t shape;
+            // The faces read since the shape was last flushed
+            std::vector<Run> pending;
+            size_t pending_faces = 0;
+
+            // Same as exportFaceGroupToShape() in tinyobj
+            bool flush() {
+                if (pending_faces == 0) {
+                    return false;
+                }
+                tinyobj::mesh_t &mesh = shape.mesh;
+                for (const Run &run : pending) {
+                    size_t count = run.last_index - run.first_index;
+                    mesh.indices.insert(mesh.indices.end(), run.chunk->triangles.begin() + run.first_index,
+                                        run.chunk->triangles.begin() + run.last_index);
+                    mesh.num_face_vertices.insert(mesh.num_face_vertices.end(), count / 3, 3);
+                    mesh.material_ids.insert(mesh.material_ids.end(), count / 3, material);
+                }
+                shape.name = name;
+                pending.clear();
+                pending_faces = 0;
+                return true;
+            }
+
+            void loadMaterials(const std::string &argument) {
+                std::vector<std::string> filenames = splitFilenames(argument);
+                if (filenames.empty()) {
+                    *err += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+                    return;
+                }
+                for (const auto &f : filenames) {
+                    if (material_files) {
+                        material_files->push_back(f);
+                    }
+                    std::string err_mtl;
+                    bool ok = material_reader(f, materials, &material_map, &err_mtl);
+                    *err += err_mtl;
+                    if (ok) {
+                        return;
+                    }
+                }
+                *err += "WARN: Failed to load material file(s). Use default material.\n";
+            }
+        };
+    }
+
+    bool loadOBJ(tinyobj::attrib_t *attrib, std::vector<tinyobj::shape_t> *shapes,
+                 std::vector<tinyobj::material_t> *materials, std::string *err, const std::string &filename,
+                 const std::string &mtl_directory, const MaterialCallback &early_materials, int num_threads,
+                 std::vector<std::string> *material_files) {
+        attrib->vertices.clear();
+        attrib->normals.clear();
+        attrib->texcoords.clear();
+        shapes->clear();
+        std::string errors;
+
+        MappedFile file;
+        if (!file.open(filename)) {
+            if (err) {
+                *err = "Cannot open file [" + filename + "]\n";
+            }
+            return false;
+        }
+
+        if (early_materials) {
+            readEarlyMaterials(file.data(), file.data() + file.size(), mtl_directory, early_materials);
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Cut the file into chunks at line boundaries
+        ///////////////////////////////////////////////////////////////////////
+        if (num_threads <= 0) {
+            num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+        }
+        size_t num_chunks = std::max(size_t(1), std::min(size_t(num_threads), file.size() / MIN_CHUNK_SIZE));
+        std::vector<Chunk> chunks(num_chunks);
+        const char *begin = file.data();
+        const char *end = file.data() + file.size();
+        for (size_t i = 0; i < num_chunks; i++) {
+            chunks[i].begin = i == 0 ? begin : chunks[i - 1].end;
+            const char *chunk_end = i + 1 == num_chunks ? end : begin + file.size() * (i + 1) / num_chunks;
+            chunk_end = std::max(chunk_end, chunks[i].begin);
+            while (chunk_end < end && chunk_end[-1] != '\n') chunk_end++;
+            chunks[i].end = chunk_end;
+        }
+
+        parallelFor(num_chunks, [&](size_t i) { parseChunk(chunks[i]); });
+
+        ///////////////////////////////////////////////////////////////////////
+        // Offsets of the chunks, then resolve the indices and copy the vertex
+        // data in parallel
+        ///////////////////////////////////////////////////////////////////////
+        size_t v_size = 0, vn_size = 0, vt_size = 0;
+        for (auto &chunk : chunks) {
+            chunk.v_offset = int(v_size / 3);
+            chunk.vn_offset = int(vn_size / 3);
+            chunk.vt_offset = int(vt_size / 2);
+            v_size += chunk.v.size();
+            vn_size += chunk.vn.size();
+            vt_size += chunk.vt.size();
+        }
+        attrib->vertices.resize(v_size);
+        attrib->normals.resize(vn_size);
+        attrib->texcoords.resize(vt_size);
+        parallelFor(num_chunks, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            triangulateChunk(chunk);
+            std::copy(chunk.v.begin(), chunk.v.end(), attrib->vertices.begin() + size_t(chunk.v_offset) * 3);
+            std::copy(chunk.vn.begin(), chunk.vn.end(), attrib->normals.begin() + size_t(chunk.vn_offset) * 3);
+            std::copy(chunk.vt.begin(), chunk.vt.end(), attrib->texcoords.begin() + size_t(chunk.vt_offset) * 2);
+        });
+
+        ///////////////////////////////////////////////////////////////////////
+        // Replay the commands in file order to build the shapes
+        ///////////////////////////////////////////////////////////////////////
+        ShapeBuilder builder(shapes, materials, &errors, mtl_directory, material_files);
+        for (const auto &chunk : chunks) {
+            size_t face = 0, index = 0;
+            for (const auto &command : chunk.commands) {
+                builder.addFaces(chunk, face, command.face, index, command.triangle_index);
+                builder.command(command);
+                face = command.face;
+                index = command.triangle_index;
+            }
+            builder.addFaces(chunk, face, chunk.faces.size(), index, chunk.triangles.size());
+        }
+        builder.finish();
+
+        if (err) {
+            *err += errors;
+        }
+        return true;
+    }
+}
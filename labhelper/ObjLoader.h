@@ -0,0 +1,34 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+#include "MappedFile.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Multithreaded replacement for tinyobj::LoadObj(..., triangulate = true).
+// The file is mapped into memory and cut at line boundaries into one chunk
+// per thread. The chunks are parsed in parallel and then stitched together,
+// fixing up relative (negative) indices, shapes and materials that cross
+// chunk boundaries.
+//
+// The results are identical to those of tinyobj, down to the bits of the
+// floats, except that tags ('t' lines) are ignored. `num_threads` = 0 uses
+// one thread per core, small files are always parsed by one thread.
+//
+// `early_materials` is called with the materials of the libraries named at
+// the top of the file (before the first vertex or face) before the rest of
+// the file is parsed, e.g. to start loading their textures.
+//
+// If `material_files` is given, the material libraries that were tried
+// (found or not) are added to it, relative to `mtl_directory`.
+//////////////////////////////////////////////////////////////////////////////
+typedef std::function<void(const std::vector<tinyobj::material_t>&)> MaterialCallback;
+
+bool loadOBJ(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+             std::vector<tinyobj::material_t>* materials, std::string* err, const std::string& filename,
+             const std::string& mtl_directory, const MaterialCallback& early_materials = MaterialCallback(),
+             int num_threads = 0, std::vector<std::string>* material_files = nullptr);
+} // namespace labhelper
@@ -0,0 +1,465 @@
+#include "Simplifier.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <unordered_map>
+
+namespace labhelper {
+///////////////////////////////////////////////////////////////////////////
+// An error quadric: the weighted sum of the squared distances from a point
+// to a set of planes. Triangle planes are weighted by area, border planes
+// by the squared length of the edge.
+///////////////////////////////////////////////////////////////////////////
+    struct Quadric {
+        double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+        double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+        double c = 0.0;
+        double weight = 0.0;
+
+        // The plane dot(n, p) + d = 0, with n of unit length
+        static Quadric plane(const glm::vec3 &n, float d, double weight) {
+            Quadric q;
+            q.a00 = weight * n.x * n.x;
+            q.a01 = weight * n.x * n.y;
+            q.a02 = weight * n.x * n.z;
+            q.a11 = weight * n.y * n.y;
+            q.a12 = weight * n.y * n.z;
+            q.a22 = weight * n.z * n.z;
+            q.b0 = weight * n.x * d;
+            q.b1 = weight * n.y * d;
+            q.b2 = weight * n.z * d;
+            q.c = weight * d * d;
+            q.weight = weight;
+            return q;
+        }
+
+        Quadric &operator+=(const Quadric &o) {
+            a00 += o.a00;
+            a01 += o.a01;
+            a02 += o.a02;
+            a11 += o.a11;
+            a12 += o.a12;
+            a22 += o.a22;
+            b0 += o.b0;
+            b1 += o.b1;
+            b2 += o.b2;
+            c += o.c;
+            weight += o.weight;
+            return *this;
+        }
+
+        // The weighted mean of the squared distances
+        double error(const glm::vec3 &p) const {
+            double x = p.x, y = p.y, z = p.z;
+            double e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+                       + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+            return weight > 0.0 ? std::max(e, 0.0) / weight : 0.0;
+        }
+    };
+
+    // Border planes are weighted up, so borders keep their shape
+    const double BORDER_WEIGHT = 10.0;
+
+    enum VertexKind {
+        MANIFOLD, // Moves anywhere
+        BORDER,   // Moves along the border it is on
+        SEAM,     // Moves along the seam it is on, together with its twin
+        LOCKED    // Does not move
+    };
+
+    struct PositionHash {
+        size_t operator()(const glm::vec3 &p) const {
+            uint32_t words[3];
+            memcpy(words, &p, sizeof(words));
+            return size_t((words[0] * 73856093u) ^ (words[1] * 19349663u) ^ (words[2] * 83492791u));
+        }
+    };
+
+    struct PositionEqual {
+        bool operator()(const glm::vec3 &a, const glm::vec3 &b) const {
+            return memcmp(&a, &b, sizeof(glm::vec3)) == 0;
+        }
+    };
+
+    static uint64_t edgeKey(uint32_t a, uint32_t b) {
+        return (uint64_t(a) << 32) | b;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// The topology of the current triangles. Vertices with the same position
+// form a group, named after its first vertex, and the vertices of a group
+// are its wedges. An edge whose opposite edge uses other wedges is a seam,
+// one without an opposite edge is a border.
+///////////////////////////////////////////////////////////////////////////
+    struct Topology {
+        std::unordered_map<uint64_t, uint32_t> vertex_edges;
+        std::unordered_map<uint64_t, uint32_t> group_edges;
+        std::vector<uint8_t> kind;
+
+        VertexKind edgeKind(uint32_t a, uint32_t b, const std::vector<uint32_t> &group) const {
+            if (vertex_edges.count(edgeKey(b, a))) {
+                return MANIFOLD;
+            }
+            return group_edges.count(edgeKey(group[b], group[a])) ? SEAM : BORDER;
+        }
+    };
+
+    static void classify(const std::vector<uint32_t> &indices, const std::vector<uint32_t> &group, Topology &topology) {
+        size_t number_of_vertices = group.size();
+        topology.vertex_edges.clear();
+        topology.group_edges.clear();
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            for (int j = 0; j < 3; j++) {
+                uint32_t a = indices[i + j], b = indices[i + (j + 1) % 3];
+                topology.vertex_edges[edgeKey(a, b)]++;
+                topology.group_edges[edgeKey(group[a], group[b])]++;
+            }
+        }
+
+        std::vector<uint32_t> wedges(number_of_vertices, 0), borders(number_of_vertices, 0),
+                seams(number_of_vertices, 0);
+        std::vector<bool> referenced(number_of_vertices, false), locked(number_of_vertices, false);
+        for (uint32_t v : indices) {
+            if (!referenced[v]) {
+                referenced[v] = true;
+                wedges[group[v]]++;
+            }
+        }
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            for (int j = 0; j < 3; j++) {
+                uint32_t a = indices[i + j], b = indices[i + (j + 1) % 3];
+                uint32_t ga = group[a], gb = group[b];
+                // Edges that are shared by more than two triangles
+                if (topology.vertex_edges[edgeKey(a, b)] > 1 || topology.group_edges[edgeKey(ga, gb)] > 1) {
+                    locked[ga] = locked[gb] = true;
+                }
+                VertexKind edge = topology.edgeKind(a, b, group);
+                if (edge == SEAM) {
+                    seams[ga]++;
+                    seams[gb]++;
+                } else if (edge == BORDER) {
+                    borders[ga]++;
+                    borders[gb]++;
+                }
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // A vertex in the middle of a border has one border edge in and one
+        // out. One in the middle of a seam has two wedges, with a seam edge
+        // in and out on each side.
+        ///////////////////////////////////////////////////////////////////////
+        topology.kind.assign(number_of_vertices, LOCKED);
+        for (size_t g = 0; g < number_of_vertices; g++) {
+            if (locked[g] || wedges[g] == 0) {
+                continue;
+            }
+            if (borders[g] == 0 && seams[g] == 0 && wedges[g] == 1) {
+                topology.kind[g] = MANIFOLD;
+            } else if (borders[g] == 2 && seams[g] == 0 && wedges[g] == 1) {
+                topology.kind[g] = BORDER;
+            } else if (borders[g] == 0 && seams[g] == 4 && wedges[g] == 2) {
+                topology.kind[g] = SEAM;
+            }
+        }
+    }
+
+    struct Collapse {
+        uint32_t from, to;
+        float error;
+    };
+
+///////////////////////////////////////////////////////////////////////////
+// Simplifies towards a sequence of targets. Whenever `indices` is down to
+// `target_index_count`, or nothing more can be collapsed, level_done() is
+// called with the error so far and may lower the target to continue. The
+// quadrics keep measuring against the input, so the levels of a chain do
+// not pile up error.
+///////////////////////////////////////////////////////////////////////////
+    typedef std::function<bool(float error, size_t &target_index_count)> LevelDone;
+
+    static float simplifyChain(const glm::vec3 *positions, uint32_t number_of_vertices, std::vector<uint32_t> &indices,
+                               size_t target_index_count, float max_error, const LevelDone &level_done) {
+        std::vector<uint32_t> group(number_of_vertices);
+        std::unordered_map<glm::vec3, uint32_t, PositionHash, PositionEqual> first_with_position;
+        for (uint32_t v = 0; v < number_of_vertices; v++) {
+            group[v] = first_with_position.insert(std::make_pair(positions[v], v)).first->second;
+        }
+        auto isDegenerate = [&group](const uint32_t *triangle) {
+            return group[triangle[0]] == group[triangle[1]] || group[triangle[1]] == group[triangle[2]]
+                   || group[triangle[2]] == group[triangle[0]];
+        };
+        auto removeDegenerate = [&]() {
+            size_t kept = 0;
+            for (size_t i = 0; i + 3 <= indices.size(); i += 3) {
+                if (!isDegenerate(&indices[i])) {
+                    std::copy(&indices[i], &indices[i] + 3, &indices[kept]);
+                    kept += 3;
+                }
+            }
+            indices.resize(kept);
+        };
+        removeDegenerate();
+
+        ///////////////////////////////////////////////////////////////////////
+        // The quadrics of the groups
+        ///////////////////////////////////////////////////////////////////////
+        Topology topology;
+        classify(indices, group, topology);
+        std::vector<Quadric> quadrics(number_of_vertices);
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            const glm::vec3 &p0 = positions[indices[i]], &p1 = positions[indices[i + 1]],
+                    &p2 = positions[indices[i + 2]];
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            float length = glm::length(n);
+            if (length == 0.0f) {
+                continue;
+            }
+            n /= length;
+            Quadric q = Quadric::plane(n, -glm::dot(n, p0), 0.5 * length);
+            for (int j = 0; j < 3; j++) {
+                uint32_t a = indices[i + j], b = indices[i + (j + 1) % 3];
+                quadrics[group[a]] += q;
+                if (topology.edgeKind(a, b, group) == BORDER) {
+                    // A plane through the border edge, perpendicular to the triangle
+                    glm::vec3 edge = positions[b] - positions[a];
+                    glm::vec3 border_normal = glm::cross(edge, n);
+                    float edge_length = glm::length(border_normal);
+                    if (edge_length > 0.0f) {
+                        border_normal /= edge_length;
+                        Quadric border = Quadric::plane(border_normal, -glm::dot(border_normal, positions[a]),
+                                                        BORDER_WEIGHT * edge_length * edge_length);
+                        quadrics[group[a]] += border;
+                        quadrics[group[b]] += border;
+                    }
+                }
+            }
+        }
+
+        ///////////////////////////////////////////////////////////////////////
+        // Each pass collapses the cheapest edges, at most one around any
+        // vertex, and then removes the triangles that have become degenerate
+        ///////////////////////////////////////////////////////////////////////
+        float result_error = 0.0f;
+        std::vector<Collapse> collapses;
+        std::vector<uint32_t> first_adjacent, adjacent, remap;
+        std::vector<bool> touched;
+        std::vector<std::pair<uint32_t, uint32_t>> wedge_map;
+        for (;;) {
+            if (indices.size() <= target_index_count) {
+                if (!level_done(result_error, target_index_count)) {
+                    break;
+                }
+                continue;
+            }
+            auto allowed = [&](uint32_t from, uint32_t to, VertexKind edge) {
+                switch (topology.kind[group[from]]) {
+                    case MANIFOLD:
+                        return true;
+                    case BORDER:
+                        return edge == BORDER && (topology.kind[group[to]] == BORDER || topology.kind[group[to]] == LOCKED);
+                    case SEAM:
+                        return edge == SEAM && (topology.kind[group[to]] == SEAM || topology.kind[group[to]] == LOCKED);
+                    default:
+                        return false;
+                }
+            };
+            collapses.clear();
+            for (size_t i = 0; i < indices.size(); i += 3) {
+                for (int j = 0; j < 3; j++) {
+                    uint32_t a = indices[i + j], b = indices[i + (j + 1) % 3];
+                    VertexKind edge = topology.edgeKind(a, b, group);
+                    const uint32_t ends[2][2] = {{a, b}, {b, a}};
+                    for (const auto &end : ends) {
+                        if (allowed(end[0], end[1], edge)) {
+                            Quadric q = quadrics[group[end[0]]];
+                            q += quadrics[group[end[1]]];
+                            collapses.push_back({end[0], end[1], float(std::sqrt(q.error(positions[end[1]])))});
+                        }
+                    }
+                }
+            }
+            std::sort(collapses.begin(), collapses.end(),
+                      [](const Collapse &x, const Collapse &y) { return x.error < y.error; });
+
+            // The triangles around each group
+            first_adjacent.assign(number_of_vertices + 1, 0);
+            for (uint32_t v : indices) {
+                first_adjacent[group[v] + 1]++;
+            }
+            for (uint32_t g = 0; g < number_of_vertices; g++) {
+                first_adjacent[g + 1] += first_adjacent[g];
+            }
+            adjacent.resize(indices.size());
+            {
+                std::vector<uint32_t> fill(first_adjacent.begin(), first_adjacent.end() - 1);
+                for (size_t i = 0; i < indices.size(); i++) {
+                    adjacent[fill[group[indices[i]]]++] = uint32_t(i / 3);
+                }
+            }
+
+            remap.resize(number_of_vertices);
+            for (uint32_t v = 0; v < number_of_vertices; v++) {
+                remap[v] = v;
+            }
+            touched.assign(number_of_vertices, false);
+            size_t triangles_to_remove = (indices.size() - target_index_count + 2) / 3;
+            size_t removed = 0;
+            size_t collapsed = 0;
+            for (const Collapse &collapse : collapses) {
+                if (collapse.error > max_error || removed >= triangles_to_remove) {
+                    break;
+                }
+                uint32_t from_group = group[collapse.from], to_group = group[collapse.to];
+                if (touched[from_group] || touched[to_group]) {
+                    continue;
+                }
+
+                ///////////////////////////////////////////////////////////////
+                // Every wedge that moves goes to the wedge of the target that
+                // it shares a triangle with, so attributes stay continuous
+                ///////////////////////////////////////////////////////////////
+                wedge_map.clear();
+                bool valid = true;
+                for (uint32_t a = first_adjacent[from_group]; a < first_adjacent[from_group + 1]; a++) {
+                    const uint32_t *triangle = &indices[adjacent[a] * 3];
+                    uint32_t wedge = 0, target = UINT32_MAX;
+                    for (int j = 0; j < 3; j++) {
+                        if (group[triangle[j]] == from_group) wedge = triangle[j];
+                        if (group[triangle[j]] == to_group) target = triangle[j];
+                    }
+                    if (target == UINT32_MAX) {
+                        continue;
+                    }
+                    auto mapped = std::find_if(wedge_map.begin(), wedge_map.end(),
+                                               [wedge](const std::pair<uint32_t, uint32_t> &m) { return m.first == wedge; });
+                    if (mapped == wedge_map.end()) {
+                        wedge_map.push_back(std::make_pair(wedge, target));
+                    }
+                }
+                const glm::vec3 &target_position = positions[collapse.to];
+                for (uint32_t a = first_adjacent[from_group]; a < first_adjacent[from_group + 1] && valid; a++) {
+                    const uint32_t *triangle = &indices[adjacent[a] * 3];
+                    int corner = 0;
+                    bool collapses_away = false;
+                    for (int j = 0; j < 3; j++) {
+                        if (group[triangle[j]] == from_group) corner = j;
+                        if (group[triangle[j]] == to_group) collapses_away = true;
+                    }
+                    bool has_target = std::any_of(wedge_map.begin(), wedge_map.end(),
+                                                  [&](const std::pair<uint32_t, uint32_t> &m) {
+                                                      return m.first == triangle[corner];
+                                                  });
+                    if (!has_target) {
+                        valid = false;
+                        break;
+                    }
+                    if (collapses_away) {
+                        continue;
+                    }
+                    // Reject collapses that flip a triangle over
+                    glm::vec3 p[3] = {positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]};
+                    glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    p[corner] = target_position;
+                    glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    if (glm::dot(before, after) < 0.25f * glm::length(before) * glm::length(after)) {
+                        valid = false;
+                    }
+                }
+                if (!valid) {
+                    continue;
+                }
+
+                for (const auto &m : wedge_map) {
+                    remap[m.first] = m.second;
+                }
+                quadrics[to_group] += quadrics[from_group];
+                for (uint32_t a = first_adjacent[from_group]; a < first_adjacent[from_group + 1]; a++) {
+                    for (int j = 0; j < 3; j++) {
+                        touched[group[indices[adjacent[a] * 3 + j]]] = true;
+                    }
+                }
+                touched[to_group] = true;
+                removed += topology.kind[from_group] == MANIFOLD ? 2 : 1;
+                result_error = std::max(result_error, collapse.error);
+                collapsed++;
+            }
+            if (collapsed == 0) {
+                level_done(result_error, target_index_count);
+                break;
+            }
+            for (auto &index : indices) {
+                index = remap[index];
+            }
+            removeDegenerate();
+            classify(indices, group, topology);
+        }
+        return result_error;
+    }
+
+    float simplifyMesh(const glm::vec3 *positions, uint32_t number_of_vertices, std::vector<uint32_t> &indices,
+                       size_t target_index_count, float max_error) {
+        return simplifyChain(positions, number_of_vertices, indices, target_index_count, max_error,
+                             [](float, size_t &) { return false; });
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// LODs are made for meshes with at least MIN_LOD_TRIANGLES triangles, and
+// may be at most MAX_LOD_ERROR of the size of the mesh off. A level that
+// removes less than a quarter of the triangles of the previous one is the
+// last.
+///////////////////////////////////////////////////////////////////////////
+    const uint32_t MIN_LOD_TRIANGLES = 64;
+    const float MAX_LOD_ERROR = 0.05f;
+
+    bool generateLods(Model *model) {
+        if (model->m_positions.data() != model->m_positions_storage.data()
+            || model->m_indices.data() != model->m_indices_storage.data()
+            || model->m_indices.size() != model->m_indices_storage.size()) {
+            std::cout << "ERROR: generateLods(): " << model->m_filename << " does not own its arrays.\n";
+            return false;
+        }
+        std::vector<uint32_t> &storage = model->m_indices_storage;
+        for (auto &mesh : model->m_meshes) {
+            mesh.m_lods.clear();
+            if (mesh.m_number_of_indices < 3 * MIN_LOD_TRIANGLES) {
+                continue;
+            }
+            const glm::vec3 *positions = model->m_positions_storage.data() + mesh.m_start_index;
+            glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+            for (uint32_t v = 0; v < mesh.m_number_of_vertices; v++) {
+                lo = glm::min(lo, positions[v]);
+                hi = glm::max(hi, positions[v]);
+            }
+            float max_error = MAX_LOD_ERROR * glm::length(hi - lo);
+
+            // Each level continues from the previous one
+            std::vector<uint32_t> lod(storage.begin() + mesh.m_first_index,
+                                      storage.begin() + mesh.m_first_index + mesh.m_number_of_indices);
+            size_t previous = lod.size();
+            std::vector<MeshLod> &lods = mesh.m_lods;
+            simplifyChain(positions, mesh.m_number_of_vertices, lod, previous / 6 * 3, max_error,
+                          [&](float error, size_t &target_index_count) {
+                              if (lod.empty() || lod.size() > previous * 3 / 4) {
+                                  return false;
+                              }
+                              MeshLod mesh_lod;
+                              mesh_lod.m_first_index = uint32_t(storage.size());
+                              mesh_lod.m_number_of_indices = uint32_t(lod.size());
+                              mesh_lod.m_gpu_index_offset = 0;
+                              mesh_lod.m_error = error;
+                              storage.insert(storage.end(), lod.begin(), lod.end());
+                              lods.push_back(mesh_lod);
+                              previous = lod.size();
+                              target_index_count = previous / 6 * 3;
+                              return int(lods.size()) < MAX_LODS;
+                          });
+        }
+        model->m_indices = ArrayView<uint32_t>(storage.data(), storage.size());
+        return true;
+    }
+}
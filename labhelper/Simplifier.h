@@ -0,0 +1,37 @@
+#pragma once
+#include "Model.h"
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Quadric error simplification (Garland & Heckbert 1997, "Surface
+// Simplification Using Quadric Error Metrics"). Edges are collapsed onto
+// one of their vertices, so the simplified triangles index the vertices of
+// the mesh and no new vertices are made.
+//
+// Vertices on UV and normal seams only move along the seam (together with
+// their twin on the other side), and vertices on open borders only along
+// the border. Since each mesh has one material, material boundaries are
+// borders. Vertices where seams or borders meet are never moved.
+//////////////////////////////////////////////////////////////////////////////
+
+// Simplifies `indices` (triangles of vertices in `positions`) until at most
+// `target_index_count` are left, or no edge can be collapsed with an error
+// below `max_error`. Returns the largest error of the collapses made, as a
+// distance in the units of `positions`.
+float simplifyMesh(const glm::vec3* positions, uint32_t number_of_vertices, std::vector<uint32_t>& indices,
+                   size_t target_index_count, float max_error);
+
+//////////////////////////////////////////////////////////////////////////////
+// Fills in Mesh::m_lods with up to MAX_LODS levels of detail, each with
+// about half the triangles of the previous. Each level continues from the
+// previous one, but its error is measured against the full mesh. The LOD
+// indices are added to the end of m_indices.
+//
+// Like optimizeModel(), the model must own its arrays and must not be
+// uploaded yet. loadModelFromOBJ() does this when setLodGeneration(true)
+// was called.
+//////////////////////////////////////////////////////////////////////////////
+const int MAX_LODS = 4;
+bool generateLods(Model* model);
+} // namespace labhelper
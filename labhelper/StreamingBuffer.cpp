@@ -0,0 +1,121 @@
+#include "StreamingBuffer.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace labhelper {
+    // Regions start at multiples of this, which suits vertex attributes,
+    // pixel rows and uniform blocks alike
+    const size_t REGION_ALIGNMENT = 256;
+
+    static bool hasBufferStorage() {
+        return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    }
+
+    void StreamingBuffer::waitForRegion(int region) {
+        if (m_fences[region] == nullptr) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            GLenum status = glClientWaitSync(m_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+            if (status != GL_TIMEOUT_EXPIRED) {
+                break;
+            }
+        }
+        glDeleteSync(m_fences[region]);
+        m_fences[region] = nullptr;
+        std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+        m_last_wait_seconds += waited.count();
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// (Re)create the buffer with regions of at least `region_size` bytes. The
+// old buffer may still be read by the GPU, but deleting it is safe, GL
+// keeps it alive for as long as it is used.
+///////////////////////////////////////////////////////////////////////////
+    void StreamingBuffer::allocate(size_t region_size) {
+        destroy();
+        region_size = std::max(region_size, REGION_ALIGNMENT);
+        m_region_size = (region_size + REGION_ALIGNMENT - 1) / REGION_ALIGNMENT * REGION_ALIGNMENT;
+        m_region = 0;
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(m_target, m_buffer);
+        if (hasBufferStorage()) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(m_target, GLsizeiptr(m_region_size * REGIONS), nullptr, flags);
+            m_persistent = (unsigned char *) glMapBufferRange(m_target, 0, GLsizeiptr(m_region_size * REGIONS),
+                                                              flags);
+            if (m_persistent == nullptr) {
+                std::cout << "StreamingBuffer: could not map the buffer persistently, orphaning instead.\n";
+                glDeleteBuffers(1, &m_buffer);
+                glGenBuffers(1, &m_buffer);
+                glBindBuffer(m_target, m_buffer);
+            }
+        }
+        if (m_persistent == nullptr) {
+            glBufferData(m_target, GLsizeiptr(m_region_size), nullptr, GL_STREAM_DRAW);
+        }
+    }
+
+    void *StreamingBuffer::map(GLenum target, size_t size) {
+        m_last_wait_seconds = 0.0;
+        m_target = target;
+        if (m_buffer == 0 || size > m_region_size) {
+            // Some room to grow, so a slowly growing size does not
+            // reallocate every frame
+            allocate(m_buffer == 0 ? size : std::max(size, m_region_size + m_region_size / 2));
+        }
+        glBindBuffer(target, m_buffer);
+        m_mapped = true;
+        if (m_persistent != nullptr) {
+            // Everything that reads the previous region has been issued
+            m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_region = (m_region + 1) % REGIONS;
+            waitForRegion(m_region);
+            return m_persistent + m_region * m_region_size;
+        }
+        // Orphan the buffer, the GPU keeps reading the old storage
+        glBufferData(target, GLsizeiptr(m_region_size), nullptr, GL_STREAM_DRAW);
+        void *data = glMapBufferRange(target, 0, GLsizeiptr(size), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (data == nullptr) {
+            std::cout << "StreamingBuffer: could not map the buffer.\n";
+            m_mapped = false;
+        }
+        return data;
+    }
+
+    size_t StreamingBuffer::unmap() {
+        if (!m_mapped) {
+            return 0;
+        }
+        m_mapped = false;
+        if (m_persistent != nullptr) {
+            return m_region * m_region_size;
+        }
+        glBindBuffer(m_target, m_buffer);
+        glUnmapBuffer(m_target);
+        return 0;
+    }
+
+    void StreamingBuffer::destroy() {
+        if (m_buffer == 0) {
+            return;
+        }
+        for (int region = 0; region < REGIONS; region++) {
+            if (m_fences[region] != nullptr) {
+                glDeleteSync(m_fences[region]);
+                m_fences[region] = nullptr;
+            }
+        }
+        if (m_persistent != nullptr) {
+            glBindBuffer(m_target, m_buffer);
+            glUnmapBuffer(m_target);
+            m_persistent = nullptr;
+        }
+        glDeleteBuffers(1, &m_buffer);
+        m_buffer = 0;
+        m_region_size = 0;
+        m_mapped = false;
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// A buffer for data that is written by the CPU every frame (dynamic
+// vertices, pixels to upload, ...) without waiting for the GPU.
+//
+// With GL 4.4 / ARB_buffer_storage the buffer is mapped persistently and
+// split into REGIONS regions that are written in turn. Each region gets a
+// fence when the next one is mapped, and is only written again once the GPU
+// has passed that fence, which with three regions it normally has.
+// Without buffer storage, the buffer is orphaned on every map() instead.
+//
+// map() returns where to write the data, unmap() returns the byte offset
+// of the data in buffer(), to use as attribute or pixel offset. The data
+// must be used before the next map(). No GL calls are made by the
+// destructor, call destroy() while the context is alive.
+//////////////////////////////////////////////////////////////////////////////
+class StreamingBuffer
+{
+public:
+	static const int REGIONS = 3;
+
+	StreamingBuffer() = default;
+	StreamingBuffer(const StreamingBuffer&) = delete;
+	StreamingBuffer& operator=(const StreamingBuffer&) = delete;
+
+	// Returns room for `size` bytes, and leaves the buffer bound to
+	// `target`. The buffer grows as needed. Returns nullptr if the buffer
+	// can not be mapped.
+	void* map(GLenum target, size_t size);
+	size_t unmap();
+	void destroy();
+
+	GLuint buffer() const
+	{
+		return m_buffer;
+	}
+	bool persistent() const
+	{
+		return m_persistent != nullptr;
+	}
+	// Seconds spent waiting for the GPU in the last map()
+	double lastWaitSeconds() const
+	{
+		return m_last_wait_seconds;
+	}
+
+private:
+	GLuint m_buffer = 0;
+	GLenum m_target = GL_ARRAY_BUFFER;
+	size_t m_region_size = 0;
+	int m_region = 0;
+	bool m_mapped = false;
+	// The persistently mapped buffer, or nullptr when orphaning
+	unsigned char* m_persistent = nullptr;
+	GLsync m_fences[REGIONS] = {};
+	double m_last_wait_seconds = 0.0;
+
+	void waitForRegion(int region);
+	void allocate(size_t region_size);
+};
+} // namespace labhelper
@@ -0,0 +1,120 @@
+#include "TextureCache.h"
+#include <cassert>
+#include <GL/glew.h>
+#include <stb_image.h>
+#include "ThreadPool.h"
+
+namespace labhelper {
+    TextureImage::~TextureImage() {
+        if (data != nullptr) {
+            stbi_image_free(data);
+        }
+        if (gl_id != 0) {
+            glDeleteTextures(1, &gl_id);
+        }
+    }
+
+    TextureCache &TextureCache::instance() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void TextureCache::setCPUCopies(TextureCPUCopies policy) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Images that are already uploaded have applied the old policy
+        assert(m_uploads == 0 || policy == m_cpu_copies);
+        m_cpu_copies = policy;
+    }
+
+    TextureCPUCopies TextureCache::cpuCopies() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_cpu_copies;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Decode an image file, on any thread
+///////////////////////////////////////////////////////////////////////////
+    std::shared_ptr<TextureImage> TextureCache::decode(const std::string &path, int components) {
+        std::shared_ptr<TextureImage> image = std::make_shared<TextureImage>();
+        image->path = path;
+        image->components = components;
+        int discard;
+        image->data = stbi_load(path.c_str(), &image->width, &image->height, &discard, components);
+        m_decodes++;
+        return image->data != nullptr ? image : nullptr;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Upload a decoded image to a new GL texture, on the GL thread
+///////////////////////////////////////////////////////////////////////////
+    void TextureCache::upload(TextureImage &image) {
+        m_uploads++;
+        GLenum format, internal_format;
+        if (image.components == 1) {
+            format = GL_RED;
+            internal_format = GL_R8;
+        } else if (image.components == 3) {
+            format = GL_RGB;
+            internal_format = GL_RGB;
+        } else {
+            format = GL_RGBA;
+            internal_format = GL_RGBA;
+        }
+        glGenTextures(1, &image.gl_id);
+        glBindTexture(GL_TEXTURE_2D, image.gl_id);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE,
+                     image.data);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+        if (cpuCopies() == DROP_CPU_COPIES) {
+            stbi_image_free(image.data);
+            image.data = nullptr;
+        }
+    }
+
+    void TextureCache::prefetch(const std::string &path, int components) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Entry &entry = m_entries[Key(path, components)];
+        if (!entry.image.expired() || entry.pending.valid()) {
+            return;
+        }
+        entry.pending = ThreadPool::shared().submit([this, path, components]() { return decode(path, components); });
+    }
+
+    bool TextureCache::isReady(const std::string &path, int components) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto entry = m_entries.find(Key(path, components));
+        if (entry == m_entries.end() || !entry->second.pending.valid()) {
+            return true;
+        }
+        return entry->second.pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    std::shared_ptr<TextureImage> TextureCache::get(const std::string &path, int components) {
+        std::shared_future<std::shared_ptr<TextureImage>> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Entry &entry = m_entries[Key(path, components)];
+            std::shared_ptr<TextureImage> image = entry.image.lock();
+            if (image) {
+                m_hits++;
+                return image;
+            }
+            pending = entry.pending;
+            entry.pending = std::shared_future<std::shared_ptr<TextureImage>>();
+        }
+
+        std::shared_ptr<TextureImage> image = pending.valid() ? pending.get() : decode(path, components);
+        if (!image) {
+            return nullptr;
+        }
+        upload(*image);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries[Key(path, components)].image = image;
+        return image;
+    }
+}
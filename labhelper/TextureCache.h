@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// Whether textures keep their decoded pixels on the CPU once they are
+// uploaded to GL. Only code that samples textures on the CPU (such as the
+// pathtracer) needs them.
+//////////////////////////////////////////////////////////////////////////////
+enum TextureCPUCopies
+{
+	KEEP_CPU_COPIES,
+	DROP_CPU_COPIES
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// One decoded and uploaded image, shared by every Texture that uses the
+// same file with the same number of components. The GL texture is deleted
+// when the last Texture lets go of it.
+//////////////////////////////////////////////////////////////////////////////
+struct TextureImage
+{
+	std::string path;
+	int components = 0;
+	int width = 0, height = 0;
+	// nullptr if the CPU copy was dropped
+	uint8_t* data = nullptr;
+	uint32_t gl_id = 0;
+	~TextureImage();
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Global cache of texture images, keyed by path and number of components.
+// Images are decoded on the shared ThreadPool, prefetch() starts a decode
+// early (e.g. while the model that uses it is still being parsed). get()
+// finishes the job on the calling thread, which must own the GL context.
+//
+// NOTE: Decodes use the global stb_image flip setting, which must not be
+//       changed while decodes are running.
+//////////////////////////////////////////////////////////////////////////////
+class TextureCache
+{
+public:
+	static TextureCache& instance();
+
+	void prefetch(const std::string& path, int components);
+	// Returns nullptr if the file can not be decoded
+	std::shared_ptr<TextureImage> get(const std::string& path, int components);
+	// False while a decode started by prefetch() is still running
+	bool isReady(const std::string& path, int components);
+
+	// The policy is applied when an image is uploaded, so it can not be
+	// changed once the first image is
+	void setCPUCopies(TextureCPUCopies policy);
+	TextureCPUCopies cpuCopies() const;
+
+	// Number of get() calls that found the image already uploaded, and
+	// number of images decoded
+	int hits() const
+	{
+		return m_hits;
+	}
+	int decodes() const
+	{
+		return m_decodes;
+	}
+
+private:
+	typedef std::pair<std::string, int> Key;
+	struct Entry
+	{
+		// The image once it is uploaded, as long as someone uses it
+		std::weak_ptr<TextureImage> image;
+		// A decode started by prefetch() that no one has asked for yet
+		std::shared_future<std::shared_ptr<TextureImage>> pending;
+	};
+	std::map<Key, Entry> m_entries;
+	mutable std::mutex m_mutex;
+	TextureCPUCopies m_cpu_copies = KEEP_CPU_COPIES;
+	int m_hits = 0;
+	std::atomic<int> m_decodes{ 0 };
+	std::atomic<int> m_uploads{ 0 };
+
+	std::shared_ptr<TextureImage> decode(const std::string& path, int components);
+	void upload(TextureImage& image);
+};
+} // namespace labhelper
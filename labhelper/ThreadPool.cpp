@@ -0,0 +1,46 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace labhelper {
+    ThreadPool::ThreadPool(int number_of_threads) {
+        if (number_of_threads <= 0) {
+            number_of_threads = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+        }
+        for (int i = 0; i < number_of_threads; i++) {
+            m_threads.emplace_back(&ThreadPool::work, this);
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_job_added.notify_all();
+        for (auto &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool &ThreadPool::shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    void ThreadPool::work() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_job_added.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+                // Jobs that are already queued are still run when stopping
+                if (m_jobs.empty()) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job();
+        }
+    }
+}
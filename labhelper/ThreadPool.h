@@ -0,0 +1,57 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+//////////////////////////////////////////////////////////////////////////////
+// A fixed set of worker threads that run jobs in the order they are
+// submitted. submit() returns a future for the result of the job.
+//////////////////////////////////////////////////////////////////////////////
+class ThreadPool
+{
+public:
+	// 0 threads means one per core, minus one for the calling thread
+	explicit ThreadPool(int number_of_threads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> submit(F job)
+	{
+		typedef typename std::result_of<F()>::type Result;
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::move(job));
+		std::future<Result> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back([task]() { (*task)(); });
+		}
+		m_job_added.notify_one();
+		return result;
+	}
+
+	int size() const
+	{
+		return int(m_threads.size());
+	}
+
+	// The pool shared by everything in labhelper
+	static ThreadPool& shared();
+
+private:
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_jobs;
+	std::mutex m_mutex;
+	std::condition_variable m_job_added;
+	bool m_stopping = false;
+
+	void work();
+};
+} // namespace labhelper
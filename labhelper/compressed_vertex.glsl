@@ -0,0 +1,27 @@
+///////////////////////////////////////////////////////////////////////////////
+// Decoding of compressed vertices (see labhelper::CompressedVertex), for
+// vertex shaders that draw models. Include it with
+//     #include "<path from the shader>/labhelper/compressed_vertex.glsl"
+// labhelper::render() sets the uniforms. Positions are quantized within
+// the bounds of the mesh and scaled back with positionOffset and
+// positionScale. Normals are octahedral encoded in xy. Without
+// compressedVertices both are passed through as they are.
+///////////////////////////////////////////////////////////////////////////////
+uniform bool compressedVertices = false;
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
+vec3 decodePosition(vec3 p)
+{
+	return compressedVertices ? positionOffset + positionScale * p : p;
+}
+
+vec3 decodeNormal(vec3 n)
+{
+	if(!compressedVertices)
+		return n;
+	n.z = 1.0 - abs(n.x) - abs(n.y);
+	if(n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
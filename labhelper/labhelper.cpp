@@ -18,6 +18,7 @@
 #include <stb_image_write.h>
 
 #include "labhelper.h"
+#include "StreamingBuffer.h"
 
 #include <cmath>
 #include <cstring>
@@ -31,6 +32,7 @@
 #include <string>
 #include <fstream>
 #include <streambuf>
+#include <unordered_map>
 #include <glm/gtx/transform.hpp>
 #include <glm/glm.hpp>
 #include <imgui.h>
@@ -484,25 +486,70 @@ std::string GetShaderInfoLog(GLuint obj)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Read a shader and splice in the files it names with #include "file"
+// (relative to the shader), so that shaders can share code. The line numbers
+// of the shader are kept with #line, for the error messages.
+///////////////////////////////////////////////////////////////////////////////
+static bool readShaderSource(const std::string& path, std::string& source, int depth = 0)
+{
+	std::ifstream file(path);
+	if(!file.good() || depth > 8)
+	{
+		return false;
+	}
+	size_t separator = path.find_last_of("\\/");
+	std::string directory = separator != std::string::npos ? path.substr(0, separator + 1) : "";
+	std::string line;
+	int number = 0;
+	while(std::getline(file, line))
+	{
+		number++;
+		size_t start = line.find_first_not_of(" \t");
+		if(start == std::string::npos || line.compare(start, 8, "#include") != 0)
+		{
+			source += line + "\n";
+			continue;
+		}
+		size_t open = line.find('"', start);
+		size_t close = open != std::string::npos ? line.find('"', open + 1) : std::string::npos;
+		std::string included = close != std::string::npos ? directory + line.substr(open + 1, close - open - 1) : "";
+		if(!readShaderSource(included, source, depth + 1))
+		{
+			fatal_error("Could not include " + included + " in " + path, "Shader");
+			return false;
+		}
+		source += "#line " + std::to_string(number + 1) + "\n";
+	}
+	return true;
+}
 
 GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fragmentShader, bool allow_errors)
 {
 	GLuint vShader = glCreateShader(GL_VERTEX_SHADER);
 	GLuint fShader = glCreateShader(GL_FRAGMENT_SHADER);
 
-	std::ifstream vs_file(vertexShader);
-	if (!vs_file.good()) {
-	    fatal_error("File not found: " + vertexShader, "Vertex shader");
-	    return 0;
+	std::string vs_src;
+	if(!std::ifstream(vertexShader).good())
+	{
+		fatal_error("File not found: " + vertexShader, "Vertex shader");
+		return 0;
+	}
+	if(!readShaderSource(vertexShader, vs_src))
+	{
+		return 0;
 	}
-	std::string vs_src((std::istreambuf_iterator<char>(vs_file)), std::istreambuf_iterator<char>());
 
-	std::ifstream fs_file(fragmentShader);
-    if (!fs_file.good()) {
-        fatal_error("File not found: " + fragmentShader, "Fragment shader");
-        return 0;
-    }
-	std::string fs_src((std::istreambuf_iterator<char>(fs_file)), std::istreambuf_iterator<char>());
+	std::string fs_src;
+	if(!std::ifstream(fragmentShader).good())
+	{
+		fatal_error("File not found: " + fragmentShader, "Fragment shader");
+		return 0;
+	}
+	if(!readShaderSource(fragmentShader, fs_src))
+	{
+		return 0;
+	}
 
 	const char* vs = vs_src.c_str();
 	const char* fs = fs_src.c_str();
@@ -561,6 +608,7 @@ GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fra
 
 bool linkShaderProgram(GLuint shaderProgram, bool allow_errors)
 {
+	forgetUniformLocations(shaderProgram);
 	glLinkProgram(shaderProgram);
 	GLint linkOk = 0;
 	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linkOk);
@@ -615,26 +663,99 @@ GLuint createAddAttribBuffer(GLuint vertexArrayObject,
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// The cached locations, per program and hash of the name. Names are compared
+// as C strings, so looking one up does not allocate.
+///////////////////////////////////////////////////////////////////////////////
+struct CachedLocation
+{
+	std::string name;
+	GLint location;
+};
+static std::unordered_map<uint64_t, std::vector<CachedLocation>> uniform_locations;
+static std::unordered_map<uint64_t, std::vector<CachedLocation>> uniform_block_indices;
+
+static uint64_t locationKey(GLuint shaderProgram, const char* name)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for(const char* c = name; *c != 0; c++)
+	{
+		hash = (hash ^ uint8_t(*c)) * 16777619u;
+	}
+	return (uint64_t(shaderProgram) << 32) | hash;
+}
+
+template<typename Query>
+static GLint cachedLocation(std::unordered_map<uint64_t, std::vector<CachedLocation>>& cache,
+                            GLuint shaderProgram, const char* name, Query query)
+{
+	std::vector<CachedLocation>& bucket = cache[locationKey(shaderProgram, name)];
+	for(const CachedLocation& cached : bucket)
+	{
+		if(strcmp(cached.name.c_str(), name) == 0)
+		{
+			return cached.location;
+		}
+	}
+	CachedLocation cached;
+	cached.name = name;
+	cached.location = query(shaderProgram, name);
+	bucket.push_back(cached);
+	return cached.location;
+}
+
+GLint getUniformLocation(GLuint shaderProgram, const char* name)
+{
+	return cachedLocation(uniform_locations, shaderProgram, name,
+	                      [](GLuint program, const char* n) { return glGetUniformLocation(program, n); });
+}
+
+GLuint getUniformBlockIndex(GLuint shaderProgram, const char* name)
+{
+	return GLuint(cachedLocation(uniform_block_indices, shaderProgram, name, [](GLuint program, const char* n) {
+		return GLint(glGetUniformBlockIndex(program, n));
+	}));
+}
+
+void forgetUniformLocations(GLuint shaderProgram)
+{
+	for(auto* cache : { &uniform_locations, &uniform_block_indices })
+	{
+		for(auto it = cache->begin(); it != cache->end();)
+		{
+			if(it->first >> 32 == shaderProgram)
+			{
+				it = cache->erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+}
+
 void setUniformSlow(GLuint shaderProgram, const char* name, const glm::mat4& matrix)
 {
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, name), 1, false, &matrix[0].x);
+	glUniformMatrix4fv(getUniformLocation(shaderProgram, name), 1, false, &matrix[0].x);
 }
 void setUniformSlow(GLuint shaderProgram, const char* name, const float value)
 {
-	glUniform1f(glGetUniformLocation(shaderProgram, name), value);
+	glUniform1f(getUniformLocation(shaderProgram, name), value);
 }
 void setUniformSlow(GLuint shaderProgram, const char* name, const GLint value)
 {
-	int loc = glGetUniformLocation(shaderProgram, name);
+	int loc = getUniformLocation(shaderProgram, name);
 	glUniform1i(loc, value);
 }
 void setUniformSlow(GLuint shaderProgram, const char* name, const glm::vec3& value)
 {
-	glUniform3fv(glGetUniformLocation(shaderProgram, name), 1, &value.x);
+	glUniform3fv(getUniformLocation(shaderProgram, name), 1, &value.x);
 }
 void setUniformSlow(GLuint shaderProgram, const char* name, const uint32_t nof_values, const glm::vec3* values)
 {
-	glUniform3fv(glGetUniformLocation(shaderProgram, name), nof_values, (float*)values);
+	glUniform3fv(getUniformLocation(shaderProgram, name), nof_values, (float*)values);
 }
 
 void debugDrawLine(const glm::mat4& viewMatrix,
@@ -643,16 +764,24 @@ void debugDrawLine(const glm::mat4& viewMatrix,
 {
 	static GLuint vertexArrayObject = 0;
 	static int nofVertices = 2;
+	// The line follows the light, so its vertices are streamed every call
+	static StreamingBuffer vertices;
 	// do this initialization first time the function is called...
 	if(vertexArrayObject == 0)
 	{
 		glGenVertexArrays(1, &vertexArrayObject);
-		static const glm::vec3 positions[] = { { worldSpaceLightPos.x, worldSpaceLightPos.y,
-			                                     worldSpaceLightPos.z },
-			                                   { 0.0f, 0.0f, 0.0f } };
-		labhelper::createAddAttribBuffer(vertexArrayObject, positions, sizeof(positions), 0, 3, GL_FLOAT);
+		glBindVertexArray(vertexArrayObject);
+		glEnableVertexAttribArray(0);
 	}
+	glm::vec3* positions = (glm::vec3*)vertices.map(GL_ARRAY_BUFFER, nofVertices * sizeof(glm::vec3));
+	if(positions == nullptr)
+		return;
+	positions[0] = worldSpaceLightPos;
+	positions[1] = glm::vec3(0.0f);
+	size_t offset = vertices.unmap();
 	glBindVertexArray(vertexArrayObject);
+	glBindBuffer(GL_ARRAY_BUFFER, vertices.buffer());
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, (const void*)offset);
 	glDrawArrays(GL_LINES, 0, nofVertices);
 }
 
@@ -128,9 +128,18 @@ GLuint createAddAttribBuffer(GLuint vertexArrayObject,
 
 
 /**
-	 * Helper to set uniform variables in shaders, labeled SLOW because they find the location from string each time.
-	 * In OpenGL (and similarly in other APIs) it is much more efficient (in terms of CPU time) to keep the uniform
-	 * location, and use that. Or even better, use uniform buffers!
+	 * Cached glGetUniformLocation() and glGetUniformBlockIndex(). The location of each name is asked from GL
+	 * once per program, and forgotten when the program is linked again with linkShaderProgram(). Programs
+	 * linked some other way should call forgetUniformLocations() after linking. Only use from the GL thread.
+	 */
+GLint getUniformLocation(GLuint shaderProgram, const char* name);
+GLuint getUniformBlockIndex(GLuint shaderProgram, const char* name);
+void forgetUniformLocations(GLuint shaderProgram);
+
+/**
+	 * Helper to set uniform variables in shaders, labeled SLOW because they find the location from a string each
+	 * time, although through the cache of getUniformLocation(). It is still more efficient (in terms of CPU time)
+	 * to keep the uniform location, and use that. Or even better, use uniform buffers!
 	 * However, in the simple tutorial samples, performance is not an issue.
 	 * Overloaded to set many types.
 	 */
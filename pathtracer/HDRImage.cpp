@@ -1,4 +1,5 @@
 #include "HDRImage.h"
+#include <algorithm>
 #include <iostream>
 
 using namespace std;
@@ -6,14 +7,20 @@ using namespace glm;
 
 void HDRImage::load(const string& filename)
 {
-	stbi_set_flip_vertically_on_load(false);
 	data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
-	stbi_set_flip_vertically_on_load(true);
 	if(data == NULL)
 	{
 		std::cout << "Failed to load image: " << filename << ".\n";
 		exit(1);
 	}
+	// stb_image flips images on load (see init_window_SDL), but not
+	// environment maps. The flip setting is global and model textures may
+	// be decoded at the same time, so flip them back here instead.
+	for(int y = 0; y < height / 2; y++)
+	{
+		float* row = data + size_t(y) * width * 3;
+		std::swap_ranges(row, row + width * 3, data + size_t(height - 1 - y) * width * 3);
+	}
 };
 
 vec3 HDRImage::sample(float u, float v)
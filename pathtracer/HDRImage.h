@@ -1,6 +1,7 @@
 #pragma once
 #include <stb_image.h>
 #include <string>
+#include <utility>
 #include <glm/glm.hpp>
 
 ///////////////////////////////////////////////////////////////////////////
@@ -8,7 +9,7 @@
 ///////////////////////////////////////////////////////////////////////////
 struct HDRImage
 {
-	int width, height, components;
+	int width = 0, height = 0, components = 0;
 	float* data = nullptr;
 	HDRImage(){};
 	~HDRImage()
@@ -16,6 +17,19 @@ struct HDRImage
 		if(data != nullptr)
 			stbi_image_free(data);
 	};
+	// Images can be moved (e.g. out of a future), but not copied
+	HDRImage(HDRImage&& other)
+	{
+		*this = std::move(other);
+	}
+	HDRImage& operator=(HDRImage&& other)
+	{
+		std::swap(width, other.width);
+		std::swap(height, other.height);
+		std::swap(components, other.components);
+		std::swap(data, other.data);
+		return *this;
+	}
 	void load(const std::string& filename);
 	glm::vec3 sample(float u, float v);
 };
\ No newline at end of file
@@ -3,12 +3,16 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <chrono>
 #include <glm/ext.hpp>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
 #include "light.h"
 #include "aux.h"
+#include "stats.h"
+#include "shading.h"
+#include "wavefront.h"
 
 using namespace std;
 using namespace glm;
@@ -28,6 +32,9 @@ namespace pathtracer {
     void restart() {
         // No need to clear image,
         rendered_image.number_of_samples = 0;
+        rendered_image.next_row = 0;
+        rendered_image.dirty.assign(1, {0, 0, rendered_image.width, rendered_image.height});
+        resetTotalStats();
     }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -46,7 +53,8 @@ namespace pathtracer {
 // map.
 ///////////////////////////////////////////////////////////////////////////
     vec3 Lenvironment(const vec3 &wi) {
-        if (!settings.environment_light) return vec3(0.f);
+        // The map may still be loading
+        if (!settings.environment_light || environment.map.data == nullptr) return vec3(0.f);
 
         const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
         float phi = atan(wi.z, wi.x);
@@ -60,9 +68,158 @@ namespace pathtracer {
         if (!light.checkIntersection(ray)) {
             return false;
         }
+        STATS_COUNT(shadow_rays);
         return !occluded(ray);
     }
 
+///////////////////////////////////////////////////////////////////////////
+// Evaluate the textures of a material at a hit
+///////////////////////////////////////////////////////////////////////////
+    MaterialParams evaluateMaterial(const labhelper::Material &material, const vec2 &texture_coords) {
+        MaterialParams p;
+        p.color = vec4(material.m_color, 1.f - material.m_transparency);
+        if (material.m_color_texture.valid) {
+            if (settings.use_bilinear_interp)
+                p.color = material.m_color_texture.bilinearf4(texture_coords.x, texture_coords.y);
+            else
+                p.color = material.m_color_texture.colorf4(texture_coords.x, texture_coords.y);
+        }
+        p.metalness = material.m_metalness;
+        if (material.m_metalness_texture.valid) {
+            if (settings.use_bilinear_interp)
+                p.metalness = material.m_metalness_texture.bilinearf(texture_coords.x, texture_coords.y);
+            else
+                p.metalness = material.m_metalness_texture.colorf(texture_coords.x, texture_coords.y);
+        }
+        p.fresnel = material.m_fresnel;
+        if (material.m_fresnel_texture.valid) {
+            if (settings.use_bilinear_interp)
+                p.fresnel = material.m_fresnel_texture.bilinearf(texture_coords.x, texture_coords.y);
+            else
+                p.fresnel = material.m_fresnel_texture.colorf(texture_coords.x, texture_coords.y);
+        }
+        p.roughness = fclamp(material.m_roughness, 0.001f, 1.f);
+        if (material.m_roughness_texture.valid) {
+            if (settings.use_bilinear_interp)
+                p.roughness = material.m_roughness_texture.bilinearf(texture_coords.x, texture_coords.y);
+            else
+                p.roughness = material.m_roughness_texture.colorf(texture_coords.x, texture_coords.y);
+        }
+        p.reflectivity = material.m_reflectivity;
+        if (material.m_reflectivity_texture.valid) {
+            if (settings.use_bilinear_interp)
+                p.reflectivity = material.m_reflectivity_texture.bilinearf(texture_coords.x, texture_coords.y);
+            else
+                p.reflectivity = material.m_reflectivity_texture.colorf(texture_coords.x, texture_coords.y);
+        }
+        p.emission = material.m_emission;
+        if (material.m_emission_texture.valid) {
+            p.emission = material.m_emission_texture.colorf(texture_coords.x, texture_coords.y);
+        }
+        return p;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Light arriving at a hit from the light sources
+///////////////////////////////////////////////////////////////////////////
+    vec3 lightSampleContribution(const Intersection &hit, Light &light, const vec3 &wi, float lightPdf,
+                                 const vec3 &li, const vec3 &f, float scatteringPdf, Stopwatch &stopwatch) {
+        if (!any(greaterThan(f, glm::vec3(EPSILON)))) {
+            return vec3(0.0f);
+        }
+        Ray shadowRay;
+        shadowRay.o = hit.position + hit.geometry_normal * EPSILON;
+        shadowRay.d = wi;
+        stopwatch.lap(&RenderStats::light_seconds);
+        STATS_COUNT(shadow_rays);
+        bool is_occluded = occluded(shadowRay);
+        stopwatch.lap(&RenderStats::intersect_seconds);
+        if (is_occluded) {
+            return vec3(0.0f);
+        }
+        if (light.isDelta()) {
+            return f * li / lightPdf;
+        }
+        float weight = lightPdf * lightPdf / (lightPdf * lightPdf + scatteringPdf * scatteringPdf);
+        vec3 L = f * li * weight / lightPdf;
+        LOG_NAN(L)
+        return L;
+    }
+
+    vec3 bsdfSampleContribution(const Intersection &hit, BSDF &mat, Light &light) {
+        vec3 wi;
+        float scatteringPdf;
+        vec3 f = mat.sample_wi(wi, hit.wo, hit.shading_normal, scatteringPdf);
+        f *= abs(dot(wi, hit.shading_normal));
+        if (scatteringPdf > 0 && any(greaterThan(abs(f), glm::vec3(EPSILON)))) {
+            float weight = 1;
+                    // scatteringPdf * scatteringPdf / (lightPdf * lightPdf + scatteringPdf * scatteringPdf);
+            Ray ray(hit.position, wi);
+            bool lightIntersected = checkRayLightIntersection(ray, light);
+            vec3 li = glm::vec3(0);
+            if (lightIntersected) {
+                li = light.color * light.intensity; // Light emitted (?)
+            }
+            if (any(greaterThan(abs(li), glm::vec3(EPSILON)))) {
+                return f * li * weight / scatteringPdf;
+            }
+        }
+        return vec3(0.0f);
+    }
+
+    vec3 directIllumination(const Intersection &hit, BSDF &mat, Stopwatch &stopwatch) {
+        vec3 L = vec3(0.0f);
+        for (auto *light: lights) {
+            // Sample light source with multiple importance sampling
+            vec3 wi;
+            float lightPdf;
+            vec3 li = light->sample_li(hit.position + hit.geometry_normal * EPSILON, &wi, &lightPdf);
+            if (lightPdf > 0 && any(greaterThan(abs(li), glm::vec3(EPSILON)))) {
+                vec3 f = mat.f(wi, hit.wo, hit.shading_normal) * abs(dot(wi, hit.shading_normal));
+                float scatteringPdf = mat.pdf(wi, hit.wo, hit.shading_normal);
+                L += lightSampleContribution(hit, *light, wi, lightPdf, li, f, scatteringPdf, stopwatch);
+            }
+            // Sample BSDF with multiple importance sampling
+            if (!light->isDelta()) {
+                L += bsdfSampleContribution(hit, mat, *light);
+            }
+        }
+        stopwatch.lap(&RenderStats::light_seconds);
+        return L;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Sample the next direction of a path
+///////////////////////////////////////////////////////////////////////////
+    bool scatter(const Intersection &hit, BSDF &mat, vec3 &path_throughput, Ray &next_ray) {
+        // Sample incoming direction
+        vec3 wi;
+        float pdf;
+        vec3 brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
+
+        // return before division by pdf so we can safely return pdf as 0 from the sample function
+        // when there is some error which cuts light
+        if (pdf <= 0.f || all(lessThan(abs(brdf), vec3(FLT_EPSILON)))) {
+            STATS_COUNT(terminated_zero_pdf);
+            return false;
+        }
+
+        float cosine_term = abs(dot(wi, hit.shading_normal));
+        path_throughput *= (brdf * cosine_term) / pdf;
+        if (glm::any(glm::isnan(path_throughput))) {
+            STATS_COUNT(terminated_nan);
+            return false;
+        }
+
+        if (all(lessThan(abs(path_throughput), vec3(FLT_EPSILON)))) {
+            STATS_COUNT(terminated_zero_throughput);
+            return false;
+        }
+
+        next_ray = Ray(hit.position + sign(dot(hit.geometry_normal, wi)) * hit.geometry_normal * EPSILON, wi);
+        return true;
+    }
+
 ///////////////////////////////////////////////////////////////////////////
 // Calculate the radiance going from one point (r.hitPosition()) in one
 // direction (-r.d), through path tracing.
@@ -71,145 +228,49 @@ namespace pathtracer {
         vec3 L = vec3(0.0f);
         vec3 path_throughput = vec3(1.0);
         Ray current_ray = primary_ray;
+        Stopwatch stopwatch;
+        STATS_COUNT(paths);
         for (int bounces = 0; bounces <= settings.max_bounces; bounces++) {
+            STATS_COUNT(path_vertices);
             ///////////////////////////////////////////////////////////////////
             // Get the intersection information from the ray
             ///////////////////////////////////////////////////////////////////
             Intersection hit = getIntersection(current_ray);
+            stopwatch.lap(&RenderStats::intersect_seconds);
             ///////////////////////////////////////////////////////////////////
             // Create a Material tree for evaluating brdfs and calculating
             // sample directions.
             ///////////////////////////////////////////////////////////////////
-            vec4 color = vec4(hit.material->m_color, 1.f - hit.material->m_transparency);
-            if (hit.material->m_color_texture.valid) {
-                if (settings.use_bilinear_interp)
-                    color = hit.material->m_color_texture.bilinearf4(hit.texture_coords.x, hit.texture_coords.y);
-                else
-                    color = hit.material->m_color_texture.colorf4(hit.texture_coords.x, hit.texture_coords.y);
-            }
-            float metalness = hit.material->m_metalness;
-            if (hit.material->m_metalness_texture.valid) {
-                if (settings.use_bilinear_interp)
-                    metalness = hit.material->m_metalness_texture.bilinearf(hit.texture_coords.x, hit.texture_coords.y);
-                else
-                    metalness = hit.material->m_metalness_texture.colorf(hit.texture_coords.x, hit.texture_coords.y);
-            }
-            float fresnel = hit.material->m_fresnel;
-            if (hit.material->m_fresnel_texture.valid) {
-                if (settings.use_bilinear_interp)
-                    fresnel = hit.material->m_fresnel_texture.bilinearf(hit.texture_coords.x, hit.texture_coords.y);
-                else
-                    fresnel = hit.material->m_fresnel_texture.colorf(hit.texture_coords.x, hit.texture_coords.y);
-            }
-            float roughness = fclamp(hit.material->m_roughness, 0.001f, 1.f);
-            if (hit.material->m_roughness_texture.valid) {
-                if (settings.use_bilinear_interp)
-                    roughness = hit.material->m_roughness_texture.bilinearf(hit.texture_coords.x, hit.texture_coords.y);
-                else
-                    roughness = hit.material->m_roughness_texture.colorf(hit.texture_coords.x, hit.texture_coords.y);
-            }
-            float reflectivity = hit.material->m_reflectivity;
-            if (hit.material->m_reflectivity_texture.valid) {
-                if (settings.use_bilinear_interp)
-                    reflectivity = hit.material->m_reflectivity_texture.bilinearf(hit.texture_coords.x,
-                            hit.texture_coords.y);
-                else
-                    reflectivity = hit.material->m_reflectivity_texture.colorf(hit.texture_coords.x,
-                            hit.texture_coords.y);
-            }
-
-            Diffuse diffuse(color);
-//            BSDF &mat = diffuse;
-            BlinnPhong dielectric(roughness, fresnel, &diffuse);
-            BTDF transparency(1.3f, roughness, fresnel, color);
-//            BSDF &mat = transparency;
-            BlinnPhongMetal metal(color, roughness, fresnel);
-            LinearBlend metal_blend(metalness, &metal, &dielectric);
-            LinearBlend reflectivity_blend(reflectivity, &metal_blend, &diffuse);
-//            BSDF &mat = reflectivity_blend;
-            LinearBlend transparency_blend(color.a, &reflectivity_blend, &transparency);
-            BSDF &mat = transparency_blend;
+            MaterialParams params = evaluateMaterial(*hit.material, hit.texture_coords);
+            MaterialBSDF material(params);
+            BSDF &mat = material.bsdf();
+            stopwatch.lap(&RenderStats::shading_seconds);
 
             ///////////////////////////////////////////////////////////////////
             // Calculate Direct Illumination from lights.
             ///////////////////////////////////////////////////////////////////
-            for (auto *light: lights) {
-                // Sample light source with multiple importance sampling
-                Ray shadowRay;
-                shadowRay.o = hit.position + hit.geometry_normal * EPSILON;
-                vec3 wi;
-                float lightPdf, scatteringPdf;
-                vec3 li = light->sample_li(shadowRay.o, &wi, &lightPdf);
-                shadowRay.d = wi;
-                if (lightPdf > 0 && any(greaterThan(abs(li), glm::vec3(EPSILON)))) {
-                    vec3 f = mat.f(shadowRay.d, hit.wo, hit.shading_normal) * abs(dot(wi, hit.shading_normal));
-                    scatteringPdf = mat.pdf(shadowRay.d, hit.wo, hit.shading_normal);
-                    if (any(greaterThan(f, glm::vec3(EPSILON))) && !occluded(shadowRay)) {
-                        if (light->isDelta()) {
-                            L += f * li / lightPdf;
-                        } else {
-                            float weight = lightPdf * lightPdf / (lightPdf * lightPdf + scatteringPdf * scatteringPdf);
-                            L += f * li * weight / lightPdf;
-                            LOG_NAN(L)
-                        }
-                    }
-                }
-                // Sample BSDF with multiple importance sampling
-                if (!light->isDelta()) {
-                    vec3 f = mat.sample_wi(wi, hit.wo, hit.shading_normal, scatteringPdf);
-                    f *= abs(dot(wi, hit.shading_normal));
-                    if (scatteringPdf > 0 && any(greaterThan(abs(f), glm::vec3(EPSILON)))) {
-                        float weight = 1;
-                                // scatteringPdf * scatteringPdf / (lightPdf * lightPdf + scatteringPdf * scatteringPdf);
-                        Ray ray(hit.position, wi);
-                        bool lightIntersected = checkRayLightIntersection(ray, *light);
-                        li = glm::vec3(0);
-                        if (lightIntersected) {
-                            li = light->color * light->intensity; // Light emitted (?)
-                        }
-                        if (any(greaterThan(abs(li), glm::vec3(EPSILON)))) {
-                            L += f * li * weight / scatteringPdf;
-                        }
-                    }
-                }
-            }
+            L += directIllumination(hit, mat, stopwatch);
 
             // Emission
-            float emission = hit.material->m_emission;
-            if (hit.material->m_emission_texture.valid) {
-                emission = hit.material->m_emission_texture.colorf(hit.texture_coords.x, hit.texture_coords.y);
-            }
-            L += path_throughput * emission * hit.material->m_color;
-
-            // Sample incoming direction
-            vec3 wi;
-            float pdf;
-            vec3 brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
-
-            // return L before division by pdf so we can safely return pdf as 0 from the sample function
-            // when there is some error which cuts light
-            if (pdf <= 0.f || all(lessThan(abs(brdf), vec3(FLT_EPSILON))))
-                return L;
+            L += path_throughput * params.emission * hit.material->m_color;
 
-            float cosine_term = abs(dot(wi, hit.shading_normal));
-            path_throughput *= (brdf * cosine_term) / pdf;
-            if (glm::any(glm::isnan(path_throughput))) {
-                printf("NAN:%d pt=%s brdf=%s cos=%f pdf=%f\n",
-                        __LINE__, glm::to_string(path_throughput).c_str(), glm::to_string(brdf).c_str(), cosine_term, pdf);
+            bool alive = scatter(hit, mat, path_throughput, current_ray);
+            stopwatch.lap(&RenderStats::shading_seconds);
+            if (!alive) {
                 return L;
             }
 
-            if (all(lessThan(abs(path_throughput), vec3(FLT_EPSILON))))
-                return L;
-
-            current_ray = Ray(hit.position + sign(dot(hit.geometry_normal, wi)) * hit.geometry_normal * EPSILON, wi);
-
-            if (!intersect(current_ray)) {
-                L += path_throughput * Lenvironment(wi);
+            STATS_COUNT(bounce_rays);
+            bool intersected = intersect(current_ray);
+            stopwatch.lap(&RenderStats::intersect_seconds);
+            if (!intersected) {
+                STATS_COUNT(terminated_escaped);
+                L += path_throughput * Lenvironment(current_ray.d);
                 LOG_NAN(L)
                 return L;
             }
         }
+        STATS_COUNT(terminated_max_bounces);
         return L;
     }
 
@@ -220,11 +281,76 @@ namespace pathtracer {
         return glm::vec3(p * (1.f / p.w));
     }
 
+///////////////////////////////////////////////////////////////////////////
+// Create the camera ray through a pixel and intersect it with the scene
+///////////////////////////////////////////////////////////////////////////
+    bool generatePrimaryRay(int x, int y, int width, int height,
+                            const vec3 &camera_pos, const mat4 &inverse_PV, Ray &primaryRay) {
+        primaryRay = Ray();
+        primaryRay.o = camera_pos;
+        // Create a ray that starts in the camera position and points toward
+        // the current pixel on a virtual screen.
+        vec2 screenCoord = vec2(float(x + randf()) / float(width),
+                float(y + randf()) / float(height));
+        // Calculate direction
+        vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
+        vec3 p = homogenize(inverse_PV * viewCoord);
+        primaryRay.d = normalize(p - camera_pos);
+
+        // Check in focus
+        bool in_focus = false;
+        STATS_COUNT(primary_rays);
+        bool intersected = intersect(primaryRay);
+        if (intersected) {
+            Intersection hit = getIntersection(primaryRay);
+            if (length2((hit.position - primaryRay.o)) < settings.focal_distance * settings.focal_distance)
+                in_focus = true;
+        }
+        // Perform focus blur
+        if (!in_focus) {
+            auto focalPoint = primaryRay.o + primaryRay.d * settings.focal_distance;
+            viewCoord += vec4(randf() - 0.5f, randf() - 0.5f, 0.f, 0.f) * settings.aperture;
+            if (length2(p - camera_pos) > length2(focalPoint - camera_pos)) {
+                printf("ERROR: Screen further than focal point!\n");
+            }
+            p = homogenize(inverse_PV * viewCoord);
+            vec3 new_d = normalize(focalPoint - p);
+            primaryRay = Ray(p, new_d);
+            STATS_COUNT(primary_rays);
+            intersected = intersect(primaryRay);
+        }
+        return intersected;
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Trace a single path through pixel (x, y) of an image of the given size
+///////////////////////////////////////////////////////////////////////////
+    static vec3 tracePixel(int x, int y, int width, int height,
+                           const vec3 &camera_pos, const mat4 &inverse_PV) {
+        vec3 color;
+        Ray primaryRay;
+        // Intersect ray with scene
+        if (generatePrimaryRay(x, y, width, height, camera_pos, inverse_PV, primaryRay)) {
+            color = Li(primaryRay);
+        } else {
+            // Otherwise evaluate environment
+            color = Lenvironment(primaryRay.d);
+        }
+        if (any(isnan(color))) {
+            STATS_COUNT(nan_count);
+//            color = vec3(1.f, 0.f, 1.f);
+        }
+        return color;
+    }
+
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "openmp-use-default-none"
 
 ///////////////////////////////////////////////////////////////////////////
-// Trace one path per pixel and accumulate the result in an image
+// Trace one path per pixel and accumulate the result in an image. The
+// pass is traced in bands of rows, from Image::next_row on, until it is
+// done or settings.pass_time_budget is used up, and the rows that were
+// traced are marked dirty.
 ///////////////////////////////////////////////////////////////////////////
     void tracePaths(const glm::mat4 &V, const glm::mat4 &P) {
         // Stop here if we have as many samples as we want
@@ -232,67 +358,93 @@ namespace pathtracer {
             && (settings.max_paths_per_pixel != 0)) {
             return;
         }
+        auto start = std::chrono::steady_clock::now();
         vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-        // Trace one path per pixel (the omp parallel stuf magically distributes the
-        // pathtracing on all cores of your CPU).
-        int num_rays = 0;
-        vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
+        mat4 inverse_PV = inverse(P * V);
+        // A few rows per thread, so that the threads stay balanced, or one
+        // row of wavefront tiles
+        const int band_rows = settings.wavefront ? wavefront::TILE_SIZE : 4 * omp_get_max_threads();
+        const int first_row = std::min(rendered_image.next_row, rendered_image.height);
+        int row = first_row;
+        beginStatsPass();
+        static std::vector<vec3> wavefront_result;
+        do {
+            Tile band = {0, row, rendered_image.width, std::min(row + band_rows, rendered_image.height)};
+            if (settings.wavefront) {
+                wavefront::tracePass(rendered_image.width, rendered_image.height, band, camera_pos, inverse_PV,
+                                     wavefront_result);
+            }
+            // Trace one path per pixel (the omp parallel stuf magically distributes the
+            // pathtracing on all cores of your CPU).
 #pragma omp parallel for
-        for (int y = 0; y < rendered_image.height; y++) {
-            for (int x = 0; x < rendered_image.width; x++) {
-                vec3 color;
-                Ray primaryRay;
-                primaryRay.o = camera_pos;
-                // Create a ray that starts in the camera position and points toward
-                // the current pixel on a virtual screen.
-                vec2 screenCoord = vec2(float(x + randf()) / float(rendered_image.width),
-                        float(y + randf()) / float(rendered_image.height));
-                // Calculate direction
-                vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-                vec3 p = homogenize(inverse(P * V) * viewCoord);
-                primaryRay.d = normalize(p - camera_pos);
-
-                // Check in focus
-                bool in_focus = false;
-                bool intersected = intersect(primaryRay);
-                if (intersected) {
-                    Intersection hit = getIntersection(primaryRay);
-                    if (length2((hit.position - primaryRay.o)) < settings.focal_distance * settings.focal_distance)
-                        in_focus = true;
+            for (int y = band.y0; y < band.y1; y++) {
+                for (int x = 0; x < rendered_image.width; x++) {
+                    vec3 color = settings.wavefront
+                                 ? wavefront_result[(y - band.y0) * rendered_image.width + x]
+                                 : tracePixel(x, y, rendered_image.width, rendered_image.height, camera_pos,
+                                              inverse_PV);
+                    // Accumulate the obtained radiance to the pixels color
+                    float n = float(rendered_image.number_of_samples);
+                    rendered_image.data[y * rendered_image.width + x] =
+                            rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
+                            + (1.0f / (n + 1.0f)) * color;
                 }
-                // Perform focus blur
-                if (!in_focus) {
-                    auto focalPoint = primaryRay.o + primaryRay.d * settings.focal_distance;
-                    viewCoord += vec4(randf() - 0.5f, randf() - 0.5f, 0.f, 0.f) * settings.aperture;
-                    if (length2(p - camera_pos) > length2(focalPoint - camera_pos)) {
-                        printf("ERROR: Screen further than focal point!\n");
-                    }
-                    p = homogenize(inverse(P * V) * viewCoord);
-                    vec3 new_d = normalize(focalPoint - p);
-                    primaryRay = Ray(p, new_d);
-                    intersected = intersect(primaryRay);
-                }
-                // Intersect ray with scene
-                if (intersected) {
-                    Intersection hit = getIntersection(primaryRay);
-                    color = Li(primaryRay);
-                } else {
-                    // Otherwise evaluate environment
-                    color = Lenvironment(primaryRay.d);
+            }
+            row = band.y1;
+        } while (row < rendered_image.height
+                 && (settings.pass_time_budget <= 0.0f
+                     || std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count()
+                        < settings.pass_time_budget));
+        // Grow the last dirty band if it reaches these rows, so the list
+        // stays short when nobody displays the image
+        std::vector<Tile> &dirty = rendered_image.dirty;
+        if (!dirty.empty() && dirty.back().x0 == 0 && dirty.back().x1 == rendered_image.width
+            && dirty.back().y0 <= first_row && dirty.back().y1 >= first_row) {
+            dirty.back().y1 = std::max(dirty.back().y1, row);
+        } else if (row > first_row) {
+            dirty.push_back({0, first_row, rendered_image.width, row});
+        }
+        if (row >= rendered_image.height) {
+            rendered_image.number_of_samples += 1;
+            row = 0;
+        }
+        rendered_image.next_row = row;
+        endStatsPass();
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Trace `samples` paths per pixel of a tile and store their mean radiance
+// in `result` (row-major, tile sized). The rendered image is not touched.
+///////////////////////////////////////////////////////////////////////////
+    void traceTile(const glm::mat4 &V, const glm::mat4 &P, int width, int height,
+                   const Tile &tile, int samples, std::vector<glm::vec3> &result) {
+        vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        mat4 inverse_PV = inverse(P * V);
+        int tile_width = tile.x1 - tile.x0;
+        int tile_height = tile.y1 - tile.y0;
+        result.assign(tile_width * tile_height, vec3(0.0f));
+        if (samples <= 0) return;
+
+        if (settings.wavefront) {
+            static std::vector<vec3> pass;
+            for (int s = 0; s < samples; s++) {
+                wavefront::tracePass(width, height, tile, camera_pos, inverse_PV, pass);
+                for (size_t i = 0; i < result.size(); i++) {
+                    result[i] += pass[i] / float(samples);
                 }
-                if (any(isnan(color))) {
-                    printf("Error: NAN!\n");
-//                    color = vec3(1.f, 0.f, 1.f);
+            }
+            return;
+        }
+#pragma omp parallel for
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                vec3 sum(0.0f);
+                for (int s = 0; s < samples; s++) {
+                    sum += tracePixel(x, y, width, height, camera_pos, inverse_PV);
                 }
-                // Accumulate the obtained radiance to the pixels color
-                float n = float(rendered_image.number_of_samples);
-                rendered_image.data[y * rendered_image.width + x] =
-                        rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-                        + (1.0f / (n + 1.0f)) * color;
+                result[(y - tile.y0) * tile_width + (x - tile.x0)] = sum / float(samples);
             }
         }
-        rendered_image.number_of_samples += 1;
     }
 
 #pragma clang diagnostic pop
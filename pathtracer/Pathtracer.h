@@ -29,6 +29,11 @@ extern struct Settings
 	float aperture;
 	bool environment_light;
 	bool use_bilinear_interp;
+	// Trace with the wavefront renderer (see wavefront.h) instead of Li()
+	bool wavefront;
+	// Seconds tracePaths() may spend per call. Longer passes are finished
+	// over several calls. 0 traces a whole pass per call.
+	float pass_time_budget;
 } settings;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -40,13 +45,26 @@ extern struct Environment
 	HDRImage map;
 } environment;
 
+///////////////////////////////////////////////////////////////////////////
+// A rectangular region [x0, x1) x [y0, y1) of the rendered image
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
 ///////////////////////////////////////////////////////////////////////////
 // The rendered image
 ///////////////////////////////////////////////////////////////////////////
 extern struct Image
 {
 	int width, height, number_of_samples = 0;
+	// The first row of the current pass that is not traced yet, see
+	// tracePaths()
+	int next_row = 0;
 	std::vector<glm::vec3> data;
+	// Regions changed since the image was last displayed
+	std::vector<Tile> dirty;
 	float* getPtr()
 	{
 		return &data[0].x;
@@ -71,4 +89,13 @@ void resize(int w, int h);
 // Trace one path per pixel
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Trace `samples` paths per pixel of a tile of a width x height image and
+// return the mean radiance of each pixel in `result`. Used by the
+// distributed renderer, does not modify rendered_image. The statistics go
+// to the current stats pass, which the caller begins and ends.
+///////////////////////////////////////////////////////////////////////////
+void traceTile(const mat4& V, const mat4& P, int width, int height, const Tile& tile, int samples,
+               std::vector<glm::vec3>& result);
 }; // namespace pathtracer
@@ -0,0 +1,441 @@
+#include <GL/glew.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <labhelper.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include <HeightGrid.h>
+#include <ObjLoader.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "material.h"
+#include "sampling.h"
+#include "scene.h"
+#include "stats.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Microbenchmarks for the hot kernels of the pathtracer. Every benchmark is
+// written as one JSON object per line (to stdout, or appended to the file
+// given with --out), so results can be collected and compared across
+// commits.
+//
+// Command line:
+//   --out FILE          append the results to FILE instead of stdout
+//   --filter TEXT       only run benchmarks whose name contains TEXT
+//   --min-time SECONDS  minimum time of each of the repetitions (0.2)
+//   --repetitions N     number of repetitions, the median is reported (5)
+//   --label TEXT        added to every result, e.g. a commit hash
+///////////////////////////////////////////////////////////////////////////////
+struct BenchOptions {
+    string filter;
+    double min_time = 0.2;
+    int repetitions = 5;
+    string label;
+    ostream *out = &cout;
+} options;
+
+// Results are added to this so the compiler can not remove the kernels
+volatile float sink = 0.f;
+
+// Fixed inputs, so that every run (and every commit) measures the same work
+const int NUM_INPUTS = 4096;
+const uint32_t SEED = 1234;
+
+///////////////////////////////////////////////////////////////////////////////
+// Run `kernel(i)` with increasing iteration counts until one batch takes at
+// least min_time, then report the median time per call over the repetitions.
+///////////////////////////////////////////////////////////////////////////////
+void bench(const string &name, const function<void(int)> &kernel) {
+    if (!options.filter.empty() && name.find(options.filter) == string::npos) return;
+
+    pathtracer::seedRandom(SEED);
+    int64_t iterations = 1;
+    vector<double> ns_per_op;
+    while (int(ns_per_op.size()) < options.repetitions) {
+        auto start = chrono::steady_clock::now();
+        for (int64_t i = 0; i < iterations; i++) {
+            kernel(int(i % NUM_INPUTS));
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (elapsed.count() < options.min_time && ns_per_op.empty()) {
+            // Still calibrating
+            iterations *= elapsed.count() > 0.01 ? int64_t(options.min_time / elapsed.count()) + 1 : 10;
+            continue;
+        }
+        ns_per_op.push_back(elapsed.count() * 1e9 / double(iterations));
+    }
+    sort(ns_per_op.begin(), ns_per_op.end());
+    double median = ns_per_op[ns_per_op.size() / 2];
+
+    *options.out << "{\"name\": \"" << name << "\""
+                 << ", \"label\": \"" << options.label << "\""
+                 << ", \"iterations\": " << iterations
+                 << ", \"ns_per_op\": " << median
+                 << ", \"min_ns_per_op\": " << ns_per_op.front()
+                 << ", \"max_ns_per_op\": " << ns_per_op.back()
+                 << ", \"ops_per_second\": " << (median > 0.0 ? 1e9 / median : 0.0) << "}" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Random unit vectors in the hemisphere around n
+///////////////////////////////////////////////////////////////////////////////
+vector<vec3> randomDirections(const vec3 &n) {
+    vector<vec3> dirs(NUM_INPUTS);
+    for (auto &d : dirs) {
+        d = normalize(pathtracer::uniformSampleSphere());
+        if (dot(d, n) < 0.f) d = -d;
+    }
+    return dirs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sampling
+///////////////////////////////////////////////////////////////////////////////
+void benchSampling() {
+    bench("sampling/randf", [](int) { sink += pathtracer::randf(); });
+    bench("sampling/concentricSampleDisk", [](int) {
+        float dx, dy;
+        pathtracer::concentricSampleDisk(&dx, &dy);
+        sink += dx + dy;
+    });
+    bench("sampling/cosineSampleHemisphere", [](int) { sink += pathtracer::cosineSampleHemisphere().z; });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BSDFs. The materials are built the same way Li() builds them.
+///////////////////////////////////////////////////////////////////////////////
+void benchBSDF(const string &name, pathtracer::BSDF &bsdf) {
+    const vec3 n(0.f, 0.f, 1.f);
+    pathtracer::seedRandom(SEED);
+    vector<vec3> wis = randomDirections(n);
+    vector<vec3> wos = randomDirections(n);
+    bench("bsdf/" + name + "/f", [&](int i) { sink += bsdf.f(wis[i], wos[i], n).x; });
+    bench("bsdf/" + name + "/sample_wi", [&](int i) {
+        vec3 wi;
+        float p;
+        sink += bsdf.sample_wi(wi, wos[i], n, p).x + p;
+    });
+    bench("bsdf/" + name + "/pdf", [&](int i) { sink += bsdf.pdf(wis[i], wos[i], n); });
+}
+
+void benchBSDFs() {
+    const vec3 color(0.8f, 0.5f, 0.3f);
+    const float roughness = 0.3f, fresnel = 0.04f;
+    pathtracer::Diffuse diffuse(color);
+    pathtracer::BTDF transparency(1.5f, roughness, fresnel, color);
+    pathtracer::BlinnPhong dielectric(roughness, fresnel, &diffuse);
+    pathtracer::BlinnPhongMetal metal(color, roughness, fresnel);
+    pathtracer::LinearBlend metal_blend(0.5f, &metal, &dielectric);
+    pathtracer::LinearBlend reflectivity_blend(0.5f, &metal_blend, &diffuse);
+    pathtracer::LinearBlend transparency_blend(0.9f, &reflectivity_blend, &transparency);
+
+    benchBSDF("Diffuse", diffuse);
+    benchBSDF("BTDF", transparency);
+    benchBSDF("BlinnPhong", dielectric);
+    benchBSDF("BlinnPhongMetal", metal);
+    benchBSDF("LinearBlend", transparency_blend);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Lights, sampled and intersected from points around the scene
+///////////////////////////////////////////////////////////////////////////////
+static const char *lightName(const pathtracer::Light *light) {
+    if (dynamic_cast<const pathtracer::PointLight *>(light)) {
+        return "PointLight";
+    }
+    if (dynamic_cast<const pathtracer::CircleLight *>(light)) {
+        return "CircleLight";
+    }
+    if (dynamic_cast<const pathtracer::ParallelogramLight *>(light)) {
+        return "ParallelogramLight";
+    }
+    if (dynamic_cast<const pathtracer::SphereLight *>(light)) {
+        return "SphereLight";
+    }
+    return "Light";
+}
+
+void benchLights() {
+    pathtracer::seedRandom(SEED);
+    vector<vec3> refs(NUM_INPUTS);
+    vector<pathtracer::Ray> rays(NUM_INPUTS);
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        refs[i] = vec3(pathtracer::randf() * 60.f - 30.f, pathtracer::randf() * 30.f, pathtracer::randf() * 60.f - 30.f);
+    }
+
+    pathtracer::PointLight point(vec3(1.f), 2500.f, vec3(10.f, 40.f, 10.f));
+    vector<pathtracer::Light *> lights = {&point};
+    lights.insert(lights.end(), pathtracer::lights.begin(), pathtracer::lights.end());
+    for (size_t l = 0; l < lights.size(); l++) {
+        const pathtracer::Light *light = lights[l];
+        string name = "light/" + string(lightName(light));
+        // Aim half of the rays at the light so both outcomes are measured
+        for (int i = 0; i < NUM_INPUTS; i++) {
+            vec3 wi;
+            float pdf;
+            light->sample_li(refs[i], &wi, &pdf);
+            rays[i] = pathtracer::Ray(refs[i], i % 2 == 0 ? wi : normalize(pathtracer::uniformSampleSphere()));
+        }
+        bench(name + "/sample_li", [&](int i) {
+            vec3 wi;
+            float pdf;
+            sink += light->sample_li(refs[i], &wi, &pdf).x + pdf;
+        });
+        bench(name + "/checkIntersection", [&](int i) {
+            pathtracer::Ray ray = rays[i];
+            sink += light->checkIntersection(ray) ? 1.f : 0.f;
+        });
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture and environment lookups
+///////////////////////////////////////////////////////////////////////////////
+void benchTextures(const vector<labhelper::Model *> &models) {
+    pathtracer::seedRandom(SEED);
+    vector<vec2> uvs(NUM_INPUTS);
+    for (auto &uv : uvs) {
+        uv = vec2(pathtracer::randf(), pathtracer::randf());
+    }
+
+    const labhelper::Texture *texture = nullptr;
+    for (auto *model : models) {
+        for (auto &material : model->m_materials) {
+            if (material.m_color_texture.valid && texture == nullptr) {
+                texture = &material.m_color_texture;
+            }
+        }
+    }
+    if (texture != nullptr) {
+        bench("texture/bilinearf4", [&](int i) { sink += texture->bilinearf4(uvs[i].x, uvs[i].y).x; });
+    } else {
+        cerr << "No textured material in the scene, skipping texture/bilinearf4.\n";
+    }
+
+    if (pathtracer::environment.map.data != nullptr) {
+        bench("environment/sample", [&](int i) { sink += pathtracer::environment.map.sample(uvs[i].x, uvs[i].y).x; });
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ray queries against the scene, with the primary rays of the default camera
+///////////////////////////////////////////////////////////////////////////////
+void benchIntersection(const vec3 &camera_position, const mat4 &V, const mat4 &P) {
+    pathtracer::seedRandom(SEED);
+    mat4 inverse_PV = inverse(P * V);
+    vector<pathtracer::Ray> rays(NUM_INPUTS);
+    vector<pathtracer::Ray> hits;
+    for (auto &ray : rays) {
+        vec4 p = inverse_PV * vec4(pathtracer::randf() * 2.f - 1.f, pathtracer::randf() * 2.f - 1.f, 1.f, 1.f);
+        ray = pathtracer::Ray(camera_position, normalize(vec3(p) / p.w - camera_position));
+        pathtracer::Ray hit = ray;
+        if (pathtracer::intersect(hit)) hits.push_back(hit);
+    }
+
+    bench("scene/intersect", [&](int i) {
+        pathtracer::Ray ray = rays[i];
+        sink += pathtracer::intersect(ray) ? ray.tfar : 0.f;
+    });
+    bench("scene/occluded", [&](int i) {
+        pathtracer::Ray ray = rays[i];
+        sink += pathtracer::occluded(ray) ? 1.f : 0.f;
+    });
+    if (!hits.empty()) {
+        bench("scene/getIntersection", [&](int i) {
+            sink += pathtracer::getIntersection(hits[i % hits.size()]).position.x;
+        });
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rays through the min-max pyramid of a 2048x2048 height field, placed like
+// the terrain of the project, from a camera above it looking to the horizon
+///////////////////////////////////////////////////////////////////////////////
+void benchHeightField() {
+    const int size = 2048;
+    vector<float> heights(size_t(size) * size);
+    for (int j = 0; j < size; j++) {
+        for (int i = 0; i < size; i++) {
+            heights[size_t(j) * size + i] = 0.5f + 0.3f * sin(i * 0.01f) * cos(j * 0.013f)
+                                            + 0.05f * sin(i * 0.21f + j * 0.17f);
+        }
+    }
+    labhelper::HeightGrid grid(heights.data(), size, size, vec3(-20000.f, -300.f, -20000.f),
+                               vec3(40000.f, 1000.f, 40000.f));
+    pathtracer::seedRandom(SEED);
+    vector<vec3> directions(NUM_INPUTS);
+    for (auto &direction : directions) {
+        direction = normalize(vec3(pathtracer::randf() * 2.f - 1.f, -0.05f - 0.5f * pathtracer::randf(),
+                                   pathtracer::randf() * 2.f - 1.f));
+    }
+    const vec3 origin(0.f, 600.f, 0.f);
+    bench("heightfield/intersect", [&](int i) {
+        float tfar = FLT_MAX;
+        vec3 normal;
+        sink += grid.intersect(origin, directions[i], 0.f, tfar, normal) ? tfar : 0.f;
+    });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Whole passes of the pathtracer. Reported per pass, plus the number of rays
+// per second from the statistics.
+///////////////////////////////////////////////////////////////////////////////
+void benchTracePaths(const mat4 &V, const mat4 &P, bool wavefront) {
+    const int sizes[][2] = {{160, 90}, {640, 360}};
+    pathtracer::settings.wavefront = wavefront;
+    float pass_time_budget = pathtracer::settings.pass_time_budget;
+    pathtracer::settings.pass_time_budget = 0.0f;
+    for (auto &size : sizes) {
+        pathtracer::resize(size[0], size[1]);
+        string name = string(wavefront ? "tracePaths/wavefront/" : "tracePaths/") + to_string(size[0]) + "x"
+                      + to_string(size[1]);
+        bench(name, [&](int) { pathtracer::tracePaths(V, P); });
+        if (options.filter.empty() || name.find(options.filter) != string::npos) {
+            const pathtracer::RenderStats &stats = pathtracer::total_stats;
+            *options.out << "{\"name\": \"" << name << "/rays\""
+                         << ", \"label\": \"" << options.label << "\""
+                         << ", \"rays_per_pass\": " << stats.rays() / std::max(1, pathtracer::rendered_image.number_of_samples)
+                         << ", \"average_path_length\": " << stats.averagePathLength() << "}" << endl;
+        }
+    }
+    pathtracer::settings.wavefront = false;
+    pathtracer::settings.pass_time_budget = pass_time_budget;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parsing the bundled OBJ files, with tinyobj and with the parallel loader.
+// Also checks that both give the same result.
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+bool sameBits(const vector<T> &a, const vector<T> &b) {
+    return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+void benchLoadOBJ() {
+    const char *scenes[] = {"city", "NewShip", "landingpad2", "landing_pad_2", "wheatley", "BigSphere", "sphere"};
+    for (const char *scene : scenes) {
+        string directory = "../../scenes/";
+        string path = directory + scene + ".obj";
+        tinyobj::attrib_t attrib[2];
+        vector<tinyobj::shape_t> shapes[2];
+        vector<tinyobj::material_t> materials[2];
+        string err;
+        auto load = [&](int k) {
+            materials[k].clear();
+            err.clear();
+            if (k == 0) {
+                tinyobj::LoadObj(&attrib[k], &shapes[k], &materials[k], &err, path.c_str(), directory.c_str(), true);
+            } else {
+                labhelper::loadOBJ(&attrib[k], &shapes[k], &materials[k], &err, path, directory);
+            }
+            sink += float(attrib[k].vertices.size());
+        };
+        bench(string("obj_load/tinyobj/") + scene, [&](int) { load(0); });
+        bench(string("obj_load/parallel/") + scene, [&](int) { load(1); });
+
+        string name = string("obj_load/") + scene + "/identical";
+        if (options.filter.empty() || name.find(options.filter) != string::npos) {
+            load(0);
+            load(1);
+            bool identical = sameBits(attrib[0].vertices, attrib[1].vertices)
+                             && sameBits(attrib[0].normals, attrib[1].normals)
+                             && sameBits(attrib[0].texcoords, attrib[1].texcoords)
+                             && shapes[0].size() == shapes[1].size() && materials[0].size() == materials[1].size();
+            for (size_t i = 0; identical && i < shapes[0].size(); i++) {
+                const tinyobj::shape_t &a = shapes[0][i], &b = shapes[1][i];
+                identical = a.name == b.name && sameBits(a.mesh.indices, b.mesh.indices)
+                            && sameBits(a.mesh.num_face_vertices, b.mesh.num_face_vertices)
+                            && sameBits(a.mesh.material_ids, b.mesh.material_ids);
+            }
+            *options.out << "{\"name\": \"" << name << "\""
+                         << ", \"label\": \"" << options.label << "\""
+                         << ", \"identical\": " << (identical ? "true" : "false") << "}" << endl;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The scene of the pathtracer (see scene.h)
+///////////////////////////////////////////////////////////////////////////////
+void loadScene(vector<labhelper::Model *> &models) {
+    pathtracer::SceneDescription scene = pathtracer::setupScene();
+    pathtracer::settings.subsampling = 1;
+
+    pathtracer::environment.map.load(scene.environment_map);
+    pathtracer::environment.multiplier = scene.environment_multiplier;
+
+    for (const auto &model: scene.models) {
+        models.push_back(labhelper::loadModelFromOBJ(model.first));
+        pathtracer::addModel(models.back(), model.second);
+    }
+    pathtracer::buildBVH();
+}
+
+int main(int argc, char *argv[]) {
+    ofstream out_file;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc) {
+            out_file.open(argv[++i], ios::app);
+            if (!out_file.is_open()) {
+                cerr << "Could not open " << argv[i] << " for writing.\n";
+                return 1;
+            }
+            options.out = &out_file;
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = atof(argv[++i]);
+        } else if (arg == "--repetitions" && i + 1 < argc) {
+            options.repetitions = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--label" && i + 1 < argc) {
+            options.label = argv[++i];
+        } else {
+            cerr << "Unknown argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    // Models are uploaded to the GPU when loaded, so we need a (hidden) window
+    SDL_Window *window = labhelper::init_window_SDL("Pathtracer benchmarks", 64, 64);
+    SDL_HideWindow(window);
+
+    vector<labhelper::Model *> models;
+    loadScene(models);
+
+    vec3 camera_position(-30.0f, 10.0f, 30.0f);
+    mat4 V = lookAt(camera_position, vec3(0.0f, 10.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+    mat4 P = perspective(radians(45.0f), 16.f / 9.f, 0.1f, 100.0f);
+
+    benchLoadOBJ();
+    benchSampling();
+    benchBSDFs();
+    benchLights();
+    benchTextures(models);
+    benchIntersection(camera_position, V, P);
+    benchHeightField();
+    benchTracePaths(V, P, false);
+    benchTracePaths(V, P, true);
+
+    for (auto *model : models) {
+        labhelper::freeModel(model);
+    }
+    for (auto *light : pathtracer::lights) {
+        delete light;
+    }
+    pathtracer::lights.clear();
+    labhelper::shutDown(window);
+    return 0;
+}
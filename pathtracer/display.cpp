@@ -0,0 +1,181 @@
+#include "display.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+DisplaySettings display_settings;
+const char* tonemap_names[NUM_TONEMAPS] = { "Linear", "Reinhard", "Filmic", "ACES" };
+
+// Entries of the 8 bit lookup table, enough that neighbouring entries never
+// skip an output value
+const int LUT_SIZE = 4096;
+
+///////////////////////////////////////////////////////////////////////////
+// Tonemapping operators, from linear radiance to [0, 1]
+///////////////////////////////////////////////////////////////////////////
+static inline float hable(float x)
+{
+	// Uncharted 2 filmic curve by John Hable
+	const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+	return ((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F;
+}
+static const float FILMIC_WHITE_SCALE = 1.0f / hable(11.2f);
+
+template<int op>
+static inline float tonemap(float x)
+{
+	switch(op)
+	{
+	case TONEMAP_REINHARD: return x / (1.0f + x);
+	case TONEMAP_FILMIC: return hable(x) * FILMIC_WHITE_SCALE;
+	case TONEMAP_ACES:
+		// Fit of the ACES filmic curve by Krzysztof Narkowicz
+		return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+	default: return x;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Convert the rows of one tile. The operator is a template argument so
+// the inner loop has no branches.
+///////////////////////////////////////////////////////////////////////////
+template<int op>
+static void convertTile(const Image& image, const Tile& tile, float scale, const uint8_t* lut, uint8_t* rgba)
+{
+#pragma omp parallel for
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		const vec3* src = &image.data[y * image.width + tile.x0];
+		uint8_t* dst = rgba + (size_t(y) * image.width + tile.x0) * 4;
+		for(int x = tile.x0; x < tile.x1; x++, src++, dst += 4)
+		{
+			for(int c = 0; c < 3; c++)
+			{
+				float v = tonemap<op>((*src)[c] * scale);
+				// Also catches NaN
+				v = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+				dst[c] = lut[int(v * float(LUT_SIZE - 1) + 0.5f)];
+			}
+			dst[3] = 255;
+		}
+	}
+}
+
+void Display::convert(const Image& image, const Tile& tile, uint8_t* rgba) const
+{
+	float scale = exp2(converted_settings.exposure);
+	switch(converted_settings.tonemap)
+	{
+	case TONEMAP_REINHARD: convertTile<TONEMAP_REINHARD>(image, tile, scale, lut.data(), rgba); break;
+	case TONEMAP_FILMIC: convertTile<TONEMAP_FILMIC>(image, tile, scale, lut.data(), rgba); break;
+	case TONEMAP_ACES: convertTile<TONEMAP_ACES>(image, tile, scale, lut.data(), rgba); break;
+	default: convertTile<TONEMAP_LINEAR>(image, tile, scale, lut.data(), rgba); break;
+	}
+}
+
+void Display::update(Image& image)
+{
+	glActiveTexture(GL_TEXTURE0);
+	if(texture_id == 0)
+	{
+		glGenTextures(1, &texture_id);
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	}
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+	if(image.width <= 0 || image.height <= 0)
+		return;
+
+	///////////////////////////////////////////////////////////////////////
+	// Everything is dirty if the size or the settings changed
+	///////////////////////////////////////////////////////////////////////
+	bool everything = false;
+	if(image.width != width || image.height != height)
+	{
+		width = image.width;
+		height = image.height;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		everything = true;
+	}
+	if(lut.empty() || display_settings.srgb != converted_settings.srgb)
+	{
+		lut.resize(LUT_SIZE);
+		for(int i = 0; i < LUT_SIZE; i++)
+		{
+			float v = float(i) / float(LUT_SIZE - 1);
+			if(display_settings.srgb)
+				v = v <= 0.0031308f ? 12.92f * v : 1.055f * pow(v, 1.0f / 2.4f) - 0.055f;
+			lut[i] = uint8_t(v * 255.0f + 0.5f);
+		}
+		everything = true;
+	}
+	if(display_settings.exposure != converted_settings.exposure
+	   || display_settings.tonemap != converted_settings.tonemap)
+	{
+		everything = true;
+	}
+	converted_settings = display_settings;
+	if(everything)
+		image.dirty.assign(1, { 0, 0, width, height });
+	if(image.dirty.empty())
+		return;
+
+	auto start = chrono::steady_clock::now();
+
+	///////////////////////////////////////////////////////////////////////
+	// Convert straight into the streaming buffer, so we never wait for the
+	// previous upload to finish
+	///////////////////////////////////////////////////////////////////////
+	size_t size = size_t(width) * size_t(height) * 4;
+	uint8_t* rgba = (uint8_t*)pixels.map(GL_PIXEL_UNPACK_BUFFER, size);
+	if(rgba == nullptr)
+	{
+		cout << "Display: could not map the pixel buffer.\n";
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
+	for(const Tile& tile : image.dirty)
+	{
+		convert(image, tile, rgba);
+	}
+	size_t base = pixels.unmap();
+
+	///////////////////////////////////////////////////////////////////////
+	// Upload the dirty tiles from the buffer
+	///////////////////////////////////////////////////////////////////////
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	for(const Tile& tile : image.dirty)
+	{
+		size_t offset = base + (size_t(tile.y0) * width + tile.x0) * 4;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0, GL_RGBA,
+		                GL_UNSIGNED_BYTE, (const void*)offset);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	image.dirty.clear();
+
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	last_update_seconds = elapsed.count();
+}
+
+void Display::destroy()
+{
+	if(texture_id != 0)
+	{
+		glDeleteTextures(1, &texture_id);
+		pixels.destroy();
+	}
+	texture_id = 0;
+	width = height = 0;
+}
+} // namespace pathtracer
@@ -0,0 +1,70 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstdint>
+#include <vector>
+#include <StreamingBuffer.h>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+enum Tonemap
+{
+	TONEMAP_LINEAR = 0,
+	TONEMAP_REINHARD,
+	TONEMAP_FILMIC,
+	TONEMAP_ACES,
+	NUM_TONEMAPS
+};
+extern const char* tonemap_names[NUM_TONEMAPS];
+
+extern struct DisplaySettings
+{
+	// In stops, the image is multiplied by 2^exposure
+	float exposure = 0.0f;
+	int tonemap = TONEMAP_LINEAR;
+	// Encode the 8 bit output as sRGB (otherwise it is just clamped)
+	bool srgb = true;
+} display_settings;
+
+///////////////////////////////////////////////////////////////////////////
+// Turns the rendered image into an RGBA8 texture for display. The image
+// is tonemapped and quantized on the CPU, then streamed to the texture
+// through a labhelper::StreamingBuffer. Only the dirty tiles of the image
+// are converted and uploaded, and the texture is only reallocated when the
+// image changes size.
+///////////////////////////////////////////////////////////////////////////
+class Display
+{
+public:
+	///////////////////////////////////////////////////////////////////////
+	// Upload the dirty tiles of `image` (and clear its dirty list). The
+	// texture is left bound to texture unit 0.
+	///////////////////////////////////////////////////////////////////////
+	void update(Image& image);
+	///////////////////////////////////////////////////////////////////////
+	// Free the GL objects, must be called while the context is alive
+	///////////////////////////////////////////////////////////////////////
+	void destroy();
+
+	GLuint texture() const
+	{
+		return texture_id;
+	}
+	// Time spent in the last update() with something to upload
+	double lastUpdateSeconds() const
+	{
+		return last_update_seconds;
+	}
+
+private:
+	GLuint texture_id = 0;
+	labhelper::StreamingBuffer pixels;
+	int width = 0, height = 0;
+	DisplaySettings converted_settings;
+	// Linear [0, 1] to 8 bit, for the current srgb setting
+	std::vector<uint8_t> lut;
+	double last_update_seconds = 0.0;
+
+	void convert(const Image& image, const Tile& tile, uint8_t* rgba) const;
+};
+} // namespace pathtracer
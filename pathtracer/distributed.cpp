@@ -0,0 +1,394 @@
+#include "distributed.h"
+#include "sampling.h"
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+namespace distributed
+{
+#ifndef _WIN32
+///////////////////////////////////////////////////////////////////////////
+// Read/write exactly `size` bytes, false if the other end is gone
+///////////////////////////////////////////////////////////////////////////
+static bool readAll(int fd, void* data, size_t size)
+{
+	uint8_t* ptr = (uint8_t*)data;
+	while(size > 0)
+	{
+		ssize_t n = read(fd, ptr, size);
+		if(n <= 0)
+			return false;
+		ptr += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+	const uint8_t* ptr = (const uint8_t*)data;
+	while(size > 0)
+	{
+		ssize_t n = write(fd, ptr, size);
+		if(n <= 0)
+			return false;
+		ptr += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Accumulate the mean of `samples` new paths into the rendered image
+///////////////////////////////////////////////////////////////////////////
+static void mergeTile(const Tile& tile, int samples, const vector<vec3>& means)
+{
+	float n = float(rendered_image.number_of_samples);
+	float s = float(samples);
+	int tile_width = tile.x1 - tile.x0;
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			vec3& pixel = rendered_image.data[y * rendered_image.width + x];
+			pixel = pixel * (n / (n + s)) + means[(y - tile.y0) * tile_width + (x - tile.x0)] * (s / (n + s));
+		}
+	}
+	rendered_image.dirty.push_back(tile);
+}
+
+void runWorker(int in_fd, int out_fd)
+{
+	Job job;
+	vector<vec3> means;
+	while(readAll(in_fd, &job, sizeof(Job)))
+	{
+		if(job.magic != JOB_MAGIC)
+		{
+			cerr << "Worker: bad job header, stopping.\n";
+			return;
+		}
+		settings.max_bounces = job.max_bounces;
+		settings.focal_distance = job.focal_distance;
+		settings.aperture = job.aperture;
+		settings.environment_light = job.environment_light != 0;
+		settings.use_bilinear_interp = job.use_bilinear_interp != 0;
+		settings.wavefront = job.wavefront != 0;
+		environment.multiplier = job.environment_multiplier;
+		stats_settings.enabled = job.collect_stats != 0;
+		stats_settings.timers = job.collect_timers != 0;
+		seedRandom(job.seed);
+
+		auto start = chrono::steady_clock::now();
+		beginStatsPass();
+		traceTile(job.V, job.P, job.width, job.height, job.tile, job.samples, means);
+		endStatsPass();
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+		Result result;
+		result.id = job.id;
+		result.tile = job.tile;
+		result.samples = job.samples;
+		result.stats = stats_settings.enabled ? last_pass_stats : RenderStats();
+		result.seconds = elapsed.count();
+		if(!writeAll(out_fd, &result, sizeof(Result))
+		   || !writeAll(out_fd, means.data(), means.size() * sizeof(vec3)))
+		{
+			return;
+		}
+	}
+}
+
+Coordinator::~Coordinator()
+{
+	stop();
+}
+
+int Coordinator::start(const vector<string>& worker_commands)
+{
+	// A dead worker must show up as a failed write, not kill us
+	signal(SIGPIPE, SIG_IGN);
+	for(const string& command : worker_commands)
+	{
+		int to_worker[2], from_worker[2];
+		if(pipe(to_worker) != 0 || pipe(from_worker) != 0)
+		{
+			cerr << "Coordinator: could not create pipes.\n";
+			break;
+		}
+		int pid = fork();
+		if(pid == 0)
+		{
+			dup2(to_worker[0], 0);
+			dup2(from_worker[1], 1);
+			close(to_worker[0]);
+			close(to_worker[1]);
+			close(from_worker[0]);
+			close(from_worker[1]);
+			execl("/bin/sh", "sh", "-c", command.c_str(), (char*)nullptr);
+			_exit(127);
+		}
+		close(to_worker[0]);
+		close(from_worker[1]);
+		// Our ends must not leak into workers started later, or a worker
+		// would never see its stdin closed
+		fcntl(to_worker[1], F_SETFD, FD_CLOEXEC);
+		fcntl(from_worker[0], F_SETFD, FD_CLOEXEC);
+		if(pid < 0)
+		{
+			close(to_worker[1]);
+			close(from_worker[0]);
+			cerr << "Coordinator: could not start worker: " << command << "\n";
+			continue;
+		}
+		Worker worker;
+		worker.pid = pid;
+		worker.to_fd = to_worker[1];
+		worker.from_fd = from_worker[0];
+		worker.alive = true;
+		workers.push_back(worker);
+		cout << "Started worker " << pid << ": " << command << "\n";
+	}
+	return aliveWorkers();
+}
+
+void Coordinator::stop()
+{
+	std::deque<Tile> ignored;
+	for(auto& worker : workers)
+	{
+		if(worker.alive)
+		{
+			worker.busy = false;
+			kill(worker, ignored);
+		}
+	}
+	workers.clear();
+}
+
+int Coordinator::aliveWorkers() const
+{
+	int alive = 0;
+	for(auto& worker : workers)
+	{
+		if(worker.alive)
+			alive++;
+	}
+	return alive;
+}
+
+void Coordinator::kill(Worker& worker, std::deque<Tile>& pending)
+{
+	// Closing stdin makes a healthy worker exit its loop
+	close(worker.to_fd);
+	close(worker.from_fd);
+	waitpid(worker.pid, nullptr, 0);
+	worker.alive = false;
+	if(worker.busy)
+	{
+		pending.push_front(worker.job.tile);
+		worker.busy = false;
+		lost_workers++;
+		cerr << "Coordinator: lost worker " << worker.pid << ", reassigning its tile.\n";
+	}
+}
+
+void Coordinator::tracePaths(const mat4& V, const mat4& P)
+{
+	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
+	   && (settings.max_paths_per_pixel != 0))
+	{
+		return;
+	}
+	// A pass that was started locally is finished locally
+	if(aliveWorkers() == 0 || rendered_image.next_row != 0)
+	{
+		pathtracer::tracePaths(V, P);
+		return;
+	}
+
+	std::deque<Tile> pending;
+	for(int y = 0; y < rendered_image.height; y += tile_size)
+	{
+		for(int x = 0; x < rendered_image.width; x += tile_size)
+		{
+			pending.push_back({ x, y, std::min(x + tile_size, rendered_image.width),
+			                    std::min(y + tile_size, rendered_image.height) });
+		}
+	}
+	pass++;
+
+	// One stats pass for all the tiles: the ones traced here count in
+	// this process, the workers send theirs with each result
+	auto start = chrono::steady_clock::now();
+	beginStatsPass();
+	RenderStats remote_stats;
+	int in_flight = 0;
+	vector<vec3> means;
+	while(!pending.empty() || in_flight > 0)
+	{
+		///////////////////////////////////////////////////////////////////
+		// Hand out tiles to idle workers
+		///////////////////////////////////////////////////////////////////
+		for(auto& worker : workers)
+		{
+			if(!worker.alive || worker.busy || pending.empty())
+				continue;
+			Job& job = worker.job;
+			job = Job();
+			job.id = next_job_id++;
+			job.seed = pass * 7919u + job.id;
+			job.width = rendered_image.width;
+			job.height = rendered_image.height;
+			job.tile = pending.front();
+			job.samples = samples_per_pass;
+			job.max_bounces = settings.max_bounces;
+			job.focal_distance = settings.focal_distance;
+			job.aperture = settings.aperture;
+			job.environment_light = settings.environment_light;
+			job.use_bilinear_interp = settings.use_bilinear_interp;
+			job.wavefront = settings.wavefront;
+			job.environment_multiplier = environment.multiplier;
+			job.collect_stats = stats_settings.enabled;
+			job.collect_timers = stats_settings.timers;
+			job.V = V;
+			job.P = P;
+			pending.pop_front();
+			worker.busy = true;
+			worker.job_start = chrono::steady_clock::now();
+			in_flight++;
+			if(!writeAll(worker.to_fd, &job, sizeof(Job)))
+			{
+				in_flight--;
+				kill(worker, pending);
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Nobody left to do the work, trace the rest ourselves
+		///////////////////////////////////////////////////////////////////
+		if(in_flight == 0 && aliveWorkers() == 0)
+		{
+			while(!pending.empty())
+			{
+				Tile tile = pending.front();
+				pending.pop_front();
+				traceTile(V, P, rendered_image.width, rendered_image.height, tile, samples_per_pass, means);
+				mergeTile(tile, samples_per_pass, means);
+			}
+			break;
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Wait for results, but no longer than until the first job times
+		// out
+		///////////////////////////////////////////////////////////////////
+		vector<pollfd> fds;
+		vector<Worker*> polled;
+		auto timeout = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(job_timeout));
+		auto deadline = chrono::steady_clock::time_point::max();
+		for(auto& worker : workers)
+		{
+			if(worker.alive && worker.busy)
+			{
+				fds.push_back({ worker.from_fd, POLLIN, 0 });
+				polled.push_back(&worker);
+				deadline = std::min(deadline, worker.job_start + timeout);
+			}
+		}
+		int64_t wait_ms = 0;
+		if(!polled.empty())
+		{
+			wait_ms = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+		}
+		if(poll(fds.data(), fds.size(), int(std::max<int64_t>(0, wait_ms)) + 1) < 0)
+			continue;
+		auto now = chrono::steady_clock::now();
+		for(size_t i = 0; i < fds.size(); i++)
+		{
+			Worker& worker = *polled[i];
+			if(fds[i].revents == 0)
+			{
+				if(now - worker.job_start > timeout)
+				{
+					cerr << "Coordinator: worker " << worker.pid << " took more than " << job_timeout
+					     << " s on a tile.\n";
+					::kill(worker.pid, SIGKILL);
+					in_flight--;
+					kill(worker, pending);
+				}
+				continue;
+			}
+			Result result;
+			bool ok = readAll(worker.from_fd, &result, sizeof(Result)) && result.magic == RESULT_MAGIC
+			          && result.id == worker.job.id;
+			if(ok)
+			{
+				means.resize((result.tile.x1 - result.tile.x0) * (result.tile.y1 - result.tile.y0));
+				ok = readAll(worker.from_fd, means.data(), means.size() * sizeof(vec3));
+			}
+			in_flight--;
+			if(!ok)
+			{
+				kill(worker, pending);
+				continue;
+			}
+			worker.busy = false;
+			mergeTile(result.tile, result.samples, means);
+			remote_stats += result.stats;
+		}
+	}
+	rendered_image.number_of_samples += samples_per_pass;
+	endStatsPass(remote_stats);
+
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	rays_per_second = stats_settings.enabled && elapsed.count() > 0.0
+	                      ? double(last_pass_stats.rays()) / elapsed.count()
+	                      : 0.0;
+}
+
+#else // _WIN32
+
+void runWorker(int in_fd, int out_fd)
+{
+	cerr << "Distributed rendering is not supported on Windows.\n";
+}
+
+Coordinator::~Coordinator() {}
+
+int Coordinator::start(const vector<string>& worker_commands)
+{
+	cerr << "Distributed rendering is not supported on Windows, rendering locally.\n";
+	return 0;
+}
+
+void Coordinator::stop() {}
+
+int Coordinator::aliveWorkers() const
+{
+	return 0;
+}
+
+void Coordinator::kill(Worker& worker, std::deque<Tile>& pending) {}
+
+void Coordinator::tracePaths(const mat4& V, const mat4& P)
+{
+	pathtracer::tracePaths(V, P);
+}
+#endif // _WIN32
+} // namespace distributed
+} // namespace pathtracer
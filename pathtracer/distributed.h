@@ -0,0 +1,120 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include "Pathtracer.h"
+#include "stats.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Distributed rendering. A coordinator splits each pass into tiles and
+// hands them out to worker processes, which are copies of the pathtracer
+// started with --worker. Workers read jobs from stdin and write results to
+// stdout, so a worker command may also be something like
+// "ssh otherhost /path/to/pathtracer --worker".
+///////////////////////////////////////////////////////////////////////////
+namespace distributed
+{
+const uint32_t JOB_MAGIC = 0x4a425054;    // "TPBJ"
+const uint32_t RESULT_MAGIC = 0x53525054; // "TPRS"
+
+// Everything a worker needs to trace a tile. Sent as raw bytes, so both
+// ends must be the same build.
+struct Job
+{
+	uint32_t magic = JOB_MAGIC;
+	uint32_t id;
+	uint32_t seed;
+	int32_t width, height;
+	Tile tile;
+	int32_t samples;
+	// Settings which can be changed from the gui of the coordinator
+	int32_t max_bounces;
+	float focal_distance;
+	float aperture;
+	int32_t environment_light;
+	int32_t use_bilinear_interp;
+	int32_t wavefront;
+	float environment_multiplier;
+	int32_t collect_stats;
+	int32_t collect_timers;
+	glm::mat4 V, P;
+};
+
+// Header of a result, followed by (x1-x0)*(y1-y0) vec3 pixel means
+struct Result
+{
+	uint32_t magic = RESULT_MAGIC;
+	uint32_t id;
+	Tile tile;
+	int32_t samples;
+	// The counters of the tile, zero if the job did not collect them
+	RenderStats stats;
+	double seconds;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Serve jobs from in_fd until it is closed
+///////////////////////////////////////////////////////////////////////////
+void runWorker(int in_fd, int out_fd);
+
+class Coordinator
+{
+public:
+	int tile_size = 64;
+	int samples_per_pass = 1;
+	// Seconds a worker may spend on one tile. A worker that takes longer
+	// is killed, and its tile given to another worker (or traced here).
+	float job_timeout = 30.0f;
+
+	~Coordinator();
+
+	///////////////////////////////////////////////////////////////////////
+	// Start one worker per command. Returns the number of workers running.
+	///////////////////////////////////////////////////////////////////////
+	int start(const std::vector<std::string>& worker_commands);
+	void stop();
+
+	///////////////////////////////////////////////////////////////////////
+	// Same as pathtracer::tracePaths, but the pass is traced by the
+	// workers. Tiles of workers that die or time out are given to the
+	// others; if every worker is gone the pass is traced locally.
+	///////////////////////////////////////////////////////////////////////
+	void tracePaths(const glm::mat4& V, const glm::mat4& P);
+
+	int aliveWorkers() const;
+	// Rays (primary, bounce and shadow) per second over the last pass,
+	// summed over all workers
+	double raysPerSecond() const
+	{
+		return rays_per_second;
+	}
+	int lostWorkers() const
+	{
+		return lost_workers;
+	}
+
+private:
+	struct Worker
+	{
+		int pid = -1;
+		int to_fd = -1;
+		int from_fd = -1;
+		bool alive = false;
+		bool busy = false;
+		Job job;
+		std::chrono::steady_clock::time_point job_start;
+	};
+	std::vector<Worker> workers;
+	uint32_t next_job_id = 0;
+	uint32_t pass = 0;
+	int lost_workers = 0;
+	double rays_per_second = 0.0;
+
+	void kill(Worker& worker, std::deque<Tile>& pending);
+};
+} // namespace distributed
+} // namespace pathtracer
@@ -1,7 +1,9 @@
 #include "embree.h"
 #include "sampling.h"
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <vector>
 
 
 using namespace std;
@@ -14,16 +16,9 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 RTCDevice embree_device;
 RTCScene embree_scene;
-
-///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
-///////////////////////////////////////////////////////////////////////////
-void buildBVH()
-{
-	cout << "Embree building BVH..." << flush;
-	rtcCommit(embree_scene);
-	cout << "done.\n";
-}
+// Embree does not allow geometry to be added to a static scene once it has
+// been committed, so then the scene is made anew (see reopenScene())
+static bool embree_scene_committed = false;
 
 ///////////////////////////////////////////////////////////////////////////
 // Called when there is an embree error
@@ -35,30 +30,49 @@ void embreeErrorHandler(const RTCError code, const char* str)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Lazy initialize embree on first use
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
-
-///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
-///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+static void initEmbree()
 {
-	///////////////////////////////////////////////////////////////////////
-	// Lazy initialize embree on first use
-	///////////////////////////////////////////////////////////////////////
-	cout << "Initializing embree..." << flush;
 	static bool embree_is_initialized = false;
 	if(!embree_is_initialized)
 	{
+		cout << "Initializing embree..." << flush;
 		embree_is_initialized = true;
 		embree_device = rtcNewDevice();
 		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
 		embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+		cout << "done.\n";
 	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build an acceleration structure for the scene. The scene may be empty,
+// and models may be added and the BVH rebuilt later.
+///////////////////////////////////////////////////////////////////////////
+void buildBVH()
+{
+	initEmbree();
+	cout << "Embree building BVH..." << flush;
+	rtcCommit(embree_scene);
+	embree_scene_committed = true;
 	cout << "done.\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Used to map an Embree geometry ID to our scene Meshes and Materials
+///////////////////////////////////////////////////////////////////////////
+map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
+map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+// Where the triangles of the geometry (the mesh or one of its LODs) start
+map<uint32_t, uint32_t> map_geom_ID_to_first_index;
 
+///////////////////////////////////////////////////////////////////////////
+// Add the meshes of a model to the current embree scene
+///////////////////////////////////////////////////////////////////////////
+static void addModelGeometry(const labhelper::Model* model, const mat4& model_matrix,
+                             const labhelper::LodSelection& lod)
+{
 	///////////////////////////////////////////////////////////////////////
 	// Transform and add each mesh in the model as a geometry in embree,
 	// and create mappings so that we can connect an embree geom_ID to a
@@ -67,48 +81,257 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 	cout << "Adding " << model->m_name << " to embree scene..." << flush;
 	for(auto& mesh : model->m_meshes)
 	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
+		uint32_t first_index = mesh.m_first_index;
+		uint32_t number_of_indices = mesh.m_number_of_indices;
+		int level = labhelper::selectLod(mesh, lod);
+		if(level > 0)
+		{
+			first_index = mesh.m_lods[level - 1].m_first_index;
+			number_of_indices = mesh.m_lods[level - 1].m_number_of_indices;
+		}
+		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC, number_of_indices / 3,
+		                                      mesh.m_number_of_vertices);
 		map_geom_ID_to_mesh[geom_ID] = &mesh;
 		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		map_geom_ID_to_first_index[geom_ID] = first_index;
+		if(model_matrix == mat4(1.0f))
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			// Untransformed vertices are shared with the model (which pads
+			// them as Embree requires), so nothing is copied
+			rtcSetBuffer2(embree_scene, geom_ID, RTC_VERTEX_BUFFER, &model->m_positions[mesh.m_start_index], 0,
+			              sizeof(vec3), mesh.m_number_of_vertices);
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		else
 		{
-			embree_tri_idxs[i] = i;
+			// Transform and commit vertices
+			vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			}
+			rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+		// The triangle indices are always shared with the model
+		rtcSetBuffer2(embree_scene, geom_ID, RTC_INDEX_BUFFER, &model->m_indices[first_index], 0,
+		              3 * sizeof(uint32_t), number_of_indices / 3);
 	}
 	cout << "done.\n";
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Height fields are embree user geometry, one primitive per node of a
+// level of the pyramid. The level is the lowest one with at most
+// MAX_HEIGHT_FIELD_PRIMITIVES nodes, but nodes of at least 16x16 cells.
+///////////////////////////////////////////////////////////////////////////
+struct HeightFieldGeometry
+{
+	std::shared_ptr<const labhelper::HeightGrid> grid;
+	const labhelper::Material* material;
+	uint32_t geom_ID;
+	int level;
+	int width;
+};
+map<uint32_t, unique_ptr<HeightFieldGeometry>> map_geom_ID_to_height_field;
+const size_t MAX_HEIGHT_FIELD_PRIMITIVES = 1 << 16;
+
+static void heightFieldBounds(void* ptr, size_t item, RTCBounds& bounds)
+{
+	const HeightFieldGeometry* geometry = (const HeightFieldGeometry*)ptr;
+	vec3 low, high;
+	geometry->grid->nodeBounds(geometry->level, int(item % geometry->width), int(item / geometry->width), low, high);
+	bounds.lower_x = low.x;
+	bounds.lower_y = low.y;
+	bounds.lower_z = low.z;
+	bounds.upper_x = high.x;
+	bounds.upper_y = high.y;
+	bounds.upper_z = high.z;
+}
+
+static void heightFieldIntersect(void* ptr, RTCRay& ray, size_t item)
+{
+	const HeightFieldGeometry* geometry = (const HeightFieldGeometry*)ptr;
+	Ray& r = (Ray&)ray;
+	vec3 normal;
+	if(geometry->grid->intersect(r.o, r.d, r.tnear, r.tfar, normal, geometry->level,
+	                             int(item % geometry->width), int(item / geometry->width)))
+	{
+		r.n = normal;
+		r.u = r.v = 0.0f;
+		r.geomID = geometry->geom_ID;
+		r.primID = uint32_t(item);
+	}
+}
+
+static void heightFieldOccluded(void* ptr, RTCRay& ray, size_t item)
+{
+	const HeightFieldGeometry* geometry = (const HeightFieldGeometry*)ptr;
+	Ray& r = (Ray&)ray;
+	float tfar = r.tfar;
+	vec3 normal;
+	if(geometry->grid->intersect(r.o, r.d, r.tnear, tfar, normal, geometry->level,
+	                             int(item % geometry->width), int(item / geometry->width)))
+	{
+		r.geomID = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a height field to the current embree scene
+///////////////////////////////////////////////////////////////////////////
+static void addHeightFieldGeometry(const std::shared_ptr<const labhelper::HeightGrid>& grid,
+                                   const labhelper::Material* material)
+{
+	cout << "Adding height field to embree scene..." << flush;
+	unique_ptr<HeightFieldGeometry> geometry(new HeightFieldGeometry);
+	geometry->grid = grid;
+	geometry->material = material;
+	const vector<labhelper::HeightGrid::Level>& levels = grid->levels();
+	int level = std::min(4, int(levels.size()) - 1);
+	while(size_t(levels[level].width) * levels[level].height > MAX_HEIGHT_FIELD_PRIMITIVES)
+	{
+		level++;
+	}
+	geometry->level = level;
+	geometry->width = levels[level].width;
+	size_t primitives = size_t(levels[level].width) * levels[level].height;
+	geometry->geom_ID = rtcNewUserGeometry3(embree_scene, RTC_GEOMETRY_STATIC, primitives);
+	rtcSetUserData(embree_scene, geometry->geom_ID, geometry.get());
+	rtcSetBoundsFunction(embree_scene, geometry->geom_ID, heightFieldBounds);
+	rtcSetIntersectFunction(embree_scene, geometry->geom_ID, heightFieldIntersect);
+	rtcSetOccludedFunction(embree_scene, geometry->geom_ID, heightFieldOccluded);
+	uint32_t geom_ID = geometry->geom_ID;
+	map_geom_ID_to_height_field[geom_ID] = std::move(geometry);
+	cout << "done (" << primitives << " nodes of level " << level << ").\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Everything added to the scene, so that it can be added again when the
+// scene is made anew
+///////////////////////////////////////////////////////////////////////////
+struct ModelInstance
+{
+	const labhelper::Model* model;
+	mat4 model_matrix;
+	labhelper::LodSelection lod;
+};
+vector<ModelInstance> scene_models;
+vector<pair<shared_ptr<const labhelper::HeightGrid>, const labhelper::Material*>> scene_height_fields;
+
+///////////////////////////////////////////////////////////////////////////
+// If the scene has been committed, replace it with an uncommitted scene
+// with the same geometry, so that more can be added before the next
+// buildBVH()
+///////////////////////////////////////////////////////////////////////////
+static void reopenScene()
+{
+	initEmbree();
+	if(!embree_scene_committed)
+	{
+		return;
+	}
+	rtcDeleteScene(embree_scene);
+	embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+	embree_scene_committed = false;
+	map_geom_ID_to_model.clear();
+	map_geom_ID_to_mesh.clear();
+	map_geom_ID_to_first_index.clear();
+	map_geom_ID_to_height_field.clear();
+	for(const ModelInstance& instance : scene_models)
+	{
+		addModelGeometry(instance.model, instance.model_matrix, instance.lod);
+	}
+	for(const auto& height_field : scene_height_fields)
+	{
+		addHeightFieldGeometry(height_field.first, height_field.second);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model to the embree scene
+///////////////////////////////////////////////////////////////////////////
+void addModel(const labhelper::Model* model, const mat4& model_matrix, const labhelper::LodSelection& lod)
+{
+	reopenScene();
+	scene_models.push_back({ model, model_matrix, lod });
+	addModelGeometry(model, model_matrix, lod);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a height field to the embree scene
+///////////////////////////////////////////////////////////////////////////
+void addHeightField(const std::shared_ptr<const labhelper::HeightGrid>& grid, const labhelper::Material* material)
+{
+	if(grid == nullptr || grid->empty())
+	{
+		return;
+	}
+	reopenScene();
+	scene_height_fields.push_back(make_pair(grid, material));
+	addHeightFieldGeometry(grid, material);
+}
+
+static Intersection getHeightFieldIntersection(const HeightFieldGeometry& geometry, const Ray& r)
+{
+	const labhelper::HeightGrid& grid = *geometry.grid;
+	Intersection i;
+	i.material = geometry.material;
+	i.position = r.o + r.tfar * r.d;
+	i.geometry_normal = normalize(r.n);
+	i.shading_normal = grid.normalAt(i.position.x, i.position.z);
+	i.wo = normalize(-r.d);
+	i.texture_coords = vec2((i.position.x - grid.origin().x) / grid.extent().x,
+	                        (i.position.z - grid.origin().z) / grid.extent().z);
+	return i;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Extract an intersection from an embree ray.
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
+	if(!map_geom_ID_to_height_field.empty())
+	{
+		auto height_field = map_geom_ID_to_height_field.find(r.geomID);
+		if(height_field != map_geom_ID_to_height_field.end())
+		{
+			return getHeightFieldIntersection(*height_field->second, r);
+		}
+	}
 	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
 	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
 	Intersection i;
 	i.material = &(model->m_materials[mesh->m_material_idx]);
+    const uint32_t* triangle = &model->m_indices[map_geom_ID_to_first_index[r.geomID] + r.primID * 3];
+    uint32_t v0 = mesh->m_start_index + triangle[0];
+    uint32_t v1 = mesh->m_start_index + triangle[1];
+    uint32_t v2 = mesh->m_start_index + triangle[2];
     float w = 1.0f - (r.u + r.v);
-    vec2 t0 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-    vec2 t1 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-    vec2 t2 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+    vec2 t0, t1, t2;
+    vec3 n0, n1, n2;
+    if(!model->m_compressed_vertices.empty())
+    {
+        // Half the memory traffic of the float arrays
+        const labhelper::CompressedVertex* c = model->m_compressed_vertices.data();
+        t0 = labhelper::decodeTextureCoordinates(c[v0]);
+        t1 = labhelper::decodeTextureCoordinates(c[v1]);
+        t2 = labhelper::decodeTextureCoordinates(c[v2]);
+        n0 = labhelper::decodeNormal(c[v0]);
+        n1 = labhelper::decodeNormal(c[v1]);
+        n2 = labhelper::decodeNormal(c[v2]);
+    }
+    else
+    {
+        t0 = model->m_texture_coordinates[v0];
+        t1 = model->m_texture_coordinates[v1];
+        t2 = model->m_texture_coordinates[v2];
+        n0 = model->m_normals[v0];
+        n1 = model->m_normals[v1];
+        n2 = model->m_normals[v2];
+    }
     i.texture_coords = w * t0 + r.u * t1 + r.v * t2;
     i.geometry_normal = -normalize(r.n);
     i.position = r.o + r.tfar * r.d;
     i.wo = normalize(-r.d);
-    vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-    vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-    vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
     i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
 //    if (i.material->m_normal_texture.valid) {
 //        glm::vec3 bump = i.material->m_normal_texture.colorf3(i.texture_coords.x, i.texture_coords.y);
@@ -2,18 +2,32 @@
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
+#include "HeightGrid.h"
 #include <glm/glm.hpp>
 #include <map>
+#include <memory>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Add a model to the embree scene. The LOD of each mesh is picked once,
+// with `lod` (the full meshes by default).
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+void addModel(const labhelper::Model* model, const glm::mat4& model_matrix,
+              const labhelper::LodSelection& lod = labhelper::LodSelection());
 
 ///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
+// Add a height field to the embree scene. It is not tessellated: embree
+// gets the boxes of a level of the min-max pyramid, and rays are traced
+// through the pyramid below those (see HeightGrid). The texture
+// coordinates of a hit go from (0, 0) at the origin of the grid to (1, 1)
+// at the far corner.
+///////////////////////////////////////////////////////////////////////////
+void addHeightField(const std::shared_ptr<const labhelper::HeightGrid>& grid, const labhelper::Material* material);
+
+///////////////////////////////////////////////////////////////////////////
+// Build an acceleration structure for the scene. Call it again after
+// adding more models.
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH();
 
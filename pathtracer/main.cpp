@@ -9,9 +9,19 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <Model.h>
+#include <HeightGrid.h>
+#include <ThreadPool.h>
 #include <string>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "Pathtracer.h"
 #include "embree.h"
+#include "distributed.h"
+#include "stats.h"
+#include "display.h"
+#include "scene.h"
 
 using namespace glm;
 using namespace std;
@@ -27,6 +37,11 @@ static float deltaTime = 0.0f;
 
 bool drawLightHelpers = false;
 
+///////////////////////////////////////////////////////////////////////////////
+// Distributed rendering (see distributed.h)
+///////////////////////////////////////////////////////////////////////////////
+pathtracer::distributed::Coordinator coordinator;
+
 // Mouse input
 ivec2 g_prevMouseCoords = {-1, -1};
 bool g_isMouseDragging = false;
@@ -37,9 +52,9 @@ bool g_isMouseDragging = false;
 GLuint shaderProgram, basicShader;
 
 ///////////////////////////////////////////////////////////////////////////////
-// GL texture to put pathtracing result into
+// Tonemaps the pathtracing result into a GL texture (see display.h)
 ///////////////////////////////////////////////////////////////////////////////
-uint32_t pathtracer_result_txt_id;
+pathtracer::Display result_display;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -54,6 +69,56 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 vector<pair<labhelper::Model *, mat4>> models;
 vector<pathtracer::LightHelper *> lightHelpers;
 
+///////////////////////////////////////////////////////////////////////////////
+// Terrain, from --terrain <height map> [diffuse map]. It is placed like the
+// height field of the project.
+///////////////////////////////////////////////////////////////////////////////
+string terrainHeightMap, terrainDiffuseMap;
+labhelper::Material terrainMaterial;
+
+///////////////////////////////////////////////////////////////////////////////
+// Assets that are loading in the background. Models are added to the scene
+// (and the environment map replaced) as they become ready.
+///////////////////////////////////////////////////////////////////////////////
+vector<pair<shared_future<labhelper::Model *>, mat4>> loadingModels;
+future<HDRImage> loadingEnvironment;
+future<shared_ptr<const labhelper::HeightGrid>> loadingTerrain;
+// Milliseconds per frame spent on uploading assets that have been loaded
+float uploadBudgetMs = 2.0f;
+
+///////////////////////////////////////////////////////////////////////////////
+// Upload some of the assets that are loading, and add the ones that are
+// done to the scene. Returns false once everything is loaded.
+///////////////////////////////////////////////////////////////////////////////
+bool finishLoading(float budget_ms) {
+    labhelper::finishUploads(budget_ms);
+    bool changed = labhelper::takeIfReady(loadingEnvironment, pathtracer::environment.map);
+    shared_ptr<const labhelper::HeightGrid> terrain;
+    if (labhelper::takeIfReady(loadingTerrain, terrain) && terrain != nullptr) {
+        pathtracer::addHeightField(terrain, &terrainMaterial);
+        changed = true;
+    }
+    for (auto it = loadingModels.begin(); it != loadingModels.end();) {
+        labhelper::Model *model;
+        if (labhelper::takeIfReady(it->first, model)) {
+            models.push_back(make_pair(model, it->second));
+            // The full meshes: the scene is only built once, while the
+            // camera moves, and workers (with their own small windows)
+            // must trace the same geometry as the coordinator
+            pathtracer::addModel(model, it->second);
+            changed = true;
+            it = loadingModels.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (changed) {
+        pathtracer::buildBVH();
+        pathtracer::restart();
+    }
+    return loadingEnvironment.valid() || loadingTerrain.valid() || !loadingModels.empty();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
 ///////////////////////////////////////////////////////////////////////////////
@@ -67,81 +132,70 @@ void initialize() {
             "../../pathtracer/simple_geo.frag");
 
     ///////////////////////////////////////////////////////////////////////////
-    // Initial path-tracer settings
+    // Settings, lights and what to load (see scene.h)
     ///////////////////////////////////////////////////////////////////////////
-    pathtracer::settings.max_bounces = 8;
-    pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
-    pathtracer::settings.aperture = 0.f;
-    pathtracer::settings.focal_distance = 100000.f;
-    pathtracer::settings.environment_light = true;
-    pathtracer::settings.use_bilinear_interp = true;
-#ifdef _DEBUG
-    pathtracer::settings.subsampling = 16;
-#else
-    pathtracer::settings.subsampling = 4;
-#endif
+    pathtracer::SceneDescription scene = pathtracer::setupScene();
+    for (auto *light: pathtracer::lights) {
+        if (auto *circle = dynamic_cast<pathtracer::CircleLight *>(light)) {
+            lightHelpers.push_back(new pathtracer::CircleLightHelper(circle));
+        } else if (auto *rectangle = dynamic_cast<pathtracer::ParallelogramLight *>(light)) {
+            lightHelpers.push_back(new pathtracer::RectangleLightHelper(rectangle));
+        } else if (auto *sphere = dynamic_cast<pathtracer::SphereLight *>(light)) {
+            lightHelpers.push_back(new pathtracer::SphereLightHelper(sphere));
+        }
+    }
 
     ///////////////////////////////////////////////////////////////////////////
-    // Set up light
+    // Load environment map
     ///////////////////////////////////////////////////////////////////////////
-    {
-//        auto *point_light = new pathtracer::PointLight(
-//                vec3(1.f, 1.f, 1.f),
-//                2500.f, vec3(10.0f, 40.0f,
-//                        10.0f));
-//        pathtracer::lights.push_back(point_light);
-
-        auto* circle = new pathtracer::CircleLight(
-                vec3(10.f, 18.f, 10.f), normalize(-vec3(15.f, 18.f, 15.f)),
-                8, vec3(1.f, 0.f, 0.f), 2.f
-        );
-        pathtracer::lights.push_back(circle);
-        lightHelpers.push_back(new pathtracer::CircleLightHelper(circle));
-
-        auto* rectangle = new pathtracer::ParallelogramLight(
-                vec3(0.f, 8.f, -15.f),
-                vec3(12.f, 0.f, 6.f), vec3(-10.f, 10.f, 0.f),
-                vec3(0.f, 0.f, 1.f), 2.f);
-        pathtracer::lights.push_back(rectangle);
-        lightHelpers.push_back(new pathtracer::RectangleLightHelper(rectangle));
-
-        auto* sphere = new pathtracer::SphereLight(
-                worldUp * 18.f,
-                4.f,
-                vec3(0.f, 1.f, 0.f),
-                1.f);
-        pathtracer::lights.push_back(sphere);
-        lightHelpers.push_back(new pathtracer::SphereLightHelper(sphere));
-    }
+    string environmentMap = scene.environment_map;
+    loadingEnvironment = labhelper::ThreadPool::shared().submit([environmentMap]() {
+        HDRImage map;
+        map.load(environmentMap);
+        return map;
+    });
+    pathtracer::environment.multiplier = scene.environment_multiplier;
 
     ///////////////////////////////////////////////////////////////////////////
-    // Load environment map
+    // Load the terrain, if any
     ///////////////////////////////////////////////////////////////////////////
-    pathtracer::environment.map.load("../../scenes/envmaps/001.hdr");
-    pathtracer::environment.multiplier = 1.0f;
+    if (!terrainHeightMap.empty()) {
+        terrainMaterial.m_name = "terrain";
+        terrainMaterial.m_color = vec3(0.5f);
+        terrainMaterial.m_reflectivity = 0.f;
+        terrainMaterial.m_roughness = 1.f;
+        terrainMaterial.m_metalness = 0.f;
+        terrainMaterial.m_fresnel = 0.04f;
+        terrainMaterial.m_emission = 0.f;
+        terrainMaterial.m_transparency = 0.f;
+        if (!terrainDiffuseMap.empty()) {
+            terrainMaterial.m_color_texture.load("", terrainDiffuseMap, 4);
+        }
+        loadingTerrain = labhelper::ThreadPool::shared().submit([]() -> shared_ptr<const labhelper::HeightGrid> {
+            int width, height, components;
+            float *data = stbi_loadf(terrainHeightMap.c_str(), &width, &height, &components, 1);
+            if (data == nullptr) {
+                cout << "Failed to load height map: " << terrainHeightMap << ".\n";
+                return nullptr;
+            }
+            auto grid = make_shared<const labhelper::HeightGrid>(data, width, height, vec3(-20000.f, -300.f, -20000.f),
+                                                                 vec3(40000.f, 1000.f, 40000.f));
+            stbi_image_free(data);
+            return grid;
+        });
+    }
 
     ///////////////////////////////////////////////////////////////////////////
     // Load .obj models to scene
     ///////////////////////////////////////////////////////////////////////////
-    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/NewShip.obj"), /*scale(vec3(10.f)) */
-            translate(vec3(0.0f, 10.0f, 0.0f))));
-    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/landingpad2.obj"), mat4(1.0f)));
-//	models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/landing_pad_2.obj"), mat4(1.0f)));
-//	models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/tetra_balls.obj"), translate(vec3(0.f, 10.f, 0.f))));
-//	models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/BigSphere2.obj"), mat4(1.0f)));
-//	models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/BigSphere2.obj"), translate(vec3(0.0f, 10.0f, 0.0f))));
-//    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/untitled.obj"), scale(vec3(10.f))));
-//    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/testCUBE.obj"), mat4(1.0f)));
-//    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/wheatley.obj"), scale(vec3(10.f))));
-//    models.push_back(make_pair(labhelper::loadModelFromOBJ("../../scenes/roughness_test_balls.obj"), mat4(1.0f)));
-
+    for (const auto &model: scene.models) {
+        loadingModels.push_back(make_pair(labhelper::loadModelFromOBJAsync(model.first), model.second));
+    }
 
     ///////////////////////////////////////////////////////////////////////////
-    // Add models to pathtracer scene
+    // Start with an empty scene, the models are added to it as they are
+    // loaded (see finishLoading())
     ///////////////////////////////////////////////////////////////////////////
-    for (auto m : models) {
-        pathtracer::addModel(m.first, m.second);
-    }
     pathtracer::buildBVH();
 
     // Light helpers
@@ -150,21 +204,9 @@ void initialize() {
     }
 
     ///////////////////////////////////////////////////////////////////////////
-    // Generate result texture
-    ///////////////////////////////////////////////////////////////////////////
-    glGenTextures(1, &pathtracer_result_txt_id);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    ///////////////////////////////////////////////////////////////////////////
-    // This is INCORRECT! But an easy way to get us a brighter image that
-    // just looks a little better...
+    // Do not enable GL_FRAMEBUFFER_SRGB, the result texture is already sRGB
+    // encoded (see pathtracer::display_settings)
     ///////////////////////////////////////////////////////////////////////////
-    //glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
 void display(void) {
@@ -191,13 +233,12 @@ void display(void) {
             float(pathtracer::rendered_image.width)
             / float(pathtracer::rendered_image.height),
             0.1f, 100.0f);
-    pathtracer::tracePaths(viewMatrix, projMatrix);
+    coordinator.tracePaths(viewMatrix, projMatrix);
 
     ///////////////////////////////////////////////////////////////////////////
-    // Copy pathtraced image to texture for display
+    // Tonemap the changed parts of the pathtraced image into the texture
     ///////////////////////////////////////////////////////////////////////////
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-            pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+    result_display.update(pathtracer::rendered_image);
 
     ///////////////////////////////////////////////////////////////////////////
     // Render a fullscreen quad, textured with our pathtraced image.
@@ -351,13 +392,57 @@ void gui() {
         ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
         ImGui::Checkbox("Environment Light", &pathtracer::settings.environment_light);
         ImGui::Checkbox("Bilinear interpolation", &pathtracer::settings.use_bilinear_interp);
+        ImGui::Checkbox("Wavefront shading", &pathtracer::settings.wavefront);
+        ImGui::SliderFloat("Time per frame (s)", &pathtracer::settings.pass_time_budget, 0.0f, 0.1f);
         ImGui::Separator();
         ImGui::Text("Samples: %d", pathtracer::rendered_image.number_of_samples);
+        if (coordinator.aliveWorkers() > 0 || coordinator.lostWorkers() > 0) {
+            ImGui::Text("Workers: %d (lost %d)", coordinator.aliveWorkers(), coordinator.lostWorkers());
+            ImGui::Text("Rays/s: %.3f M", coordinator.raysPerSecond() * 1e-6);
+            ImGui::SliderInt("Tile size", &coordinator.tile_size, 16, 256);
+            ImGui::SliderFloat("Tile timeout (s)", &coordinator.job_timeout, 1.0f, 120.0f);
+        }
         if (ImGui::Button("Restart Pathtracing")) {
             pathtracer::restart();
         }
     }
 
+    if (ImGui::CollapsingHeader("Display", "display_ch", true, false)) {
+        ImGui::SliderFloat("Exposure", &pathtracer::display_settings.exposure, -5.0f, 5.0f);
+        ImGui::Combo("Tonemap", &pathtracer::display_settings.tonemap, pathtracer::tonemap_names,
+                     pathtracer::NUM_TONEMAPS);
+        ImGui::Checkbox("sRGB", &pathtracer::display_settings.srgb);
+        ImGui::Text("Upload: %.2f ms", result_display.lastUpdateSeconds() * 1e3);
+        ImGui::SliderFloat("Asset upload budget (ms)", &uploadBudgetMs, 0.1f, 16.0f);
+    }
+
+    if (ImGui::CollapsingHeader("Statistics", "stats_ch", true, false)) {
+        ImGui::Checkbox("Collect statistics", &pathtracer::stats_settings.enabled);
+        ImGui::Checkbox("Collect timers", &pathtracer::stats_settings.timers);
+        const pathtracer::RenderStats &pass = pathtracer::last_pass_stats;
+        const pathtracer::RenderStats &total = pathtracer::total_stats;
+        ImGui::Text("Last pass: %.1f ms", pass.pass_seconds * 1e3);
+        ImGui::Text("Rays/s: %.3f M", pass.pass_seconds > 0.0 ? double(pass.rays()) / pass.pass_seconds * 1e-6 : 0.0);
+        ImGui::Text("Rays: %llu primary, %llu bounce, %llu shadow", (unsigned long long) pass.primary_rays,
+                    (unsigned long long) pass.bounce_rays, (unsigned long long) pass.shadow_rays);
+        ImGui::Text("Average path length: %.2f", total.averagePathLength());
+        ImGui::Separator();
+        double paths = total.paths > 0 ? double(total.paths) : 1.0;
+        ImGui::Text("Terminated: escaped %.1f%%, max bounces %.1f%%", 100.0 * total.terminated_escaped / paths,
+                    100.0 * total.terminated_max_bounces / paths);
+        ImGui::Text("            zero pdf %.1f%%, zero throughput %.1f%%, NaN %.1f%%",
+                    100.0 * total.terminated_zero_pdf / paths, 100.0 * total.terminated_zero_throughput / paths,
+                    100.0 * total.terminated_nan / paths);
+        ImGui::Text("NaN samples: %llu", (unsigned long long) total.nan_count);
+        if (pathtracer::stats_settings.timers) {
+            double thread_seconds = total.intersect_seconds + total.shading_seconds + total.light_seconds;
+            if (thread_seconds <= 0.0) thread_seconds = 1.0;
+            ImGui::Text("Time: intersect %.1f%%, shading %.1f%%, lights %.1f%%",
+                        100.0 * total.intersect_seconds / thread_seconds, 100.0 * total.shading_seconds / thread_seconds,
+                        100.0 * total.light_seconds / thread_seconds);
+        }
+    }
+
     if (ImGui::CollapsingHeader("Depth of Field", "dof", true, false)) {
         ImGui::SliderFloat("Focal distance", &pathtracer::settings.focal_distance, 131.f, 200.f);
         ImGui::SliderFloat("Aperture", &pathtracer::settings.aperture, 0.f, 1.f);
@@ -367,11 +452,18 @@ void gui() {
     // Choose a model to modify
     ///////////////////////////////////////////////////////////////////////////
     static int model_index = 0;
-    static labhelper::Model *model = models[0].first;
+    static labhelper::Model *model = nullptr;
     static int mesh_index = 0;
-    static int material_index = model->m_meshes[mesh_index].m_material_idx;
+    static int material_index = 0;
+    if (model == nullptr && !models.empty()) {
+        // The first model has finished loading
+        model = models[0].first;
+        material_index = model->m_meshes[mesh_index].m_material_idx;
+    }
 
-    if (ImGui::CollapsingHeader("Models", "meshes_ch", true, true)) {
+    if (model == nullptr) {
+        ImGui::Text("Loading models...");
+    } else if (ImGui::CollapsingHeader("Models", "meshes_ch", true, true)) {
         if (ImGui::Combo("Model", &model_index, model_getter, (void *) &models, int(models.size()))) {
             model = models[model_index].first;
             mesh_index = 0;
@@ -467,10 +559,76 @@ void gui() {
 }
 
 int main(int argc, char *argv[]) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Command line:
+    //   --worker            serve tiles on stdin/stdout (started by a coordinator)
+    //   --workers N         start N local worker processes
+    //   --worker-cmd CMD    start a worker with a shell command, e.g.
+    //                       "ssh host cd repo/build/pathtracer && ./pathtracer --worker"
+    //   --stats-json FILE   append the statistics of every pass to FILE
+    //   --terrain HEIGHT_MAP [DIFFUSE_MAP]
+    //                       add a height field to the scene
+    ///////////////////////////////////////////////////////////////////////////
+    bool worker_mode = false;
+    int local_workers = 0;
+    vector<string> worker_commands;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--worker") {
+            worker_mode = true;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            local_workers += atoi(argv[++i]);
+        } else if (arg == "--worker-cmd" && i + 1 < argc) {
+            worker_commands.push_back(argv[++i]);
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            pathtracer::stats_settings.json_path = argv[++i];
+        } else if (arg == "--terrain" && i + 1 < argc) {
+            terrainHeightMap = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                terrainDiffuseMap = argv[++i];
+            }
+        }
+    }
+    // Local workers render the same scene
+    string worker_arguments = " --worker";
+    if (!terrainHeightMap.empty()) {
+        worker_arguments += " --terrain \"" + terrainHeightMap + "\"";
+        if (!terrainDiffuseMap.empty()) {
+            worker_arguments += " \"" + terrainDiffuseMap + "\"";
+        }
+    }
+    for (int w = 0; w < local_workers; w++) {
+        worker_commands.push_back(string(argv[0]) + worker_arguments);
+    }
+
+    if (worker_mode) {
+#ifndef _WIN32
+        // stdout carries results, everything we print goes to stderr instead
+        int out_fd = dup(1);
+        dup2(2, 1);
+#else
+        int out_fd = 1;
+#endif
+        g_window = labhelper::init_window_SDL("Pathtracer worker", 64, 64);
+        SDL_HideWindow(g_window);
+        initialize();
+        // Workers must render the whole scene
+        while (finishLoading(100.0f)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        pathtracer::distributed::runWorker(0, out_fd);
+        labhelper::shutDown(g_window);
+        return 0;
+    }
+
     g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
     initialize();
 
+    if (!worker_commands.empty()) {
+        coordinator.start(worker_commands);
+    }
+
     bool stopRendering = false;
     auto startTime = std::chrono::system_clock::now();
 
@@ -480,6 +638,8 @@ int main(int argc, char *argv[]) {
         deltaTime = timeSinceStart.count() - currentTime;
         currentTime = timeSinceStart.count();
 
+        finishLoading(uploadBudgetMs);
+
         // render to window
         display();
 
@@ -493,6 +653,8 @@ int main(int argc, char *argv[]) {
         stopRendering = handleEvents();
     }
 
+    coordinator.stop();
+
     // Delete Models
     for (auto &m : models) {
         labhelper::freeModel(m.first);
@@ -505,6 +667,7 @@ int main(int argc, char *argv[]) {
     }
 
     pathtracer::lights.clear();
+    result_display.destroy();
     // Shut down everything. This includes the window and all other subsystems.
     labhelper::shutDown(g_window);
     return 0;
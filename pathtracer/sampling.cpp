@@ -19,6 +19,14 @@ float randf()
 	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
 }
 
+void seedRandom(uint32_t seed)
+{
+	for(int i = 0; i < 24; i++)
+	{
+		generators[i].seed(seed * 24u + uint32_t(i));
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
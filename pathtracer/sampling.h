@@ -8,6 +8,11 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 float randf();
 ///////////////////////////////////////////////////////////////////////////
+// Reseed the per-thread generators, so that several processes rendering
+// the same image do not produce the same sequence of samples
+///////////////////////////////////////////////////////////////////////////
+void seedRandom(uint32_t seed);
+///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy);
@@ -0,0 +1,65 @@
+#include "scene.h"
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+SceneDescription setupScene()
+{
+	///////////////////////////////////////////////////////////////////////
+	// Initial path-tracer settings
+	///////////////////////////////////////////////////////////////////////
+	settings.max_bounces = 8;
+	settings.max_paths_per_pixel = 0; // 0 = Infinite
+	settings.aperture = 0.f;
+	settings.focal_distance = 100000.f;
+	settings.environment_light = true;
+	settings.use_bilinear_interp = true;
+	settings.wavefront = false;
+	settings.pass_time_budget = 0.03f;
+#ifdef _DEBUG
+	settings.subsampling = 16;
+#else
+	settings.subsampling = 4;
+#endif
+
+	///////////////////////////////////////////////////////////////////////
+	// Set up light
+	///////////////////////////////////////////////////////////////////////
+	//	lights.push_back(new PointLight(vec3(1.f, 1.f, 1.f), 2500.f, vec3(10.0f, 40.0f, 10.0f)));
+	lights.push_back(new CircleLight(vec3(10.f, 18.f, 10.f), normalize(-vec3(15.f, 18.f, 15.f)), 8,
+	                                 vec3(1.f, 0.f, 0.f), 2.f));
+	lights.push_back(new ParallelogramLight(vec3(0.f, 8.f, -15.f), vec3(12.f, 0.f, 6.f), vec3(-10.f, 10.f, 0.f),
+	                                        vec3(0.f, 0.f, 1.f), 2.f));
+	lights.push_back(new SphereLight(vec3(0.f, 18.f, 0.f), 4.f, vec3(0.f, 1.f, 0.f), 1.f));
+
+	SceneDescription scene;
+	scene.environment_map = "../../scenes/envmaps/001.hdr";
+	scene.environment_multiplier = 1.0f;
+
+	///////////////////////////////////////////////////////////////////////
+	// .obj models
+	///////////////////////////////////////////////////////////////////////
+	labhelper::setModelOptimization(true);
+	labhelper::setLodGeneration(true);
+	labhelper::setVertexCompression(true);
+	// Embree builds its BVH from the float positions
+	labhelper::setKeepVertexArrays(true);
+	scene.models.push_back(make_pair("../../scenes/NewShip.obj", /*scale(vec3(10.f)) */
+	                                 translate(vec3(0.0f, 10.0f, 0.0f))));
+	scene.models.push_back(make_pair("../../scenes/landingpad2.obj", mat4(1.0f)));
+	//	scene.models.push_back(make_pair("../../scenes/landing_pad_2.obj", mat4(1.0f)));
+	//	scene.models.push_back(make_pair("../../scenes/tetra_balls.obj", translate(vec3(0.f, 10.f, 0.f))));
+	//	scene.models.push_back(make_pair("../../scenes/BigSphere2.obj", mat4(1.0f)));
+	//	scene.models.push_back(make_pair("../../scenes/BigSphere2.obj", translate(vec3(0.0f, 10.0f, 0.0f))));
+	//	scene.models.push_back(make_pair("../../scenes/untitled.obj", scale(vec3(10.f))));
+	//	scene.models.push_back(make_pair("../../scenes/testCUBE.obj", mat4(1.0f)));
+	//	scene.models.push_back(make_pair("../../scenes/wheatley.obj", scale(vec3(10.f))));
+	//	scene.models.push_back(make_pair("../../scenes/roughness_test_balls.obj", mat4(1.0f)));
+	return scene;
+}
+} // namespace pathtracer
@@ -0,0 +1,27 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The scene the pathtracer starts with, shared with the benchmarks so
+// that they measure the same scene.
+///////////////////////////////////////////////////////////////////////////
+struct SceneDescription
+{
+	std::string environment_map;
+	float environment_multiplier = 1.0f;
+	// OBJ files and their model matrices
+	std::vector<std::pair<std::string, glm::mat4>> models;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Sets the initial settings, adds the lights to pathtracer::lights and
+// sets how models are loaded. Returns what the caller has to load, on
+// whichever thread and in whichever order it likes.
+///////////////////////////////////////////////////////////////////////////
+SceneDescription setupScene();
+} // namespace pathtracer
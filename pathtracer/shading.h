@@ -0,0 +1,98 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "material.h"
+#include "embree.h"
+#include "stats.h"
+
+namespace pathtracer {
+///////////////////////////////////////////////////////////////////////////
+// The building blocks of a path, shared by the megakernel in
+// Pathtracer.cpp and the wavefront renderer in wavefront.cpp.
+///////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////
+// The parameters of a material at one point, after texture lookups
+///////////////////////////////////////////////////////////////////////////
+    struct MaterialParams {
+        vec4 color; // alpha is 1 - transparency
+        float metalness;
+        float fresnel;
+        float roughness;
+        float reflectivity;
+        float emission;
+    };
+
+    MaterialParams evaluateMaterial(const labhelper::Material &material, const vec2 &texture_coords);
+
+///////////////////////////////////////////////////////////////////////////
+// The tree of BSDFs used for every material. The BSDFs point to each
+// other, so it can not be copied.
+///////////////////////////////////////////////////////////////////////////
+    class MaterialBSDF {
+    public:
+        explicit MaterialBSDF(const MaterialParams &p)
+                : diffuse(p.color),
+                  dielectric(p.roughness, p.fresnel, &diffuse),
+                  transparency(1.3f, p.roughness, p.fresnel, p.color),
+                  metal(p.color, p.roughness, p.fresnel),
+                  metal_blend(p.metalness, &metal, &dielectric),
+                  reflectivity_blend(p.reflectivity, &metal_blend, &diffuse),
+                  transparency_blend(p.color.a, &reflectivity_blend, &transparency) {
+        }
+
+        MaterialBSDF(const MaterialBSDF &) = delete;
+        MaterialBSDF &operator=(const MaterialBSDF &) = delete;
+
+        BSDF &bsdf() {
+            return transparency_blend;
+        }
+
+    private:
+        Diffuse diffuse;
+        BlinnPhong dielectric;
+        BTDF transparency;
+        BlinnPhongMetal metal;
+        LinearBlend metal_blend;
+        LinearBlend reflectivity_blend;
+        LinearBlend transparency_blend;
+    };
+
+///////////////////////////////////////////////////////////////////////////
+// Return the radiance from a certain direction wi from the environment
+// map.
+///////////////////////////////////////////////////////////////////////////
+    vec3 Lenvironment(const vec3 &wi);
+
+///////////////////////////////////////////////////////////////////////////
+// Create the camera ray through pixel (x, y), including depth of field,
+// and intersect it with the scene. Returns whether it hit anything.
+///////////////////////////////////////////////////////////////////////////
+    bool generatePrimaryRay(int x, int y, int width, int height,
+                            const vec3 &camera_pos, const mat4 &inverse_PV, Ray &ray);
+
+///////////////////////////////////////////////////////////////////////////
+// Light arriving at a hit from the light sources, with multiple
+// importance sampling.
+///////////////////////////////////////////////////////////////////////////
+    vec3 directIllumination(const Intersection &hit, BSDF &mat, Stopwatch &stopwatch);
+
+///////////////////////////////////////////////////////////////////////////
+// The two halves of directIllumination() for one light, for renderers
+// that evaluate the BSDF themselves. lightSampleContribution() takes the
+// light sample (wi, lightPdf, li) and the BSDF in that direction, with
+// the cosine term, and traces the shadow ray. bsdfSampleContribution()
+// samples the BSDF, for lights that are not delta lights.
+///////////////////////////////////////////////////////////////////////////
+    vec3 lightSampleContribution(const Intersection &hit, Light &light, const vec3 &wi, float lightPdf,
+                                 const vec3 &li, const vec3 &f, float scatteringPdf, Stopwatch &stopwatch);
+    vec3 bsdfSampleContribution(const Intersection &hit, BSDF &mat, Light &light);
+
+///////////////////////////////////////////////////////////////////////////
+// Sample the next direction of a path, update its throughput and set up
+// the (not yet intersected) next ray. Returns false, and counts why, if
+// the path should be terminated.
+///////////////////////////////////////////////////////////////////////////
+    bool scatter(const Intersection &hit, BSDF &mat, vec3 &path_throughput, Ray &next_ray);
+}
@@ -10,9 +10,12 @@ uniform mat4 normalMatrix;
 out vec3 viewSpaceNormal;
 out vec3 vertPos;
 
+// The models of the scene may be drawn with compressed vertices
+#include "../labhelper/compressed_vertex.glsl"
+
 void main()
 {
-	vertPos = (modelViewMatrix * vec4(position, 1.0)).xyz;
-	viewSpaceNormal = (normalMatrix * vec4(normal, 0.0)).xyz;
+	vertPos = (modelViewMatrix * vec4(decodePosition(position), 1.0)).xyz;
+	viewSpaceNormal = (normalMatrix * vec4(decodeNormal(normal), 0.0)).xyz;
 	gl_Position = projectionMatrix * vec4(vertPos, 1.f);
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "stats.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace pathtracer
+{
+StatsSettings stats_settings;
+RenderStats last_pass_stats;
+RenderStats total_stats;
+// Sized for the default team up front, beginStatsPass() grows it if needed
+vector<ThreadStats> thread_stats(static_cast<size_t>(omp_get_max_threads()));
+
+static chrono::steady_clock::time_point pass_start;
+static int pass_number = 0;
+
+RenderStats& RenderStats::operator+=(const RenderStats& o)
+{
+	primary_rays += o.primary_rays;
+	shadow_rays += o.shadow_rays;
+	bounce_rays += o.bounce_rays;
+	paths += o.paths;
+	path_vertices += o.path_vertices;
+	terminated_escaped += o.terminated_escaped;
+	terminated_max_bounces += o.terminated_max_bounces;
+	terminated_zero_pdf += o.terminated_zero_pdf;
+	terminated_zero_throughput += o.terminated_zero_throughput;
+	terminated_nan += o.terminated_nan;
+	nan_count += o.nan_count;
+	intersect_seconds += o.intersect_seconds;
+	shading_seconds += o.shading_seconds;
+	light_seconds += o.light_seconds;
+	pass_seconds += o.pass_seconds;
+	return *this;
+}
+
+string RenderStats::toJSON(int pass) const
+{
+	stringstream ss;
+	ss << "{\"pass\": " << pass
+	   << ", \"pass_seconds\": " << pass_seconds
+	   << ", \"primary_rays\": " << primary_rays
+	   << ", \"shadow_rays\": " << shadow_rays
+	   << ", \"bounce_rays\": " << bounce_rays
+	   << ", \"rays_per_second\": " << (pass_seconds > 0.0 ? double(rays()) / pass_seconds : 0.0)
+	   << ", \"paths\": " << paths
+	   << ", \"average_path_length\": " << averagePathLength()
+	   << ", \"terminated\": {\"escaped\": " << terminated_escaped
+	   << ", \"max_bounces\": " << terminated_max_bounces
+	   << ", \"zero_pdf\": " << terminated_zero_pdf
+	   << ", \"zero_throughput\": " << terminated_zero_throughput
+	   << ", \"nan\": " << terminated_nan << "}"
+	   << ", \"nan_count\": " << nan_count
+	   << ", \"intersect_seconds\": " << intersect_seconds
+	   << ", \"shading_seconds\": " << shading_seconds
+	   << ", \"light_seconds\": " << light_seconds << "}";
+	return ss.str();
+}
+
+void beginStatsPass()
+{
+	size_t threads = size_t(omp_get_max_threads());
+	if(thread_stats.size() < threads)
+		thread_stats.resize(threads);
+	for(auto& t : thread_stats)
+		t.stats = RenderStats();
+	pass_start = chrono::steady_clock::now();
+}
+
+void endStatsPass(const RenderStats& remote)
+{
+	if(!stats_settings.enabled)
+		return;
+	RenderStats pass = remote;
+	for(auto& t : thread_stats)
+		pass += t.stats;
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - pass_start;
+	pass.pass_seconds = elapsed.count();
+	last_pass_stats = pass;
+	total_stats += pass;
+	pass_number++;
+
+	if(!stats_settings.json_path.empty())
+	{
+		ofstream json(stats_settings.json_path, ios::app);
+		if(!json.is_open())
+		{
+			cout << "Could not open " << stats_settings.json_path << " for writing, disabling json stats.\n";
+			stats_settings.json_path.clear();
+			return;
+		}
+		json << pass.toJSON(pass_number) << "\n";
+	}
+}
+
+void resetTotalStats()
+{
+	total_stats = RenderStats();
+}
+} // namespace pathtracer
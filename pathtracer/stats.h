@@ -0,0 +1,131 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Counters and timers collected while tracing. Every thread writes to its
+// own copy, and the copies are summed at the end of each pass, so there
+// is no contention while rendering.
+///////////////////////////////////////////////////////////////////////////
+struct RenderStats
+{
+	// Rays
+	uint64_t primary_rays = 0;
+	uint64_t shadow_rays = 0;
+	uint64_t bounce_rays = 0;
+	// Paths, and the sum of their lengths (in vertices)
+	uint64_t paths = 0;
+	uint64_t path_vertices = 0;
+	// Why paths were terminated
+	uint64_t terminated_escaped = 0;
+	uint64_t terminated_max_bounces = 0;
+	uint64_t terminated_zero_pdf = 0;
+	uint64_t terminated_zero_throughput = 0;
+	uint64_t terminated_nan = 0;
+	// Paths that returned NaN radiance
+	uint64_t nan_count = 0;
+	// Thread-seconds spent in each part of the renderer
+	double intersect_seconds = 0.0;
+	double shading_seconds = 0.0;
+	double light_seconds = 0.0;
+	// Wall clock time of the pass
+	double pass_seconds = 0.0;
+
+	uint64_t rays() const
+	{
+		return primary_rays + shadow_rays + bounce_rays;
+	}
+	double averagePathLength() const
+	{
+		return paths > 0 ? double(path_vertices) / double(paths) : 0.0;
+	}
+	RenderStats& operator+=(const RenderStats& o);
+	std::string toJSON(int pass) const;
+};
+
+extern struct StatsSettings
+{
+	bool enabled = true;
+	// Timers are more expensive than counters, so they can be turned off
+	bool timers = true;
+	// If not empty, every pass is appended to this file as one JSON line
+	std::string json_path;
+} stats_settings;
+
+// Statistics of the last finished pass, and of all passes since restart()
+extern RenderStats last_pass_stats;
+extern RenderStats total_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Per thread storage, padded so two threads never share a cache line
+///////////////////////////////////////////////////////////////////////////
+struct ThreadStats
+{
+	RenderStats stats;
+	char padding[64];
+};
+extern std::vector<ThreadStats> thread_stats;
+
+inline RenderStats& threadStats()
+{
+	size_t thread = size_t(omp_get_thread_num());
+	if(thread < thread_stats.size())
+		return thread_stats[thread].stats;
+	// A thread beyond the ones beginStatsPass() made room for. Its counts
+	// are lost, rather than written past the end.
+	static thread_local ThreadStats overflow;
+	return overflow.stats;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Called around each pass (tracePaths, or all the tiles of a distributed
+// pass). `remote` is added to the counters of this process, e.g. the
+// counters the workers sent back.
+///////////////////////////////////////////////////////////////////////////
+void beginStatsPass();
+void endStatsPass(const RenderStats& remote = RenderStats());
+void resetTotalStats();
+
+///////////////////////////////////////////////////////////////////////////
+// Splits the time spent by the current thread into sections: each call to
+// lap() adds the time since the previous lap to one of the timers. Does
+// nothing if timers are disabled.
+///////////////////////////////////////////////////////////////////////////
+class Stopwatch
+{
+public:
+	Stopwatch() : active(stats_settings.enabled && stats_settings.timers)
+	{
+		if(active)
+			last = std::chrono::steady_clock::now();
+	}
+	void lap(double RenderStats::*timer)
+	{
+		if(active)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::chrono::duration<double> elapsed = now - last;
+			threadStats().*timer += elapsed.count();
+			last = now;
+		}
+	}
+
+private:
+	bool active;
+	std::chrono::steady_clock::time_point last;
+};
+
+#define STATS_COUNT(counter)                                                                                 \
+	do                                                                                                   \
+	{                                                                                                    \
+		if(pathtracer::stats_settings.enabled)                                                           \
+		{                                                                                                \
+			pathtracer::threadStats().counter++;                                                         \
+		}                                                                                                \
+	} while(0)
+} // namespace pathtracer
@@ -0,0 +1,471 @@
+#include "wavefront.h"
+#include <algorithm>
+#include <cfloat>
+#include <omp.h>
+#include <xmmintrin.h>
+#include <glm/ext.hpp>
+#include "shading.h"
+#include "stats.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer {
+namespace wavefront {
+///////////////////////////////////////////////////////////////////////////
+// The state of the paths of one tile, as a structure of arrays. There is
+// one batch per thread, reused for every tile, so nothing is allocated
+// while tracing.
+///////////////////////////////////////////////////////////////////////////
+    struct PathBatch {
+        // Indexed by path
+        std::vector<Ray> rays;
+        std::vector<vec3> throughput;
+        std::vector<vec3> radiance;
+        std::vector<int> pixel;
+        // The paths still alive before and after the current bounce
+        std::vector<int> active;
+        std::vector<int> next_active;
+        // The hits of the current bounce, indexed like `active`
+        std::vector<vec3> position;
+        std::vector<vec3> geometry_normal;
+        std::vector<vec3> shading_normal;
+        std::vector<vec3> wo;
+        std::vector<vec2> texture_coords;
+        std::vector<const labhelper::Material *> material;
+        std::vector<int> bin;
+        // The hits in material order. Hits order[bin_start[b]] to
+        // order[bin_start[b + 1] - 1] have material bin_material[b].
+        std::vector<int> order;
+        std::vector<const labhelper::Material *> bin_material;
+        std::vector<int> bin_start;
+        std::vector<int> bin_fill;
+        // Material parameters, indexed like `order`
+        std::vector<vec4> color;
+        std::vector<float> metalness;
+        std::vector<float> fresnel;
+        std::vector<float> roughness;
+        std::vector<float> reflectivity;
+        std::vector<float> emission;
+
+        void resize(size_t n) {
+            rays.resize(n);
+            throughput.resize(n);
+            radiance.resize(n);
+            pixel.resize(n);
+            active.reserve(n);
+            next_active.reserve(n);
+            position.resize(n);
+            geometry_normal.resize(n);
+            shading_normal.resize(n);
+            wo.resize(n);
+            texture_coords.resize(n);
+            material.resize(n);
+            bin.resize(n);
+            order.resize(n);
+            color.resize(n);
+            metalness.resize(n);
+            fresnel.resize(n);
+            roughness.resize(n);
+            reflectivity.resize(n);
+            emission.resize(n);
+        }
+
+        Intersection hit(int k) const {
+            Intersection i;
+            i.position = position[k];
+            i.geometry_normal = geometry_normal[k];
+            i.shading_normal = shading_normal[k];
+            i.wo = wo[k];
+            i.texture_coords = texture_coords[k];
+            i.material = material[k];
+            return i;
+        }
+    };
+
+    static std::vector<PathBatch> batches;
+
+///////////////////////////////////////////////////////////////////////////
+// Counting sort of the hits by material. A tile only sees a handful of
+// materials, so they are found with a linear search.
+///////////////////////////////////////////////////////////////////////////
+    static void sortByMaterial(PathBatch &b, int count) {
+        b.bin_material.clear();
+        int last = -1;
+        for (int k = 0; k < count; k++) {
+            if (last < 0 || b.bin_material[last] != b.material[k]) {
+                auto it = std::find(b.bin_material.begin(), b.bin_material.end(), b.material[k]);
+                last = int(it - b.bin_material.begin());
+                if (it == b.bin_material.end()) {
+                    b.bin_material.push_back(b.material[k]);
+                }
+            }
+            b.bin[k] = last;
+        }
+
+        int bins = int(b.bin_material.size());
+        b.bin_start.assign(bins + 1, 0);
+        for (int k = 0; k < count; k++) {
+            b.bin_start[b.bin[k] + 1]++;
+        }
+        for (int i = 0; i < bins; i++) {
+            b.bin_start[i + 1] += b.bin_start[i];
+        }
+        b.bin_fill.assign(b.bin_start.begin(), b.bin_start.end() - 1);
+        for (int k = 0; k < count; k++) {
+            b.order[b.bin_fill[b.bin[k]]++] = k;
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Evaluate one scalar channel of a material for the sorted hits
+// [begin, end). Without a texture this is a plain fill.
+///////////////////////////////////////////////////////////////////////////
+    static void evaluateChannel(const PathBatch &b, int begin, int end, const labhelper::Texture &texture,
+                                float constant, bool bilinear, std::vector<float> &out) {
+        if (!texture.valid) {
+            std::fill(out.begin() + begin, out.begin() + end, constant);
+        } else if (bilinear) {
+            for (int pos = begin; pos < end; pos++) {
+                const vec2 &uv = b.texture_coords[b.order[pos]];
+                out[pos] = texture.bilinearf(uv.x, uv.y);
+            }
+        } else {
+            for (int pos = begin; pos < end; pos++) {
+                const vec2 &uv = b.texture_coords[b.order[pos]];
+                out[pos] = texture.colorf(uv.x, uv.y);
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Same as evaluateMaterial(), for all hits of one material at once
+///////////////////////////////////////////////////////////////////////////
+    static void evaluateBin(PathBatch &b, int bin) {
+        const labhelper::Material &m = *b.bin_material[bin];
+        int begin = b.bin_start[bin];
+        int end = b.bin_start[bin + 1];
+        bool bilinear = settings.use_bilinear_interp;
+
+        if (!m.m_color_texture.valid) {
+            std::fill(b.color.begin() + begin, b.color.begin() + end, vec4(m.m_color, 1.f - m.m_transparency));
+        } else {
+            for (int pos = begin; pos < end; pos++) {
+                const vec2 &uv = b.texture_coords[b.order[pos]];
+                b.color[pos] = bilinear ? m.m_color_texture.bilinearf4(uv.x, uv.y) : m.m_color_texture.colorf4(uv.x, uv.y);
+            }
+        }
+        evaluateChannel(b, begin, end, m.m_metalness_texture, m.m_metalness, bilinear, b.metalness);
+        evaluateChannel(b, begin, end, m.m_fresnel_texture, m.m_fresnel, bilinear, b.fresnel);
+        evaluateChannel(b, begin, end, m.m_roughness_texture, fclamp(m.m_roughness, 0.001f, 1.f), bilinear,
+                        b.roughness);
+        evaluateChannel(b, begin, end, m.m_reflectivity_texture, m.m_reflectivity, bilinear, b.reflectivity);
+        evaluateChannel(b, begin, end, m.m_emission_texture, m.m_emission, false, b.emission);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Four vectors, one per SSE lane
+///////////////////////////////////////////////////////////////////////////
+    struct Vec3x4 {
+        __m128 x, y, z;
+    };
+
+    static inline Vec3x4 load3(const vec3 *v) {
+        return {_mm_setr_ps(v[0].x, v[1].x, v[2].x, v[3].x), _mm_setr_ps(v[0].y, v[1].y, v[2].y, v[3].y),
+                _mm_setr_ps(v[0].z, v[1].z, v[2].z, v[3].z)};
+    }
+
+    static inline __m128 dot3(const Vec3x4 &a, const Vec3x4 &b) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+    }
+
+    static inline __m128 abs4(__m128 v) {
+        return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+    }
+
+    // BlinnPhong::G1() with v.m and v.n given
+    static inline __m128 G1x4(__m128 v_m, __m128 v_n, __m128 s_sqr) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128 valid = _mm_and_ps(_mm_cmpneq_ps(v_n, zero), _mm_cmpgt_ps(_mm_div_ps(v_m, v_n), zero));
+        __m128 tan_v = _mm_div_ps(_mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(v_n, v_n)))), v_n);
+        __m128 g = _mm_div_ps(_mm_set1_ps(2.0f),
+                              _mm_add_ps(one, _mm_sqrt_ps(_mm_add_ps(one, _mm_mul_ps(s_sqr, _mm_mul_ps(tan_v, tan_v))))));
+        return _mm_and_ps(valid, g);
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// MaterialBSDF::f() (times the cosine term) and pdf() of four opaque hits
+// at once. Without transparency, the tree is the diffuse layer and one
+// Blinn-Phong microfacet layer, which the dielectric and the metal share
+// as they have the same roughness and R0. All the BSDFs are zero unless
+// both directions are above the surface, see sameHemisphere().
+///////////////////////////////////////////////////////////////////////////
+    static void opaqueBSDF4(const vec3 *wi, const vec3 *wo, const vec3 *n, const MaterialParams *p, vec3 *f,
+                            float *pdf) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 inv_pi = _mm_set1_ps(1.0f / M_PI);
+        Vec3x4 i = load3(wi), o = load3(wo), normal = load3(n);
+        __m128 roughness = _mm_setr_ps(p[0].roughness, p[1].roughness, p[2].roughness, p[3].roughness);
+        __m128 R0 = _mm_setr_ps(p[0].fresnel, p[1].fresnel, p[2].fresnel, p[3].fresnel);
+        __m128 metalness = _mm_setr_ps(p[0].metalness, p[1].metalness, p[2].metalness, p[3].metalness);
+        __m128 reflectivity = _mm_setr_ps(p[0].reflectivity, p[1].reflectivity, p[2].reflectivity,
+                                          p[3].reflectivity);
+        __m128 color[3];
+        for (int c = 0; c < 3; c++) {
+            color[c] = _mm_setr_ps(p[0].color[c], p[1].color[c], p[2].color[c], p[3].color[c]);
+        }
+
+        __m128 wi_n = dot3(i, normal);
+        __m128 wo_n = dot3(o, normal);
+        __m128 above = _mm_and_ps(_mm_cmpgt_ps(wi_n, zero), _mm_cmpgt_ps(wo_n, zero));
+        // Diffuse
+        __m128 diffuse = _mm_and_ps(above, inv_pi);
+        __m128 diffuse_pdf = _mm_and_ps(_mm_cmpgt_ps(wi_n, zero), _mm_mul_ps(wi_n, inv_pi));
+
+        // The microfacet layer: F, D and G at the half vector
+        Vec3x4 h = {_mm_add_ps(o.x, i.x), _mm_add_ps(o.y, i.y), _mm_add_ps(o.z, i.z)};
+        __m128 length = _mm_sqrt_ps(dot3(h, h));
+        h = {_mm_div_ps(h.x, length), _mm_div_ps(h.y, length), _mm_div_ps(h.z, length)};
+        __m128 wh_n = dot3(h, normal);
+        __m128 wh_wi = dot3(h, i);
+        __m128 wo_wh = dot3(o, h);
+        __m128 t = _mm_max_ps(zero, _mm_sub_ps(one, abs4(wh_wi)));
+        __m128 t5 = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), _mm_mul_ps(t, t)), t);
+        __m128 F = _mm_add_ps(R0, _mm_mul_ps(_mm_sub_ps(one, R0), t5));
+        __m128 s_sqr = _mm_mul_ps(roughness, roughness);
+        __m128 wh_n2 = _mm_mul_ps(wh_n, wh_n);
+        __m128 tan_m = _mm_div_ps(_mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, wh_n2))), wh_n);
+        __m128 power_term = _mm_add_ps(s_sqr, _mm_mul_ps(tan_m, tan_m));
+        __m128 D = _mm_div_ps(s_sqr, _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(M_PI), _mm_mul_ps(wh_n2, wh_n2)),
+                                                _mm_mul_ps(power_term, power_term)));
+        D = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(wh_n, zero), _mm_cmpneq_ps(power_term, zero)), D);
+        __m128 G = _mm_mul_ps(G1x4(wo_wh, wo_n, s_sqr), G1x4(wh_wi, wi_n, s_sqr));
+        __m128 epsilon = _mm_set1_ps(FLT_EPSILON);
+        __m128 reflection = _mm_div_ps(_mm_mul_ps(_mm_mul_ps(F, D), G),
+                                       _mm_mul_ps(_mm_set1_ps(4.0f), _mm_mul_ps(wo_n, wi_n)));
+        reflection = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(wi_n, epsilon), _mm_cmpge_ps(wo_n, epsilon)), reflection);
+        __m128 microfacet_pdf = _mm_div_ps(_mm_mul_ps(D, abs4(wh_n)), _mm_mul_ps(_mm_set1_ps(4.0f), abs4(wo_wh)));
+
+        // The blends: reflectivity * (metalness * metal + (1 - metalness) * dielectric)
+        // + (1 - reflectivity) * diffuse
+        __m128 cosine = abs4(wi_n);
+        float out[3][4];
+        for (int c = 0; c < 3; c++) {
+            __m128 diffuse_c = _mm_mul_ps(diffuse, color[c]);
+            __m128 dielectric = _mm_and_ps(above, _mm_add_ps(reflection, _mm_mul_ps(_mm_sub_ps(one, F), diffuse_c)));
+            __m128 metal = _mm_and_ps(above, _mm_mul_ps(reflection, color[c]));
+            __m128 specular = _mm_add_ps(_mm_mul_ps(metalness, metal),
+                                         _mm_mul_ps(_mm_sub_ps(one, metalness), dielectric));
+            __m128 total = _mm_add_ps(_mm_mul_ps(reflectivity, specular),
+                                      _mm_mul_ps(_mm_sub_ps(one, reflectivity), diffuse_c));
+            _mm_storeu_ps(out[c], _mm_mul_ps(total, cosine));
+        }
+        __m128 dielectric_pdf = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(microfacet_pdf, diffuse_pdf));
+        __m128 specular_pdf = _mm_add_ps(_mm_mul_ps(metalness, microfacet_pdf),
+                                         _mm_mul_ps(_mm_sub_ps(one, metalness), dielectric_pdf));
+        _mm_storeu_ps(pdf, _mm_add_ps(_mm_mul_ps(reflectivity, specular_pdf),
+                                      _mm_mul_ps(_mm_sub_ps(one, reflectivity), diffuse_pdf)));
+        for (int l = 0; l < 4; l++) {
+            f[l] = vec3(out[0][l], out[1][l], out[2][l]);
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel of a tile
+///////////////////////////////////////////////////////////////////////////
+    static void traceTile(PathBatch &b, const Tile &tile, int width, int height, const vec3 &camera_pos,
+                          const mat4 &inverse_PV, const Tile &region, std::vector<vec3> &result) {
+        int region_width = region.x1 - region.x0;
+        size_t max_paths = size_t((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+        if (b.rays.size() < max_paths) {
+            b.resize(max_paths);
+        }
+
+        ///////////////////////////////////////////////////////////////////
+        // Primary rays. Those that miss the scene are done already.
+        ///////////////////////////////////////////////////////////////////
+        int paths = 0;
+        b.active.clear();
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                int pixel = (y - region.y0) * region_width + (x - region.x0);
+                Ray &ray = b.rays[paths];
+                if (generatePrimaryRay(x, y, width, height, camera_pos, inverse_PV, ray)) {
+                    STATS_COUNT(paths);
+                    b.throughput[paths] = vec3(1.0f);
+                    b.radiance[paths] = vec3(0.0f);
+                    b.pixel[paths] = pixel;
+                    b.active.push_back(paths);
+                    paths++;
+                } else {
+                    result[pixel] = Lenvironment(ray.d);
+                    if (any(isnan(result[pixel]))) {
+                        STATS_COUNT(nan_count);
+                    }
+                }
+            }
+        }
+
+        Stopwatch stopwatch;
+        for (int bounces = 0; bounces <= settings.max_bounces && !b.active.empty(); bounces++) {
+            int count = int(b.active.size());
+
+            ///////////////////////////////////////////////////////////////
+            // Gather the hits
+            ///////////////////////////////////////////////////////////////
+            for (int k = 0; k < count; k++) {
+                STATS_COUNT(path_vertices);
+                Intersection hit = getIntersection(b.rays[b.active[k]]);
+                b.position[k] = hit.position;
+                b.geometry_normal[k] = hit.geometry_normal;
+                b.shading_normal[k] = hit.shading_normal;
+                b.wo[k] = hit.wo;
+                b.texture_coords[k] = hit.texture_coords;
+                b.material[k] = hit.material;
+            }
+            stopwatch.lap(&RenderStats::intersect_seconds);
+
+            ///////////////////////////////////////////////////////////////
+            // Sort by material and evaluate the textures of each material
+            ///////////////////////////////////////////////////////////////
+            sortByMaterial(b, count);
+            for (int bin = 0; bin < int(b.bin_material.size()); bin++) {
+                evaluateBin(b, bin);
+            }
+            stopwatch.lap(&RenderStats::shading_seconds);
+
+            ///////////////////////////////////////////////////////////////
+            // Shade in material order, four hits at a time. The BSDFs of
+            // the light samples are evaluated with opaqueBSDF4(), except
+            // for transparent hits. BSDF sampling stays scalar per hit.
+            ///////////////////////////////////////////////////////////////
+            b.next_active.clear();
+            for (int pos = 0; pos < count; pos += 4) {
+                int lanes = std::min(4, count - pos);
+                Intersection hit[4];
+                MaterialParams params[4];
+                vec3 wo[4], n[4], L[4];
+                for (int l = 0; l < 4; l++) {
+                    // Unused lanes repeat the last hit
+                    int q = pos + std::min(l, lanes - 1);
+                    hit[l] = b.hit(b.order[q]);
+                    params[l].color = b.color[q];
+                    params[l].metalness = b.metalness[q];
+                    params[l].fresnel = b.fresnel[q];
+                    params[l].roughness = b.roughness[q];
+                    params[l].reflectivity = b.reflectivity[q];
+                    params[l].emission = b.emission[q];
+                    wo[l] = hit[l].wo;
+                    n[l] = hit[l].shading_normal;
+                    L[l] = vec3(0.0f);
+                }
+
+                for (auto *light : lights) {
+                    vec3 wi[4], li[4], f[4];
+                    float light_pdf[4], pdf[4];
+                    for (int l = 0; l < 4; l++) {
+                        if (l < lanes) {
+                            li[l] = light->sample_li(hit[l].position + hit[l].geometry_normal * EPSILON, &wi[l],
+                                                     &light_pdf[l]);
+                        } else {
+                            wi[l] = wi[lanes - 1];
+                        }
+                    }
+                    opaqueBSDF4(wi, wo, n, params, f, pdf);
+                    for (int l = 0; l < lanes; l++) {
+                        if (light_pdf[l] <= 0 || !any(greaterThan(abs(li[l]), glm::vec3(EPSILON)))) {
+                            continue;
+                        }
+                        if (params[l].color.a < 1.0f) {
+                            MaterialBSDF material(params[l]);
+                            BSDF &mat = material.bsdf();
+                            f[l] = mat.f(wi[l], wo[l], n[l]) * abs(dot(wi[l], n[l]));
+                            pdf[l] = mat.pdf(wi[l], wo[l], n[l]);
+                        }
+                        L[l] += lightSampleContribution(hit[l], *light, wi[l], light_pdf[l], li[l], f[l], pdf[l],
+                                                        stopwatch);
+                    }
+                }
+                stopwatch.lap(&RenderStats::light_seconds);
+
+                for (int l = 0; l < lanes; l++) {
+                    int i = b.active[b.order[pos + l]];
+                    MaterialBSDF material(params[l]);
+                    BSDF &mat = material.bsdf();
+                    for (auto *light : lights) {
+                        if (!light->isDelta()) {
+                            L[l] += bsdfSampleContribution(hit[l], mat, *light);
+                        }
+                    }
+                    stopwatch.lap(&RenderStats::light_seconds);
+                    b.radiance[i] += L[l];
+                    // Emission
+                    b.radiance[i] += b.throughput[i] * params[l].emission * hit[l].material->m_color;
+
+                    bool alive = scatter(hit[l], mat, b.throughput[i], b.rays[i]);
+                    stopwatch.lap(&RenderStats::shading_seconds);
+                    if (alive) {
+                        b.next_active.push_back(i);
+                    }
+                }
+            }
+
+            ///////////////////////////////////////////////////////////////
+            // Intersect the continuation rays
+            ///////////////////////////////////////////////////////////////
+            b.active.clear();
+            for (int i : b.next_active) {
+                STATS_COUNT(bounce_rays);
+                if (intersect(b.rays[i])) {
+                    b.active.push_back(i);
+                } else {
+                    STATS_COUNT(terminated_escaped);
+                    b.radiance[i] += b.throughput[i] * Lenvironment(b.rays[i].d);
+                }
+            }
+            stopwatch.lap(&RenderStats::intersect_seconds);
+        }
+        for (size_t k = 0; k < b.active.size(); k++) {
+            STATS_COUNT(terminated_max_bounces);
+        }
+
+        for (int i = 0; i < paths; i++) {
+            result[b.pixel[i]] = b.radiance[i];
+            if (any(isnan(b.radiance[i]))) {
+                STATS_COUNT(nan_count);
+            }
+        }
+    }
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "openmp-use-default-none"
+
+    void tracePass(int width, int height, const Tile &region, const vec3 &camera_pos, const mat4 &inverse_PV,
+                   std::vector<glm::vec3> &result) {
+        int region_width = region.x1 - region.x0;
+        int region_height = region.y1 - region.y0;
+        result.resize(size_t(region_width * region_height));
+
+        size_t threads = size_t(omp_get_max_threads());
+        if (batches.size() < threads) {
+            batches.resize(threads);
+        }
+
+        int tiles_x = (region_width + TILE_SIZE - 1) / TILE_SIZE;
+        int tiles_y = (region_height + TILE_SIZE - 1) / TILE_SIZE;
+#pragma omp parallel for schedule(dynamic)
+        for (int t = 0; t < tiles_x * tiles_y; t++) {
+            Tile tile;
+            tile.x0 = region.x0 + (t % tiles_x) * TILE_SIZE;
+            tile.y0 = region.y0 + (t / tiles_x) * TILE_SIZE;
+            tile.x1 = std::min(tile.x0 + TILE_SIZE, region.x1);
+            tile.y1 = std::min(tile.y0 + TILE_SIZE, region.y1);
+            traceTile(batches[omp_get_thread_num()], tile, width, height, camera_pos, inverse_PV, region, result);
+        }
+    }
+
+#pragma clang diagnostic pop
+}
+}
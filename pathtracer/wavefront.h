@@ -0,0 +1,31 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Pathtracer.h"
+
+namespace pathtracer {
+///////////////////////////////////////////////////////////////////////////
+// Wavefront path tracing. Instead of following one path at a time through
+// Li(), all paths of a tile advance one bounce together, in stages:
+//   1. the hits of every live path are gathered into arrays,
+//   2. the hits are sorted by material,
+//   3. the textures of each material are evaluated for all its hits,
+//   4. the paths are shaded in material order, with the BSDFs of the
+//      light samples evaluated four hits at a time with SSE,
+//   5. the continuation rays are intersected.
+// Neighbouring work then uses the same material and textures, which keeps
+// the branches predictable and the texture data in cache.
+///////////////////////////////////////////////////////////////////////////
+namespace wavefront {
+    // Width and height of the tiles traced as one batch
+    const int TILE_SIZE = 32;
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel of `region` (of a width x height image) and
+// store the radiance of each pixel in `result` (row-major, region sized).
+// Tiles of the region are traced in parallel.
+///////////////////////////////////////////////////////////////////////////
+    void tracePass(int width, int height, const Tile &region, const vec3 &camera_pos, const mat4 &inverse_PV,
+                   std::vector<glm::vec3> &result);
+}
+}
@@ -0,0 +1,311 @@
+#include "ParticleEmitters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+ParticleEmitters::~ParticleEmitters() {
+    // The jobs use the emitters
+    wait();
+}
+
+void ParticleEmitters::init(const std::string &texture_filename) {
+    // The attribute is pointed at the buffer in draw()
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    texture = labhelper::TextureCache::instance().get(texture_filename, 4);
+    if (texture == nullptr) {
+        std::cout << "Could not load particle texture " << texture_filename << ".\n";
+    }
+}
+
+void ParticleEmitters::destroy() {
+    wait();
+    buffer.destroy();
+    texture.reset();
+    if (vao != 0) {
+        glDeleteVertexArrays(1, &vao);
+        vao = 0;
+    }
+}
+
+ParticleSystem *ParticleEmitters::add(int max_size, float particles_per_second, float gravity, float air_res,
+                                      float velocity, float lifetime) {
+    emitters.emplace_back(new ParticleSystem(max_size, particles_per_second, gravity, air_res, velocity, lifetime));
+    ParticleSystem *emitter = emitters.back().get();
+    if (!free_arrays.empty()) {
+        emitter->particles = std::move(free_arrays.back());
+        emitter->particles.size = 0;
+        free_arrays.pop_back();
+    }
+    emitter->rng.seed(next_seed++);
+    return emitter;
+}
+
+void ParticleEmitters::remove(ParticleSystem *emitter) {
+    auto found = std::find_if(emitters.begin(), emitters.end(),
+                              [emitter](const std::unique_ptr<ParticleSystem> &e) { return e.get() == emitter; });
+    if (found == emitters.end()) {
+        return;
+    }
+    free_arrays.push_back(std::move((*found)->particles));
+    emitters.erase(found);
+}
+
+size_t ParticleEmitters::numberOfParticles() const {
+    size_t count = 0;
+    for (const auto &emitter : emitters) {
+        count += emitter->particles.size;
+    }
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Neighbouring emitters are grouped until a chunk has about CHUNK_PARTICLES
+// particles to move or spawn, so a few large emitters are spread over the
+// workers, and hundreds of small ones do not each pay for a job.
+///////////////////////////////////////////////////////////////////////////////
+void ParticleEmitters::update(float dt, float currentTime) {
+    wait();
+    int steps = 1;
+    float step = dt, time = currentTime;
+    if (fixed_timestep > 0.f) {
+        accumulated_time += dt;
+        steps = int(accumulated_time / fixed_timestep);
+        if (steps > max_steps_per_update) {
+            steps = max_steps_per_update;
+            accumulated_time = fixed_timestep * steps;
+        }
+        accumulated_time -= fixed_timestep * steps;
+        step = fixed_timestep;
+        time = simulated_time;
+        simulated_time += fixed_timestep * steps;
+    }
+    if (steps == 0) {
+        return;
+    }
+    size_t begin = 0;
+    while (begin < emitters.size()) {
+        size_t end = begin, work = 0;
+        while (end < emitters.size() && work < CHUNK_PARTICLES) {
+            const ParticleSystem &emitter = *emitters[end];
+            work += (emitter.particles.size + size_t(std::max(emitter.pps * step, 0.f)) + 1) * steps;
+            end++;
+        }
+        jobs.push_back(pool.submit([this, begin, end, steps, step, time]() {
+            for (size_t i = begin; i < end; i++) {
+                for (int s = 0; s < steps; s++) {
+                    emitters[i]->process_particles(step, time + s * step);
+                }
+            }
+        }));
+        begin = end;
+    }
+}
+
+void ParticleEmitters::wait() {
+    if (jobs.empty()) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (auto &job : jobs) {
+        job.get();
+    }
+    jobs.clear();
+    std::chrono::duration<float, std::milli> waited = std::chrono::steady_clock::now() - start;
+    wait_ms = waited.count();
+    simulate_ms = 0.f;
+    for (const auto &emitter : emitters) {
+        simulate_ms += emitter->simulate_ms;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sorts `keys`, and `values` along with them. A stable LSD radix sort
+// in three passes of 11 bits, that skips the passes where all keys have the
+// same digit (the high bits of nearby depths usually are). The scratch
+// arrays are swapped with the results, so nothing is allocated once they
+// are large enough.
+///////////////////////////////////////////////////////////////////////////////
+static void radixSort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values,
+                      std::vector<uint32_t> &keys_scratch, std::vector<uint32_t> &values_scratch) {
+    const int BITS = 11, BUCKETS = 1 << BITS, PASSES = 3;
+    static_assert(BITS * PASSES >= 32, "The passes must cover the keys");
+    const size_t n = keys.size();
+    keys_scratch.resize(n);
+    values_scratch.resize(n);
+    uint32_t histogram[PASSES][BUCKETS] = {};
+    for (size_t i = 0; i < n; i++) {
+        for (int pass = 0; pass < PASSES; pass++) {
+            histogram[pass][(keys[i] >> (pass * BITS)) & (BUCKETS - 1)]++;
+        }
+    }
+    for (int pass = 0; pass < PASSES; pass++) {
+        uint32_t *counts = histogram[pass];
+        if (n == 0 || counts[(keys[0] >> (pass * BITS)) & (BUCKETS - 1)] == n) {
+            continue;
+        }
+        uint32_t offset = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++) {
+            uint32_t count = counts[bucket];
+            counts[bucket] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            uint32_t destination = counts[(keys[i] >> (pass * BITS)) & (BUCKETS - 1)]++;
+            keys_scratch[destination] = keys[i];
+            values_scratch[destination] = values[i];
+        }
+        keys.swap(keys_scratch);
+        values.swap(values_scratch);
+    }
+}
+
+// Unsigned keys that sort like the floats they are made from
+static uint32_t sortableKey(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A step moves a particle by exactly its new velocity times the step, so
+// where it was `behind` seconds before the last step ended is
+// position - velocity * behind. Particles spawned by the last step have a
+// lifetime of 0 and did not exist before it, they are drawn where they are.
+///////////////////////////////////////////////////////////////////////////////
+void ParticleEmitters::uploadGpuData(const glm::mat4 &viewMatrix) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t n = numberOfParticles();
+    const float behind = fixed_timestep > 0.f ? fixed_timestep - accumulated_time : 0.f;
+    view_space.resize(n);
+    sort_keys.resize(n);
+    sort_indices.resize(n);
+    size_t i = 0;
+    for (const auto &emitter : emitters) {
+        const ParticleArrays &particles = emitter->particles;
+        for (size_t j = 0; j < particles.size; j++, i++) {
+            const float back = particles.lifetime[j] > 0.f ? behind : 0.f;
+            glm::vec4 pos = viewMatrix * glm::vec4(particles.position[0][j] - particles.velocity[0][j] * back,
+                                                   particles.position[1][j] - particles.velocity[1][j] * back,
+                                                   particles.position[2][j] - particles.velocity[2][j] * back, 1.f);
+            view_space[i] = glm::vec4(pos.x, pos.y, pos.z,
+                                      (particles.lifetime[j] - back) / particles.life_length[j]);
+            sort_keys[i] = sortableKey(pos.z);
+            sort_indices[i] = uint32_t(i);
+        }
+    }
+    // Far (most negative z) first
+    radixSort(sort_keys, sort_indices, sort_keys_scratch, sort_indices_scratch);
+    auto sorted = std::chrono::steady_clock::now();
+
+    glm::vec4 *data = static_cast<glm::vec4 *>(buffer.map(GL_ARRAY_BUFFER, sizeof(glm::vec4) * n));
+    if (data != nullptr) {
+        for (size_t k = 0; k < n; k++) {
+            data[k] = view_space[sort_indices[k]];
+        }
+    }
+    buffer_offset = buffer.unmap();
+    uploaded_particles = data != nullptr ? n : 0;
+    std::chrono::duration<float, std::milli> sort_time = sorted - start;
+    std::chrono::duration<float, std::milli> upload_time = std::chrono::steady_clock::now() - sorted;
+    sort_ms = sort_time.count();
+    upload_ms = upload_time.count();
+}
+
+void ParticleEmitters::draw(GLuint currentShaderProgram,
+                            const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix,
+                            float windowWidth, float windowHeight) {
+    wait();
+    uploadGpuData(viewMatrix);
+    glUseProgram(currentShaderProgram);
+    labhelper::setUniformSlow(currentShaderProgram, "screen_x", windowWidth);
+    labhelper::setUniformSlow(currentShaderProgram, "screen_y", windowHeight);
+    labhelper::setUniformSlow(currentShaderProgram, "P", projectionMatrix);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture != nullptr ? texture->gl_id : 0);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer.buffer());
+    glVertexAttribPointer(0, 4, GL_FLOAT, false, 0, (void *) buffer_offset);
+    glDrawArrays(GL_POINTS, 0, GLsizei(uploaded_particles));
+}
+
+void ParticleEmitters::benchmark() {
+    const float dt = 1.f / 60.f;
+    const int frames = 100;
+    const int particles_per_emitter = 2000;
+    for (int number_of_emitters : {100, 500}) {
+        for (int number_of_threads : {1, 0}) {
+            ParticleEmitters emitters(number_of_threads);
+            for (int e = 0; e < number_of_emitters; e++) {
+                ParticleSystem *emitter = emitters.add(particles_per_emitter, 0.f, 20.f, 0.5f, 50.f, 4.f);
+                // Fill the emitter in one frame, then keep it full
+                emitter->pps = particles_per_emitter / dt;
+                emitter->process_particles(dt, 0.f);
+                emitter->pps = particles_per_emitter / emitter->life_length;
+                // Spread the ages, so particles die and are spawned every frame
+                std::uniform_real_distribution<float> age(0.f, emitter->life_length);
+                for (size_t i = 0; i < emitter->particles.size; i++) {
+                    emitter->particles.lifetime[i] = age(emitter->rng);
+                }
+            }
+            size_t particles = emitters.numberOfParticles();
+            auto start = std::chrono::steady_clock::now();
+            for (int frame = 0; frame < frames; frame++) {
+                emitters.update(dt, frame * dt);
+                emitters.wait();
+            }
+            std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+            double ms_per_frame = time.count() * 1e3 / frames;
+            std::cout << number_of_emitters << " emitters, " << particles << " particles, "
+                      << emitters.pool.size() << " threads: " << ms_per_frame << " ms/frame ("
+                      << ms_per_frame * 1e6 / particles << " ns/particle).\n";
+        }
+    }
+}
+
+void ParticleEmitters::replay(float seconds) {
+    const float step = 1.f / 120.f;
+    const int number_of_emitters = 64;
+    uint64_t checksums[2] = {};
+    for (int run = 0; run < 2; run++) {
+        ParticleEmitters emitters(run == 0 ? 1 : 0);
+        emitters.fixed_timestep = step;
+        for (int e = 0; e < number_of_emitters; e++) {
+            emitters.add(4000, 1000.f + 50.f * e, 20.f, 0.5f, 50.f, 2.f);
+        }
+        const int steps = int(seconds / step + 0.5f);
+        auto start = std::chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++) {
+            // The emitters circle the origin, each at its own height and speed
+            for (int e = 0; e < number_of_emitters; e++) {
+                const float angle = s * step * (0.5f + 0.05f * e) + e;
+                emitters[e].spawnModelMatrix = glm::mat4(
+                        std::cos(angle), 0.f, -std::sin(angle), 0.f,
+                        0.f, 1.f, 0.f, 0.f,
+                        std::sin(angle), 0.f, std::cos(angle), 0.f,
+                        100.f * std::cos(angle), float(e), 100.f * std::sin(angle), 1.f);
+                emitters[e].halted = (s / 240 + e) % 5 == 0;
+            }
+            emitters.update(step, s * step);
+            emitters.wait();
+        }
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+        uint64_t checksum = 14695981039346656037ull;
+        for (size_t e = 0; e < emitters.size(); e++) {
+            checksum = (checksum ^ emitters[e].particles.checksum()) * 1099511628211ull;
+        }
+        checksums[run] = checksum;
+        std::cout << seconds << " s on " << emitters.pool.size() << " threads: " << steps << " steps of "
+                  << number_of_emitters << " emitters, " << emitters.numberOfParticles() << " particles at the end, "
+                  << steps / time.count() << " steps/s, checksum " << std::hex << checksum << std::dec << ".\n";
+    }
+    if (checksums[0] != checksums[1]) {
+        std::cout << "The checksums differ, the simulation depends on the threads.\n";
+    }
+}
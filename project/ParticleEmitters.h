@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ParticleSystem.h"
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+#include <StreamingBuffer.h>
+#include <TextureCache.h>
+#include <ThreadPool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Any number of emitters, simulated on worker threads and drawn with one
+// texture, one buffer and one draw call.
+//
+// update() splits the emitters into chunks of about CHUNK_PARTICLES
+// particles and hands them to the workers, and returns at once, so the
+// simulation runs while the rest of the frame is submitted to GL. The
+// emitters must not be changed, added or removed until wait() has returned.
+// draw() waits, and sorts the particles of all emitters together, so
+// overlapping emitters blend correctly.
+//
+// The arrays of removed emitters are kept in a pool and given to the next
+// added emitter, so emitters that come and go do not allocate.
+//
+// With a fixed_timestep, update() only advances the emitters in whole steps
+// of that length, and keeps the rest of the frame time for the next frame.
+// Together with the seeded generators of the emitters this makes the
+// simulation the same at any frame rate and on any number of threads. The
+// particles are then drawn where they were a fraction of a step ago, which
+// interpolates between the last two steps.
+///////////////////////////////////////////////////////////////////////////////
+class ParticleEmitters {
+private:
+    static const size_t CHUNK_PARTICLES = 16384;
+
+    labhelper::ThreadPool pool;
+    std::vector<std::unique_ptr<ParticleSystem>> emitters;
+    std::vector<ParticleArrays> free_arrays;
+    std::vector<std::future<void>> jobs;
+    uint32_t next_seed = 1;
+    // Frame time that was not yet simulated, less than one fixed step
+    float accumulated_time = 0.f;
+    float simulated_time = 0.f;
+
+    GLuint vao = 0;
+    // Shared with anything else that uses the same image
+    std::shared_ptr<labhelper::TextureImage> texture;
+    // The sorted particles are written straight into this every frame
+    labhelper::StreamingBuffer buffer;
+    size_t buffer_offset = 0;
+    size_t uploaded_particles = 0;
+    // Reused every frame by uploadGpuData(), see radixSort()
+    std::vector<glm::vec4> view_space;
+    std::vector<uint32_t> sort_keys, sort_indices, sort_keys_scratch, sort_indices_scratch;
+
+    void uploadGpuData(const glm::mat4 &viewMatrix);
+
+public:
+    // Milliseconds the calling thread waited for the simulation in the last
+    // wait(), the summed simulation time of all emitters, and the time spent
+    // sorting and uploading in the last draw()
+    float wait_ms = 0.f;
+    float simulate_ms = 0.f;
+    float sort_ms = 0.f;
+    float upload_ms = 0.f;
+    // Seconds per simulation step, or 0 to step once per frame
+    float fixed_timestep = 0.f;
+    // At most this many steps are taken per update(), a slower simulation
+    // falls behind rather than taking ever longer frames
+    int max_steps_per_update = 4;
+
+    // 0 threads means one per core, minus one for the calling thread
+    explicit ParticleEmitters(int number_of_threads = 0) : pool(number_of_threads) {}
+
+    ~ParticleEmitters();
+
+    void init(const std::string &texture_filename = "../../scenes/explosion.png");
+
+    // Deletes the GL objects, call while the context is alive
+    void destroy();
+
+    ParticleSystem *add(int max_size, float particles_per_second, float gravity, float air_res, float velocity,
+                        float lifetime);
+
+    void remove(ParticleSystem *emitter);
+
+    size_t size() const { return emitters.size(); }
+
+    ParticleSystem &operator[](size_t i) { return *emitters[i]; }
+
+    size_t numberOfParticles() const;
+
+    // Simulates dt more seconds of frame time. The time passed to the
+    // emitters is the simulated time, not currentTime, when stepping fixed.
+    void update(float dt, float currentTime);
+
+    void wait();
+
+    void draw(GLuint currentShaderProgram, const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix,
+              float windowWidth, float windowHeight);
+
+    // Times update() and wait() on hundreds of emitters, on one thread and
+    // on the pool, and prints the results. Needs no GL context. Run with:
+    // project --particle-benchmark
+    static void benchmark();
+
+    // Runs `seconds` of a scripted scene of moving emitters with fixed steps,
+    // once on one worker and once on the pool, and prints the steps per
+    // second and a checksum of the particles. The checksums must be equal,
+    // and only change when the behaviour of the simulation does. Run with:
+    // project --particle-replay [seconds]
+    static void replay(float seconds);
+};
@@ -1,111 +1,299 @@
 #include "ParticleSystem.h"
-#include "hdr.h"
 
 #include <algorithm>
-#include <stb_image.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
 
-void ParticleSystem::init() {
-    glGenBuffers(1, &buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 4 * max_size, nullptr, GL_STATIC_DRAW);
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PARTICLES_SSE
+#include <xmmintrin.h>
+#endif
 
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glVertexAttribPointer(0, 4, GL_FLOAT, false, 0, nullptr);
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-
-    int w, h, comp;
-    unsigned char* image = stbi_load("../../scenes/explosion.png", &w, &h, &comp, STBI_rgb_alpha);
-
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-    free(image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-}
-
-void ParticleSystem::uploadGpuData(const glm::mat4 &viewMatrix,
-                                   const glm::mat4 &projectionMatrix) {
-    std::vector<glm::vec4> data;
-    for (auto particle: particles) {
-        glm::vec4 pos = viewMatrix * glm::vec4(particle.pos, 1.f);
-        data.emplace_back(
-                pos.x, pos.y, pos.z,
-                particle.lifetime / particle.life_length
-        );
+void ParticleArrays::reserve(size_t new_capacity) {
+    new_capacity = (new_capacity + PARTICLE_BATCH - 1) / PARTICLE_BATCH * PARTICLE_BATCH;
+    if (new_capacity <= capacity()) {
+        return;
     }
-    std::sort(data.begin(), std::next(data.begin(), data.size()),
-              [](const glm::vec4 &lhs, const glm::vec4 &rhs) { return lhs.z < rhs.z; });
-
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::vec4) * data.size(), &data[0]);
+    for (int k = 0; k < 3; k++) {
+        position[k].resize(new_capacity, 0.f);
+        velocity[k].resize(new_capacity, 0.f);
+    }
+    lifetime.resize(new_capacity, 0.f);
+    life_length.resize(new_capacity, 0.f);
 }
 
-void ParticleSystem::kill(unsigned idx) {
-    particles[idx] = particles.back();
-    particles.pop_back();
+uint64_t ParticleArrays::checksum() const {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const void *data, size_t bytes) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ p[i]) * 1099511628211ull;
+        }
+    };
+    const uint64_t count = size;
+    add(&count, sizeof(count));
+    for (const AlignedFloats *array : {&position[0], &position[1], &position[2], &velocity[0], &velocity[1],
+                                       &velocity[2], &lifetime, &life_length}) {
+        add(array->data(), size * sizeof(float));
+    }
+    return hash;
 }
 
 void ParticleSystem::spawn() {
-    if (particles.size() < max_size) {
-        const float theta = labhelper::uniform_randf(0.f, 2.f * M_PI);
-        const float u = labhelper::uniform_randf(/*-1.f*/0.99f, 1.f);
-        Particle particle{};
-        particle.velocity = glm::normalize(
+    if (particles.size < size_t(std::max(max_size, 0))) {
+        particles.reserve(size_t(max_size));
+        const float theta = random(0.f, 2.f * M_PI);
+        const float u = random(/*-1.f*/0.99f, 1.f);
+        glm::vec3 velocity = glm::normalize(
                 glm::vec3(spawnModelMatrix * (glm::vec4(
                         u,
                         sqrt(1.f - u * u) * cosf(theta),
                         sqrt(1.f - u * u) * sinf(theta),
                         0.0f
                 )))) * initial_velocity;
-        particle.pos = glm::vec3(spawnModelMatrix * glm::vec4(0.f, 0.f, 0.f, 1.f));
-        particle.lifetime = 0.f;
-        particle.life_length = life_length;
-        particles.push_back(particle);
+        glm::vec3 pos = glm::vec3(spawnModelMatrix * glm::vec4(0.f, 0.f, 0.f, 1.f));
+        size_t i = particles.size++;
+        for (int k = 0; k < 3; k++) {
+            particles.position[k][i] = pos[k];
+            particles.velocity[k][i] = velocity[k];
+        }
+        particles.lifetime[i] = 0.f;
+        particles.life_length[i] = life_length;
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// The particles that are still alive are moved and written back in order,
+// over the ones that died. Writes never get ahead of reads, so this is done
+// in place. The drag used to be clamped with
+//     if (length(resistance) < length(velocity)) velocity -= resistance;
+//     else velocity = vec3(0);
+// with resistance = velocity * air_resistance * dt. That is the same as
+// scaling the velocity by max(0, 1 - air_resistance * dt), without the two
+// square roots per particle.
+///////////////////////////////////////////////////////////////////////////////
 void ParticleSystem::process_particles(float dt, float currentTime) {
-    for (unsigned i = 0; i < particles.size(); ++i) {
-        Particle &particle = particles[i];
-        if (particle.lifetime >= particle.life_length) {
-            kill(i);
-            i--;
+    auto start = std::chrono::steady_clock::now();
+    const float drag = std::max(0.f, 1.f - air_resistance * dt);
+    const float gravity_dt = gravity * dt;
+    float *arrays[8] = {particles.position[0].data(), particles.position[1].data(), particles.position[2].data(),
+                        particles.velocity[0].data(), particles.velocity[1].data(), particles.velocity[2].data(),
+                        particles.lifetime.data(), particles.life_length.data()};
+    float **position = arrays, **velocity = arrays + 3;
+    float *lifetime = arrays[6], *life_lengths = arrays[7];
+    const size_t size = particles.size;
+    size_t kept = 0;
+#ifdef PARTICLES_SSE
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 drag4 = _mm_set1_ps(drag);
+    const __m128 gravity_dt4 = _mm_set1_ps(gravity_dt);
+    for (size_t i = 0; i < size; i += 4) {
+        __m128 values[8];
+        values[6] = _mm_load_ps(lifetime + i);
+        values[7] = _mm_load_ps(life_lengths + i);
+        int alive = _mm_movemask_ps(_mm_cmplt_ps(values[6], values[7]));
+        if (size - i < 4) {
+            // The padding after the last particle
+            alive &= (1 << (size - i)) - 1;
+        }
+        if (alive == 0) {
+            continue;
+        }
+        values[6] = _mm_add_ps(values[6], dt4);
+        for (int k = 0; k < 3; k++) {
+            values[3 + k] = _mm_load_ps(velocity[k] + i);
+        }
+        values[4] = _mm_sub_ps(values[4], gravity_dt4);
+        for (int k = 0; k < 3; k++) {
+            values[3 + k] = _mm_mul_ps(values[3 + k], drag4);
+            values[k] = _mm_add_ps(_mm_load_ps(position[k] + i), _mm_mul_ps(values[3 + k], dt4));
+        }
+        if (alive == 0xf) {
+            for (int a = 0; a < 8; a++) {
+                _mm_storeu_ps(arrays[a] + kept, values[a]);
+            }
+            kept += 4;
+        } else {
+            alignas(16) float lanes[8][4];
+            for (int a = 0; a < 8; a++) {
+                _mm_store_ps(lanes[a], values[a]);
+            }
+            for (int lane = 0; lane < 4; lane++) {
+                if (alive & (1 << lane)) {
+                    for (int a = 0; a < 8; a++) {
+                        arrays[a][kept] = lanes[a][lane];
+                    }
+                    kept++;
+                }
+            }
         }
     }
-    for (auto &particle: particles) {
-        particle.lifetime += dt;
-        particle.velocity.y -= gravity * dt;
-        glm::vec3 resistance = particle.velocity * air_resistance * dt;
-        if (length(resistance) < length(particle.velocity)) particle.velocity -= resistance;
-        else particle.velocity = glm::vec3(0);
-        particle.pos += particle.velocity * dt;
+#else
+    for (size_t i = 0; i < size; i++) {
+        if (lifetime[i] >= life_lengths[i]) {
+            continue;
+        }
+        glm::vec3 v(velocity[0][i], velocity[1][i] - gravity_dt, velocity[2][i]);
+        v *= drag;
+        for (int k = 0; k < 3; k++) {
+            position[k][kept] = position[k][i] + v[k] * dt;
+            velocity[k][kept] = v[k];
+        }
+        lifetime[kept] = lifetime[i] + dt;
+        life_lengths[kept] = life_lengths[i];
+        kept++;
     }
+#endif
+    particles.size = kept;
+    collide();
 
-    if (halted) return;
+    if (!halted) {
+        particles_to_spawn += pps * dt;
+        while (particles_to_spawn > 1.f) {
+            spawn();
+            particles_to_spawn -= 1.f;
+        }
+    }
+    std::chrono::duration<float, std::milli> time = std::chrono::steady_clock::now() - start;
+    simulate_ms = time.count();
+}
 
-    particles_to_spawn += pps * dt;
-    while (particles_to_spawn > 1.f) {
-        spawn();
-        particles_to_spawn -= 1.f;
+///////////////////////////////////////////////////////////////////////////////
+// Batches of PARTICLE_BATCH particles that are all above the highest point of
+// the ground under them (from the min-max pyramid) are skipped. In the other
+// batches the ground is sampled under four particles at a time, and the
+// particles below it are put back on it, with the velocity into it reflected.
+///////////////////////////////////////////////////////////////////////////////
+void ParticleSystem::collide() {
+    if (ground == nullptr || ground->empty()) {
+        return;
+    }
+    const labhelper::HeightGrid &grid = *ground;
+    float *position[3] = {particles.position[0].data(), particles.position[1].data(), particles.position[2].data()};
+    float *velocity[3] = {particles.velocity[0].data(), particles.velocity[1].data(), particles.velocity[2].data()};
+    const size_t size = particles.size;
+    const glm::vec2 texels_per_unit = grid.toTexels(1.f, 1.f) - grid.toTexels(0.f, 0.f);
+    const glm::vec2 texel_origin = grid.toTexels(0.f, 0.f);
+    const int last_i = grid.width() - 1, last_j = grid.height() - 1;
+    for (size_t batch = 0; batch < size; batch += PARTICLE_BATCH) {
+        const size_t end = std::min(batch + PARTICLE_BATCH, size);
+        float min_x = position[0][batch], max_x = min_x, min_y = position[1][batch];
+        float min_z = position[2][batch], max_z = min_z;
+        for (size_t i = batch + 1; i < end; i++) {
+            min_x = std::min(min_x, position[0][i]);
+            max_x = std::max(max_x, position[0][i]);
+            min_y = std::min(min_y, position[1][i]);
+            min_z = std::min(min_z, position[2][i]);
+            max_z = std::max(max_z, position[2][i]);
+        }
+        float low, high;
+        grid.heightRange(min_x, min_z, max_x, max_z, low, high);
+        if (min_y >= high) {
+            continue;
+        }
+        for (size_t i = batch; i < end; i += 4) {
+            // Bilinear like a clamped GL_LINEAR texture, see HeightGrid
+            alignas(16) float ground_height[4];
+            int below = 0;
+#ifdef PARTICLES_SSE
+            __m128 tx = _mm_add_ps(_mm_mul_ps(_mm_load_ps(position[0] + i), _mm_set1_ps(texels_per_unit.x)),
+                                   _mm_set1_ps(texel_origin.x));
+            __m128 ty = _mm_add_ps(_mm_mul_ps(_mm_load_ps(position[2] + i), _mm_set1_ps(texels_per_unit.y)),
+                                   _mm_set1_ps(texel_origin.y));
+            tx = _mm_min_ps(_mm_max_ps(tx, _mm_setzero_ps()), _mm_set1_ps(float(last_i)));
+            ty = _mm_min_ps(_mm_max_ps(ty, _mm_setzero_ps()), _mm_set1_ps(float(last_j)));
+            alignas(16) float fx[4], fy[4], corners[4][4];
+            _mm_store_ps(fx, tx);
+            _mm_store_ps(fy, ty);
+            for (int lane = 0; lane < 4; lane++) {
+                const int i0 = std::min(int(fx[lane]), std::max(last_i - 1, 0));
+                const int j0 = std::min(int(fy[lane]), std::max(last_j - 1, 0));
+                fx[lane] -= float(i0);
+                fy[lane] -= float(j0);
+                corners[0][lane] = grid.texel(i0, j0);
+                corners[1][lane] = grid.texel(i0 + 1, j0);
+                corners[2][lane] = grid.texel(i0, j0 + 1);
+                corners[3][lane] = grid.texel(i0 + 1, j0 + 1);
+            }
+            __m128 fs = _mm_load_ps(fx), ft = _mm_load_ps(fy);
+            __m128 top = _mm_add_ps(_mm_load_ps(corners[0]),
+                                    _mm_mul_ps(fs, _mm_sub_ps(_mm_load_ps(corners[1]), _mm_load_ps(corners[0]))));
+            __m128 bottom = _mm_add_ps(_mm_load_ps(corners[2]),
+                                       _mm_mul_ps(fs, _mm_sub_ps(_mm_load_ps(corners[3]), _mm_load_ps(corners[2]))));
+            __m128 h = _mm_add_ps(top, _mm_mul_ps(ft, _mm_sub_ps(bottom, top)));
+            h = _mm_add_ps(_mm_set1_ps(grid.origin().y), _mm_mul_ps(h, _mm_set1_ps(grid.extent().y)));
+            below = _mm_movemask_ps(_mm_cmplt_ps(_mm_load_ps(position[1] + i), h));
+            _mm_store_ps(ground_height, h);
+#else
+            for (int lane = 0; lane < 4; lane++) {
+                ground_height[lane] = grid.heightAt(position[0][i + lane], position[2][i + lane]);
+                if (position[1][i + lane] < ground_height[lane]) {
+                    below |= 1 << lane;
+                }
+            }
+#endif
+            if (end - i < 4) {
+                // The padding after the last particle
+                below &= (1 << (end - i)) - 1;
+            }
+            for (int lane = 0; lane < 4; lane++) {
+                if ((below & (1 << lane)) == 0) {
+                    continue;
+                }
+                const size_t p = i + lane;
+                glm::vec3 n = grid.normalAt(position[0][p], position[2][p]);
+                glm::vec3 v(velocity[0][p], velocity[1][p], velocity[2][p]);
+                float into = glm::dot(v, n);
+                if (into < 0.f) {
+                    glm::vec3 along = v - into * n;
+                    v = along * (1.f - friction) - into * bounce * n;
+                }
+                position[1][p] = ground_height[lane];
+                for (int k = 0; k < 3; k++) {
+                    velocity[k][p] = v[k];
+                }
+            }
+        }
     }
 }
 
-void ParticleSystem::draw(GLuint currentShaderProgram,
-                          const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix,
-                          float windowWidth, float windowHeight) {
-    uploadGpuData(viewMatrix, projectionMatrix);
-    glUseProgram(currentShaderProgram);
-    labhelper::setUniformSlow(currentShaderProgram, "screen_x", windowWidth);
-    labhelper::setUniformSlow(currentShaderProgram, "screen_y", windowHeight);
-    labhelper::setUniformSlow(currentShaderProgram, "P", projectionMatrix);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glBindVertexArray(vao);
-    glDrawArrays(GL_POINTS, 0, particles.size());
+void ParticleSystem::benchmark() {
+    const float dt = 1.f / 60.f;
+    const int frames = 100;
+    // Rolling hills that the falling particles reach after about a second
+    const int resolution = 512;
+    std::vector<float> hills(resolution * resolution);
+    for (int j = 0; j < resolution; j++) {
+        for (int i = 0; i < resolution; i++) {
+            hills[j * resolution + i] = 0.5f + 0.25f * (std::sin(i * 0.05f) + std::cos(j * 0.07f));
+        }
+    }
+    auto ground = std::make_shared<labhelper::HeightGrid>(hills.data(), resolution, resolution,
+                                                          glm::vec3(-200.f, -30.f, -200.f),
+                                                          glm::vec3(400.f, 20.f, 400.f));
+    for (bool collide : {false, true}) {
+        for (int count : {10000, 100000, 1000000}) {
+            ParticleSystem system(count, 0.f, 20.f, 0.5f, 50.f, 4.f);
+            if (collide) {
+                system.ground = ground;
+            }
+            while (system.particles.size < size_t(count)) {
+                system.spawn();
+            }
+            // Spread the ages, so particles die and are spawned every frame
+            for (size_t i = 0; i < system.particles.size; i++) {
+                system.particles.lifetime[i] = system.random(0.f, system.life_length);
+            }
+            system.pps = float(count) / system.life_length;
+            auto start = std::chrono::steady_clock::now();
+            for (int frame = 0; frame < frames; frame++) {
+                system.process_particles(dt, frame * dt);
+            }
+            std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+            double ms_per_frame = time.count() * 1e3 / frames;
+            std::cout << count << " particles" << (collide ? " colliding with the ground" : "") << ": "
+                      << ms_per_frame << " ms/frame (" << ms_per_frame * 1e6 / count << " ns/particle).\n";
+        }
+    }
 }
@@ -2,33 +2,106 @@
 
 
 #include <GL/glew.h>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
 #include <vector>
 #include <glm/detail/type_vec3.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
 #include <labhelper.h>
+#include <HeightGrid.h>
 
-struct Particle {
-    float lifetime;
-    float life_length;
-    glm::vec3 velocity;
-    glm::vec3 pos;
+///////////////////////////////////////////////////////////////////////////////
+// An allocator for arrays that are read with aligned SIMD loads
+///////////////////////////////////////////////////////////////////////////////
+template<typename T, size_t Alignment = 32>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) {
+        void *p = nullptr;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = nullptr;
+#endif
+        if (p == nullptr) throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t) {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
 };
 
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloats;
+
+///////////////////////////////////////////////////////////////////////////////
+// The particles as a structure of arrays. The first `size` entries are
+// alive, and the arrays are padded to a multiple of PARTICLE_BATCH so that
+// whole batches can always be loaded.
+///////////////////////////////////////////////////////////////////////////////
+const size_t PARTICLE_BATCH = 8;
+
+struct ParticleArrays {
+    size_t size = 0;
+    AlignedFloats position[3];
+    AlignedFloats velocity[3];
+    AlignedFloats lifetime;
+    AlignedFloats life_length;
+
+    size_t capacity() const { return lifetime.size(); }
+
+    // Keeps the particles, and pads the capacity to whole batches
+    void reserve(size_t capacity);
+
+    // FNV-1a hash of the live particles, to check that changes to the
+    // simulation do not change its results
+    uint64_t checksum() const;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// One emitter. The simulation only touches the emitter's own state, so
+// different emitters can be processed on different threads at the same
+// time. Drawing is done for all emitters at once by ParticleEmitters.
+///////////////////////////////////////////////////////////////////////////////
 class ParticleSystem {
 private:
-    GLuint vao = 0;
-    GLuint buffer = 0;
-    GLuint texture = 0;
     float particles_to_spawn = 0.f;
 
-    void kill(unsigned idx);
-
     void spawn();
 
-    void uploadGpuData(const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix);
+    void collide();
+
+    float random(float from, float to) {
+        return from + (to - from) * std::generate_canonical<float, 24>(rng);
+    }
 
 public:
-    std::vector<Particle> particles;
+    ParticleArrays particles;
     int max_size;
     float gravity;
     float air_resistance;
@@ -37,6 +110,17 @@ public:
     bool halted;
     float pps;
     glm::mat4 spawnModelMatrix;
+    // Particles that fall below this bounce off it. Set it between steps,
+    // the pointer keeps the grid alive while a step uses it.
+    std::shared_ptr<const labhelper::HeightGrid> ground;
+    // The part of the speed into the ground that is kept, and the part of
+    // the speed along it that is lost, in a collision
+    float bounce = 0.3f;
+    float friction = 0.2f;
+    // Each emitter has its own generator, rand() is shared by all threads
+    std::minstd_rand rng;
+    // Milliseconds spent in the last process_particles()
+    float simulate_ms = 0.f;
 
     ParticleSystem() : ParticleSystem(0, 0.f, 0.f, 0.f, 0.f, 0.f) {}
 
@@ -49,10 +133,12 @@ public:
 
     ~ParticleSystem() = default;
 
-    void init();
-
+    // Removes the particles that have lived their life length, moves the
+    // others, and spawns new ones. One pass over the arrays, four particles
+    // at a time with SSE. Then lets them collide with the ground.
     void process_particles(float dt, float ct);
 
-    void draw(GLuint currentShaderProgram, const glm::mat4 &viewMatrix, const glm::mat4 &projectionMatrix,
-            float windowWidth, float windowHeight);
+    // Times process_particles() on 10k to 1M particles and prints the
+    // results. Needs no GL context. Run with: project --particle-benchmark
+    static void benchmark();
 };
@@ -1,6 +1,10 @@
 #include "hdr.h"
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <stb_image.h>
+#include <AsyncLoader.h>
+#include <ThreadPool.h>
 
 namespace labhelper
 {
@@ -11,14 +15,20 @@ struct HDRImage
 	// Constructor
 	HDRImage(const std::string& filename)
 	{
-		stbi_set_flip_vertically_on_load(false);
 		data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
-		stbi_set_flip_vertically_on_load(true);
 		if(data == nullptr)
 		{
 			std::cout << "Failed to load image: " << filename << ".\n";
 			exit(1);
 		}
+		// stb_image flips images on load (see init_window_SDL), but not
+		// environment maps. The flip setting is global and other images may
+		// be decoded at the same time, so flip them back here instead.
+		for(int y = 0; y < height / 2; y++)
+		{
+			float* row = data + size_t(y) * width * 3;
+			std::swap_ranges(row, row + width * 3, data + size_t(height - 1 - y) * width * 3);
+		}
 	};
 	// Destructor
 	~HDRImage()
@@ -27,7 +37,7 @@ struct HDRImage
 	};
 };
 
-GLuint loadHdrTexture(const std::string& filename)
+static GLuint uploadHdrTexture(const HDRImage& image)
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -38,13 +48,12 @@ GLuint loadHdrTexture(const std::string& filename)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-	HDRImage image(filename);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
 
 	return texId;
 }
 
-GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+static GLuint createHdrMipmapTexture()
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -53,17 +62,88 @@ GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	return texId;
+}
 
+static void uploadHdrMipmapLevel(GLuint texId, int level, const HDRImage& image)
+{
+	glBindTexture(GL_TEXTURE_2D, texId);
+	glTexImage2D(GL_TEXTURE_2D, level, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+	if(level == 0)
+	{
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+}
+
+GLuint loadHdrTexture(const std::string& filename)
+{
+	HDRImage image(filename);
+	return uploadHdrTexture(image);
+}
+
+GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+{
+	GLuint texId = createHdrMipmapTexture();
 	for(int i = 0; i < filenames.size(); i++)
 	{
 		HDRImage image(filenames[i]);
-		glTexImage2D(GL_TEXTURE_2D, i, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
-		if(i == 0)
-		{
-			glGenerateMipmap(GL_TEXTURE_2D);
-		}
+		uploadHdrMipmapLevel(texId, i, image);
 	}
 
 	return texId;
 }
+
+typedef std::shared_future<std::shared_ptr<HDRImage>> HDRImageFuture;
+
+static HDRImageFuture decodeHdrImage(const std::string& filename)
+{
+	return ThreadPool::shared().submit([filename]() { return std::make_shared<HDRImage>(filename); }).share();
+}
+
+std::shared_future<GLuint> loadHdrTextureAsync(const std::string& filename)
+{
+	HDRImageFuture image = decodeHdrImage(filename);
+	auto result = std::make_shared<std::promise<GLuint>>();
+	queueUpload([image, result]() -> UploadStatus {
+		if(!isReady(image))
+		{
+			return UPLOAD_WAITING;
+		}
+		result->set_value(uploadHdrTexture(*image.get()));
+		return UPLOAD_DONE;
+	});
+	return result->get_future().share();
+}
+
+std::shared_future<GLuint> loadHdrMipmapTextureAsync(const std::vector<std::string>& filenames)
+{
+	// All levels are decoded in parallel, and uploaded one per step
+	std::vector<HDRImageFuture> images;
+	for(const auto& filename : filenames)
+	{
+		images.push_back(decodeHdrImage(filename));
+	}
+	auto result = std::make_shared<std::promise<GLuint>>();
+	GLuint texId = 0;
+	size_t level = 0;
+	queueUpload([images, result, texId, level]() mutable -> UploadStatus {
+		if(!isReady(images[level]))
+		{
+			return UPLOAD_WAITING;
+		}
+		if(level == 0)
+		{
+			texId = createHdrMipmapTexture();
+		}
+		uploadHdrMipmapLevel(texId, int(level), *images[level].get());
+		images[level] = HDRImageFuture();
+		if(++level < images.size())
+		{
+			return UPLOAD_PROGRESS;
+		}
+		result->set_value(texId);
+		return UPLOAD_DONE;
+	});
+	return result->get_future().share();
+}
 } // namespace labhelper
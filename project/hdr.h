@@ -1,8 +1,13 @@
 #include <vector>
 #include <string>
+#include <future>
 #include <GL/glew.h>
 
 namespace labhelper {
 	GLuint loadHdrTexture(const std::string &filename);
 	GLuint loadHdrMipmapTexture(const std::vector<std::string> &filenames);
+	// Decode on the ThreadPool and upload from finishUploads() (see
+	// AsyncLoader.h). The futures are ready once the texture is uploaded.
+	std::shared_future<GLuint> loadHdrTextureAsync(const std::string &filename);
+	std::shared_future<GLuint> loadHdrMipmapTextureAsync(const std::vector<std::string> &filenames);
 }
\ No newline at end of file
@@ -1,30 +1,116 @@
 
 #include "heightfield.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <stdint.h>
+#include <memory>
+#include <utility>
 #include <vector>
 #include <stb_image.h>
 #include <labhelper.h>
+#include <AsyncLoader.h>
+#include <ThreadPool.h>
 #include <glm/gtc/matrix_transform.hpp>
 
 using namespace glm;
 using std::string;
 
 HeightField::HeightField(void)
-        : m_meshResolution(0), m_vao(UINT32_MAX), m_positionBuffer(UINT32_MAX), m_uvBuffer(UINT32_MAX),
-          m_indexBuffer(UINT32_MAX), m_numIndices(0), m_texid_hf(UINT32_MAX), m_texid_diffuse(UINT32_MAX),
+        : m_meshResolution(0), m_vao(UINT32_MAX), m_positionBuffer(UINT32_MAX),
+          m_indexBuffer(UINT32_MAX), m_numIndices(0), m_numHalfIndices(0), m_texid_hf(UINT32_MAX), m_texid_diffuse(UINT32_MAX),
           m_heightFieldPath(""), m_diffuseTexturePath("") {
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Images are decoded separately from the upload, so that it can be done on
+// the ThreadPool. They are flipped on load, see init_window_SDL.
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+struct DecodedImage {
+    T *data = nullptr;
+    int width = 0, height = 0, components = 0;
+
+    ~DecodedImage() {
+        stbi_image_free(data);
+    }
+};
+
+static std::shared_ptr<DecodedImage<float>> decodeHeightField(const std::string &path) {
+    auto image = std::make_shared<DecodedImage<float>>();
+    image->data = stbi_loadf(path.c_str(), &image->width, &image->height, &image->components, 1);
+    return image;
+}
+
+static std::shared_ptr<DecodedImage<uint8_t>> decodeDiffuseTexture(const std::string &path) {
+    auto image = std::make_shared<DecodedImage<uint8_t>>();
+    image->data = stbi_load(path.c_str(), &image->width, &image->height, &image->components, 3);
+    return image;
+}
+
 void HeightField::loadHeightField(const std::string &heigtFieldPath) {
-    int width, height, components;
-    stbi_set_flip_vertically_on_load(true);
-    float *data = stbi_loadf(heigtFieldPath.c_str(), &width, &height, &components, 1);
+    auto image = decodeHeightField(heigtFieldPath);
+    uploadHeightField(heigtFieldPath, image->data, image->width, image->height);
+}
+
+void HeightField::loadDiffuseTexture(const std::string &diffusePath) {
+    auto image = decodeDiffuseTexture(diffusePath);
+    uploadDiffuseTexture(diffusePath, image->data, image->width, image->height);
+}
+
+void HeightField::loadHeightFieldAsync(const std::string &heigtFieldPath) {
+    // The grid and its pyramid are built on the pool too
+    typedef std::pair<std::shared_ptr<DecodedImage<float>>, std::shared_ptr<const labhelper::HeightGrid>> Decoded;
+    auto image = labhelper::ThreadPool::shared().submit([this, heigtFieldPath]() {
+        auto decoded = decodeHeightField(heigtFieldPath);
+        return Decoded(decoded, makeGrid(decoded->data, decoded->width, decoded->height));
+    }).share();
+    labhelper::queueUpload([this, image, heigtFieldPath]() -> labhelper::UploadStatus {
+        if (!labhelper::isReady(image)) {
+            return labhelper::UPLOAD_WAITING;
+        }
+        const auto &decoded = *image.get().first;
+        uploadHeightField(heigtFieldPath, decoded.data, decoded.width, decoded.height, image.get().second);
+        return labhelper::UPLOAD_DONE;
+    });
+}
+
+void HeightField::loadDiffuseTextureAsync(const std::string &diffusePath) {
+    auto image = labhelper::ThreadPool::shared().submit([diffusePath]() {
+        return decodeDiffuseTexture(diffusePath);
+    }).share();
+    labhelper::queueUpload([this, image, diffusePath]() -> labhelper::UploadStatus {
+        if (!labhelper::isReady(image)) {
+            return labhelper::UPLOAD_WAITING;
+        }
+        const auto &decoded = *image.get();
+        uploadDiffuseTexture(diffusePath, decoded.data, decoded.width, decoded.height);
+        return labhelper::UPLOAD_DONE;
+    });
+}
+
+glm::mat4 HeightField::modelMatrix() const {
+    return scale(translate(mat4(1), m_translation), m_scale);
+}
+
+std::shared_ptr<const labhelper::HeightGrid> HeightField::makeGrid(const float *data, int width, int height) const {
+    if (data == nullptr) {
+        return nullptr;
+    }
+    return std::make_shared<labhelper::HeightGrid>(data, width, height, m_translation - vec3(m_scale.x, 0.f, m_scale.z),
+                                                   vec3(2.f * m_scale.x, m_scale.y, 2.f * m_scale.z));
+}
+
+void HeightField::uploadHeightField(const std::string &heigtFieldPath, const float *data, int width, int height,
+                                    std::shared_ptr<const labhelper::HeightGrid> grid) {
     if (data == nullptr) {
         std::cout << "Failed to load image: " << heigtFieldPath << ".\n";
         return;
     }
+    m_grid = grid != nullptr ? grid : makeGrid(data, width, height);
+    m_heightFieldWidth = std::max(width, height);
+    m_selectionValid = false;
 
     if (m_texid_hf == UINT32_MAX) {
         glGenTextures(1, &m_texid_hf);
@@ -42,10 +128,7 @@ void HeightField::loadHeightField(const std::string &heigtFieldPath) {
     std::cout << "Successfully loaded heigh field texture: " << heigtFieldPath << ".\n";
 }
 
-void HeightField::loadDiffuseTexture(const std::string &diffusePath) {
-    int width, height, components;
-    stbi_set_flip_vertically_on_load(true);
-    uint8_t *data = stbi_load(diffusePath.c_str(), &width, &height, &components, 3);
+void HeightField::uploadDiffuseTexture(const std::string &diffusePath, const uint8_t *data, int width, int height) {
     if (data == nullptr) {
         std::cout << "Failed to load image: " << diffusePath << ".\n";
         return;
@@ -69,65 +152,178 @@ void HeightField::loadDiffuseTexture(const std::string &diffusePath) {
 
 
 void HeightField::generateMesh(int tesselation) {
-    float uvStep = 1.f / tesselation;
-    float step = uvStep * 2.f;
-    int nVertices = tesselation + 1; // 1 vertex more than faces
-
-    int verticesSize = nVertices * nVertices;
-    // Allocate in the heap because in the stack we get segmentation fault with 1024 of tesselation (1 million vecs)
-    vec3 *vertices = new vec3[verticesSize];
-    vec2 *uv = new vec2[verticesSize];
+    // The half resolution patch morphs like the full one, so it needs an
+    // even number of quads too
+    tesselation = std::max(4, (tesselation + 3) / 4 * 4);
+    const int nVertices = tesselation + 1; // 1 vertex more than faces
 
+    // The patch spans [0, 1], and is placed and scaled per node
+    std::vector<vec2> vertices(nVertices * nVertices);
     for (int i = 0; i < nVertices; i++) {
         for (int j = 0; j < nVertices; j++) {
-            vertices[i * nVertices + j] = vec3(j * step - 1.f, 0.f, i * step - 1.f);
-            uv[i * nVertices + j] = vec2(j * uvStep, i * uvStep);
+            vertices[i * nVertices + j] = vec2(j, i) / float(tesselation);
         }
     }
 
+    std::vector<uint32_t> indices;
+    for (int step : {1, 2}) {
+        for (int i = 0; i < tesselation; i += step) {
+            for (int j = 0; j < tesselation; j += step) {
+                uint32_t a = i * nVertices + j, b = a + step, c = a + step * nVertices, d = c + step;
+                uint32_t quad[] = {a, c, b, b, c, d};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+        if (step == 1) {
+            m_numIndices = GLuint(indices.size());
+        }
+    }
+    m_numHalfIndices = GLuint(indices.size()) - m_numIndices;
+
     glGenVertexArrays(1, &m_vao);
     glBindVertexArray(m_vao);
 
-    // Send them already, to erase them from memory
     glGenBuffers(1, &m_positionBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, m_positionBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * verticesSize, vertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, nullptr);
-    // Enable the attribute
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, nullptr);
     glEnableVertexAttribArray(0);
 
-    glGenBuffers(1, &m_uvBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_uvBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * verticesSize, uv, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 2, GL_FLOAT, false, 0, nullptr);
-    // Enable the attribute
-    glEnableVertexAttribArray(1);
+    // One (x, z, size, level) and one tile per node, pointed at the node
+    // buffer in draw()
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
 
-    delete[] vertices;
-    delete[] uv;
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * indices.size(), indices.data(), GL_STATIC_DRAW);
 
-    // 2 per strip + 1 extra for primitive restart, as many strips as tesselation
-    m_numIndices = (2 * nVertices + 1) * tesselation;
-    int *indices = new int[m_numIndices];
-    int next = 0;
+    m_meshResolution = tesselation;
+    m_selectionValid = false;
+}
 
-    // We use tesselation cause there is no need for an extra strip
-    for (int i = 0; i < tesselation; i++) {
-        // But we do need an extra couple of vertices to close each strip
-        for (int j = 0; j < nVertices; j++) {
-            indices[next++] = i * nVertices + j;
-            indices[next++] = (i + 1) * nVertices + j;
+float HeightField::lodRange(int depth) const {
+    if (depth <= 0) {
+        return INFINITY;
+    }
+    return m_lodDetail * 2.f * m_scale.x / float(1 << depth);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns false if the node is beyond its range, then its parent covers the
+// area at the parent's level. Nodes outside the frustum are "selected" with
+// nothing to draw, before the range test, so that the parent does not draw
+// them either.
+///////////////////////////////////////////////////////////////////////////////
+bool HeightField::selectNode(float x, float z, float size, int depth, const labhelper::Frustum &frustum,
+                             const vec3 &camera) {
+    vec3 low = m_translation + m_scale * vec3(x, 0.f, z);
+    vec3 high = m_translation + m_scale * vec3(x + size, 1.f, z + size);
+    if (m_tiles != nullptr) {
+        const float tiles = float(1 << depth);
+        m_tiles->heightRange(depth, int((x + 1.f) * 0.5f * tiles + 0.5f), int((z + 1.f) * 0.5f * tiles + 0.5f),
+                             low.y, high.y);
+        low.y = m_translation.y + m_scale.y * low.y;
+        high.y = m_translation.y + m_scale.y * high.y;
+    } else if (m_grid != nullptr) {
+        m_grid->heightRange(low.x, low.z, high.x, high.z, low.y, high.y);
+    }
+    if (!labhelper::intersects(frustum, 0.5f * (low + high), 0.5f * (high - low))) {
+        return true;
+    }
+    vec3 closest = clamp(camera, low, high);
+    if (distance(closest, camera) > lodRange(depth)) {
+        return false;
+    }
+    if (depth == m_maxDepth || distance(closest, camera) > lodRange(depth + 1)) {
+        m_nodes.push_back(vec4(x, z, size, float(depth)));
+        m_nodeTiles.push_back(useTile(x, z, depth));
+        return true;
+    }
+    const float half = 0.5f * size;
+    for (int child = 0; child < 4; child++) {
+        float cx = x + half * float(child & 1), cz = z + half * float(child >> 1);
+        if (!selectNode(cx, cz, half, depth + 1, frustum, camera)) {
+            m_quarterNodes.push_back(vec4(cx, cz, half, float(depth)));
+            m_quarterTiles.push_back(useTile(cx, cz, depth + 1));
         }
-        indices[next++] = UINT32_MAX; // primitive restart
     }
+    return true;
+}
 
-    glGenBuffers(1, &m_indexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(int) * m_numIndices, indices, GL_STATIC_DRAW);
+vec4 HeightField::useTile(float x, float z, int depth) {
+    if (m_tiles == nullptr) {
+        return vec4(0.f);
+    }
+    const float tiles = float(1 << depth);
+    vec4 tile = m_tiles->use(depth, int((x + 1.f) * 0.5f * tiles + 0.5f), int((z + 1.f) * 0.5f * tiles + 0.5f));
+    return vec4(2.f * tile.x - 1.f, 2.f * tile.y - 1.f, 2.f * tile.z, tile.w);
+}
+
+bool HeightField::loadTiles(const std::string &directory) {
+    m_tiles.reset(new TerrainTiles());
+    if (!m_tiles->open(directory)) {
+        m_tiles.reset();
+        return false;
+    }
+    m_heightFieldWidth = m_tiles->tileSize() << (m_tiles->levels() - 1);
+    m_selectionValid = false;
 
-    delete[] indices;
+    // Collisions use the level 0 tile, which is always resident. Its heights
+    // are at the corners of its cells rather than at texel centers, so the
+    // grid reaches half a cell past the terrain on every side.
+    const int size = m_tiles->tileSize();
+    vec3 cell(2.f * m_scale.x / float(size), 0.f, 2.f * m_scale.z / float(size));
+    m_grid = std::make_shared<labhelper::HeightGrid>(m_tiles->rootHeights().data(), size + 1, size + 1,
+                                                     m_translation - vec3(m_scale.x, 0.f, m_scale.z) - 0.5f * cell,
+                                                     vec3(2.f * m_scale.x, m_scale.y, 2.f * m_scale.z) + cell);
+    return true;
+}
 
-    m_meshResolution = tesselation;
+void HeightField::updateTiles() {
+    if (m_tiles != nullptr && m_tiles->update()) {
+        m_selectionValid = false;
+    }
+}
+
+void HeightField::selectNodes(const mat4 &viewMatrix, const mat4 &projectionMatrix) {
+    if (m_selectionValid && viewMatrix == m_selectedView && projectionMatrix == m_selectedProjection
+        && m_lodDetail == m_selectedDetail) {
+        return;
+    }
+    // The leaves have about one quad per texel
+    m_maxDepth = 0;
+    while (m_maxDepth + 1 < MAX_LODS && (m_meshResolution << m_maxDepth) < m_heightFieldWidth) {
+        m_maxDepth++;
+    }
+    m_nodes.clear();
+    m_quarterNodes.clear();
+    m_nodeTiles.clear();
+    m_quarterTiles.clear();
+    const labhelper::Frustum frustum = labhelper::frustumFromMatrix(projectionMatrix * viewMatrix);
+    const vec3 camera = vec3(inverse(viewMatrix)[3]);
+    selectNode(-1.f, -1.f, 2.f, 0, frustum, camera);
+
+    // The nodes, then their tiles
+    const size_t count = m_nodes.size() + m_quarterNodes.size();
+    vec4 *data = static_cast<vec4 *>(m_nodeBuffer.map(GL_ARRAY_BUFFER, 2 * sizeof(vec4) * count));
+    if (data != nullptr) {
+        data = std::copy(m_nodes.begin(), m_nodes.end(), data);
+        data = std::copy(m_quarterNodes.begin(), m_quarterNodes.end(), data);
+        data = std::copy(m_nodeTiles.begin(), m_nodeTiles.end(), data);
+        std::copy(m_quarterTiles.begin(), m_quarterTiles.end(), data);
+    }
+    m_nodeOffset = m_nodeBuffer.unmap();
+    if (data == nullptr) {
+        m_nodes.clear();
+        m_quarterNodes.clear();
+    }
+    m_selectionValid = true;
+    m_selectedView = viewMatrix;
+    m_selectedProjection = projectionMatrix;
+    m_selectedDetail = m_lodDetail;
 }
 
 void HeightField::draw(GLuint currentShaderProgram, const mat4 &viewMatrix, const mat4 &projectionMatrix,
@@ -136,9 +332,14 @@ void HeightField::draw(GLuint currentShaderProgram, const mat4 &viewMatrix, cons
         std::cout << "No vertex array is generated, cannot draw anything.\n";
         return;
     }
+    if (m_tiles == nullptr && (m_texid_hf == UINT32_MAX || m_texid_diffuse == UINT32_MAX)) {
+        // Not loaded (yet)
+        return;
+    }
+    selectNodes(viewMatrix, projectionMatrix);
     glUseProgram(currentShaderProgram);
 
-    mat4 modelMatrix = scale(translate(mat4(1), vec3(0.f, -300.f, 0.f)), vec3(20000.f, 1000.f, 20000.f));
+    mat4 modelMatrix = this->modelMatrix();
     labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
                               projectionMatrix * viewMatrix * modelMatrix);
     labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * modelMatrix);
@@ -153,12 +354,45 @@ void HeightField::draw(GLuint currentShaderProgram, const mat4 &viewMatrix, cons
     glUniform1fv(glGetUniformLocation(currentShaderProgram, "material_fresnel"), 1, &m_fresnel);
     glUniform1fv(glGetUniformLocation(currentShaderProgram, "material_shininess"), 1, &m_shininess);
 
+    // Morph over the last third of each range, towards the next level out
+    vec2 lodMorph[MAX_LODS];
+    for (int depth = 0; depth < MAX_LODS; depth++) {
+        float end = lodRange(depth), start = mix(lodRange(depth + 1), end, 0.66f);
+        lodMorph[depth] = depth == 0 ? vec2(1e30f, 2e30f) : vec2(start, end);
+    }
+    glUniform2fv(labhelper::getUniformLocation(currentShaderProgram, "lodMorph"), MAX_LODS, &lodMorph[0].x);
+    GLint gridResolution = labhelper::getUniformLocation(currentShaderProgram, "gridResolution");
+    labhelper::setUniformSlow(currentShaderProgram, "useTiles", GLint(m_tiles != nullptr));
+
 //    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texid_hf);
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, m_texid_diffuse);
+    if (m_tiles != nullptr) {
+        labhelper::setUniformSlow(currentShaderProgram, "tileSize", float(m_tiles->tileSize()));
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_tiles->heightTexture());
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_tiles->diffuseTexture());
+    }
     glBindVertexArray(m_vao);
-    glDrawElements(GL_TRIANGLE_STRIP, m_numIndices, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, m_nodeBuffer.buffer());
+    const size_t tileOffset = m_nodeOffset + sizeof(vec4) * (m_nodes.size() + m_quarterNodes.size());
+    if (!m_nodes.empty()) {
+        glUniform1f(gridResolution, float(m_meshResolution));
+        glVertexAttribPointer(2, 4, GL_FLOAT, false, 0, (void *) m_nodeOffset);
+        glVertexAttribPointer(3, 4, GL_FLOAT, false, 0, (void *) tileOffset);
+        glDrawElementsInstanced(GL_TRIANGLES, m_numIndices, GL_UNSIGNED_INT, nullptr, GLsizei(m_nodes.size()));
+    }
+    if (!m_quarterNodes.empty()) {
+        glUniform1f(gridResolution, float(m_meshResolution / 2));
+        glVertexAttribPointer(2, 4, GL_FLOAT, false, 0, (void *) (m_nodeOffset + sizeof(vec4) * m_nodes.size()));
+        glVertexAttribPointer(3, 4, GL_FLOAT, false, 0, (void *) (tileOffset + sizeof(vec4) * m_nodes.size()));
+        glDrawElementsInstanced(GL_TRIANGLES, m_numHalfIndices, GL_UNSIGNED_INT,
+                                (void *) (sizeof(uint32_t) * m_numIndices), GLsizei(m_quarterNodes.size()));
+    }
 //    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-}
\ No newline at end of file
+    m_drawnNodes = int(m_nodes.size() + m_quarterNodes.size());
+    m_drawnTriangles = int((m_nodes.size() * m_numIndices + m_quarterNodes.size() * m_numHalfIndices) / 3);
+}
@@ -4,6 +4,8 @@
 precision highp float;
 
 layout(binding = 1) uniform sampler2D diffuseMap;
+layout(binding = 3) uniform sampler2DArray diffuseTiles;
+uniform bool useTiles;
 layout(binding = 4) uniform sampler2D ssao;
 uniform bool useSsao;
 
@@ -34,6 +36,8 @@ layout(binding = 8) uniform sampler2D reflectionMap;
 in vec2 texCoord;
 in vec3 viewSpaceNormal;
 in vec3 viewSpacePosition;
+in vec2 tileCoord;
+flat in float tileLayer;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
@@ -61,7 +65,8 @@ vec3 calculateIndirectIllumination(vec3 wo, vec3 n)
     vec2 lookup = sphericalCoords(N);
     vec4 irradiance = environment_multiplier * texture(irradianceMap, lookup);
     float ssaoValue = texture(ssao, gl_FragCoord.xy / textureSize(ssao, 0)).r;
-    vec3 material_color = texture(diffuseMap, texCoord).xyz;
+    vec3 material_color = useTiles ? texture(diffuseTiles, vec3(tileCoord, tileLayer)).xyz
+                                   : texture(diffuseMap, texCoord).xyz;
     vec3 diffuse_term = material_color * (1 / PI) * irradiance.rgb * (useSsao ? ssaoValue : 1.0f);
 
     vec3 wo_w = mat3(viewInverse) * wo;
@@ -1,17 +1,45 @@
+#include <memory>
 #include <string>
 #include <GL/glew.h>
+#include <vector>
 #include <glm/glm.hpp>
+#include <Culling.h>
+#include <HeightGrid.h>
+#include <StreamingBuffer.h>
+#include "terraintiles.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// The terrain is drawn with continuous distance-dependent LOD (Strugar 2009,
+// "Continuous Distance-Dependent Level of Detail for Rendering Heightmaps").
+// A quadtree over the terrain is walked every frame, and every selected node
+// is an instance of one small grid patch. A node at depth d is used up to
+// lodRange(d) from the camera, which halves with each level. Near the end of
+// its range the vertex shader slides every other vertex of the patch onto
+// its even neighbour, so the patch turns into the coarser level next to
+// it without cracks or pops. Nodes outside the frustum are skipped, with
+// their heights bounded by the min-max pyramid of m_grid.
+//
+// Instead of one height texture and one diffuse texture, the terrain can
+// come from tiles that are streamed in as the nodes need them, see
+// TerrainTiles. Each node is then drawn with the finest resident tile that
+// covers it.
+///////////////////////////////////////////////////////////////////////////////
 
 class HeightField {
 public:
-	int m_meshResolution; // triangles edges per quad side
+	static const int MAX_LODS = 16;
+
+	int m_meshResolution; // quads per side of the patch
 	GLuint m_texid_hf;
 	GLuint m_texid_diffuse;
 	GLuint m_vao;
 	GLuint m_positionBuffer;
-	GLuint m_uvBuffer;
 	GLuint m_indexBuffer;
+	// The indices of the whole patch, followed by those of the same patch
+	// at half the resolution, that covers a quarter of a node at the
+	// node's level
 	GLuint m_numIndices;
+	GLuint m_numHalfIndices;
 	std::string m_heightFieldPath;
 	std::string m_diffuseTexturePath;
 
@@ -20,6 +48,25 @@ public:
 	float m_fresnel = 0.04f;
 	float m_shininess = 0.0f;
 
+	// The mesh spans [-1, 1] in x and z and the heights [0, 1], and is
+	// scaled by m_scale and then moved by m_translation
+	glm::vec3 m_translation = glm::vec3(0.f, -300.f, 0.f);
+	glm::vec3 m_scale = glm::vec3(20000.f, 1000.f, 20000.f);
+
+	// The loaded heights on the CPU, in world space, for collisions. Replaced
+	// (not changed) when a new height field is loaded, so users that hold on
+	// to it can keep reading it. With tiles, only the level 0 tile.
+	std::shared_ptr<const labhelper::HeightGrid> m_grid;
+
+	// Set by loadTiles()
+	std::unique_ptr<TerrainTiles> m_tiles;
+
+	// lodRange(d) is m_lodDetail times the width of a node at depth d
+	float m_lodDetail = 2.5f;
+	// Nodes and triangles drawn by the last draw()
+	int m_drawnNodes = 0;
+	int m_drawnTriangles = 0;
+
 	HeightField(void);
 
 	// load height field
@@ -28,10 +75,49 @@ public:
 	// load diffuse map
 	void loadDiffuseTexture(const std::string &diffusePath);
 
-	// generate mesh
+	// load on the ThreadPool, the textures are uploaded by finishUploads()
+	// (see AsyncLoader.h). Nothing is drawn until both are loaded.
+	void loadHeightFieldAsync(const std::string &heigtFieldPath);
+	void loadDiffuseTextureAsync(const std::string &diffusePath);
+
+	// Draw from the tiles in `directory` (see TerrainTiles::build) instead
+	bool loadTiles(const std::string &directory);
+	// Call once per frame, streams the tiles
+	void updateTiles();
+
+	// Builds the grid if it is not given
+	void uploadHeightField(const std::string &heigtFieldPath, const float *data, int width, int height,
+	                       std::shared_ptr<const labhelper::HeightGrid> grid = nullptr);
+	void uploadDiffuseTexture(const std::string &diffusePath, const uint8_t *data, int width, int height);
+
+	// generate the patch, with `tesselation` (rounded up to a multiple of 4) quads per side
 	void generateMesh(int tesselation);
 
+	glm::mat4 modelMatrix() const;
+	std::shared_ptr<const labhelper::HeightGrid> makeGrid(const float *data, int width, int height) const;
+
 	// render height map
 	void draw(GLuint shader, const glm::mat4& viewMat, const glm::mat4& projMat, const float env_mult, bool use_ssao);
 
+	float lodRange(int depth) const;
+
+private:
+	int m_heightFieldWidth = 0;
+	int m_maxDepth = 0;
+	// The selected nodes as (x, z, size, level) in mesh space, and the
+	// quarters of nodes that are drawn with the half resolution patch
+	std::vector<glm::vec4> m_nodes, m_quarterNodes;
+	// The tiles of those, as (x, z, size, slot) in mesh space
+	std::vector<glm::vec4> m_nodeTiles, m_quarterTiles;
+	labhelper::StreamingBuffer m_nodeBuffer;
+	size_t m_nodeOffset = 0;
+	// The passes of a frame share one selection
+	bool m_selectionValid = false;
+	glm::mat4 m_selectedView, m_selectedProjection;
+	float m_selectedDetail = 0.f;
+
+	void selectNodes(const glm::mat4& viewMat, const glm::mat4& projMat);
+	bool selectNode(float x, float z, float size, int depth, const labhelper::Frustum& frustum,
+	                const glm::vec3& camera);
+	glm::vec4 useTile(float x, float z, int depth);
 };
@@ -2,10 +2,17 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Input vertex attributes
 ///////////////////////////////////////////////////////////////////////////////
-layout(location = 0) in vec3 position;
-layout(location = 1) in vec2 texCoordIn;
+// A vertex of the patch, in [0, 1]
+layout(location = 0) in vec2 gridPosition;
+// Per instance: the corner (x, z) and size of the node in mesh space, and
+// its level
+layout(location = 2) in vec4 node;
+// Per instance, with tiles: the corner (x, z) and size of the tile in mesh
+// space, and its layer in the tile arrays
+layout(location = 3) in vec4 tile;
 
 layout(binding = 0) uniform sampler2D heightMap;
+layout(binding = 2) uniform sampler2DArray heightTiles;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
@@ -14,6 +21,14 @@ layout(binding = 0) uniform sampler2D heightMap;
 uniform mat4 normalMatrix;
 uniform mat4 modelViewMatrix;
 uniform mat4 modelViewProjectionMatrix;
+// Quads per side of the patch in this draw call
+uniform float gridResolution;
+// Distances from the camera where each level starts and ends morphing into
+// the next coarser one (see HeightField)
+uniform vec2 lodMorph[16];
+// Heights come from heightTiles instead of heightMap, tileSize + 1 per side
+uniform bool useTiles;
+uniform float tileSize;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
@@ -21,13 +36,24 @@ uniform mat4 modelViewProjectionMatrix;
 out vec2 texCoord;
 out vec3 viewSpacePosition;
 out vec3 viewSpaceNormal;
+out vec2 tileCoord;
+flat out float tileLayer;
+
+vec2 toTile(vec2 unitCubePos) {
+    return (unitCubePos - tile.xy) / tile.z;
+}
 
 float height(vec2 unitCubePos) {
+    if (useTiles) {
+        // Heights sit at the corners of the tile and evenly in between
+        vec2 uv = (toTile(unitCubePos) * tileSize + vec2(0.5f)) / (tileSize + 1.f);
+        return texture(heightTiles, vec3(uv, tile.w)).r;
+    }
     return texture(heightMap, unitCubePos * 0.5f + vec2(0.5f)).r;
 }
 
 vec3 computeNormal(vec3 O) {
-    vec2 pixelStepUnitCube = 2.f / textureSize(heightMap, 0);
+    vec2 pixelStepUnitCube = useTiles ? vec2(tile.z / tileSize) : 2.f / textureSize(heightMap, 0);
 
     vec2 a = - vec2(pixelStepUnitCube.x, 0.f);
     vec2 b =  vec2(pixelStepUnitCube.x, 0.f);
@@ -54,12 +80,25 @@ vec3 computeNormal(vec3 O) {
 
 void main()
 {
-    float height = texture(heightMap, texCoordIn).r;
-    vec4 pos = vec4(position.x, height, position.z, 1.0);
+    vec2 meshPosition = node.xy + gridPosition * node.z;
+    float unmorphedHeight = height(meshPosition);
+    float viewDistance = length((modelViewMatrix * vec4(meshPosition.x, unmorphedHeight, meshPosition.y, 1.0)).xyz);
+    vec2 morph = lodMorph[int(node.w)];
+    float morphFactor = clamp((viewDistance - morph.x) / (morph.y - morph.x), 0.0, 1.0);
+    // Every other vertex slides onto its even neighbour, which leaves the
+    // triangles of the next coarser level
+    vec2 vertex = floor(gridPosition * gridResolution + vec2(0.5));
+    vec2 odd = mod(vertex, 2.0) / gridResolution;
+    meshPosition = node.xy + (gridPosition - odd * morphFactor) * node.z;
+
+    vec2 texCoordIn = meshPosition * 0.5 + vec2(0.5);
+    vec4 pos = vec4(meshPosition.x, height(meshPosition), meshPosition.y, 1.0);
     vec3 normal = computeNormal(pos.xyz);
 
     viewSpacePosition = (modelViewMatrix * pos).xyz;
     gl_Position = modelViewProjectionMatrix * pos;
     texCoord = texCoordIn;
+    tileCoord = toTile(meshPosition);
+    tileLayer = tile.w;
     viewSpaceNormal = (normalMatrix * vec4(normal, 0.0)).xyz;
 }
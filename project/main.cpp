@@ -22,8 +22,9 @@ using namespace glm;
 #include <Model.h>
 #include "hdr.h"
 #include "fbo.h"
-#include "ParticleSystem.h"
+#include "ParticleEmitters.h"
 #include "heightfield.h"
+#include "ssao.h"
 
 
 using std::min;
@@ -61,10 +62,9 @@ bool cameraModeChangePressed = false;
 int print = (int) Final;
 
 bool useSsao = true;
-float margin = 0.001f;
-bool useRotation = true;
-bool blurSsao = true;
 bool drawHeightField = true;
+// Set with --terrain-tiles <directory>, see TerrainTiles
+std::string terrainTilesDirectory;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
@@ -73,9 +73,7 @@ GLuint shaderProgram;       // Shader for rendering the final image
 GLuint simpleShaderProgram; // Shader used to draw the shadow map
 GLuint backgroundProgram;
 GLuint normalShaderProgram; // Normals shader
-GLuint ssaoShaderProgram;
 GLuint texToScreenShaderProgram;
-GLuint horizontalBlurShader, verticalBlurShader;
 GLuint particlesShaderProgram;
 GLuint heightFieldShaderProgram, hfNormalsShaderProgram;
 
@@ -85,6 +83,7 @@ GLuint heightFieldShaderProgram, hfNormalsShaderProgram;
 float environment_multiplier = 1.5f;
 GLuint environmentMap, irradianceMap, reflectionMap;
 const std::string envmap_base_name = "001";
+std::shared_future<GLuint> environmentMapLoad, irradianceMapLoad, reflectionMapLoad;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Light source
@@ -95,14 +94,8 @@ vec3 point_light_color = vec3(1.f, 1.f, 1.f);
 
 float point_light_intensity_multiplier = 10000.0f;
 
-int requiredSamplesNum = 50;
-int samplesNum = requiredSamplesNum;
-float hemisphereSize = 10.f;
-vec3 *ssaoPoints;
-const unsigned ANGLES_RESOL = 64;
-GLuint ssaoAnglesTex;
 FboInfo normalsBuffer(1);
-FboInfo ssaoBuffer(1);
+Ssao ssao;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Shadow map
@@ -140,9 +133,23 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 labhelper::Model *fighterModel = nullptr;
 labhelper::Model *landingpadModel = nullptr;
 labhelper::Model *sphereModel = nullptr;
-
-// Particle system
-ParticleSystem particleSystem(10000, 200, 20.f, 0.5f, 50.f, 1.f);
+// Models are loaded in the background, and drawn once they are ready
+std::shared_future<labhelper::Model *> fighterModelLoad, landingpadModelLoad, sphereModelLoad;
+// Milliseconds per frame spent on uploading assets that have been loaded
+float uploadBudgetMs = 2.0f;
+// Meshes are drawn with the coarsest LOD that is off by at most this many
+// pixels, 0 draws the full meshes
+float lodErrorPixels = 1.0f;
+// Meshes outside the frustum of a pass are not drawn, these count them
+bool frustumCulling = true;
+labhelper::RenderStatistics cameraPassStatistics, shadowPassStatistics, normalsPassStatistics;
+
+// Particle systems, simulated on worker threads while the frame is drawn.
+// The exhaust of the fighter is one of the emitters.
+ParticleEmitters particleEmitters;
+ParticleSystem *particleSystem = nullptr;
+bool fixedParticleTimestep = true;
+bool particlesCollide = true;
 bool manualParticleRate = false;
 
 // Height field
@@ -161,17 +168,6 @@ const float FIGHTER_MAX_SPEED = 5.f;
 const float FIGHTER_TURN_SPEED = 5.0f;
 
 
-void recreateSamplePoints() {
-    if (ssaoPoints != NULL) {
-        free(ssaoPoints);
-    }
-    samplesNum = requiredSamplesNum;
-    ssaoPoints = new vec3[samplesNum];
-    for (unsigned int i = 0; i < samplesNum; i++) {
-        ssaoPoints[i] = labhelper::cosineSampleHemisphere() * labhelper::randf() * 0.95f + 0.05f;
-    }
-}
-
 void initGL() {
     ///////////////////////////////////////////////////////////////////////
     //		Load Shaders
@@ -181,13 +177,9 @@ void initGL() {
     shaderProgram = labhelper::loadShaderProgram("../../project/shading.vert", "../../project/shading.frag");
     simpleShaderProgram = labhelper::loadShaderProgram("../../project/simple.vert", "../../project/simple.frag");
     normalShaderProgram = labhelper::loadShaderProgram("../../project/normals.vert", "../../project/normals.frag");
-    ssaoShaderProgram = labhelper::loadShaderProgram("../../project/postFx.vert", "../../project/ssao.frag");
     texToScreenShaderProgram = labhelper::loadShaderProgram("../../project/postFx.vert",
                                                             "../../project/textureToScreen.frag");
-    horizontalBlurShader = labhelper::loadShaderProgram("../../project/postFx.vert",
-                                                        "../../project/horizontal_blur.frag");
-    verticalBlurShader = labhelper::loadShaderProgram("../../project/postFx.vert",
-                                                      "../../project/vertical_blur.frag");
+    ssao.init();
     particlesShaderProgram = labhelper::loadShaderProgram("../../project/particle.vert",
                                                           "../../project/particle.frag");
     heightFieldShaderProgram = labhelper::loadShaderProgram("../../project/heightfield.vert",
@@ -198,30 +190,20 @@ void initGL() {
     ///////////////////////////////////////////////////////////////////////
     // Load models and set up model matrices
     ///////////////////////////////////////////////////////////////////////
-    fighterModel = labhelper::loadModelFromOBJ("../../scenes/NewShip.obj");
-    landingpadModel = labhelper::loadModelFromOBJ("../../scenes/landingpad.obj");
-    sphereModel = labhelper::loadModelFromOBJ("../../scenes/sphere.obj");
+    // Textures are only sampled on the GPU here
+    labhelper::TextureCache::instance().setCPUCopies(labhelper::DROP_CPU_COPIES);
+    labhelper::setModelOptimization(true);
+    labhelper::setLodGeneration(true);
+    labhelper::setVertexCompression(true);
+    fighterModelLoad = labhelper::loadModelFromOBJAsync("../../scenes/NewShip.obj");
+    landingpadModelLoad = labhelper::loadModelFromOBJAsync("../../scenes/landingpad.obj");
+    sphereModelLoad = labhelper::loadModelFromOBJAsync("../../scenes/sphere.obj");
 
     roomModelMatrix = mat4(1.0f);
     T = translate(15.0f * worldUp);
     R = mat4(1);
     landingPadModelMatrix = mat4(1.0f);
 
-    recreateSamplePoints();
-
-    float randomAngles[ANGLES_RESOL * ANGLES_RESOL];
-    for (auto &angle: randomAngles) {
-        angle = labhelper::randf();
-    }
-    glGenTextures(1, &ssaoAnglesTex);
-    glBindTexture(GL_TEXTURE_2D, ssaoAnglesTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, ANGLES_RESOL, ANGLES_RESOL, 0, GL_RGB, GL_UNSIGNED_BYTE, randomAngles);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
     ///////////////////////////////////////////////////////////////////////
     // Load environment map
     ///////////////////////////////////////////////////////////////////////
@@ -230,9 +212,10 @@ void initGL() {
     for (int i = 0; i < roughnesses; i++)
         filenames.push_back("../../scenes/envmaps/" + envmap_base_name + "_dl_" + std::to_string(i) + ".hdr");
 
-    reflectionMap = labhelper::loadHdrMipmapTexture(filenames);
-    environmentMap = labhelper::loadHdrTexture("../../scenes/envmaps/" + envmap_base_name + ".hdr");
-    irradianceMap = labhelper::loadHdrTexture("../../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
+    reflectionMapLoad = labhelper::loadHdrMipmapTextureAsync(filenames);
+    environmentMapLoad = labhelper::loadHdrTextureAsync("../../scenes/envmaps/" + envmap_base_name + ".hdr");
+    irradianceMapLoad = labhelper::loadHdrTextureAsync("../../scenes/envmaps/" + envmap_base_name
+                                                       + "_irradiance.hdr");
 
     ///////
     // Buffers
@@ -240,7 +223,7 @@ void initGL() {
     int w, h;
     SDL_GetWindowSize(g_window, &w, &h);
     normalsBuffer.resize(w, h);
-    ssaoBuffer.resize(w, h);
+    ssao.resize(w, h);
 
     ///////////////////////////////////////////////////////////////////////
     // Setup Framebuffer for shadow map rendering
@@ -251,25 +234,40 @@ void initGL() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
 
     // Particles
-    particleSystem.init();
+    particleEmitters.init();
+    particleSystem = particleEmitters.add(100000, 200, 20.f, 0.5f, 50.f, 1.f);
 
     // Heightfield
-    heightField.generateMesh(750);
-    heightField.loadHeightField("../../scenes/nlsFinland/L3123F.png");
-    heightField.loadDiffuseTexture("../../scenes/nlsFinland/L3123F_downscaled.jpg");
+    heightField.generateMesh(32);
+    if (terrainTilesDirectory.empty() || !heightField.loadTiles(terrainTilesDirectory)) {
+        heightField.loadHeightFieldAsync("../../scenes/nlsFinland/L3123F.png");
+        heightField.loadDiffuseTextureAsync("../../scenes/nlsFinland/L3123F_downscaled.jpg");
+    }
 
     glEnable(GL_DEPTH_TEST); // enable Z-buffering
     glEnable(GL_CULL_FACE);  // enables backface culling
     // Enable shader program point size modulation.
     glEnable(GL_PROGRAM_POINT_SIZE);
-    // Enable primitive restart for triangle strips in heightField
-    glEnable(GL_PRIMITIVE_RESTART);
-    glPrimitiveRestartIndex(UINT32_MAX);
     // Enable blending
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Upload some of the assets that are loading, and start using the ones that
+// are done
+///////////////////////////////////////////////////////////////////////////////
+void finishLoading() {
+    labhelper::finishUploads(uploadBudgetMs);
+    labhelper::takeIfReady(fighterModelLoad, fighterModel);
+    labhelper::takeIfReady(landingpadModelLoad, landingpadModel);
+    labhelper::takeIfReady(sphereModelLoad, sphereModel);
+    labhelper::takeIfReady(environmentMapLoad, environmentMap);
+    labhelper::takeIfReady(irradianceMapLoad, irradianceMap);
+    labhelper::takeIfReady(reflectionMapLoad, reflectionMap);
+    heightField.updateTiles();
+}
+
 void debugDrawLight(const glm::mat4 &viewMatrix,
                     const glm::mat4 &projectionMatrix,
                     const glm::vec3 &worldSpaceLightPos) {
@@ -277,7 +275,9 @@ void debugDrawLight(const glm::mat4 &viewMatrix,
     glUseProgram(shaderProgram);
     labhelper::setUniformSlow(shaderProgram, "modelViewProjectionMatrix",
                               projectionMatrix * viewMatrix * modelMatrix);
-    labhelper::render(sphereModel);
+    if (sphereModel != nullptr) {
+        labhelper::render(sphereModel);
+    }
 }
 
 
@@ -289,12 +289,29 @@ void drawBackground(const mat4 &viewMatrix, const mat4 &projectionMatrix) {
     labhelper::drawFullScreenQuad();
 }
 
+void renderModel(const labhelper::Model *model,
+                 const mat4 &modelViewMatrix,
+                 const mat4 &projectionMatrix,
+                 int viewportHeight,
+                 labhelper::RenderStatistics &statistics) {
+    labhelper::LodSelection lod =
+            labhelper::lodSelection(modelViewMatrix, projectionMatrix, viewportHeight, lodErrorPixels);
+    if (frustumCulling) {
+        labhelper::render(model, true, lod, projectionMatrix * modelViewMatrix, &statistics);
+    } else {
+        labhelper::render(model, true, lod);
+        statistics.drawn_meshes += uint32_t(model->m_meshes.size());
+    }
+}
+
 void drawScene(GLuint currentShaderProgram,
                const mat4 &viewMatrix,
                const mat4 &projectionMatrix,
                const mat4 &lightViewMatrix,
-               const mat4 &lightProjectionMatrix) {
+               const mat4 &lightProjectionMatrix,
+               labhelper::RenderStatistics &statistics) {
     glUseProgram(currentShaderProgram);
+    statistics = labhelper::RenderStatistics();
     // Light source
     vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
     labhelper::setUniformSlow(currentShaderProgram, "point_light_color", point_light_color);
@@ -311,6 +328,10 @@ void drawScene(GLuint currentShaderProgram,
     // camera
     labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
 
+    // The shadow map and the camera pass have different viewports
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
     // landing pad
     labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
                               projectionMatrix * viewMatrix * landingPadModelMatrix);
@@ -318,7 +339,9 @@ void drawScene(GLuint currentShaderProgram,
     labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
                               inverse(transpose(viewMatrix * landingPadModelMatrix)));
 
-    labhelper::render(landingpadModel);
+    if (landingpadModel != nullptr) {
+        renderModel(landingpadModel, viewMatrix * landingPadModelMatrix, projectionMatrix, viewport[3], statistics);
+    }
 
     // Fighter
     labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
@@ -327,7 +350,9 @@ void drawScene(GLuint currentShaderProgram,
     labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
                               inverse(transpose(viewMatrix * fighterModelMatrix)));
 
-    labhelper::render(fighterModel);
+    if (fighterModel != nullptr) {
+        renderModel(fighterModel, viewMatrix * fighterModelMatrix, projectionMatrix, viewport[3], statistics);
+    }
 }
 
 void debugFullscreen(GLuint texture) {
@@ -368,7 +393,8 @@ void drawShadowMap(mat4 &lightViewMatrix, mat4 &lightProjMatrix) {
     }
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    drawScene(simpleShaderProgram, lightViewMatrix, lightProjMatrix, lightViewMatrix, lightProjMatrix);
+    drawScene(simpleShaderProgram, lightViewMatrix, lightProjMatrix, lightViewMatrix, lightProjMatrix,
+              shadowPassStatistics);
 
     if (usePolygonOffset) {
         glDisable(GL_POLYGON_OFFSET_FILL);
@@ -386,7 +412,7 @@ void display(void) {
             windowWidth = w;
             windowHeight = h;
             normalsBuffer.resize(w, h);
-            ssaoBuffer.resize(w, h);
+            ssao.resize(w, h);
             glViewport(0, 0, w, h);
         }
     }
@@ -441,7 +467,8 @@ void display(void) {
         glBindFramebuffer(GL_FRAMEBUFFER, normalsBuffer.framebufferId);
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        drawScene(normalShaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+        drawScene(normalShaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix,
+                  normalsPassStatistics);
         if (drawHeightField) {
             heightField.draw(hfNormalsShaderProgram, viewMatrix, projMatrix, environment_multiplier, false);
         }
@@ -453,47 +480,10 @@ void display(void) {
         }
 
         // SSAO drawing
-        glBindFramebuffer(GL_FRAMEBUFFER, ssaoBuffer.framebufferId);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        glUseProgram(ssaoShaderProgram);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, normalsBuffer.depthBuffer);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, normalsBuffer.colorTextureTargets[0]);
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, ssaoAnglesTex);
-        labhelper::setUniformSlow(ssaoShaderProgram, "useRotation", useRotation);
-        labhelper::setUniformSlow(ssaoShaderProgram, "projectionMatrix", projMatrix);
-        labhelper::setUniformSlow(ssaoShaderProgram, "inverseProjectionMatrix", inverse(projMatrix));
-        if (requiredSamplesNum != samplesNum) {
-            recreateSamplePoints();
-        }
-        labhelper::setUniformSlow(ssaoShaderProgram, "number_samples", samplesNum);
-        labhelper::setUniformSlow(ssaoShaderProgram, "hemisphere_radius", hemisphereSize);
-        labhelper::setUniformSlow(ssaoShaderProgram, "samples", samplesNum, ssaoPoints);
-        labhelper::setUniformSlow(ssaoShaderProgram, "epsilon", margin);
-        labhelper::drawFullScreenQuad();
-
-        if (blurSsao) {
-            // We use the normals buffer as auxiliar buffer for this
-            glBindFramebuffer(GL_FRAMEBUFFER, normalsBuffer.framebufferId);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glUseProgram(horizontalBlurShader);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoBuffer.colorTextureTargets[0]);
-            labhelper::drawFullScreenQuad();
-
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoBuffer.framebufferId);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glUseProgram(verticalBlurShader);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, normalsBuffer.colorTextureTargets[0]);
-            labhelper::drawFullScreenQuad();
-        }
+        ssao.render(normalsBuffer.depthBuffer, normalsBuffer.colorTextureTargets[0], viewMatrix, projMatrix);
 
         if (print == (int) SSAO) {
-            debugFullscreen(ssaoBuffer.colorTextureTargets[0]);
+            debugFullscreen(ssao.texture());
             debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
             return;
         }
@@ -515,7 +505,7 @@ void display(void) {
     glActiveTexture(GL_TEXTURE10);
     glBindTexture(GL_TEXTURE_2D, shadowMapFB.depthBuffer);
     glActiveTexture(GL_TEXTURE4);
-    glBindTexture(GL_TEXTURE_2D, ssaoBuffer.colorTextureTargets[0]);
+    glBindTexture(GL_TEXTURE_2D, ssao.texture());
     mat4 lightMatrix =
             translate(vec3(0.5f)) * scale(vec3(0.5f)) * lightProjMatrix * lightViewMatrix * inverse(viewMatrix);
     labhelper::setUniformSlow(shaderProgram, "lightMatrix", lightMatrix);
@@ -525,20 +515,14 @@ void display(void) {
     labhelper::setUniformSlow(shaderProgram, "spotOuterAngle", std::cos(radians(outerSpotlightAngle)));
     labhelper::setUniformSlow(shaderProgram, "spotInnerAngle", std::cos(radians(innerSpotlightAngle)));
 
-    drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+    drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix, cameraPassStatistics);
 
     // Height terrain
     if (drawHeightField) {
         heightField.draw(heightFieldShaderProgram, viewMatrix, projMatrix, environment_multiplier, useSsao);
     }
 
-    particleSystem.spawnModelMatrix = fighterModelMatrix * mat4(
-            1.f, 0.f, 0.f, 0.f,
-            0.f, 1.f, 0.f, 0.f,
-            0.f, 0.f, 1.f, 0.f,
-            19.5f, 3.f, 0.f, 1.f
-    );
-    particleSystem.draw(particlesShaderProgram, viewMatrix, projMatrix, (float) windowWidth, (float) windowHeight);
+    particleEmitters.draw(particlesShaderProgram, viewMatrix, projMatrix, (float) windowWidth, (float) windowHeight);
     glUseProgram(shaderProgram);
 
     debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
@@ -665,7 +649,7 @@ bool handleEvents(void) {
 
     T[3] += vec4(fighterSpeed, 0.f);
     if (!manualParticleRate) {
-        particleSystem.pps = forward ? 2000 * length(fighterSpeed) / FIGHTER_MAX_SPEED : 0;
+        particleSystem->pps = forward ? 2000 * length(fighterSpeed) / FIGHTER_MAX_SPEED : 0;
     }
 
     // PLACE CAMERA
@@ -705,26 +689,53 @@ void gui() {
 
     if (print == SSAO || (print == Final && useSsao)) {
         if (ImGui::CollapsingHeader("SSAO", "ssao_ch", true, true)) {
-            ImGui::SliderInt("Number of samples", &requiredSamplesNum, 1, 512);
-            ImGui::SliderFloat("Hemisphere size", &hemisphereSize, 1.f, 50.f);
-            ImGui::SliderFloat("Margin", &margin, 0.0f, 0.1f);
-            ImGui::Checkbox("Blur SSAO", &blurSsao);
-            ImGui::Checkbox("Use Rotation", &useRotation);
+            ImGui::Text("Resolution");
+            ImGui::RadioButton("Half", &ssao.downsample, 2);
+            ImGui::SameLine();
+            ImGui::RadioButton("Quarter", &ssao.downsample, 4);
+            ImGui::SliderInt("Number of samples", &ssao.samples, 1, 64);
+            ImGui::SliderFloat("Hemisphere size", &ssao.radius, 1.f, 50.f);
+            ImGui::SliderFloat("Margin", &ssao.margin, 0.0f, 0.1f);
+            ImGui::Checkbox("Accumulate over frames", &ssao.temporal);
+            if (ssao.temporal) {
+                ImGui::SliderInt("Frames", &ssao.max_history, 1, 64);
+            }
+            ImGui::Checkbox("Use Rotation", &ssao.rotate);
+            ImGui::Text("%.1f depth taps per pixel", ssao.tapsPerPixel());
         }
     }
     if (ImGui::CollapsingHeader("Particle system", "particles_ch", true, true)) {
         ImGui::Checkbox("Manual rate", &manualParticleRate);
         if (manualParticleRate) {
-            ImGui::SliderFloat("Particles per second", &particleSystem.pps, 0.f, 10000.f);
+            ImGui::SliderFloat("Particles per second", &particleSystem->pps, 0.f, 10000.f);
+        }
+        ImGui::SliderFloat("Lifetime", &particleSystem->life_length, 1.0f, 10.f);
+        ImGui::SliderFloat("Initial velocity", &particleSystem->initial_velocity, 0.0f, 120.f);
+        ImGui::SliderFloat("Gravity", &particleSystem->gravity, 0.0f, 30.f);
+        ImGui::SliderFloat("Air resistance", &particleSystem->air_resistance, 0.0f, 5.f);
+        ImGui::Checkbox("Stop", &particleSystem->halted);
+        ImGui::Checkbox("Fixed timestep (1/60 s, interpolated)", &fixedParticleTimestep);
+        ImGui::Checkbox("Collide with terrain", &particlesCollide);
+        if (particlesCollide && heightField.m_tiles != nullptr) {
+            ImGui::Text("Against the coarsest tile (%dx%d heights)", heightField.m_tiles->tileSize() + 1,
+                        heightField.m_tiles->tileSize() + 1);
         }
-        ImGui::SliderFloat("Lifetime", &particleSystem.life_length, 1.0f, 10.f);
-        ImGui::SliderFloat("Initial velocity", &particleSystem.initial_velocity, 0.0f, 120.f);
-        ImGui::SliderFloat("Gravity", &particleSystem.gravity, 0.0f, 30.f);
-        ImGui::SliderFloat("Air resistance", &particleSystem.air_resistance, 0.0f, 5.f);
-        ImGui::Checkbox("Stop", &particleSystem.halted);
+        if (particlesCollide) {
+            ImGui::SliderFloat("Bounce", &particleSystem->bounce, 0.f, 1.f);
+            ImGui::SliderFloat("Friction", &particleSystem->friction, 0.f, 1.f);
+        }
+        ImGui::Text("%zu particles in %zu emitters: simulate %.2f ms (waited %.2f ms), sort %.2f ms, upload %.2f ms",
+                    particleEmitters.numberOfParticles(), particleEmitters.size(), particleEmitters.simulate_ms,
+                    particleEmitters.wait_ms, particleEmitters.sort_ms, particleEmitters.upload_ms);
     }
 
     if (drawHeightField && ImGui::CollapsingHeader("Height field", "height_ch", true, true)) {
+        ImGui::SliderFloat("LOD detail", &heightField.m_lodDetail, 1.5f, 8.f);
+        ImGui::Text("%d nodes, %d triangles", heightField.m_drawnNodes, heightField.m_drawnTriangles);
+        if (heightField.m_tiles != nullptr) {
+            ImGui::Text("Tiles: %d of %d resident, %d reading", heightField.m_tiles->residentTiles(),
+                        heightField.m_tiles->slots(), heightField.m_tiles->readingTiles());
+        }
         ImGui::SliderFloat("Fresnel", &heightField.m_fresnel, 0.f, 1.f);
         ImGui::SliderFloat("Metalness", &heightField.m_metalness, 0.f, 1.f);
         ImGui::SliderFloat("Reflectivity", &heightField.m_reflectivity, 0.f, 1.f);
@@ -763,6 +774,13 @@ void gui() {
     }
 
     // ----------------- Set variables --------------------------
+    ImGui::SliderFloat("Upload budget (ms)", &uploadBudgetMs, 0.1f, 16.0f);
+    ImGui::SliderFloat("LOD error (pixels)", &lodErrorPixels, 0.0f, 8.0f);
+    ImGui::Checkbox("Frustum culling", &frustumCulling);
+    ImGui::Text("Meshes drawn/culled: camera %u/%u, shadow %u/%u, SSAO normals %u/%u",
+                cameraPassStatistics.drawn_meshes, cameraPassStatistics.culled_meshes,
+                shadowPassStatistics.drawn_meshes, shadowPassStatistics.culled_meshes,
+                normalsPassStatistics.drawn_meshes, normalsPassStatistics.culled_meshes);
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
                 ImGui::GetIO().Framerate);
     // ----------------------------------------------------------
@@ -771,6 +789,21 @@ void gui() {
 }
 
 int main(int argc, char *argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--particle-benchmark") {
+        ParticleSystem::benchmark();
+        ParticleEmitters::benchmark();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--particle-replay") {
+        ParticleEmitters::replay(argc > 2 ? float(std::atof(argv[2])) : 10.f);
+        return 0;
+    }
+    if (argc > 4 && std::string(argv[1]) == "--make-tiles") {
+        return TerrainTiles::build(argv[2], argv[3], argv[4]) ? 0 : 1;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--terrain-tiles") {
+        terrainTilesDirectory = argv[2];
+    }
     g_window = labhelper::init_window_SDL("OpenGL Project");
 
     initGL();
@@ -784,9 +817,21 @@ int main(int argc, char *argv[]) {
         previousTime = currentTime;
         currentTime = timeSinceStart.count();
         deltaTime = currentTime - previousTime;
-        particleSystem.process_particles(deltaTime, currentTime);
+        // The emitters are simulated while the frame is drawn, and must
+        // not be changed until wait()
+        particleSystem->spawnModelMatrix = fighterModelMatrix * mat4(
+                1.f, 0.f, 0.f, 0.f,
+                0.f, 1.f, 0.f, 0.f,
+                0.f, 0.f, 1.f, 0.f,
+                19.5f, 3.f, 0.f, 1.f
+        );
+        particleSystem->ground = particlesCollide && drawHeightField ? heightField.m_grid : nullptr;
+        particleEmitters.fixed_timestep = fixedParticleTimestep ? 1.f / 60.f : 0.f;
+        particleEmitters.update(deltaTime, currentTime);
+        finishLoading();
         // render to window
         display();
+        particleEmitters.wait();
 
         // Render overlay GUI.
         if (showUI) {
@@ -803,6 +848,7 @@ int main(int argc, char *argv[]) {
     labhelper::freeModel(fighterModel);
     labhelper::freeModel(landingpadModel);
     labhelper::freeModel(sphereModel);
+    particleEmitters.destroy();
 
     // Shut down everything. This includes the window and all other subsystems.
     labhelper::shutDown(g_window);
@@ -6,8 +6,11 @@ uniform mat4 modelViewProjectionMatrix;
 uniform mat4 normalMatrix;
 out vec3 viewSpaceNormal;
 
+// decodePosition() and decodeNormal()
+#include "../labhelper/compressed_vertex.glsl"
+
 void main()
 {
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
-	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
+	gl_Position = modelViewProjectionMatrix * vec4(decodePosition(position), 1.0);
+	viewSpaceNormal = (normalMatrix * vec4(decodeNormal(normalIn), 0.0)).xyz;
 }
@@ -14,6 +14,11 @@ uniform mat4 modelViewMatrix;
 uniform mat4 modelViewProjectionMatrix;
 uniform mat4 lightMatrix;
 
+///////////////////////////////////////////////////////////////////////////////
+// Vertex decoding, the model may have compressed vertices
+///////////////////////////////////////////////////////////////////////////////
+#include "../labhelper/compressed_vertex.glsl"
+
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
 ///////////////////////////////////////////////////////////////////////////////
@@ -24,9 +29,10 @@ out vec4 shadowMapCoord;
 
 void main()
 {
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+	vec3 modelSpacePosition = decodePosition(position);
+	gl_Position = modelViewProjectionMatrix * vec4(modelSpacePosition, 1.0);
 	texCoord = texCoordIn;
-	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
-	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
+	viewSpaceNormal = (normalMatrix * vec4(decodeNormal(normalIn), 0.0)).xyz;
+	viewSpacePosition = (modelViewMatrix * vec4(modelSpacePosition, 1.0)).xyz;
 	shadowMapCoord = lightMatrix * vec4(viewSpacePosition, 1.f);
 }
@@ -8,8 +8,11 @@ out vec2 texCoord; // outgoing interpolated texcoord to fragshader
 
 uniform mat4 modelViewProjectionMatrix;
 
+// decodePosition() for models with compressed vertices
+#include "../labhelper/compressed_vertex.glsl"
+
 void main()
 {
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+	gl_Position = modelViewProjectionMatrix * vec4(decodePosition(position), 1.0);
 	texCoord = texCoordIn;
 }
\ No newline at end of file
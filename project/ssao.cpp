@@ -0,0 +1,158 @@
+#include "ssao.h"
+
+#include <algorithm>
+#include <labhelper.h>
+
+using namespace glm;
+
+void Ssao::init() {
+    m_depthProgram = labhelper::loadShaderProgram("../../project/postFx.vert", "../../project/ssao_depth.frag");
+    m_aoProgram = labhelper::loadShaderProgram("../../project/postFx.vert", "../../project/ssao.frag");
+    m_upsampleProgram = labhelper::loadShaderProgram("../../project/postFx.vert",
+                                                     "../../project/ssao_upsample.frag");
+}
+
+void Ssao::resize(int width, int height) {
+    m_width = width;
+    m_height = height;
+    m_output.resize(width, height);
+    m_historyValid = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Levels stop at MAX_LEVELS, or where the smaller side would go below 8
+///////////////////////////////////////////////////////////////////////////////
+void Ssao::createDepthPyramid() {
+    m_lowWidth = std::max(1, (m_width + downsample - 1) / downsample);
+    m_lowHeight = std::max(1, (m_height + downsample - 1) / downsample);
+    m_levels = 1;
+    while (m_levels < MAX_LEVELS && std::min(m_lowWidth, m_lowHeight) >> m_levels >= 8) {
+        m_levels++;
+    }
+
+    if (m_depthPyramid != 0) {
+        glDeleteTextures(1, &m_depthPyramid);
+        glDeleteFramebuffers(GLsizei(m_depthFramebuffers.size()), m_depthFramebuffers.data());
+    }
+    glGenTextures(1, &m_depthPyramid);
+    glBindTexture(GL_TEXTURE_2D, m_depthPyramid);
+    glTexStorage2D(GL_TEXTURE_2D, m_levels, GL_R32F, m_lowWidth, m_lowHeight);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    m_depthFramebuffers.resize(m_levels);
+    glGenFramebuffers(m_levels, m_depthFramebuffers.data());
+    for (int level = 0; level < m_levels; level++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, m_depthFramebuffers[level]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_depthPyramid, level);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for (auto &history : m_history) {
+        history.resize(m_lowWidth, m_lowHeight);
+    }
+    m_historyValid = false;
+}
+
+void Ssao::render(GLuint depthTexture, GLuint normalsTexture, const mat4 &viewMatrix, const mat4 &projectionMatrix) {
+    if (m_depthPyramid == 0 || m_lowWidth != std::max(1, (m_width + downsample - 1) / downsample)
+        || m_lowHeight != std::max(1, (m_height + downsample - 1) / downsample)) {
+        createDepthPyramid();
+    }
+    if (int(m_samplePoints.size()) != samples) {
+        // Points in the hemisphere, more of them close to the center
+        m_samplePoints.resize(samples);
+        for (auto &point : m_samplePoints) {
+            point = labhelper::cosineSampleHemisphere() * labhelper::randf() * 0.95f + 0.05f;
+        }
+    }
+    m_frame++;
+    // All passes write their results as they are, whatever blending the
+    // frame uses
+    const GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_BLEND);
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Depth pyramid. While a level is drawn, only the level above it can be
+    // read, so there is no feedback loop.
+    ///////////////////////////////////////////////////////////////////////////
+    glUseProgram(m_depthProgram);
+    labhelper::setUniformSlow(m_depthProgram, "projectionMatrix", projectionMatrix);
+    labhelper::setUniformSlow(m_depthProgram, "downsample", GLint(downsample));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    for (int level = 0; level < m_levels; level++) {
+        if (level > 0) {
+            glBindTexture(GL_TEXTURE_2D, m_depthPyramid);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+        }
+        labhelper::setUniformSlow(m_depthProgram, "level", GLint(level));
+        glBindFramebuffer(GL_FRAMEBUFFER, m_depthFramebuffers[level]);
+        glViewport(0, 0, std::max(1, m_lowWidth >> level), std::max(1, m_lowHeight >> level));
+        labhelper::drawFullScreenQuad();
+    }
+    glBindTexture(GL_TEXTURE_2D, m_depthPyramid);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m_levels - 1);
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Occlusion at low resolution, accumulated with the last frame
+    ///////////////////////////////////////////////////////////////////////////
+    const int previous = m_current;
+    m_current = 1 - m_current;
+    const bool useHistory = temporal && m_historyValid;
+    glBindFramebuffer(GL_FRAMEBUFFER, m_history[m_current].framebufferId);
+    glViewport(0, 0, m_lowWidth, m_lowHeight);
+    glUseProgram(m_aoProgram);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_depthPyramid);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, normalsTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, m_history[previous].colorTextureTargets[0]);
+    labhelper::setUniformSlow(m_aoProgram, "projectionMatrix", projectionMatrix);
+    labhelper::setUniformSlow(m_aoProgram, "levels", GLint(m_levels));
+    labhelper::setUniformSlow(m_aoProgram, "downsample", GLint(downsample));
+    labhelper::setUniformSlow(m_aoProgram, "number_samples", GLint(samples));
+    labhelper::setUniformSlow(m_aoProgram, "samples", uint32_t(samples), m_samplePoints.data());
+    labhelper::setUniformSlow(m_aoProgram, "hemisphere_radius", radius);
+    labhelper::setUniformSlow(m_aoProgram, "epsilon", margin);
+    labhelper::setUniformSlow(m_aoProgram, "useRotation", GLint(rotate));
+    labhelper::setUniformSlow(m_aoProgram, "frame", GLint(temporal ? m_frame % 1024 : 0));
+    labhelper::setUniformSlow(m_aoProgram, "useHistory", GLint(useHistory));
+    labhelper::setUniformSlow(m_aoProgram, "maxHistory", float(max_history));
+    labhelper::setUniformSlow(m_aoProgram, "previousViewFromView", m_previousView * inverse(viewMatrix));
+    labhelper::setUniformSlow(m_aoProgram, "previousProjectionMatrix", m_previousProjection);
+    labhelper::drawFullScreenQuad();
+    m_previousView = viewMatrix;
+    m_previousProjection = projectionMatrix;
+    m_historyValid = true;
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Bilateral upsample to the window
+    ///////////////////////////////////////////////////////////////////////////
+    glBindFramebuffer(GL_FRAMEBUFFER, m_output.framebufferId);
+    glViewport(0, 0, m_width, m_height);
+    glUseProgram(m_upsampleProgram);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, m_history[m_current].colorTextureTargets[0]);
+    labhelper::setUniformSlow(m_upsampleProgram, "projectionMatrix", projectionMatrix);
+    labhelper::setUniformSlow(m_upsampleProgram, "downsample", GLint(downsample));
+    labhelper::drawFullScreenQuad();
+    if (blend) {
+        glEnable(GL_BLEND);
+    }
+
+    // The pyramid (about 4/3 per low resolution pixel), the occlusion (the
+    // samples, and the depth, normal and history of the pixel) and the
+    // upsample (16 and the depth of the pixel)
+    float lowPixels = float(m_lowWidth) * float(m_lowHeight), pixels = float(m_width) * float(m_height);
+    m_tapsPerPixel = (lowPixels * (4.f / 3.f + float(samples) + 3.f) + pixels * 17.f) / pixels;
+}
@@ -3,26 +3,36 @@
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
 
-layout(binding = 0) uniform sampler2D depthTexture;
+///////////////////////////////////////////////////////////////////////////////
+// Occlusion of one low resolution pixel (see Ssao), accumulated with the
+// previous frames. Writes (occlusion, view depth, frames).
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 0) uniform sampler2D depthPyramid;
 layout(binding = 1) uniform sampler2D normalsTexture;
-
-layout(binding = 2) uniform sampler2D randomAngles;
-uniform bool useRotation;
+layout(binding = 2) uniform sampler2D history;
 
 layout(location = 0) out vec4 fragmentColor;
 
 uniform mat4 projectionMatrix;
-uniform mat4 inverseProjectionMatrix;
-uniform int number_samples = 10;
+uniform int levels;
+uniform int downsample;
+uniform int number_samples = 8;
 uniform float hemisphere_radius;
-uniform vec3 samples[215];
+uniform vec3 samples[64];
 uniform float epsilon;
+uniform bool useRotation;
+// Shifts the angles of all pixels a little every frame
+uniform int frame;
 
-in vec2 texCoord;
+uniform bool useHistory;
+uniform float maxHistory;
+uniform mat4 previousViewFromView;
+uniform mat4 previousProjectionMatrix;
 
 #define PI 3.14159265359
 
-vec3 homogenize(vec4 v) { return vec3((1.0 / v.w) * v); }
+// The angles of a 4x4 block, neighbours are far apart
+const int bayer[16] = int[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);
 
 // Computes one vector in the plane perpendicular to v
 vec3 perpendicular(vec3 v)
@@ -36,94 +46,106 @@ vec3 perpendicular(vec3 v)
     else return vec3(-v.y, v.x, 0.0f);
 }
 
-vec2 textureCoord(in sampler2D tex, vec2 rectangleCoord)
-{
-    return rectangleCoord / textureSize(tex, 0);
+vec4 axis_angle_to_quaternion(vec3 axis, float angle) {
+    float half_angle = angle/2;
+    return vec4(
+    axis * sin(half_angle),
+    cos(half_angle)
+    );
 }
 
-vec4 textureRect(in sampler2D tex, vec2 rectangleCoord) {
-    return texture(tex, textureCoord(tex, rectangleCoord));
+vec3 rotate_by_axis(vec3 pos, vec3 axis, float angle) {
+    vec4 q = axis_angle_to_quaternion(axis, angle);
+    return pos + 2.0f * cross(q.xyz, cross(q.xyz, pos) + q.w * pos);
+}
+
+// The window pixel that the depth of a low resolution pixel comes from, see
+// ssao_depth.frag
+ivec2 fullResolutionPixel(ivec2 pixel) {
+    return pixel * downsample + ivec2(pixel.y & 1, pixel.x & 1) * (downsample / 2);
 }
 
-vec3 hemisphericalVisibility(mat3 tbn, vec3 vs_pos) {
+// View space position at texture coordinates uv and view depth
+vec3 viewPosition(vec2 uv, float depth) {
+    vec2 ndc = uv * 2.0 - 1.0;
+    return vec3(ndc.x * depth / projectionMatrix[0][0], ndc.y * depth / projectionMatrix[1][1], -depth);
+}
+
+float hemisphericalVisibility(mat3 tbn, vec3 vs_pos, vec2 uv) {
+    vec2 size = vec2(textureSize(depthPyramid, 0));
     int num_visible_samples = 0;
     int num_valid_samples = 0;
     for (int i = 0; i < number_samples; i++) {
-        // Project hemisphere sample onto the local base
-        vec3 s = tbn * samples[i];
-
-        // compute view-space position of sample
-        vec3 vs_sample_position = vs_pos + s * hemisphere_radius;
-
-        // compute the ndc-coords of the sample
-        vec3 sample_coords_ndc = homogenize(projectionMatrix * vec4(vs_sample_position, 1.0));
-
-        // Sample the depth-buffer at a texture coord based on the ndc-coord of the sample
-        float blocker_depth = texture(depthTexture, sample_coords_ndc.xy * 0.5f + vec2(0.5f)).r;
+        vec3 vs_sample_position = vs_pos + tbn * samples[i] * hemisphere_radius;
+        vec4 sample_clip = projectionMatrix * vec4(vs_sample_position, 1.0);
+        vec2 sample_uv = sample_clip.xy / sample_clip.w * 0.5 + 0.5;
 
-        // Find the view-space coord of the blocker
-        vec3 vs_blocker_pos = homogenize(
-        inverseProjectionMatrix * vec4(
-        sample_coords_ndc.xy, blocker_depth * 2.0f - 1.0f, 1.0f));
+        // Taps 16 pixels away or more read coarser levels
+        float offset = length((sample_uv - uv) * size);
+        int level = clamp(int(log2(max(offset, 1.0))) - 3, 0, levels - 1);
+        ivec2 level_size = textureSize(depthPyramid, level);
+        ivec2 texel = clamp(ivec2(sample_uv * vec2(level_size)), ivec2(0), level_size - 1);
+        vec3 vs_blocker_pos = viewPosition(sample_uv, texelFetch(depthPyramid, texel, level).r);
 
         // Check that the blocker is closer than hemisphere_radius to vs_pos
         if (distance(vs_blocker_pos, vs_pos) > hemisphere_radius) {
             continue;
         }
-
         // Check if the blocker pos is closer to the camera than our
         // fragment, otherwise, increase num_visible_samples
         if (length(vs_blocker_pos) + epsilon >= length(vs_pos)) {
             num_visible_samples += 1;
         }
-
         num_valid_samples += 1;
     }
-
     if (num_valid_samples == 0)
-    return vec3(1.f);
-    return vec3(float(num_visible_samples) / float(num_valid_samples));
-}
-
-vec4 axis_angle_to_quaternion(vec3 axis, float angle) {
-    float half_angle = angle/2;
-    return vec4(
-    axis * sin(half_angle),
-    cos(half_angle)
-    );
-}
-
-vec3 rotate_by_axis(vec3 pos, vec3 axis, float angle) {
-    vec4 q = axis_angle_to_quaternion(axis, angle);
-    return pos + 2.0f * cross(q.xyz, cross(q.xyz, pos) + q.w * pos);
+    return 1.f;
+    return float(num_visible_samples) / float(num_valid_samples);
 }
 
 void main()
 {
-    float fragmentDepth = texture(depthTexture, texCoord).r;
-    vec3 vs_normal = texture(normalsTexture, texCoord).xyz * 2.f - vec3(1.f);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(depthPyramid, pixel, 0).r;
+    float farDepth = projectionMatrix[3][2] / (1.0 + projectionMatrix[2][2]);
+    if (depth > 0.999 * farDepth) {
+        // Background
+        fragmentColor = vec4(1.0, depth, 1.0, 1.0);
+        return;
+    }
 
-    // Normalized Device Coordinates (clip space)
-    vec4 ndc = vec4(texCoord.x * 2.0 - 1.0, texCoord.y * 2.0 - 1.0, fragmentDepth * 2.0 - 1.0, 1.0);
-    // Transform to view space
-    vec3 vs_pos = homogenize(inverseProjectionMatrix * ndc);
+    ivec2 full = fullResolutionPixel(pixel);
+    vec2 uv = (vec2(full) + vec2(0.5)) / vec2(textureSize(normalsTexture, 0));
+    vec3 vs_normal = normalize(texelFetch(normalsTexture, full, 0).xyz * 2.f - vec3(1.f));
+    vec3 vs_pos = viewPosition(uv, depth);
 
     vec3 vs_tangent = perpendicular(vs_normal);
     if (useRotation) {
-        float angle = textureRect(randomAngles, gl_FragCoord.xy).r * 2 * PI;
-        vs_tangent = rotate_by_axis(vs_tangent, vs_normal, angle);
+        float angle = (float(bayer[(pixel.y & 3) * 4 + (pixel.x & 3)]) + fract(float(frame) * 0.618034)) / 16.0;
+        vs_tangent = rotate_by_axis(vs_tangent, vs_normal, angle * 2.0 * PI);
     }
     vec3 vs_bitangent = cross(vs_normal, vs_tangent);
-
-    // local base:
     mat3 tbn = mat3(vs_tangent, vs_bitangent, vs_normal);
 
-    vec4 final_color = vec4(hemisphericalVisibility(tbn, vs_pos), 1.0f);
-    // Check if we got invalid results in the operations
-    if (any(isnan(final_color)))
-    {
-        final_color.xyz = vec3(1.f, 0.f, 1.f);
+    float occlusion = hemisphericalVisibility(tbn, vs_pos, uv);
+    if (isnan(occlusion)) {
+        occlusion = 1.0;
     }
 
-    fragmentColor = final_color;
+    // Average with the same surface in the last frame, if it was seen
+    float frames = 1.0;
+    if (useHistory) {
+        vec4 previous = previousViewFromView * vec4(vs_pos, 1.0);
+        vec4 previous_clip = previousProjectionMatrix * previous;
+        vec2 previous_uv = previous_clip.xy / previous_clip.w * 0.5 + 0.5;
+        if (previous_clip.w > 0.0 && all(greaterThanEqual(previous_uv, vec2(0.0)))
+            && all(lessThan(previous_uv, vec2(1.0)))) {
+            vec4 last = texelFetch(history, ivec2(previous_uv * vec2(textureSize(history, 0))), 0);
+            if (abs(last.y + previous.z) < 0.05 * -previous.z) {
+                frames = min(last.z + 1.0, maxHistory);
+                occlusion = mix(last.x, occlusion, 1.0 / frames);
+            }
+        }
+    }
+    fragmentColor = vec4(occlusion, depth, frames, 1.0);
 }
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <glm/glm.hpp>
+#include "fbo.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Screen space ambient occlusion, computed at a fraction of the window
+// resolution and accumulated over frames.
+//
+// render() takes the depth and normals of the frame and:
+//  1. Builds a pyramid of view space depths, from 1/downsample of the window
+//     size down. Each texel is one of the 2x2 texels below it, alternating
+//     on a rotated grid. An average would make up depths between surfaces.
+//  2. Shoots `samples` taps per low resolution pixel into the hemisphere
+//     around the normal. Taps that land far away read coarser levels of the
+//     pyramid, which keeps them in cache. The hemisphere is turned by an
+//     angle in one of 16 sectors, picked by the pixel position in a 4x4
+//     block, and moved within the sector every frame.
+//  3. Reprojects the pixel into the previous frame, and if the depth there
+//     matches, averages with the result there over up to max_history
+//     frames.
+//  4. Upsamples to the window resolution from the 4x4 low resolution
+//     pixels around each pixel, which hold all 16 sectors, weighted by how
+//     close their depth is, so occlusion does not bleed over edges.
+//
+// The result is in texture(), one value per pixel.
+///////////////////////////////////////////////////////////////////////////////
+class Ssao {
+public:
+    // 2 for half resolution, 4 for quarter
+    int downsample = 2;
+    // Taps per low resolution pixel and frame
+    int samples = 8;
+    float radius = 10.f;
+    // A blocker must be this much closer to count
+    float margin = 0.001f;
+    bool rotate = true;
+    bool temporal = true;
+    int max_history = 16;
+
+    void init();
+    void resize(int width, int height);
+    // depthTexture and normalsTexture are from the camera with viewMatrix
+    // and projectionMatrix (a symmetric perspective)
+    void render(GLuint depthTexture, GLuint normalsTexture, const glm::mat4 &viewMatrix,
+                const glm::mat4 &projectionMatrix);
+    GLuint texture() const {
+        return m_output.colorTextureTargets[0];
+    }
+    // Depth taps per window pixel in the last render(), for the GUI
+    float tapsPerPixel() const {
+        return m_tapsPerPixel;
+    }
+
+private:
+    static const int MAX_LEVELS = 5;
+
+    GLuint m_depthProgram = 0, m_aoProgram = 0, m_upsampleProgram = 0;
+    int m_width = 0, m_height = 0;
+    int m_lowWidth = 0, m_lowHeight = 0;
+    int m_levels = 0;
+    // View space depth pyramid, and a framebuffer per level
+    GLuint m_depthPyramid = 0;
+    std::vector<GLuint> m_depthFramebuffers;
+    // (occlusion, depth, frames) at low resolution, this frame and the last
+    FboInfo m_history[2];
+    int m_current = 0;
+    bool m_historyValid = false;
+    FboInfo m_output;
+    glm::mat4 m_previousView, m_previousProjection;
+    std::vector<glm::vec3> m_samplePoints;
+    unsigned m_frame = 0;
+    float m_tapsPerPixel = 0.f;
+
+    void createDepthPyramid();
+};
@@ -0,0 +1,38 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// One level of the view space depth pyramid of Ssao. Level 0 is made from
+// the depth buffer, the others from the level above, which is the only one
+// that can be read from depthPyramid.
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 0) uniform sampler2D depthTexture;
+layout(binding = 1) uniform sampler2D depthPyramid;
+
+uniform mat4 projectionMatrix;
+uniform int downsample;
+uniform int level;
+
+layout(location = 0) out vec4 fragmentColor;
+
+// The distance along the view direction of a depth buffer value
+float linearDepth(float depth) {
+    return projectionMatrix[3][2] / (depth * 2.0 - 1.0 + projectionMatrix[2][2]);
+}
+
+void main()
+{
+    // Each pixel takes one of the pixels it covers, alternating on a
+    // rotated grid. Same as fullResolutionPixel() in ssao.frag.
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 pick = ivec2(pixel.y & 1, pixel.x & 1);
+    if (level == 0) {
+        ivec2 source = min(pixel * downsample + pick * (downsample / 2), textureSize(depthTexture, 0) - 1);
+        fragmentColor = vec4(linearDepth(texelFetch(depthTexture, source, 0).r), 0.0, 0.0, 1.0);
+    } else {
+        ivec2 source = min(pixel * 2 + pick, textureSize(depthPyramid, 0) - 1);
+        fragmentColor = vec4(texelFetch(depthPyramid, source, 0).r, 0.0, 0.0, 1.0);
+    }
+}
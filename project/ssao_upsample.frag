@@ -0,0 +1,47 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// The occlusion of a window pixel, from the 4x4 low resolution pixels around
+// it (see Ssao). They are weighted by distance and by how close their depth
+// is to the depth of the pixel, so that occlusion stays on its side of
+// edges.
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 0) uniform sampler2D depthTexture;
+layout(binding = 1) uniform sampler2D occlusion;
+
+uniform mat4 projectionMatrix;
+uniform int downsample;
+
+layout(location = 0) out vec4 fragmentColor;
+
+// The distance along the view direction of a depth buffer value
+float linearDepth(float depth) {
+    return projectionMatrix[3][2] / (depth * 2.0 - 1.0 + projectionMatrix[2][2]);
+}
+
+void main()
+{
+    float depth = linearDepth(texelFetch(depthTexture, ivec2(gl_FragCoord.xy), 0).r);
+    ivec2 size = textureSize(occlusion, 0);
+    // Where the pixel is among the low resolution pixels, with their centers
+    // at whole numbers
+    vec2 position = gl_FragCoord.xy / float(downsample) - vec2(0.5);
+    ivec2 base = ivec2(floor(position));
+    vec2 f = position - vec2(base);
+
+    float sum = 0.0, weights = 0.0;
+    for (int j = -1; j <= 2; j++) {
+        for (int i = -1; i <= 2; i++) {
+            vec4 low = texelFetch(occlusion, clamp(base + ivec2(i, j), ivec2(0), size - 1), 0);
+            vec2 d = abs(vec2(i, j) - f);
+            float weight = max(0.0, 2.0 - d.x) * max(0.0, 2.0 - d.y);
+            weight /= 0.001 + abs(low.y - depth) / depth;
+            sum += low.x * weight;
+            weights += weight;
+        }
+    }
+    fragmentColor = vec4(vec3(weights > 0.0 ? sum / weights : 1.0), 1.0);
+}
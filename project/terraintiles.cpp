@@ -0,0 +1,411 @@
+#include "terraintiles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stb_image.h>
+#include <ThreadPool.h>
+#include <AsyncLoader.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// "TTIL", then the version
+static const uint32_t TILES_MAGIC = 0x4c495454;
+static const uint32_t TILES_VERSION = 1;
+
+static int mipLevels(int size) {
+    int levels = 1;
+    while (size > 1) {
+        size /= 2;
+        levels++;
+    }
+    return levels;
+}
+
+TerrainTiles::~TerrainTiles() {
+    // Reads that are still running only write to their own futures
+    m_reading.clear();
+}
+
+std::string TerrainTiles::tilePath(uint64_t key) const {
+    return m_directory + "/" + std::to_string(key >> 48) + "_" + std::to_string((key >> 24) & 0xffffff) + "_"
+           + std::to_string(key & 0xffffff) + ".tile";
+}
+
+size_t TerrainTiles::tileBytes() const {
+    size_t bytes = sizeof(float) * (m_tileSize + 1) * (m_tileSize + 1);
+    for (int size = m_tileSize; size >= 1; size /= 2) {
+        bytes += 3 * size * size;
+    }
+    return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Heights are sampled bilinearly from the height map, like the texture it
+// used to be, at the corners of the tile and evenly in between. Diffuse
+// texels are the average of the diffuse pixels under them. The maps are
+// flipped, like the textures in the project.
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+static void flipRows(T *pixels, int width, int height, int components) {
+    size_t row_size = size_t(width) * components;
+    for (int y = 0; y < height / 2; y++) {
+        T *row = pixels + size_t(y) * row_size;
+        std::swap_ranges(row, row + row_size, pixels + size_t(height - 1 - y) * row_size);
+    }
+}
+
+bool TerrainTiles::build(const std::string &heightMapPath, const std::string &diffuseMapPath,
+                         const std::string &directory, int tileSize) {
+    // The stb_image flip setting is global (see init_window_SDL), so it is
+    // left alone. It is still off here, --make-tiles runs before the window
+    // is created.
+    int hw, hh, hc, dw, dh, dc;
+    float *heights = stbi_loadf(heightMapPath.c_str(), &hw, &hh, &hc, 1);
+    if (heights == nullptr) {
+        std::cout << "Failed to load image: " << heightMapPath << ".\n";
+        return false;
+    }
+    uint8_t *diffuse = stbi_load(diffuseMapPath.c_str(), &dw, &dh, &dc, 3);
+    if (diffuse == nullptr) {
+        std::cout << "Failed to load image: " << diffuseMapPath << ".\n";
+        stbi_image_free(heights);
+        return false;
+    }
+    flipRows(heights, hw, hh, 1);
+    flipRows(diffuse, dw, dh, 3);
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+    TerrainTiles tiles;
+    tiles.m_directory = directory;
+    tiles.m_tileSize = tileSize;
+    tiles.m_levels = 1;
+    while ((tileSize << (tiles.m_levels - 1)) < std::max(hw, hh)) {
+        tiles.m_levels++;
+    }
+
+    auto sourceHeight = [&](float u, float v) {
+        float x = std::min(std::max(u * hw - 0.5f, 0.f), float(hw - 1));
+        float y = std::min(std::max(v * hh - 0.5f, 0.f), float(hh - 1));
+        int x0 = std::min(int(x), std::max(hw - 2, 0)), y0 = std::min(int(y), std::max(hh - 2, 0));
+        int x1 = std::min(x0 + 1, hw - 1), y1 = std::min(y0 + 1, hh - 1);
+        float s = x - x0, t = y - y0;
+        return (heights[y0 * hw + x0] * (1.f - s) + heights[y0 * hw + x1] * s) * (1.f - t)
+               + (heights[y1 * hw + x0] * (1.f - s) + heights[y1 * hw + x1] * s) * t;
+    };
+
+    std::ofstream index(directory + "/tiles.idx", std::ios::binary);
+    int32_t header[4] = {int32_t(TILES_MAGIC), int32_t(TILES_VERSION), tileSize, tiles.m_levels};
+    index.write(reinterpret_cast<const char *>(header), sizeof(header));
+    std::vector<char> data(tiles.tileBytes());
+    const int samples = tileSize + 1;
+    for (int level = 0; level < tiles.m_levels; level++) {
+        const int n = 1 << level;
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                float *tileHeights = reinterpret_cast<float *>(data.data());
+                float range[2] = {INFINITY, -INFINITY};
+                for (int j = 0; j < samples; j++) {
+                    for (int i = 0; i < samples; i++) {
+                        float h = sourceHeight((x + float(i) / tileSize) / n, (y + float(j) / tileSize) / n);
+                        tileHeights[j * samples + i] = h;
+                        range[0] = std::min(range[0], h);
+                        range[1] = std::max(range[1], h);
+                    }
+                }
+                index.write(reinterpret_cast<const char *>(range), sizeof(range));
+
+                uint8_t *texels = reinterpret_cast<uint8_t *>(tileHeights + samples * samples);
+                for (int j = 0; j < tileSize; j++) {
+                    int y0 = int(std::floor(float(y * tileSize + j) / (n * tileSize) * dh));
+                    int y1 = std::max(y0 + 1, int(std::floor(float(y * tileSize + j + 1) / (n * tileSize) * dh)));
+                    for (int i = 0; i < tileSize; i++) {
+                        int x0 = int(std::floor(float(x * tileSize + i) / (n * tileSize) * dw));
+                        int x1 = std::max(x0 + 1, int(std::floor(float(x * tileSize + i + 1) / (n * tileSize) * dw)));
+                        uint32_t sum[3] = {0, 0, 0};
+                        for (int py = y0; py < y1; py++) {
+                            for (int px = x0; px < x1; px++) {
+                                const uint8_t *pixel = diffuse + 3 * (std::min(py, dh - 1) * dw + std::min(px, dw - 1));
+                                for (int c = 0; c < 3; c++) {
+                                    sum[c] += pixel[c];
+                                }
+                            }
+                        }
+                        const uint32_t count = uint32_t((y1 - y0) * (x1 - x0));
+                        for (int c = 0; c < 3; c++) {
+                            texels[3 * (j * tileSize + i) + c] = uint8_t((sum[c] + count / 2) / count);
+                        }
+                    }
+                }
+                // The mip chain, each level the average of 2x2 texels above
+                for (int size = tileSize; size > 1; size /= 2) {
+                    uint8_t *next = texels + 3 * size * size;
+                    for (int j = 0; j < size / 2; j++) {
+                        for (int i = 0; i < size / 2; i++) {
+                            for (int c = 0; c < 3; c++) {
+                                int sum = texels[3 * ((2 * j) * size + 2 * i) + c]
+                                          + texels[3 * ((2 * j) * size + 2 * i + 1) + c]
+                                          + texels[3 * ((2 * j + 1) * size + 2 * i) + c]
+                                          + texels[3 * ((2 * j + 1) * size + 2 * i + 1) + c];
+                                next[3 * (j * (size / 2) + i) + c] = uint8_t((sum + 2) / 4);
+                            }
+                        }
+                    }
+                    texels = next;
+                }
+
+                std::ofstream file(tiles.tilePath(key(level, x, y)), std::ios::binary);
+                file.write(data.data(), data.size());
+                if (!file) {
+                    std::cout << "Failed to write " << tiles.tilePath(key(level, x, y)) << ".\n";
+                    stbi_image_free(heights);
+                    stbi_image_free(diffuse);
+                    return false;
+                }
+            }
+        }
+        std::cout << "Level " << level << ": " << n * n << " tiles.\n";
+    }
+    stbi_image_free(heights);
+    stbi_image_free(diffuse);
+    return bool(index);
+}
+
+static std::vector<char> readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return std::vector<char>();
+    }
+    std::vector<char> data(size_t(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+    return file ? data : std::vector<char>();
+}
+
+bool TerrainTiles::open(const std::string &directory, size_t budgetBytes) {
+    destroy();
+    std::vector<char> index = readFile(directory + "/tiles.idx");
+    int32_t header[4] = {};
+    if (index.size() >= sizeof(header)) {
+        memcpy(header, index.data(), sizeof(header));
+    }
+    if (uint32_t(header[0]) != TILES_MAGIC || uint32_t(header[1]) != TILES_VERSION || header[2] <= 0
+        || header[3] <= 0 || header[3] > 16) {
+        std::cout << "Failed to load terrain tiles: " << directory << ".\n";
+        return false;
+    }
+    m_directory = directory;
+    m_tileSize = header[2];
+    m_levels = header[3];
+    m_levelStart.assign(1, 0);
+    for (int level = 0; level < m_levels; level++) {
+        m_levelStart.push_back(m_levelStart.back() + (size_t(1) << (2 * level)));
+    }
+    const size_t count = m_levelStart.back();
+    if (index.size() != sizeof(header) + 2 * sizeof(float) * count) {
+        std::cout << "Failed to load terrain tiles: " << directory << ".\n";
+        return false;
+    }
+    m_low.resize(count);
+    m_high.resize(count);
+    const float *ranges = reinterpret_cast<const float *>(index.data() + sizeof(header));
+    for (size_t i = 0; i < count; i++) {
+        m_low[i] = ranges[2 * i];
+        m_high[i] = ranges[2 * i + 1];
+    }
+
+    GLint maxLayers = 256;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    m_slots = int(std::min(std::max(budgetBytes / tileBytes(), size_t(8)), size_t(maxLayers)));
+
+    glGenTextures(1, &m_heightTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_heightTexture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R32F, m_tileSize + 1, m_tileSize + 1, m_slots);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    glGenTextures(1, &m_diffuseTexture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_diffuseTexture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, mipLevels(m_tileSize), GL_RGB8, m_tileSize, m_tileSize, m_slots);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+    for (int slot = m_slots - 1; slot >= 0; slot--) {
+        m_freeSlots.push_back(slot);
+    }
+    std::vector<char> root = readFile(tilePath(key(0, 0, 0)));
+    if (root.size() != tileBytes() || !upload(key(0, 0, 0), root)) {
+        std::cout << "Failed to load terrain tile " << tilePath(key(0, 0, 0)) << ".\n";
+        destroy();
+        return false;
+    }
+    m_rootHeights.resize(size_t(m_tileSize + 1) * size_t(m_tileSize + 1));
+    memcpy(m_rootHeights.data(), root.data(), m_rootHeights.size() * sizeof(float));
+    std::cout << "Opened terrain tiles " << directory << ": " << m_levels << " levels of " << m_tileSize
+              << " texel tiles, room for " << m_slots << " tiles.\n";
+    return true;
+}
+
+void TerrainTiles::destroy() {
+    m_reading.clear();
+    m_wanted.clear();
+    m_tiles.clear();
+    m_failedTiles = 0;
+    m_freeSlots.clear();
+    m_rootHeights.clear();
+    if (m_heightTexture != 0) {
+        glDeleteTextures(1, &m_heightTexture);
+        glDeleteTextures(1, &m_diffuseTexture);
+        m_heightTexture = 0;
+        m_diffuseTexture = 0;
+    }
+}
+
+void TerrainTiles::heightRange(int level, int x, int y, float &low, float &high) const {
+    if (level >= m_levels) {
+        x >>= level - m_levels + 1;
+        y >>= level - m_levels + 1;
+        level = m_levels - 1;
+    }
+    size_t i = m_levelStart[level] + (size_t(y) << level) + size_t(x);
+    low = m_low[i];
+    high = m_high[i];
+}
+
+glm::vec4 TerrainTiles::use(int level, int x, int y) {
+    if (level >= m_levels) {
+        x >>= level - m_levels + 1;
+        y >>= level - m_levels + 1;
+        level = m_levels - 1;
+    }
+    for (int l = level; l >= 0; l--, x >>= 1, y >>= 1) {
+        auto tile = m_tiles.find(key(l, x, y));
+        if (tile == m_tiles.end()) {
+            if (l == level) {
+                m_wanted.push_back(key(l, x, y));
+            }
+            continue;
+        }
+        if (tile->second.slot < 0) {
+            // Being read, or failed
+            continue;
+        }
+        tile->second.lastUsed = m_frame;
+        const float size = 1.f / float(1 << l);
+        return glm::vec4(x * size, y * size, size, float(tile->second.slot));
+    }
+    return glm::vec4(0.f, 0.f, 1.f, 0.f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The tiles used since the last update() are not evicted, the caller may
+// still draw them. If they take up every slot, no more tiles are read
+// until some are no longer used.
+///////////////////////////////////////////////////////////////////////////////
+int TerrainTiles::takeSlot() {
+    if (!m_freeSlots.empty()) {
+        int slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        return slot;
+    }
+    auto oldest = m_tiles.end();
+    for (auto tile = m_tiles.begin(); tile != m_tiles.end(); ++tile) {
+        if (tile->second.slot < 0 || (tile->first >> 48) == 0 || tile->second.lastUsed >= m_frame) {
+            continue;
+        }
+        if (oldest == m_tiles.end() || tile->second.lastUsed < oldest->second.lastUsed) {
+            oldest = tile;
+        }
+    }
+    if (oldest == m_tiles.end()) {
+        return -1;
+    }
+    int slot = oldest->second.slot;
+    m_tiles.erase(oldest);
+    return slot;
+}
+
+// `data` must be tileBytes() long
+bool TerrainTiles::upload(uint64_t key, const std::vector<char> &data) {
+    const int slot = takeSlot();
+    if (slot < 0) {
+        return false;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_heightTexture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot, m_tileSize + 1, m_tileSize + 1, 1, GL_RED, GL_FLOAT,
+                    data.data());
+    // The small mip levels have rows that are not a multiple of 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_diffuseTexture);
+    const char *texels = data.data() + sizeof(float) * (m_tileSize + 1) * (m_tileSize + 1);
+    for (int mip = 0, size = m_tileSize; size >= 1; mip++, size /= 2) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip, 0, 0, slot, size, size, 1, GL_RGB, GL_UNSIGNED_BYTE, texels);
+        texels += 3 * size * size;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    Tile &tile = m_tiles[key];
+    tile.slot = slot;
+    tile.lastUsed = m_frame;
+    return true;
+}
+
+bool TerrainTiles::update() {
+    bool uploaded = false;
+    for (size_t i = 0; i < m_reading.size();) {
+        std::vector<char> data;
+        if (!labhelper::takeIfReady(m_reading[i].data, data)) {
+            i++;
+            continue;
+        }
+        const uint64_t key = m_reading[i].key;
+        m_reading.erase(m_reading.begin() + i);
+        if (data.size() != tileBytes()) {
+            // Kept, so that use() does not ask for it again
+            std::cout << "Failed to load terrain tile " << tilePath(key) << ".\n";
+            m_tiles[key].slot = FAILED;
+            m_failedTiles++;
+            continue;
+        }
+        m_tiles.erase(key);
+        uploaded = upload(key, data) || uploaded;
+    }
+
+    // Coarse tiles first, they stand in for the most area
+    std::sort(m_wanted.begin(), m_wanted.end());
+    m_wanted.erase(std::unique(m_wanted.begin(), m_wanted.end()), m_wanted.end());
+    size_t evictable = m_freeSlots.size();
+    for (const auto &tile : m_tiles) {
+        if (tile.second.slot >= 0 && (tile.first >> 48) != 0 && tile.second.lastUsed < m_frame) {
+            evictable++;
+        }
+    }
+    for (uint64_t key : m_wanted) {
+        if (int(m_reading.size()) >= MAX_READS || m_reading.size() >= evictable) {
+            break;
+        }
+        if (m_tiles.count(key) != 0) {
+            continue;
+        }
+        m_tiles[key].slot = READING;
+        std::string path = tilePath(key);
+        m_reading.push_back(Read{key, labhelper::ThreadPool::shared().submit([path]() {
+            return readFile(path);
+        })});
+    }
+    m_wanted.clear();
+    m_frame++;
+    return uploaded;
+}
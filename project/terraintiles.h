@@ -0,0 +1,147 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////////
+// A terrain that is cut into a pyramid of tiles on disk, and streamed in
+// around the camera.
+//
+// Level 0 is one tile over the whole terrain, and level l has 2^l x 2^l
+// tiles, so tile (l, x, y) covers exactly the CDLOD node (l, x, y) of
+// HeightField. A tile holds (tile size + 1)^2 heights, at its corners and
+// evenly in between. Corners of a level are corners of the finer levels
+// too, and get the same heights, so neighbouring tiles of different levels
+// meet. It also holds tile size^2 diffuse texels with their mip chain.
+//
+// Resident tiles live in the layers ("slots") of two texture arrays, the
+// number of slots follows from the memory budget. Tiles that are used but
+// not resident are read on the ThreadPool, a few at a time, and replace
+// the least recently used tiles. The level 0 tile is always resident, so
+// there is always a tile to fall back to. Tiles that fail to read are
+// remembered and not read again; the tiles above them stand in.
+//
+// build() makes the tiles from a height map and a diffuse map, run it with
+// project --make-tiles <height map> <diffuse map> <directory>
+///////////////////////////////////////////////////////////////////////////////
+class TerrainTiles
+{
+public:
+	TerrainTiles() = default;
+	~TerrainTiles();
+	TerrainTiles(const TerrainTiles&) = delete;
+	TerrainTiles& operator=(const TerrainTiles&) = delete;
+
+	static bool build(const std::string& heightMapPath, const std::string& diffuseMapPath,
+	                  const std::string& directory, int tileSize = 128);
+
+	// Reads the index and the level 0 tile, and makes room for as many
+	// tiles as fit in budgetBytes
+	bool open(const std::string& directory, size_t budgetBytes = 64 << 20);
+	void destroy();
+	bool isOpen() const
+	{
+		return m_heightTexture != 0;
+	}
+
+	int levels() const
+	{
+		return m_levels;
+	}
+	int tileSize() const
+	{
+		return m_tileSize;
+	}
+	GLuint heightTexture() const
+	{
+		return m_heightTexture;
+	}
+	GLuint diffuseTexture() const
+	{
+		return m_diffuseTexture;
+	}
+
+	// The (tile size + 1)^2 heights of the level 0 tile, in [0, 1], at the
+	// corners of its cells. Kept on the CPU for collisions.
+	const std::vector<float>& rootHeights() const
+	{
+		return m_rootHeights;
+	}
+
+	// The lowest and highest height in tile (level, x, y), in [0, 1]. Levels
+	// past the last one use the last one.
+	void heightRange(int level, int x, int y, float& low, float& high) const;
+
+	// The best resident tile for the area of tile (level, x, y), which is
+	// that tile or one above it, as (x, z, size, slot) with x and z in [0, 1]
+	// over the terrain. Asks for the tile if it is not resident.
+	glm::vec4 use(int level, int x, int y);
+
+	// Call once per frame: uploads the tiles that have been read and starts
+	// reading the tiles that were asked for. Returns true if tiles were
+	// uploaded, then use() may return other tiles than before, and tiles
+	// that were not used since the last update() may be gone.
+	bool update();
+
+	int residentTiles() const
+	{
+		return int(m_tiles.size()) - int(m_reading.size()) - m_failedTiles;
+	}
+	int slots() const
+	{
+		return m_slots;
+	}
+	int readingTiles() const
+	{
+		return int(m_reading.size());
+	}
+
+private:
+	static const int MAX_READS = 8;
+	// Slots of tiles that are not resident
+	static const int READING = -1;
+	static const int FAILED = -2;
+
+	struct Tile
+	{
+		int slot = READING;
+		uint64_t lastUsed = 0;
+	};
+	struct Read
+	{
+		uint64_t key;
+		std::future<std::vector<char>> data;
+	};
+
+	std::string m_directory;
+	int m_tileSize = 0;
+	int m_levels = 0;
+	int m_slots = 0;
+	// Lowest and highest height of every tile, level by level
+	std::vector<float> m_low, m_high;
+	std::vector<size_t> m_levelStart;
+	std::vector<float> m_rootHeights;
+	GLuint m_heightTexture = 0;
+	GLuint m_diffuseTexture = 0;
+
+	// Resident tiles, tiles that are being read and tiles that failed
+	std::unordered_map<uint64_t, Tile> m_tiles;
+	int m_failedTiles = 0;
+	std::vector<int> m_freeSlots;
+	std::vector<Read> m_reading;
+	std::vector<uint64_t> m_wanted;
+	uint64_t m_frame = 1;
+
+	static uint64_t key(int level, int x, int y)
+	{
+		return (uint64_t(level) << 48) | (uint64_t(uint32_t(x)) << 24) | uint64_t(uint32_t(y));
+	}
+	std::string tilePath(uint64_t key) const;
+	size_t tileBytes() const;
+	bool upload(uint64_t key, const std::vector<char>& data);
+	int takeSlot();
+};